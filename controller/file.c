@@ -24,11 +24,24 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/uio.h>
+#else
+#include <io.h>
+#endif
 
 // The current working directory on startup, and the installation directory.
 static char *current = NULL;
 static char *install = NULL;
 
+// The umask on startup. Reading it means setting it, so it is read once, on the
+// main thread, rather than while a save runs on another thread.
+#ifndef _WIN32
+static mode_t mask = 022;
+#endif
+
 // Give an error message and stop.
 static void crash(char const *message) {
     fprintf(stderr, "%s\n", message);
@@ -90,6 +103,10 @@ static void findInstall(char const *program) {
 void findResources(char const *program) {
     findCurrent();
     findInstall(program);
+#ifndef _WIN32
+    mask = umask(0);
+    umask(mask);
+#endif
 }
 
 void freeResources() {
@@ -196,6 +213,42 @@ static char *readFile(char const *path) {
     return data;
 }
 
+#ifndef _WIN32
+
+// The pages are shared with the operating system's file cache, so mapping a
+// file costs no time or memory in proportion to its size until it is used.
+char const *mapFile(char const *path, int *psize) {
+    int size = sizeFile(path);
+    if (size < 0) { err("can't read", path); return NULL; }
+    *psize = size;
+    if (size == 0) return "";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { err("can't read", path); return NULL; }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { err("can't map", path); return NULL; }
+    return data;
+}
+
+void unmapFile(char const *data, int size) {
+    if (size > 0) munmap((void *) data, size);
+}
+
+#else
+
+// For Windows, fall back on reading the file in.
+char const *mapFile(char const *path, int *psize) {
+    char *data = readFile(path);
+    if (data != NULL) *psize = strlen(data);
+    return data;
+}
+
+void unmapFile(char const *data, int size) {
+    free((char *) data);
+}
+
+#endif
+
 // Compare two strings in natural order.
 static int compare(char *s1, char *s2) {
     while (*s1 != '\0' || *s2 != '\0') {
@@ -324,31 +377,206 @@ char *readPath(char const *path) {
     else return readFile(path);
 }
 
-// Write out a Makefile, restoring the tabs.
-static void writeMakefile(FILE *file, int size, char data[size]) {
-    int i = 0, j = 0;
-    while (i < size) {
-        if (data[j] == ' ') {
-            while (data[j] == ' ') j++;
-            fwrite("\t", 1, 1, file);
-            i = j;
+// An output has a file descriptor for the temporary file, and the paths of the
+// temporary and final files. Data waiting to be written out is described by a
+// batch of up to BATCH pieces, as in a writev call. For a Makefile, the
+// transformed data is built up in a buffer instead. The flags record whether
+// the output is at the start of a line, and whether an indent is being skipped.
+enum { BATCH = 1024, BUFFER = 65536 };
+struct output {
+    int fd;
+    char *path, *temp;
+    bool makefile, start, indent;
+    int count;
+    struct { char const *data; int n; } batch[BATCH];
+    int used;
+    char buffer[BUFFER];
+};
+
+// Make a temporary file alongside the given path, with the same permissions as
+// the original if it exists, or the default permissions allowed by the umask
+// read on startup for a new file, since mkstemp makes the file private.
+static int makeTemp(char const *path, char *temp) {
+    strcpy(temp, path);
+    strcat(temp, ".XXXXXX");
+#ifndef _WIN32
+    int fd = mkstemp(temp);
+    struct stat info;
+    if (fd >= 0 && stat(path, &info) == 0) fchmod(fd, info.st_mode & 07777);
+    else if (fd >= 0) fchmod(fd, 0666 & ~mask);
+#else
+    int fd = -1;
+    if (_mktemp(temp) != NULL) {
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+    }
+#endif
+    return fd;
+}
+
+output *openOutput(char const *path) {
+    int n = strlen(path);
+    assert(path[n - 1] != '/');
+    output *o = malloc(sizeof(output));
+    o->path = malloc(n + 1);
+    o->temp = malloc(n + 8);
+    strcpy(o->path, path);
+    o->fd = makeTemp(path, o->temp);
+    if (o->fd < 0) {
+        err("can't write", path);
+        free(o->path);
+        free(o->temp);
+        free(o);
+        return NULL;
+    }
+    o->makefile = strcmp(extension(path), "makefile") == 0;
+    o->start = true;
+    o->indent = false;
+    o->count = 0;
+    o->used = 0;
+    return o;
+}
+
+#ifndef _WIN32
+
+// Write out a batch of pieces, allowing for partial writes.
+static bool writeBatch(int fd, int n, struct iovec v[n]) {
+    while (n > 0) {
+        ssize_t done = writev(fd, v, n);
+        if (done < 0) return false;
+        while (n > 0 && done >= v[0].iov_len) {
+            done -= v[0].iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v[0].iov_base = (char *) v[0].iov_base + done;
+            v[0].iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// Write out the pending batch of pieces in one system call, if possible.
+static bool flush(output *o) {
+    if (o->count == 0) return true;
+    struct iovec v[o->count];
+    for (int i = 0; i < o->count; i++) {
+        v[i] = (struct iovec) {
+            .iov_base = (void *) o->batch[i].data, .iov_len = o->batch[i].n
+        };
+    }
+    bool ok = writeBatch(o->fd, o->count, v);
+    o->count = 0;
+    return ok;
+}
+
+// Make sure the data reaches the disk before the file replaces the original.
+static bool commit(output *o) {
+    bool ok = fsync(o->fd) == 0;
+    if (close(o->fd) != 0) ok = false;
+    return ok && rename(o->temp, o->path) == 0;
+}
+
+#else
+
+// For Windows, write out the pending pieces one at a time.
+static bool flush(output *o) {
+    for (int i = 0; i < o->count; i++) {
+        char const *data = o->batch[i].data;
+        int n = o->batch[i].n;
+        while (n > 0) {
+            int done = write(o->fd, data, n);
+            if (done < 0) { o->count = 0; return false; }
+            data += done;
+            n -= done;
         }
-        while (data[j] != '\n') j++;
-        j++;
-        fwrite(&data[i], j - i, 1, file);
+    }
+    o->count = 0;
+    return true;
+}
+
+// For Windows, rename doesn't replace an existing file, so remove it first.
+static bool commit(output *o) {
+    bool ok = _commit(o->fd) == 0;
+    if (close(o->fd) != 0) ok = false;
+    if (! ok) return false;
+    remove(o->path);
+    return rename(o->temp, o->path) == 0;
+}
+
+#endif
+
+// Add a piece to the pending batch.
+static bool add(output *o, int n, char const *data) {
+    if (n == 0) return true;
+    if (o->count == BATCH && ! flush(o)) return false;
+    o->batch[o->count].data = data;
+    o->batch[o->count].n = n;
+    o->count++;
+    return true;
+}
+
+// Copy bytes into the Makefile buffer, writing it out when it fills.
+static bool put(output *o, int n, char const *data) {
+    while (n > 0) {
+        if (o->used == BUFFER) {
+            if (! add(o, BUFFER, o->buffer) || ! flush(o)) return false;
+            o->used = 0;
+        }
+        int k = BUFFER - o->used;
+        if (k > n) k = n;
+        memcpy(&o->buffer[o->used], data, k);
+        o->used += k;
+        data += k;
+        n -= k;
+    }
+    return true;
+}
+
+// Stream out part of a Makefile, replacing each line's indent by a tab. The
+// state is kept between calls, so an indent or line can be split across pieces.
+static bool writeMakefile(output *o, int n, char const *data) {
+    int i = 0;
+    while (i < n) {
+        if (o->start) {
+            while (i < n && data[i] == ' ') { i++; o->indent = true; }
+            if (i == n) break;
+            if (o->indent && ! put(o, 1, "\t")) return false;
+            o->start = o->indent = false;
+        }
+        char const *nl = memchr(&data[i], '\n', n - i);
+        int j = (nl == NULL) ? n : nl - data + 1;
+        if (! put(o, j - i, &data[i])) return false;
+        o->start = (nl != NULL);
         i = j;
     }
+    return true;
 }
 
-void writeFile(char const *path, int size, char data[size]) {
-    assert(path[strlen(path) - 1] != '/');
-    FILE *file = fopen(path, "wb");
-    if (file == NULL) { err("can't write", path); return; }
-    if (strcmp(&path[strlen(path) - 9], "/Makefile") == 0) {
-        writeMakefile(file, size, data);
+bool writeOutput(output *o, int n, char const *data) {
+    if (o->makefile) return writeMakefile(o, n, data);
+    return add(o, n, data);
+}
+
+bool closeOutput(output *o, bool ok) {
+    if (ok && o->used > 0) ok = add(o, o->used, o->buffer);
+    if (ok) ok = flush(o);
+    if (ok) ok = commit(o);
+    else close(o->fd);
+    if (! ok) {
+        err("can't write", o->path);
+        remove(o->temp);
     }
-    else fwrite(data, size, 1, file);
-    fclose(file);
+    free(o->path);
+    free(o->temp);
+    free(o);
+    return ok;
+}
+
+void writeFile(char const *path, int size, char data[size]) {
+    output *o = openOutput(path);
+    if (o == NULL) return;
+    closeOutput(o, writeOutput(o, size, data));
 }
 
 #ifdef fileTest
@@ -430,6 +658,28 @@ static void testReadDirectory() {
     free(text);
 }
 
+// Test writing a file in pieces, restoring tabs split across pieces, and
+// leaving the original alone after a failure.
+static void testWrite() {
+    char *path = "fileTestMakefile";
+    output *o = openOutput(path);
+    assert(writeOutput(o, 5, "a:\n  "));
+    assert(writeOutput(o, 8, "  echo\nb"));
+    assert(writeOutput(o, 3, ":\n "));
+    assert(writeOutput(o, 2, "x\n"));
+    assert(closeOutput(o, true));
+    char *text = readFile(path);
+    assert(strcmp(text, "a:\n\techo\nb:\n\tx\n") == 0);
+    free(text);
+    o = openOutput(path);
+    writeOutput(o, 4, "new\n");
+    assert(! closeOutput(o, false));
+    text = readFile(path);
+    assert(strcmp(text, "a:\n\techo\nb:\n\tx\n") == 0);
+    free(text);
+    remove(path);
+}
+
 int main(int n, char *args[n]) {
     findResources(args[0]);
     testSnipe();
@@ -440,6 +690,7 @@ int main(int n, char *args[n]) {
     testCompare();
     testSort();
     testReadDirectory();
+    testWrite();
     freeResources();
     printf("File module OK\n");
     return 0;
@@ -6,7 +6,9 @@
 // are ignored and directory names have / at the end.
 #include <stdbool.h>
 
-// Find the installation directory and current working directory from args[0].
+// Find the installation directory and current working directory from args[0],
+// and read the umask for new files. Call it on startup, on the main thread,
+// before any file is written.
 void findResources(char const *arg0);
 
 // Free up resource path strings when shutting down.
@@ -46,5 +48,32 @@ int sizeFile(char const *path);
 // is returned.
 char *readPath(char const *path);
 
+// Map a file into memory read-only, for a big file which is too expensive to
+// read in. Return the data, and the size in *psize, or NULL on failure. The
+// data is not null terminated, and may not end with a newline.
+char const *mapFile(char const *path, int *psize);
+
+// Release the memory mapping of a file.
+void unmapFile(char const *data, int size);
+
+// An output object writes a file safely. The data goes to a temporary file in
+// the same directory, which is synced to disk and then renamed over the
+// original, so a crash part way through never leaves a truncated file. For a
+// Makefile, leading indents are converted back to tabs as the data streams out.
+struct output;
+typedef struct output output;
+
+// Start writing a file. On failure, a message is printed and NULL is returned.
+output *openOutput(char const *path);
+
+// Add n bytes to the output. The bytes are not copied, so they must remain
+// valid and unchanged until the output is closed. Return false on failure.
+bool writeOutput(output *o, int n, char const *data);
+
+// Finish writing, replacing the original file, and free the output object. If
+// ok is false, because of an earlier failure, the temporary file is removed and
+// the original is left alone. Return true for success, or print a message.
+bool closeOutput(output *o, bool ok);
+
 // Write the given data to the given file. On failure, a message is printed.
 void writeFile(char const *path, int size, char data[size]);
@@ -8,8 +8,9 @@ int getUTF8(char const *t, int *plength);
 // Convert a unicode character into a UTF8 string (of up to 4 bytes plus '\0').
 void putUTF8(unsigned int code, char *s);
 
-// Check that text is UTF8 valid. Non-newline ASCII control characters are
-// invalid. Assume s[n+1] exists. Return an error message or NULL.
+// Check that text is UTF8 valid, with no control characters '\0' to '\7'.
+// Return an error message, giving the position of the first invalid byte, or
+// NULL. The message is valid until the next call.
 char const *utf8valid(char *s, int n);
 
 // Convert a UTF16 string to a UTF8 string. (Allow twice the number of bytes.)
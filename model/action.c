@@ -21,6 +21,7 @@ static char *actionNames[] = {
     [CutStartLine]="CutStartLine", [CutEndLine]="CutEndLine",
     [Newline]="Newline", [Bigger]="Bigger", [Smaller]="Smaller",
     [CycleTheme]="CycleTheme", [Point]="Point", [Select]="Select",
+    [SelectBlock]="SelectBlock",
     [AddPoint]="AddPoint", [AddSelect]="AddSelect", [Insert]="Insert",
     [Cut]="Cut", [Copy]="Copy", [Paste]="Paste", [PageUp]="PageUp",
     [PageDown]="PageDown", [Undo]="Undo", [Redo]="Redo", [Resize]="Resize",
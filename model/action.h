@@ -9,9 +9,9 @@ enum action {
     MarkLeftWord, MarkRightWord, MarkUpLine, MarkDownLine, MarkStartLine,
     MarkEndLine, CutLeftChar, CutRightChar, CutLeftWord, CutRightWord,
     CutUpLine, CutDownLine, CutStartLine, CutEndLine, Newline, Insert, Cut,
-    Copy, Paste, Point, Select, AddPoint, AddSelect,  Undo, Redo, Load, Save,
-    Open, Bigger, Smaller, CycleTheme, PageUp, PageDown, Resize, Focus, Defocus,
-    Blink, Frame, Scroll, Help, Quit, Ignore,
+    Copy, Paste, Point, Select, SelectBlock, AddPoint, AddSelect,  Undo, Redo,
+    Load, Save, Open, Bigger, Smaller, CycleTheme, PageUp, PageDown, Resize,
+    Focus, Defocus, Blink, Frame, Scroll, Help, Quit, Ignore,
     COUNT_ACTIONS = Ignore + 1
 };
 typedef int action;
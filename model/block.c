@@ -0,0 +1,209 @@
+// Column selection. Free and open source. See LICENSE.
+#include "text.h"
+#include "block.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// A block is two corners. The selection runs between the rows and between the
+// columns of the corners, whichever way round they are.
+struct block { int baseRow, baseCol, markRow, markCol; };
+
+block *newBlock(int baseRow, int baseCol, int markRow, int markCol) {
+    block *b = malloc(sizeof(block));
+    *b = (block) {
+        .baseRow=baseRow, .baseCol=baseCol, .markRow=markRow, .markCol=markCol
+    };
+    return b;
+}
+
+void freeBlock(block *b) {
+    free(b);
+}
+
+void markBlock(block *b, int row, int col) {
+    b->markRow = row;
+    b->markCol = col;
+}
+
+int topBlock(block *b) {
+    return b->baseRow < b->markRow ? b->baseRow : b->markRow;
+}
+
+int bottomBlock(block *b) {
+    return b->baseRow > b->markRow ? b->baseRow : b->markRow;
+}
+
+// Find the left column of the block.
+static int leftBlock(block *b) {
+    return b->baseCol < b->markCol ? b->baseCol : b->markCol;
+}
+
+// Find the right column of the block.
+static int rightBlock(block *b) {
+    return b->baseCol > b->markCol ? b->baseCol : b->markCol;
+}
+
+bool rowBlock(block *b, int row, int *left, int *right) {
+    if (row < topBlock(b) || row > bottomBlock(b)) return false;
+    *left = leftBlock(b);
+    *right = rightBlock(b);
+    return true;
+}
+
+bool columnsBlock(block *b, text *t, int row, int *left, int *right) {
+    if (! rowBlock(b, row, left, right)) return false;
+    int end = columnText(t, row, INT_MAX);
+    if (end < 0 || end < *left) return false;
+    *left = columnText(t, row, *left);
+    *right = columnText(t, row, *right);
+    return true;
+}
+
+// Collapse the block to a column of carets.
+static void collapse(block *b, int col) {
+    b->baseCol = b->markCol = col;
+}
+
+void typeBlock(block *b, text *t, int n, char s[n]) {
+    int left = leftBlock(b), right = rightBlock(b);
+    replaceColumns(t, topBlock(b), bottomBlock(b), left, right, n, s);
+    collapse(b, left + n);
+}
+
+void cutBlock(block *b, text *t) {
+    int left = leftBlock(b), right = rightBlock(b);
+    if (left == right) {
+        if (left == 0) return;
+        left--;
+    }
+    replaceColumns(t, topBlock(b), bottomBlock(b), left, right, 0, NULL);
+    collapse(b, left);
+}
+
+#ifdef blockTest
+// ----------------------------------------------------------------------------
+
+// Check that a text object holds the given string.
+static bool same(text *t, char *s) {
+    int n = lengthText(t);
+    if (n != strlen(s)) return false;
+    char out[n + 1];
+    getText(t, 0, n, out);
+    return strcmp(out, s) == 0;
+}
+
+// Check the corners, and the rows inside and outside the block.
+static void testRows() {
+    block *b = newBlock(5, 7, 2, 3);
+    int left, right;
+    assert(topBlock(b) == 2 && bottomBlock(b) == 5);
+    assert(! rowBlock(b, 1, &left, &right));
+    assert(rowBlock(b, 2, &left, &right) && left == 3 && right == 7);
+    assert(rowBlock(b, 5, &left, &right) && left == 3 && right == 7);
+    assert(! rowBlock(b, 6, &left, &right));
+    markBlock(b, 9, 10);
+    assert(topBlock(b) == 5 && bottomBlock(b) == 9);
+    assert(rowBlock(b, 9, &left, &right) && left == 7 && right == 10);
+    freeBlock(b);
+}
+
+// Check typing and backspacing in a block, with short rows, and that the edits
+// can be undone.
+static void testType() {
+    char s[] = "abcdef\nab\nabc\nabcdefgh\nabcdef\n";
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(loadText(t, strlen(s), s));
+    block *b = newBlock(0, 3, 3, 5);
+    typeBlock(b, t, 2, "XY");
+    assert(same(t, "abcXYf\nab\nabcXY\nabcXYfgh\nabcdef\n"));
+    int left, right;
+    assert(rowBlock(b, 1, &left, &right) && left == 5 && right == 5);
+    cutBlock(b, t);
+    assert(same(t, "abcXf\nab\nabcX\nabcXfgh\nabcdef\n"));
+    typeBlock(b, t, 1, "Z");
+    assert(same(t, "abcXZf\nab\nabcXZ\nabcXZfgh\nabcdef\n"));
+    history *copy = newHistory();
+    int n = currentHistory(h);
+    loadHistory(copy, n, bytesHistory(h), n);
+    while (currentHistory(copy) > 0) editText(t, undo(copy));
+    assert(same(t, "abcdef\nab\nabc\nabcdefgh\nabcdef\n"));
+    freeHistory(copy);
+    freeBlock(b);
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check that a block whose columns fall inside a two-byte character moves
+// them back to the start of the character, rather than splitting it, and that
+// the carets are drawn where the edits left them.
+static void testSplit() {
+    char s[] = "a\xCE\xB1" "bc\nabcd\n";
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(loadText(t, strlen(s), s));
+    block *b = newBlock(0, 2, 1, 2);
+    typeBlock(b, t, 1, "X");
+    assert(same(t, "aX\xCE\xB1" "bc\nabXcd\n"));
+    int left, right;
+    assert(columnsBlock(b, t, 0, &left, &right) && left == 2 && right == 2);
+    assert(columnsBlock(b, t, 1, &left, &right) && left == 3 && right == 3);
+    markBlock(b, 1, 4);
+    cutBlock(b, t);
+    assert(same(t, "aXbc\nabXd\n"));
+    markBlock(b, 1, 9);
+    assert(columnsBlock(b, t, 1, &left, &right) && left == 3 && right == 4);
+    assert(! columnsBlock(b, t, 2, &left, &right));
+    freeBlock(b);
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check typing into a block of half a million rows, which should take about
+// as long as loading the text, with a few bytes of history per row.
+static void testLarge() {
+    int rows = 500000;
+    char *s = malloc(7 * rows + 1);
+    for (int r = 0; r < rows; r++) memcpy(&s[7 * r], "abcdef\n", 7);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(loadText(t, 7 * rows, s));
+    block *b = newBlock(0, 2, rows - 1, 4);
+    typeBlock(b, t, 1, "X");
+    assert(lengthText(t) == 6 * rows && countLines(ls) == rows);
+    char out[7];
+    getText(t, 6 * (rows - 1), 6, out);
+    assert(strcmp(out, "abXef\n") == 0);
+    assert(sizeHistory(h) <= 14 * rows);
+    freeBlock(b);
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+    free(s);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testRows();
+    testType();
+    testSplit();
+    testLarge();
+    printf("Block module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// Column selection. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A block is a rectangular selection, e.g. for editing aligned columns of data.
+// It is held symbolically, as a base corner and a mark corner, so a block over
+// hundreds of thousands of rows takes constant space, and the columns selected
+// on any row are found in constant time, e.g. to draw them. An edit to the
+// block is only expanded into edits of the individual rows when it is applied
+// to the text, as one sweep from the top row to the bottom. Columns are byte
+// offsets within lines, as with cursors. Rows which end before the left column
+// of the block are not affected by edits. On other rows, the columns are
+// clamped to the end of the row, and moved back to the start of any character
+// they fall inside, both when editing and when drawing, so after typing, each
+// row's caret follows the text typed on it. The columns are shared by all the
+// rows, so after a deletion which was moved back on some rows but not others,
+// e.g. backspacing over characters of different lengths, the caret on a row
+// may be drawn up to a character to the right of where the deletion was.
+struct block;
+typedef struct block block;
+typedef struct text text;
+
+// Create a block with the given base and mark corners, or free it.
+block *newBlock(int baseRow, int baseCol, int markRow, int markCol);
+void freeBlock(block *b);
+
+// Move the mark corner, e.g. while dragging out the block.
+void markBlock(block *b, int row, int col);
+
+// Find the first and last rows of the block.
+int topBlock(block *b);
+int bottomBlock(block *b);
+
+// Find the columns selected on a row, setting *left and *right, or return false
+// if the row is outside the block. If left and right are equal, the row has a
+// caret but no selection.
+bool rowBlock(block *b, int row, int *left, int *right);
+
+// Find the columns on a row which an edit of the block affects, as for rowBlock
+// but clamped to the row, e.g. to draw them, or return false if the row is
+// outside the block or ends before its left column.
+bool columnsBlock(block *b, text *t, int row, int *left, int *right);
+
+// Replace the selected columns on every row by s, e.g. for typing, leaving a
+// column of carets after the inserted text. The string must not contain a
+// newline.
+void typeBlock(block *b, text *t, int n, char s[n]);
+
+// Delete the selected columns on every row or, if the block is a column of
+// carets, the character before each caret, as with backspace.
+void cutBlock(block *b, text *t);
@@ -3,88 +3,488 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
 struct point { int row, col; };
 typedef struct point point;
 
+// The origin, or a zero delta.
+static point const zero = { .row=0, .col=0 };
+
 struct cursor { point base, mark; int oldCol; };
 typedef struct cursor cursor;
 
-// Multiple cursors are held in a flexible array of structures.
+// Multiple cursors are held in a B-tree, in order, so that finding, adding or
+// cutting a cursor, and finding the cursors on a row, take logarithmic time.
+// All the leaves are at the same depth. A leaf node holds up to MAX cursors,
+// and an internal node holds up to MAX children. Each node records the number
+// of cursors in its subtree, and the right hand end of its last cursor, to
+// search by position. The current cursor is found by index, and a pointer to
+// it is kept until the tree changes shape. When text is inserted or deleted,
+// the cursors after it are moved lazily: a node whose cursors all move by the
+// same amount records it as a pending delta, added to the cursors in its
+// subtree, and its own last point already includes it. Deltas are pushed down
+// on the path to any cursor which is accessed, so a multi-cursor edit moves
+// all the cursors after each edit point in logarithmic time.
+enum { MAX = 32, FILL = MAX * 3 / 4 };
+
+typedef struct node node;
+typedef union entry { cursor c; node *child; } entry;
+struct node { bool leaf; int n, count; point last, d; entry e[MAX]; };
+
 struct cursors {
-    int current, length, max;
-    cursor *a;
+    node *root;
+    int current;
+    cursor *c;
     history *h;
 };
 
+static node *newNode(bool leaf) {
+    node *x = malloc(sizeof(node));
+    x->leaf = leaf;
+    x->n = x->count = 0;
+    x->last = (point) { .row=-1, .col=-1 };
+    x->d = zero;
+    return x;
+}
+
+static void freeNode(node *x) {
+    if (! x->leaf) for (int i = 0; i < x->n; i++) freeNode(x->e[i].child);
+    free(x);
+}
+
 cursors *newCursors(history *h) {
-    int n = 1;
     cursors *cs = malloc(sizeof(cursors));
-    cursor *a = malloc(n * sizeof(cursor));
-    *cs = (cursors) { .current=0, .length=1, .max=n, .a=a, .h=h };
-    cs->a[0] = (cursor) { .base={0,0}, .mark={0,0}, .oldCol=0 };
+    node *root = newNode(true);
+    root->e[0].c = (cursor) { .base={0,0}, .mark={0,0}, .oldCol=0 };
+    root->n = root->count = 1;
+    root->last = root->d = zero;
+    *cs = (cursors) { .root=root, .current=0, .c=NULL, .h=h };
     return cs;
 }
 
-// Double the capacity.
-static void expand(cursors *cs) {
-    cs->max = cs->max * 2;
-    cs->a = realloc(cs->a, cs->max);
-}
-
 void freeCursors(cursors *cs) {
-    free(cs->a);
+    freeNode(cs->root);
     free(cs);
 }
 
 int nCursors(cursors *cs) {
-    return cs->length;
+    return cs->root->count;
 }
 
 int currentCursor(cursors *cs) {
     return cs->current;
 }
 
+// Compare one row/col point to another.
+static int compare(point p0, point p1) {
+    if (p0.row < p1.row) return -1;
+    if (p0.row > p1.row) return +1;
+    if (p0.col < p1.col) return -1;
+    if (p0.col > p1.col) return +1;
+    return 0;
+}
+
+// Find the left hand end of a cursor.
+static point left(cursor *c) {
+    return compare(c->mark, c->base) < 0 ? c->mark : c->base;
+}
+
+// Find the right hand end of a cursor.
+static point right(cursor *c) {
+    return compare(c->mark, c->base) > 0 ? c->mark : c->base;
+}
+
+// Add a delta to a point.
+static point plus(point p, point d) {
+    return (point) { .row=p.row + d.row, .col=p.col + d.col };
+}
+
+// Add a delta to both ends of a cursor.
+static void shiftCursor(cursor *c, point d) {
+    c->base = plus(c->base, d);
+    c->mark = plus(c->mark, d);
+}
+
+// Recalculate the totals for a node from its entries.
+static void sum(node *x) {
+    if (x->leaf) {
+        x->count = x->n;
+        if (x->n > 0) x->last = plus(right(&x->e[x->n - 1].c), x->d);
+        return;
+    }
+    x->count = 0;
+    for (int i = 0; i < x->n; i++) x->count += x->e[i].child->count;
+    if (x->n > 0) x->last = plus(x->e[x->n - 1].child->last, x->d);
+}
+
+// Push a node's pending delta down to its children or cursors.
+static void push(node *x) {
+    if (x->d.row == 0 && x->d.col == 0) return;
+    for (int i = 0; i < x->n; i++) {
+        if (x->leaf) shiftCursor(&x->e[i].c, x->d);
+        else {
+            node *c = x->e[i].child;
+            c->d = plus(c->d, x->d);
+            c->last = plus(c->last, x->d);
+        }
+    }
+    x->d = zero;
+}
+
+// Insert k entries into node x at index i. If x overflows, share the entries
+// evenly between x and as many new nodes as necessary, to the right of x.
+// Return the number of new nodes, with an allocated array of them in *pmore.
+static int put(node *x, int i, int k, entry es[k], node ***pmore) {
+    int total = x->n + k;
+    if (total <= MAX) {
+        memmove(&x->e[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+        memcpy(&x->e[i], es, k * sizeof(entry));
+        x->n = total;
+        sum(x);
+        return 0;
+    }
+    entry *all = malloc(total * sizeof(entry));
+    memcpy(all, x->e, i * sizeof(entry));
+    memcpy(&all[i], es, k * sizeof(entry));
+    memcpy(&all[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+    int m = (total + FILL - 1) / FILL;
+    node **more = malloc((m - 1) * sizeof(node *));
+    int done = 0;
+    for (int j = 0; j < m; j++) {
+        node *y = (j == 0) ? x : newNode(x->leaf);
+        int size = total / m + (j < total % m ? 1 : 0);
+        memcpy(y->e, &all[done], size * sizeof(entry));
+        y->n = size;
+        sum(y);
+        done += size;
+        if (j > 0) more[j - 1] = y;
+    }
+    free(all);
+    *pmore = more;
+    return m - 1;
+}
+
+// Insert k cursors at index i in the subtree x. An insertion at a boundary
+// between children goes at the end of the left child. Return the number of new
+// nodes created to the right of x, as with put. The entries for new nodes are
+// allocated, since a whole set of matches can create millions of them.
+static int insertAt(node *x, int i, int k, entry es[k], node ***pmore) {
+    push(x);
+    if (x->leaf) return put(x, i, k, es, pmore);
+    int j = 0;
+    while (j < x->n - 1 && i > x->e[j].child->count) {
+        i -= x->e[j].child->count;
+        j++;
+    }
+    node **more;
+    int m = insertAt(x->e[j].child, i, k, es, &more);
+    if (m == 0) { sum(x); return 0; }
+    entry *children = malloc(m * sizeof(entry));
+    for (int l = 0; l < m; l++) children[l].child = more[l];
+    free(more);
+    m = put(x, j + 1, m, children, pmore);
+    free(children);
+    return m;
+}
+
+// Insert k cursors at index i, growing the tree upwards if necessary.
+static void insertAll(cursors *cs, int i, int k, entry es[k]) {
+    cs->c = NULL;
+    node **more;
+    int m = insertAt(cs->root, i, k, es, &more);
+    while (m > 0) {
+        node *root = newNode(false);
+        entry *children = malloc((m + 1) * sizeof(entry));
+        children[0].child = cs->root;
+        for (int j = 0; j < m; j++) children[j + 1].child = more[j];
+        free(more);
+        cs->root = root;
+        m = put(root, 0, m + 1, children, &more);
+        free(children);
+    }
+}
+
+// Merge child i+1 into child i of x.
+static void join(node *x, int i) {
+    node *a = x->e[i].child, *b = x->e[i + 1].child;
+    push(a);
+    push(b);
+    memcpy(&a->e[a->n], b->e, b->n * sizeof(entry));
+    a->n += b->n;
+    sum(a);
+    free(b);
+    memmove(&x->e[i + 1], &x->e[i + 2], (x->n - i - 2) * sizeof(entry));
+    x->n--;
+}
+
+// Delete the cursors from index i1 up to (not including) i2 in the subtree x.
+// Children which are covered entirely are freed without being visited, and
+// neighbouring children which have become small are merged.
+static void deleteAt(node *x, int i1, int i2) {
+    push(x);
+    if (x->leaf) {
+        memmove(&x->e[i1], &x->e[i2], (x->n - i2) * sizeof(entry));
+        x->n -= i2 - i1;
+        sum(x);
+        return;
+    }
+    int j = 0, start = 0;
+    for (int i = 0; i < x->n; i++) {
+        node *c = x->e[i].child;
+        int count = c->count;
+        int lo = (i1 > start ? i1 : start) - start;
+        int hi = (i2 < start + count ? i2 : start + count) - start;
+        start += count;
+        if (lo <= 0 && hi >= count) { freeNode(c); continue; }
+        if (lo < hi) deleteAt(c, lo, hi);
+        x->e[j++].child = c;
+    }
+    x->n = j;
+    for (int i = 0; i < x->n - 1; ) {
+        node *a = x->e[i].child, *b = x->e[i + 1].child;
+        bool small = a->n < MAX / 4 || b->n < MAX / 4;
+        if (small && a->n + b->n <= MAX) join(x, i);
+        else i++;
+    }
+    sum(x);
+}
+
+// Delete the cursors from index i1 up to i2, shrinking the tree if necessary.
+static void deleteAll(cursors *cs, int i1, int i2) {
+    if (i1 >= i2) return;
+    cs->c = NULL;
+    deleteAt(cs->root, i1, i2);
+    while (! cs->root->leaf && cs->root->n <= 1) {
+        node *root = cs->root;
+        if (root->n == 0) cs->root = newNode(true);
+        else cs->root = root->e[0].child;
+        free(root);
+    }
+}
+
+// Find the cursor at index i, where 0 <= i < #cursors, pushing deltas down.
+static cursor *locate(cursors *cs, int i) {
+    node *x = cs->root;
+    push(x);
+    while (! x->leaf) {
+        int j = 0;
+        while (j < x->n - 1 && i >= x->e[j].child->count) {
+            i -= x->e[j].child->count;
+            j++;
+        }
+        x = x->e[j].child;
+        push(x);
+    }
+    return &x->e[i].c;
+}
+
+// Get the current cursor.
+static cursor *get(cursors *cs) {
+    if (cs->c == NULL) cs->c = locate(cs, cs->current);
+    return cs->c;
+}
+
+// Recalculate the totals on the path to the cursor at index i in subtree x.
+static void resum(node *x, int i) {
+    if (! x->leaf) {
+        int j = 0;
+        while (j < x->n - 1 && i >= x->e[j].child->count) {
+            i -= x->e[j].child->count;
+            j++;
+        }
+        resum(x->e[j].child, i);
+    }
+    sum(x);
+}
+
+// After the current cursor has moved, update the totals above it.
+static void moved(cursors *cs) {
+    resum(cs->root, cs->current);
+}
+
+// Copy n cursors from index i onwards in the subtree x into an array, adding
+// the deltas d from above.
+static void gather(node *x, int i, int n, cursor *out, point d) {
+    d = plus(d, x->d);
+    if (x->leaf) {
+        for (int j = 0; j < n; j++) {
+            out[j] = x->e[i + j].c;
+            shiftCursor(&out[j], d);
+        }
+        return;
+    }
+    for (int j = 0; j < x->n && n > 0; j++) {
+        node *c = x->e[j].child;
+        if (i >= c->count) { i -= c->count; continue; }
+        int k = c->count - i < n ? c->count - i : n;
+        gather(c, i, k, out, d);
+        out += k;
+        n -= k;
+        i = 0;
+    }
+}
+
+// Find the index of the first cursor whose right hand end is at or after a
+// given point, assuming the cursors are in a normalised state. This is the
+// index at which to insert a new cursor at that point.
+static int find(cursors *cs, point p) {
+    node *x = cs->root;
+    point d = zero;
+    int index = 0;
+    while (! x->leaf) {
+        d = plus(d, x->d);
+        int j = 0;
+        while (j < x->n - 1) {
+            node *c = x->e[j].child;
+            if (compare(plus(c->last, d), p) >= 0) break;
+            index += c->count;
+            j++;
+        }
+        x = x->e[j].child;
+    }
+    d = plus(d, x->d);
+    int j = 0;
+    while (j < x->n && compare(plus(right(&x->e[j].c), d), p) < 0) j++;
+    return index + j;
+}
+
+// Add a delta to the cursors from index i1 up to i2 in the subtree x, where a
+// node which is covered entirely just records the delta.
+static void shiftAt(node *x, int i1, int i2, point d) {
+    if (i1 <= 0 && i2 >= x->count) {
+        x->d = plus(x->d, d);
+        x->last = plus(x->last, d);
+        return;
+    }
+    if (i1 < 0) i1 = 0;
+    if (i2 > x->count) i2 = x->count;
+    if (x->leaf) {
+        for (int i = i1; i < i2; i++) shiftCursor(&x->e[i].c, d);
+        sum(x);
+        return;
+    }
+    int start = 0;
+    for (int i = 0; i < x->n && start < i2; i++) {
+        node *c = x->e[i].child;
+        if (start + c->count > i1) shiftAt(c, i1 - start, i2 - start, d);
+        start += c->count;
+    }
+    sum(x);
+}
+
+// Add a delta to the cursors from index i1 up to i2.
+static void shiftAll(cursors *cs, int i1, int i2, point d) {
+    if (i1 >= i2 || (d.row == 0 && d.col == 0)) return;
+    cs->c = NULL;
+    shiftAt(cs->root, i1, i2, d);
+}
+
+// Move a cursor end, if it is at or after p, by s if it is on the same row as
+// p, or by l if it is on a later row.
+static point move(point q, point p, point s, point l) {
+    if (compare(q, p) < 0) return q;
+    return plus(q, q.row == p.row ? s : l);
+}
+
+// Move one cursor's ends individually, using move.
+static void moveEnds(cursors *cs, int i, point p, point s, point l) {
+    cursor *c = locate(cs, i);
+    c->base = move(c->base, p, s, l);
+    c->mark = move(c->mark, p, s, l);
+    resum(cs->root, i);
+    cs->c = NULL;
+}
+
+// Move the cursor ends at or after p, as with move. The cursors which start on
+// p's row and end on it move by s, and the ones which start on later rows move
+// by l, each as one lazy shift. At most two cursors straddle p or the end of
+// its row, and they are moved individually.
+static void moveFrom(cursors *cs, point p, point s, point l) {
+    int n = nCursors(cs);
+    point next = { .row=p.row + 1, .col=0 };
+    int i = find(cs, p), j = find(cs, next), k;
+    bool straddle = i < n && compare(left(locate(cs, i)), p) < 0;
+    if (straddle) i++;
+    if (j < i) j = i;
+    k = j;
+    if (j < n && compare(left(locate(cs, j)), next) < 0) k++;
+    if (straddle) moveEnds(cs, i - 1, p, s, l);
+    shiftAll(cs, i, j, s);
+    if (k > j) moveEnds(cs, j, p, s, l);
+    shiftAll(cs, k, n, l);
+}
+
+void insertCursors(cursors *cs, int row, int col, int endRow, int endCol) {
+    point p = { .row=row, .col=col };
+    point s = { .row=endRow - row, .col=endCol - col };
+    point l = { .row=endRow - row, .col=0 };
+    moveFrom(cs, p, s, l);
+}
+
+// First move the cursor ends within the range to its end, individually.
+void deleteCursors(cursors *cs, int row, int col, int endRow, int endCol) {
+    point p = { .row=row, .col=col }, q = { .row=endRow, .col=endCol };
+    int n = nCursors(cs);
+    for (int i = find(cs, p); i < n; i++) {
+        cursor *c = locate(cs, i);
+        if (compare(left(c), q) > 0) break;
+        if (compare(c->base, p) >= 0 && compare(c->base, q) < 0) c->base = q;
+        if (compare(c->mark, p) >= 0 && compare(c->mark, q) < 0) c->mark = q;
+        resum(cs->root, i);
+    }
+    cs->c = NULL;
+    point s = { .row=row - endRow, .col=col - endCol };
+    point l = { .row=row - endRow, .col=0 };
+    moveFrom(cs, q, s, l);
+}
+
 // Primitive operations which include calls to save them in the history.
 
 void setCursor(cursors *cs, int i) {
-    if (i < 0) i = 0; else if (i >= cs->length) i = cs->length - 1;
+    int n = nCursors(cs);
+    if (i < 0) i = 0; else if (i >= n) i = n - 1;
     if (i == cs->current) return;
     saveSetCursor(cs->h, i - cs->current);
     cs->current = i;
+    cs->c = NULL;
 }
 
 // Set the base row of the current cursor.
 static void setBaseRow(cursors *cs, int r) {
-    int old = cs->a[cs->current].base.row;
+    int old = get(cs)->base.row;
     if (r == old) return;
     saveBaseRow(cs->h, r - old);
-    cs->a[cs->current].base.row = r;
+    get(cs)->base.row = r;
+    moved(cs);
 }
 
 // Set the base col of the current cursor.
 static void setBaseCol(cursors *cs, int c) {
-    int old = cs->a[cs->current].base.col;
+    int old = get(cs)->base.col;
     if (c == old) return;
     saveBaseCol(cs->h, c - old);
-    cs->a[cs->current].base.col = c;
+    get(cs)->base.col = c;
+    moved(cs);
 }
 
 // Set the mark row of the current cursor.
 static void setMarkRow(cursors *cs, int r) {
-    int old = cs->a[cs->current].mark.row;
+    int old = get(cs)->mark.row;
     if (r == old) return;
     saveMarkRow(cs->h, r - old);
-    cs->a[cs->current].mark.row = r;
+    get(cs)->mark.row = r;
+    moved(cs);
 }
 
 // Set the mark col of the current cursor.
 static void setMarkCol(cursors *cs, int c) {
-    int old = cs->a[cs->current].mark.col;
+    int old = get(cs)->mark.col;
     if (c == old) return;
     saveMarkCol(cs->h, c - old);
-    cs->a[cs->current].mark.col = c;
+    get(cs)->mark.col = c;
+    moved(cs);
 }
 
 // Combinations
@@ -103,9 +503,10 @@ static void setMark(cursors *cs, point p) {
 
 // Set the current cursor equal to another.
 static void setEqual(cursors *cs, int i) {
-    setBase(cs, cs->a[i].base);
-    setMark(cs, cs->a[i].mark);
-    cs->a[cs->current].oldCol = 0;
+    cursor c = *locate(cs, i);
+    setBase(cs, c.base);
+    setMark(cs, c.mark);
+    get(cs)->oldCol = 0;
 }
 
 void moveCursor(cursors *cs, int row, int col) {
@@ -124,50 +525,119 @@ void markCursor(cursors *cs, int row, int col) {
     setMark(cs, p);
 }
 
-// Compare one row/col point to another.
-static int compare(point p0, point p1) {
-    if (p0.row < p1.row) return -1;
-    if (p0.row > p1.row) return +1;
-    if (p0.col < p1.col) return -1;
-    if (p0.col > p1.col) return +1;
-    return 0;
+// Make a copy of the cursor at index i (or of the last cursor, if i is the
+// number of cursors) and insert it at index i.
+static void duplicate(cursors *cs, int i) {
+    int n = nCursors(cs);
+    entry e = { .c=*locate(cs, i < n ? i : n - 1) };
+    insertAll(cs, i, 1, &e);
 }
 
-// Find the right index at which to insert a new cursor, assuming the cursors
-// are in a normalised state.
-static int find(cursors *cs, int row, int col) {
-    point p = { .row=row, .col=col };
-    int n = -1;
-    for (int i = 0; i < cs->length && n < 0; i++) {
-        int pb = compare(p, cs->a[cs->current].base);
-        int pm = compare(p, cs->a[cs->current].mark);
-        if (pb >= 0 || pm >= 0) n = i;
-    }
-    if (n < 0) n = cs->length;
-    return n;
+// Remove the cursor at index i.
+static void removeCursor(cursors *cs, int i) {
+    deleteAll(cs, i, i + 1);
 }
 
-// Set the new cursor initially equal to the next (or prev) cursor then move it.
+// Make the next cursor current, or the previous one if there is none, insert a
+// copy of it, then move the new cursor, so that the history can replay the
+// addition, and undo it as a cut of the current cursor.
 void addCursor(cursors *cs, int row, int col) {
-    if (cs->length >= cs->max) expand(cs);
-    int newIndex = find(cs, row, col);
-    saveAddCursor(cs->h, newIndex - cs->current);
-    setCursor(cs, newIndex);
-    for (int i = cs->length - 1; i > cs->current; i--) cs->a[i+1] = cs->a[i];
-    cs->length++;
-    if (cs->current < cs->length-1) setEqual(cs, cs->current + 1);
-    else setEqual(cs, cs->current - 1);
+    point p = { .row=row, .col=col };
+    int i = find(cs, p), n = nCursors(cs);
+    setCursor(cs, i < n ? i : n - 1);
+    saveAddCursor(cs->h, 0);
+    duplicate(cs, cs->current);
+    if (i == n) setCursor(cs, n);
+    get(cs)->oldCol = 0;
     moveCursor(cs, row, col);
 }
 
+// Describe a cursor c as four integers, relative to the cursor p before it. The
+// base is relative to the base of p, and the mark is relative to the base, with
+// each column relative only if the row is the same, so the integers are mostly
+// small.
+static void encode(cursor *p, cursor *c, int v[4]) {
+    int dr = c->base.row - p->base.row;
+    int mr = c->mark.row - c->base.row;
+    v[0] = dr;
+    v[1] = (dr == 0) ? c->base.col - p->base.col : c->base.col;
+    v[2] = mr;
+    v[3] = (mr == 0) ? c->mark.col - c->base.col : c->mark.col;
+}
+
+// Rebuild a cursor c from four integers, relative to the cursor p before it.
+static void decode(cursor *p, cursor *c, int const v[4]) {
+    c->base.row = p->base.row + v[0];
+    c->base.col = (v[0] == 0) ? p->base.col + v[1] : v[1];
+    c->mark.row = c->base.row + v[2];
+    c->mark.col = (v[2] == 0) ? c->base.col + v[3] : v[3];
+    c->oldCol = 0;
+}
+
+// Describe the n cursors after index i as a vector of four integers each.
+static void describe(cursors *cs, int i, int n, int v[4*n]) {
+    cursor *a = malloc((n + 1) * sizeof(cursor));
+    gather(cs->root, i, n + 1, a, zero);
+    for (int k = 0; k < n; k++) encode(&a[k], &a[k + 1], &v[4*k]);
+    free(a);
+}
+
+// Insert n cursors after index i, from a vector describing them.
+static void rebuild(cursors *cs, int i, int n, int const v[4*n]) {
+    entry *es = malloc((n + 1) * sizeof(entry));
+    cursor *p = locate(cs, i);
+    for (int k = 0; k < n; k++) {
+        decode(p, &es[k].c, &v[4*k]);
+        p = &es[k].c;
+    }
+    insertAll(cs, i + 1, n, es);
+    free(es);
+}
+
+// Remove n cursors after index i.
+static void clip(cursors *cs, int i, int n) {
+    deleteAll(cs, i + 1, i + 1 + n);
+}
+
+void setCursors(cursors *cs, int n, int points[n][4]) {
+    if (n <= 0) return;
+    setCursor(cs, 0);
+    int old = nCursors(cs) - 1;
+    if (old > 0) {
+        int *v = malloc(4 * old * sizeof(int));
+        describe(cs, 0, old, v);
+        saveCutCursors(cs->h, 4 * old, v);
+        clip(cs, 0, old);
+        free(v);
+    }
+    point base = { .row=points[0][0], .col=points[0][1] };
+    point mark = { .row=points[0][2], .col=points[0][3] };
+    setBase(cs, base);
+    setMark(cs, mark);
+    get(cs)->oldCol = 0;
+    if (n == 1) return;
+    entry *es = malloc(n * sizeof(entry));
+    for (int i = 1; i < n; i++) {
+        es[i - 1].c = (cursor) {
+            .base={ .row=points[i][0], .col=points[i][1] },
+            .mark={ .row=points[i][2], .col=points[i][3] },
+            .oldCol=0
+        };
+    }
+    insertAll(cs, 1, n - 1, es);
+    free(es);
+    int *v = malloc(4 * (n - 1) * sizeof(int));
+    describe(cs, 0, n - 1, v);
+    saveAddCursors(cs->h, 4 * (n - 1), v);
+    free(v);
+}
+
 // Set cursor equal to next (or prev) before deleting it, to allow undo.
-// If last cursor is deleted, should be followed by setCursor.
-static void cutCursor(cursors *cs) {
-    if (cs->current < cs->length-1) setEqual(cs, cs->current + 1);
+void cutCursor(cursors *cs) {
+    if (cs->current < nCursors(cs) - 1) setEqual(cs, cs->current + 1);
     else setEqual(cs, cs->current - 1);
     saveCutCursor(cs->h, 0);
-    for (int i = cs->current + 2; i < cs->length; i++) cs->a[i-1] = cs->a[i];
-    cs->length--;
+    removeCursor(cs, cs->current);
 }
 
 // Check whether two cursors overlap, including touching ambiguously, i.e. two
@@ -208,36 +678,283 @@ static bool leftward(cursor *c) {
 }
 
 // Merge two overlapping cursors.
-static void merge(cursors *cs, int i) {
-    cursor *c0 = &cs->a[i], *c1 = &cs->a[i+1];
-    point base = smallest(c0->base, c0->mark, c1->base, c1->mark);
-    point mark = largest(c0->base, c0->mark, c1->base, c1->mark);
-    if (leftward(c0) && leftward(c1)) {
+static cursor unite(cursor c0, cursor c1) {
+    point base = smallest(c0.base, c0.mark, c1.base, c1.mark);
+    point mark = largest(c0.base, c0.mark, c1.base, c1.mark);
+    if (leftward(&c0) && leftward(&c1)) {
         point temp = base;
         base = mark;
         mark = temp;
     }
-    setCursor(cs, i+1);
-    setBase(cs, base);
-    setMark(cs, mark);
-    setCursor(cs, i);
-    cutCursor(cs);
+    return (cursor) { .base=base, .mark=mark, .oldCol=0 };
+}
+
+// Find the cursors, starting with a[0], which overlap each other in a chain,
+// and return the number of them, setting *u to their union.
+static int group(int n, cursor a[n], cursor *u) {
+    int k = 1;
+    *u = a[0];
+    while (k < n && overlap(u, &a[k])) *u = unite(*u, a[k++]);
+    return k;
 }
 
+// Make a single sweep through the cursors, finding groups and their unions. If
+// there are any, rebuild the tree. Each group is recorded as its index (in
+// the merged cursors, relative to the previous group), the number of cursors
+// in it, and the cursors, with the first relative to the origin. The current
+// cursor is first moved to the start of its group.
 void mergeCursors(cursors *cs) {
-    for (int i = 0; i < cs->length - 1; i++) {
-        if (overlap(&cs->a[i], &cs->a[i+1])) {
-            merge(cs, i);
+    int n = nCursors(cs);
+    cursor *a = malloc(n * sizeof(cursor));
+    gather(cs->root, 0, n, a, zero);
+    entry *es = malloc(n * sizeof(entry));
+    int *v = malloc(6 * n * sizeof(int));
+    int m = 0, count = 0, prev = 0, first = cs->current, current = 0;
+    cursor origin = { .base=zero, .mark=zero, .oldCol=0 };
+    for (int i = 0; i < n; ) {
+        int k = group(n - i, &a[i], &es[m].c);
+        if (k > 1) {
+            v[count++] = m - prev;
+            v[count++] = k;
+            prev = m;
+            encode(&origin, &a[i], &v[count]);
+            for (int j = 1; j < k; j++) {
+                encode(&a[i + j - 1], &a[i + j], &v[count + 4 * j]);
+            }
+            count += 4 * k;
+            if (first > i && first < i + k) first = i;
+        }
+        if (first >= i && first < i + k) current = m;
+        m++;
+        i += k;
+    }
+    if (m < n) {
+        setCursor(cs, first);
+        saveMergeCursors(cs->h, count, v);
+        freeNode(cs->root);
+        cs->root = newNode(true);
+        insertAll(cs, 0, m, es);
+        cs->current = current;
+    }
+    free(v);
+    free(es);
+    free(a);
+}
+
+void shiftCursors(cursors *cs, int i, int n, int rows, int cols) {
+    if (n <= 0 || (rows == 0 && cols == 0)) return;
+    int v[4] = { i - cs->current, n, rows, cols };
+    saveShiftCursors(cs->h, 4, v);
+    point d = { .row=rows, .col=cols };
+    shiftAll(cs, i, i + n, d);
+}
+
+// Add individual deltas, four per cursor from v, multiplied by sign, to the
+// ends of n cursors from index i onwards in the subtree x, in a single walk.
+static void adjustAt(node *x, int i, int n, int const *v, int sign) {
+    push(x);
+    if (x->leaf) {
+        for (int j = 0; j < n; j++) {
+            cursor *c = &x->e[i + j].c;
+            int const *w = &v[4 * j];
+            c->base.row += sign * w[0];
+            c->base.col += sign * w[1];
+            c->mark.row += sign * w[2];
+            c->mark.col += sign * w[3];
+        }
+        sum(x);
+        return;
+    }
+    for (int j = 0; j < x->n && n > 0; j++) {
+        node *c = x->e[j].child;
+        if (i >= c->count) { i -= c->count; continue; }
+        int k = c->count - i < n ? c->count - i : n;
+        adjustAt(c, i, k, v, sign);
+        v += 4 * k;
+        n -= k;
+        i = 0;
+    }
+    sum(x);
+}
+
+// Find the deltas from the old cursors to the new points. If they are all the
+// same, and the same for both ends, record a shift instead.
+void moveCursors(cursors *cs, int i, int n, int points[n][4]) {
+    if (n <= 0) return;
+    cursor *a = malloc(n * sizeof(cursor));
+    gather(cs->root, i, n, a, zero);
+    int *v = malloc((4 * n + 1) * sizeof(int));
+    v[0] = i - cs->current;
+    int *d = &v[1];
+    bool same = true;
+    for (int k = 0; k < n; k++) {
+        int *w = &d[4 * k];
+        w[0] = points[k][0] - a[k].base.row;
+        w[1] = points[k][1] - a[k].base.col;
+        w[2] = points[k][2] - a[k].mark.row;
+        w[3] = points[k][3] - a[k].mark.col;
+        if (w[0] != d[0] || w[1] != d[1] || w[2] != d[0] || w[3] != d[1]) {
+            same = false;
+        }
+    }
+    if (same) shiftCursors(cs, i, n, d[0], d[1]);
+    else {
+        saveMoveCursors(cs->h, 4 * n + 1, v);
+        cs->c = NULL;
+        adjustAt(cs->root, i, n, d, 1);
+    }
+    free(v);
+    free(a);
+}
+
+// Carry out a ShiftCursors or MoveCursors edit, or subtract the deltas for an
+// UnshiftCursors or UnmoveCursors edit, as one bulk operation on the tree.
+static void editShift(cursors *cs, edit e) {
+    int *v = malloc((e.n + 1) * sizeof(int));
+    int count = unpackVector(e, v);
+    int sign = (e.op == ShiftCursors || e.op == MoveCursors) ? 1 : -1;
+    int i = cs->current + v[0];
+    if (e.op == ShiftCursors || e.op == UnshiftCursors) {
+        point d = { .row=sign * v[2], .col=sign * v[3] };
+        shiftAll(cs, i, i + v[1], d);
+    }
+    else {
+        cs->c = NULL;
+        adjustAt(cs->root, i, (count - 1) / 4, &v[1], sign);
+    }
+    free(v);
+}
+
+// Carry out a MergeCursors or SplitCursors edit, one group at a time, using
+// the index of each group in the merged cursors, offset by the number of extra
+// cursors from the groups already split.
+static void editMerge(cursors *cs, edit e) {
+    int *v = malloc((e.n + 1) * sizeof(int));
+    int count = unpackVector(e, v);
+    int at = 0, extra = 0;
+    cursor origin = { .base=zero, .mark=zero, .oldCol=0 };
+    for (int x = 0; x < count; ) {
+        at += v[x++];
+        int k = v[x++];
+        entry *es = malloc(k * sizeof(entry));
+        for (int j = 0; j < k; j++) {
+            cursor *p = (j == 0) ? &origin : &es[j - 1].c;
+            decode(p, &es[j].c, &v[x + 4 * j]);
         }
+        x += 4 * k;
+        if (e.op == MergeCursors) {
+            cursor u = es[0].c;
+            for (int j = 1; j < k; j++) u = unite(u, es[j].c);
+            deleteAll(cs, at + 1, at + k);
+            *locate(cs, at) = u;
+            resum(cs->root, at);
+            if (cs->current >= at + k) cs->current -= k - 1;
+        }
+        else {
+            deleteAll(cs, at + extra, at + extra + 1);
+            insertAll(cs, at + extra, k, es);
+            if (cs->current > at + extra) cs->current += k - 1;
+            extra += k - 1;
+        }
+        free(es);
+    }
+    cs->c = NULL;
+    free(v);
+}
+
+int rowCursors(cursors *cs, int row, int *n) {
+    point p = { .row=row, .col=0 };
+    int i = find(cs, p), total = nCursors(cs), k = 0;
+    cursor batch[MAX];
+    while (i + k < total) {
+        int m = total - i - k < MAX ? total - i - k : MAX;
+        gather(cs->root, i + k, m, batch, zero);
+        int j = 0;
+        while (j < m && left(&batch[j]).row <= row) j++;
+        k += j;
+        if (j < m) break;
     }
+    *n = k;
+    return i;
 }
 
+void getCursors(cursors *cs, int i, int n, int points[n][4]) {
+    cursor *a = malloc((n + 1) * sizeof(cursor));
+    gather(cs->root, i, n, a, zero);
+    for (int k = 0; k < n; k++) {
+        points[k][0] = a[k].base.row;
+        points[k][1] = a[k].base.col;
+        points[k][2] = a[k].mark.row;
+        points[k][3] = a[k].mark.col;
+    }
+    free(a);
+}
+
+void restoreCursors(cursors *cs, int n, int points[n][4], int current) {
+    if (n <= 0 || current < 0 || current >= n) return;
+    entry *es = malloc(n * sizeof(entry));
+    for (int i = 0; i < n; i++) {
+        es[i].c = (cursor) {
+            .base={ .row=points[i][0], .col=points[i][1] },
+            .mark={ .row=points[i][2], .col=points[i][3] },
+            .oldCol=0
+        };
+    }
+    freeNode(cs->root);
+    cs->root = newNode(true);
+    cs->c = NULL;
+    insertAll(cs, 0, n, es);
+    cs->current = current;
+    free(es);
+}
+
+// Carry out an AddCursors or CutCursors edit.
+static void editVector(cursors *cs, edit e) {
+    int *v = malloc((e.n + 1) * sizeof(int));
+    int n = unpackVector(e, v) / 4;
+    if (e.op == AddCursors) rebuild(cs, cs->current, n, v);
+    else clip(cs, cs->current, n);
+    free(v);
+}
+
+void editCursors(cursors *cs, edit e) {
+    switch (e.op) {
+        case AddCursor: duplicate(cs, cs->current + e.n); return;
+        case CutCursor:
+            removeCursor(cs, cs->current);
+            cs->current += e.n;
+            return;
+        case SetCursor: cs->current += e.n; cs->c = NULL; return;
+        case AddCursors: case CutCursors: editVector(cs, e); return;
+        case MergeCursors: case SplitCursors: editMerge(cs, e); return;
+        case ShiftCursors: case UnshiftCursors: case MoveCursors:
+        case UnmoveCursors: editShift(cs, e); return;
+        default: break;
+    }
+    cursor *c = get(cs);
+    switch (e.op) {
+        case CursorRow: c->base.row += e.n; c->mark.row += e.n; break;
+        case CursorCol: c->base.col += e.n; c->mark.col += e.n; break;
+        case BaseRow: c->base.row += e.n; break;
+        case BaseCol: c->base.col += e.n; break;
+        case MarkRow: c->mark.row += e.n; break;
+        case MarkCol: c->mark.col += e.n; break;
+        default: return;
+    }
+    moved(cs);
+}
+
+int cursorBaseRow(cursors *cs) { return get(cs)->base.row; }
+int cursorBaseCol(cursors *cs) { return get(cs)->base.col; }
+int cursorMarkRow(cursors *cs) { return get(cs)->mark.row; }
+int cursorMarkCol(cursors *cs) { return get(cs)->mark.col; }
+int cursorLeftRow(cursors *cs) { return left(get(cs)).row; }
+int cursorLeftCol(cursors *cs) { return left(get(cs)).col; }
+int cursorRightRow(cursors *cs) { return right(get(cs)).row; }
+int cursorRightCol(cursors *cs) { return right(get(cs)).col; }
+int cursorOldCol(cursors *cs) { return get(cs)->oldCol; }
+
 // TODO: extract info functions
-// TODO: adjust after insert/delete text
-// Convert point to position (at EOL or EOT)
-// If position before ins/del, ignore.
-// If after, (a) increase/decrease row by newlines.
-// (b) if on same line as last line of ins/del, adjust col.
 
 /*
 // --------------------
@@ -273,7 +990,348 @@ int cursorCol(cursors *cs) {
 // test, the cursors start non-overlapping, and merging is done so that they
 // should end up non-overlapping.
 
+// Check that cursor movements can be replayed from the history, and undone.
+static void testEdit() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    moveCursor(cs, 3, 4);
+    markCursor(cs, 5, 0);
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), 0);
+    cursors *cs2 = newCursors(copy);
+    while (currentHistory(copy) < sizeHistory(copy)) {
+        editCursors(cs2, redo(copy));
+    }
+    assert(cursorBaseRow(cs2) == 3 && cursorBaseCol(cs2) == 4);
+    assert(cursorMarkRow(cs2) == 5 && cursorMarkCol(cs2) == 0);
+    while (currentHistory(copy) > 0) editCursors(cs2, undo(copy));
+    assert(cursorBaseRow(cs2) == 0 && cursorMarkRow(cs2) == 0);
+    assert(cursorBaseCol(cs2) == 0 && cursorMarkCol(cs2) == 0);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+}
+
+// Check that the cursors match a list of points.
+static bool check(cursors *cs, int n, int points[n][4]) {
+    if (nCursors(cs) != n) return false;
+    int (*actual)[4] = malloc(n * sizeof(int[4]));
+    getCursors(cs, 0, n, actual);
+    bool ok = memcmp(actual, points, n * sizeof(int[4])) == 0;
+    free(actual);
+    return ok;
+}
+
+// Check that many cursors can be set at once, with a compact history, and that
+// the edit can be replayed, undone and redone.
+static void testSet() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int n = 50000;
+    int (*points)[4] = malloc(n * sizeof(int[4]));
+    for (int i = 0; i < n; i++) {
+        int row = i / 3, col = 10 * (i % 3) + 2;
+        points[i][0] = points[i][2] = row;
+        points[i][1] = col + 5;
+        points[i][3] = col;
+    }
+    int two[2][4] = { { 1, 1, 1, 1 }, { 7, 0, 7, 0 } };
+    setCursors(cs, 2, two);
+    setCursor(cs, 1);
+    saveEnd(h);
+    int before = sizeHistory(h);
+    setCursors(cs, n, points);
+    saveEnd(h);
+    assert(check(cs, n, points));
+    assert(sizeHistory(h) - before < 5 * n);
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), 0);
+    cursors *cs2 = newCursors(copy);
+    while (currentHistory(copy) < sizeHistory(copy)) {
+        editCursors(cs2, redo(copy));
+    }
+    assert(check(cs2, n, points));
+    while (currentHistory(copy) > before) editCursors(cs2, undo(copy));
+    assert(check(cs2, 2, two) && currentCursor(cs2) == 1);
+    while (currentHistory(copy) < sizeHistory(copy)) {
+        editCursors(cs2, redo(copy));
+    }
+    assert(check(cs2, n, points));
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+    free(points);
+}
+
+// Check that cursors added in any order are found and kept in order, that the
+// history can replay the additions and cuts, and that the cursors on each row
+// can be found.
+static void testIndex() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int n = 3000;
+    srand(1);
+    markCursor(cs, 0, 2);
+    for (int i = 1; i < n; i++) {
+        int k = (i * 1237) % n;
+        int row = k / 3, col = 4 * (k % 3);
+        addCursor(cs, row, col);
+        markCursor(cs, row, col + 2);
+        assert(cursorBaseRow(cs) == row && cursorBaseCol(cs) == col);
+    }
+    assert(nCursors(cs) == n);
+    int (*points)[4] = malloc(n * sizeof(int[4]));
+    for (int k = 0; k < n; k++) {
+        points[k][0] = points[k][2] = k / 3;
+        points[k][1] = 4 * (k % 3);
+        points[k][3] = 4 * (k % 3) + 2;
+    }
+    assert(check(cs, n, points));
+    int count;
+    assert(rowCursors(cs, 0, &count) == 0 && count == 3);
+    assert(rowCursors(cs, 500, &count) == 1500 && count == 3);
+    assert(rowCursors(cs, 1000, &count) == n && count == 0);
+    for (int i = 0; i < 100; i++) {
+        setCursor(cs, rand() % (nCursors(cs) - 1));
+        cutCursor(cs);
+    }
+    assert(nCursors(cs) == n - 100);
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), 0);
+    cursors *cs2 = newCursors(copy);
+    while (currentHistory(copy) < sizeHistory(copy)) {
+        editCursors(cs2, redo(copy));
+    }
+    assert(nCursors(cs2) == n - 100);
+    int (*actual)[4] = malloc(n * sizeof(int[4]));
+    getCursors(cs, 0, n - 100, actual);
+    assert(check(cs2, n - 100, actual));
+    while (currentHistory(copy) > 0) editCursors(cs2, undo(copy));
+    assert(nCursors(cs2) == 1 && cursorBaseRow(cs2) == 0);
+    free(actual);
+    free(points);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+}
+
+// Adjust an array of points naively, for comparison.
+static void adjust(int n, int ps[n][4], point p, point s, point l) {
+    for (int i = 0; i < n; i++) for (int j = 0; j < 4; j += 2) {
+        point q = { .row=ps[i][j], .col=ps[i][j+1] };
+        q = move(q, p, s, l);
+        ps[i][j] = q.row;
+        ps[i][j+1] = q.col;
+    }
+}
+
+// Check random insertions and deletions against naive adjustment, with cursors
+// which are mostly on their own rows, some sharing rows and some spanning rows.
+static void testAdjust() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int n = 2000;
+    int (*ps)[4] = malloc(n * sizeof(int[4]));
+    srand(2);
+    int row = 0, col = 0;
+    for (int i = 0; i < n; i++) {
+        if (rand() % 3 > 0) { row += 1 + rand() % 2; col = 0; }
+        ps[i][2] = row;
+        ps[i][3] = col + rand() % 3;
+        if (rand() % 5 == 0) row += 1;
+        ps[i][0] = row;
+        ps[i][1] = (ps[i][2] == row ? ps[i][3] : 0) + rand() % 4;
+        col = ps[i][1] + 1;
+    }
+    setCursors(cs, n, ps);
+    for (int t = 0; t < 1000; t++) {
+        point p = { .row=rand() % (row + 2), .col=rand() % 8 };
+        point e = { .row=p.row + rand() % 2, .col=rand() % 8 };
+        if (e.row == p.row && e.col < p.col) e.col = p.col + rand() % 3;
+        if (rand() % 2 == 0) {
+            insertCursors(cs, p.row, p.col, e.row, e.col);
+            point s = { e.row - p.row, e.col - p.col };
+            point l = { e.row - p.row, 0 };
+            adjust(n, ps, p, s, l);
+        }
+        else {
+            deleteCursors(cs, p.row, p.col, e.row, e.col);
+            for (int i = 0; i < n; i++) for (int j = 0; j < 4; j += 2) {
+                point q = { .row=ps[i][j], .col=ps[i][j+1] };
+                if (compare(q, p) >= 0 && compare(q, e) < 0) q = e;
+                ps[i][j] = q.row;
+                ps[i][j+1] = q.col;
+            }
+            point s = { p.row - e.row, p.col - e.col };
+            point l = { p.row - e.row, 0 };
+            adjust(n, ps, e, s, l);
+        }
+        if (t % 50 == 0) {
+            setCursor(cs, rand() % n);
+            assert(cursorBaseRow(cs) == ps[currentCursor(cs)][0]);
+        }
+        assert(check(cs, n, ps));
+    }
+    free(ps);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check merging many groups of overlapping cursors in one pass, as a single
+// edit in the history, with a current cursor inside a group, and replaying it.
+static void testMerge() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int rows = 10000, n = 0;
+    int (*ps)[4] = malloc(3 * rows * sizeof(int[4]));
+    for (int r = 0; r < rows; r++) {
+        int k = (r % 2 == 0) ? 3 : 1;
+        for (int j = 0; j < k; j++) {
+            bool left = j == 2;
+            ps[n][0] = ps[n][2] = r;
+            ps[n][1] = left ? 3 : 0;
+            ps[n][3] = 0;
+            n++;
+        }
+    }
+    setCursors(cs, n, ps);
+    setCursor(cs, 5);
+    saveEnd(h);
+    int before = sizeHistory(h);
+    mergeCursors(cs);
+    saveEnd(h);
+    int size = sizeHistory(h);
+    assert(nCursors(cs) == rows && currentCursor(cs) == 2);
+    assert(cursorBaseRow(cs) == 2 && cursorBaseCol(cs) == 0);
+    assert(cursorMarkRow(cs) == 2 && cursorMarkCol(cs) == 3);
+    mergeCursors(cs);
+    assert(sizeHistory(h) == size);
+    history *copy = newHistory();
+    loadHistory(copy, size, bytesHistory(h), 0);
+    cursors *cs2 = newCursors(copy);
+    while (currentHistory(copy) < before) editCursors(cs2, redo(copy));
+    assert(check(cs2, n, ps) && currentCursor(cs2) == 5);
+    edit e = redo(copy);
+    assert(e.op == SetCursor && ! e.end);
+    editCursors(cs2, e);
+    e = redo(copy);
+    assert(e.op == MergeCursors && e.end);
+    editCursors(cs2, e);
+    int (*merged)[4] = malloc(rows * sizeof(int[4]));
+    getCursors(cs, 0, rows, merged);
+    assert(check(cs2, rows, merged) && currentCursor(cs2) == 2);
+    while (currentHistory(copy) > before) editCursors(cs2, undo(copy));
+    assert(check(cs2, n, ps) && currentCursor(cs2) == 5);
+    free(merged);
+    free(ps);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+}
+
+// Check that moving many cursors at once is recorded compactly, as a shift if
+// they all move the same way, and that it can be replayed and undone.
+static void testShift() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int n = 10000;
+    int (*ps)[4] = malloc(n * sizeof(int[4]));
+    for (int r = 0; r < n; r++) {
+        ps[r][0] = ps[r][2] = r;
+        ps[r][1] = ps[r][3] = 2;
+    }
+    setCursors(cs, n, ps);
+    setCursor(cs, 100);
+    saveEnd(h);
+    int start = sizeHistory(h);
+    shiftCursors(cs, 0, n, 0, 1);
+    saveEnd(h);
+    assert(sizeHistory(h) - start <= 8);
+    for (int r = 0; r < n; r++) ps[r][1] = ps[r][3] = 3;
+    assert(check(cs, n, ps));
+    int middle = sizeHistory(h);
+    for (int r = 0; r < n; r++) ps[r][1] = ps[r][3] = 3 + r % 5;
+    moveCursors(cs, 0, n, ps);
+    assert(check(cs, n, ps));
+    assert(sizeHistory(h) - middle <= 4 * n + 8);
+    assert(cursorBaseRow(cs) == 100 && cursorBaseCol(cs) == 3);
+    for (int r = 0; r < n; r++) ps[r][1] = 7;
+    moveCursors(cs, 0, n, ps);
+    saveEnd(h);
+    assert(check(cs, n, ps));
+    assert(sizeHistory(h) - middle <= 2 * (4 * n + 8));
+    int before = sizeHistory(h);
+    for (int r = 50; r < 60; r++) {
+        ps[r][1] += 2;
+        ps[r][3] += 2;
+    }
+    moveCursors(cs, 50, 10, &ps[50]);
+    saveEnd(h);
+    assert(sizeHistory(h) - before < 8);
+    assert(check(cs, n, ps));
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), 0);
+    cursors *cs2 = newCursors(copy);
+    for (edit e = redo(copy); e.op != End; e = redo(copy)) {
+        editCursors(cs2, e);
+    }
+    assert(check(cs2, n, ps) && currentCursor(cs2) == 100);
+    while (currentHistory(copy) > start) editCursors(cs2, undo(copy));
+    for (int r = 0; r < n; r++) {
+        ps[r][0] = ps[r][2] = r;
+        ps[r][1] = ps[r][3] = 2;
+    }
+    assert(check(cs2, n, ps));
+    free(ps);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+}
+
+// Check that cursors saved by getCursors can be restored in a fresh cursors
+// object without recording anything, and that edits from the history carry on
+// from them, as when a journal is recovered.
+static void testRestore() {
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    int three[3][4] = { { 0, 2, 0, 2 }, { 1, 0, 1, 4 }, { 5, 3, 5, 3 } };
+    setCursors(cs, 3, three);
+    setCursor(cs, 2);
+    saveEnd(h);
+    int before = sizeHistory(h), points[3][4];
+    getCursors(cs, 0, 3, points);
+    moveCursor(cs, 6, 1);
+    saveEnd(h);
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), before);
+    cursors *cs2 = newCursors(copy);
+    restoreCursors(cs2, 3, points, currentCursor(cs));
+    assert(sizeHistory(copy) == sizeHistory(h));
+    assert(check(cs2, 3, three) && currentCursor(cs2) == 2);
+    while (currentHistory(copy) < sizeHistory(copy)) {
+        editCursors(cs2, redo(copy));
+    }
+    assert(cursorBaseRow(cs2) == 6 && cursorBaseCol(cs2) == 1);
+    assert(nCursors(cs2) == 3 && currentCursor(cs2) == 2);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(copy);
+}
+
 int main() {
+    testEdit();
+    testSet();
+    testIndex();
+    testAdjust();
+    testMerge();
+    testShift();
+    testRestore();
     printf("Cursors module OK\n");
     return 0;
 }
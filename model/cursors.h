@@ -35,14 +35,69 @@ void moveCursor(cursors *cs, int row, int col);
 // Add a cursor at the given point, at the right index. It becomes current.
 void addCursor(cursors *cs, int row, int col);
 
+// Replace all the cursors by n new ones, e.g. to select all the matches of a
+// search, given as base row and column then mark row and column. They must be
+// in order and not overlap. The first becomes current. The history records the
+// removal of the old cursors and the addition of the new ones as single edits,
+// using a few bytes per cursor.
+void setCursors(cursors *cs, int n, int points[n][4]);
+
+// Move n cursors from index i onwards by the same number of rows and columns,
+// e.g. when every cursor moves one character right. The cursors must stay in
+// order. The shift is recorded as a single edit of a few bytes, and takes
+// logarithmic time, as a lazy delta in the tree of cursors.
+void shiftCursors(cursors *cs, int i, int n, int rows, int cols);
+
+// Move n cursors from index i onwards to new points, given as base row and
+// column then mark row and column, e.g. when every cursor moves to the end of
+// its line. The cursors must stay in order. The movements are recorded as a
+// single edit holding a small delta for each cursor end, or as a shift if they
+// are all the same.
+void moveCursors(cursors *cs, int i, int n, int points[n][4]);
+
 // Move the current cursor's base.
 void baseCursor(cursors *cs, int row, int col);
 
 // Move the current cursor's mark.
 void markCursor(cursors *cs, int row, int col);
 
-// Merge any overlapping cursors.
-void mergeCursor(cursors *cs);
+// Remove the current cursor, after moving it onto the next cursor (or previous,
+// if it is the last) so that undo can restore it. If it was the last cursor,
+// this should be followed by setCursor.
+void cutCursor(cursors *cs);
+
+// Merge any overlapping cursors, in a single pass, recorded in the history as a
+// single edit.
+void mergeCursors(cursors *cs);
+
+// Find the cursors which touch a given row, e.g. to draw them, returning the
+// index of the first and setting *n to the number of them.
+int rowCursors(cursors *cs, int row, int *n);
+
+// Get the base row and column, then the mark row and column, of n cursors from
+// index i onwards, without changing which cursor is current.
+void getCursors(cursors *cs, int i, int n, int points[n][4]);
+
+// Replace all the cursors by n cursors saved by getCursors, with the given one
+// current, without recording anything in the history, e.g. to bring back the
+// cursors at the start of a recovered journal.
+void restoreCursors(cursors *cs, int n, int points[n][4], int current);
+
+// Adjust the cursors after an insertion of text running from (row,col) to
+// (endRow,endCol). Any cursor end at or after the start moves with the text
+// after it, so an end at the insertion point moves to the end of the inserted
+// text. This isn't recorded in the history, because it happens again when the
+// insertion is undone or redone.
+void insertCursors(cursors *cs, int row, int col, int endRow, int endCol);
+
+// Adjust the cursors after a deletion of text from (row,col) to
+// (endRow,endCol). Any cursor end within the range moves to its start, and any
+// after it moves with the text. This isn't recorded in the history.
+void deleteCursors(cursors *cs, int row, int col, int endRow, int endCol);
+
+// Carry out a cursor edit retrieved from the history by undo or redo, without
+// recording it again.
+void editCursors(cursors *cs, edit e);
 
 // Get the base and mark, or left and right ends, or remembered column, of the
 // current cursor.
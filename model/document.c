@@ -4,32 +4,58 @@
 #include "scan.h"
 #include "indent.h"
 #include "line.h"
+#include "text.h"
+#include "cursors.h"
 #include "history.h"
 #include "style.h"
 #include "string.h"
 #include "setting.h"
 #include "file.h"
+#include "journal.h"
+#include "block.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 // TODO: move scanner into text.
 
 // A document holds the path of a file or folder, its content, undo and redo
 // lists, a scroll target, whether or not there have been any changes since the
 // last load or save, a scanner, line and line-style buffers, and position/text
-// data for a pending action.
+// data for a pending action. For a big file, the memory mapping of the file,
+// which the content refers to, is also kept. The version counts edits. While a
+// background save is in progress, there is a worker thread writing out a
+// snapshot of the content taken at a given version, with the baseline for the
+// journal at that point, and a flag which the worker sets when it finishes. A
+// save asked for while another is running is pending until it finishes. A
+// journal protects against a crash. The cursors are shared by the content and
+// the undo history. While the user is making a column selection, the block
+// holds it, and typing and backspacing edit the block, otherwise it is NULL.
 struct document {
     char *path;
     char *language;
     text *content;
+    char const *map;
+    int mapSize;
     history *undos, *redos;
+    cursors *cs;
+    block *bk;
     bool changed;
+    int version;
+    bool saving, saved, pending;
+    atomic_bool finished;
+    pthread_t worker;
+    snapshot *snap;
+    int snapVersion;
+    baseline snapBase;
+    journal *jn;
     scanner *sc;
     chars *line, *lineStyles;
-    int pos;
+    int row, col, pos;
     char const *text;
 };
 
@@ -38,36 +64,222 @@ static document *newEmptyDocument() {
     scanner *sc = newScanner();
     *d = (document) {
         .path = NULL, .language = "txt", .content = NULL,
-        .undos = NULL, .redos = NULL,
-        .changed = false, .sc = sc,
+        .map = NULL, .mapSize = 0,
+        .undos = NULL, .redos = NULL, .cs = NULL, .bk = NULL,
+        .changed = false, .version = 0, .saving = false, .pending = false,
+        .jn = NULL,
+        .sc = sc,
         .line = newChars(), .lineStyles = newChars()
     };
     return d;
 }
 
-static void freeDocumentData(document *d) {
-    if (d->path != NULL) free(d->path);
+// Drop any column selection, e.g. when the cursors are moved.
+static void dropBlock(document *d) {
+    if (d->bk != NULL) freeBlock(d->bk);
+    d->bk = NULL;
+}
+
+// Free the content, with its mapped file, cursors, histories and any column
+// selection.
+static void freeContent(document *d) {
+    dropBlock(d);
     if (d->content != NULL) freeText(d->content);
+    d->content = NULL;
+    if (d->map != NULL) unmapFile(d->map, d->mapSize);
+    d->map = NULL;
+    if (d->cs != NULL) freeCursors(d->cs);
+    d->cs = NULL;
     if (d->undos != NULL) freeHistory(d->undos);
     if (d->redos != NULL) freeHistory(d->redos);
+    d->undos = d->redos = NULL;
+}
+
+static void freeDocumentData(document *d) {
+    if (d->path != NULL) free(d->path);
+    d->path = NULL;
+    freeJournal(d->jn, d->changed);
+    d->jn = NULL;
+    freeContent(d);
 }
 
+// Describe the state of the content now, for the journal, with an allocated
+// array of cursor points.
+static baseline describe(document *d) {
+    baseline b = {
+        .base=currentHistory(d->undos), .pos=positionText(d->content),
+        .current=currentCursor(d->cs), .n=nCursors(d->cs)
+    };
+    b.points = malloc(b.n * sizeof(int[4]));
+    getCursors(d->cs, 0, b.n, b.points);
+    return b;
+}
+
+// Write out a snapshot of the content span by span, straight from the text's
+// storage, so no copy of the whole text is made. A mapped original is
+// unaffected, because the new file replaces it by renaming rather than
+// overwriting it.
+static bool writeSnapshot(snapshot *snap, char const *path) {
+    output *o = openOutput(path);
+    if (o == NULL) return false;
+    bool ok = true;
+    int n = lengthSnapshot(snap);
+    for (int at = 0; ok && at < n; ) {
+        span s = spanSnapshot(snap, at);
+        ok = writeOutput(o, s.n, s.s);
+        at += s.n;
+    }
+    return closeOutput(o, ok);
+}
+
+// Run a save on the worker thread, then set a flag so that the editing thread,
+// which checks it on each timer tick, can join the worker without waiting.
+static void *saveInBackground(void *arg) {
+    document *d = arg;
+    d->saved = writeSnapshot(d->snap, d->path);
+    atomic_store(&d->finished, true);
+    return NULL;
+}
+
+// Tidy up after a save. The journal now starts from the saved state. The
+// document is only marked as unchanged if there have been no edits since the
+// snapshot.
+static void tidySave(document *d) {
+    freeSnapshot(d->snap);
+    d->saving = false;
+    if (d->saved) resetJournal(d->jn, &d->snapBase);
+    free(d->snapBase.points);
+    if (d->saved && d->version == d->snapVersion) d->changed = false;
+}
+
+// Wait for the worker, if a background save is running, and tidy up.
+static void joinSave(document *d) {
+    if (! d->saving) return;
+    pthread_join(d->worker, NULL);
+    tidySave(d);
+}
+
+// Start saving a snapshot of the content in the background, so that editing
+// can continue. If a save is already running, don't wait for it, but mark
+// another as pending, to be started when it finishes. If a thread can't be
+// started, save in the foreground. A mapped file is detached from the history
+// first, since the history's references to it won't match the new file.
 static void save(document *d) {
-    if (d->path != NULL && d->changed) writeText(d->content, d->path);
+    if (d->saving) { d->pending = true; return; }
+    d->pending = false;
+    if (d->path == NULL || ! d->changed) return;
+    detachText(d->content);
+    d->snap = snapText(d->content);
+    d->snapVersion = d->version;
+    d->snapBase = describe(d);
+    d->saving = true;
+    atomic_store(&d->finished, false);
+    if (pthread_create(&d->worker, NULL, saveInBackground, d) == 0) return;
+    d->saved = writeSnapshot(d->snap, d->path);
+    tidySave(d);
+}
+
+// On a timer tick, tidy up after a background save if it has finished, and
+// start any pending save. The join doesn't wait, because the worker is done.
+static void checkSave(document *d) {
+    if (! d->saving || ! atomic_load(&d->finished)) return;
+    joinSave(d);
+    if (d->pending) save(d);
+}
+
+// Wait for any background save to finish, and any pending save after it, e.g.
+// before quitting or loading another file.
+static void finishSave(document *d) {
+    joinSave(d);
+    if (d->pending) save(d);
+    joinSave(d);
+}
+
+// Record that an edit has been made.
+static void edited(document *d) {
+    d->changed = true;
+    d->version++;
+}
+
+// If the editor crashed while the file had unsaved changes, rebuild the history
+// from the journal, bring back the text position and cursors at its base, and
+// replay it on top of the saved file. The journal's baseline is returned, since
+// it still describes the file on disk. If an edit doesn't fit the text, the
+// journal doesn't belong to the file, and false is returned, leaving the
+// content to be reloaded.
+static bool recover(document *d, baseline *b) {
+    int target;
+    history *h = d->undos;
+    text *t = d->content;
+    if (! recoverJournal(d->path, h, b, &target)) return false;
+    bool ok = editText(t, (edit) { .op=Move, .n=b->pos });
+    if (ok) restoreCursors(d->cs, b->n, b->points, b->current);
+    while (ok && currentHistory(h) < target) ok = editText(t, redo(h));
+    while (ok && currentHistory(h) > target) ok = editText(t, undo(h));
+    if (ok) { edited(d); return true; }
+    free(b->points);
+    return false;
 }
 
+// Map a big file into memory, and describe it with a piece table rather than
+// reading it into a gap buffer.
+static text *mapContent(document *d, char const *path) {
+    d->map = mapFile(path, &d->mapSize);
+    if (d->map == NULL) return NULL;
+    text *t = newText(newLines(), d->cs, d->undos);
+    if (mapText(t, d->mapSize, d->map)) return t;
+    freeText(t);
+    unmapFile(d->map, d->mapSize);
+    d->map = NULL;
+    return NULL;
+}
+
+// Read a smaller file, or a directory listing, into a gap buffer, which is
+// validated, cleaned and indexed in one pass.
+static text *readContent(document *d, char const *path) {
+    char *data = readPath(path);
+    if (data == NULL) return NULL;
+    text *t = newText(newLines(), d->cs, d->undos);
+    bool ok = loadText(t, strlen(data), data);
+    free(data);
+    if (ok) return t;
+    freeText(t);
+    return NULL;
+}
+
+// Create fresh histories and cursors, and load the content, choosing the text
+// storage for the file according to its size.
+static bool loadContent(document *d, char const *path) {
+    d->undos = newHistory();
+    d->redos = newHistory();
+    d->cs = newCursors(d->undos);
+    int size = sizeFile(path);
+    if (size >= MAP_SIZE) d->content = mapContent(d, path);
+    else d->content = readContent(d, path);
+    return d->content != NULL;
+}
+
+// Load the file, recovering unsaved changes after a crash, and start a journal
+// whose base is the file as it is on disk.
 static void load(document *d, char const *path) {
     save(d);
+    finishSave(d);
     freeDocumentData(d);
-    d->content = readText(path);
-    if (d->content == NULL) return;
+    if (! loadContent(d, path)) return;
     d->path = malloc(strlen(path) + 1);
     strcpy(d->path, path);
     d->language = extension(d->path);
     changeLanguage(d->sc, d->language);
-    d->undos = newHistory();
-    d->redos = newHistory();
     d->changed = false;
+    if (isDirectory(d)) return;
+    baseline b;
+    if (! recover(d, &b)) {
+        freeContent(d);
+        if (! loadContent(d, path)) return;
+        b = describe(d);
+    }
+    d->jn = newJournal(d->path, d->undos, &b);
+    free(b.points);
 }
 
 document *newDocument(char const *path) {
@@ -77,6 +289,7 @@ document *newDocument(char const *path) {
 }
 
 void freeDocument(document *d) {
+    finishSave(d);
     freeDocumentData(d);
     freeScanner(d->sc);
     freeList(d->line);
@@ -124,6 +337,16 @@ static void deleteIndent(document *d, int row, int n) {
     resize(styles, endLine(lines, row));
 }
 
+// Copy n bytes of text at position p into the line buffer, from the spans
+// either side of the gap, so that fetching lines doesn't move the gap.
+static void copyLine(document *d, int p, int n) {
+    span spans[2];
+    readText(d->content, p, n, spans);
+    resize(d->line, n);
+    memcpy(C(d->line), spans[0].s, spans[0].n);
+    memcpy(&C(d->line)[spans[0].n], spans[1].s, spans[1].n);
+}
+
 // Get scanning, styles and indenting up to date, for the given line, before
 // giving it away.
 static void repairLine(document *d, int r) {
@@ -132,7 +355,7 @@ static void repairLine(document *d, int r) {
     ints *indents = getIndents(d->content);
     int p = startLine(lines, r);
     int n = getWidth(d, r);
-    getText(d->content, p, n, d->line);
+    copyLine(d, p, n);
     scan(d->sc, r, d->line, d->lineStyles);
     assert(length(styles) >= p);
     resize(styles, p + n);
@@ -158,7 +381,7 @@ chars *getLine(document *d, int row) {
     for (int r = unstyled; r <= row; r++) repairLine(d, r);
     int p = startLine(lines, row);
     int n = lengthLine(lines, row);
-    getText(d->content, p, n, d->line);
+    copyLine(d, p, n);
     return d->line;
 }
 
@@ -179,30 +402,90 @@ chars *getStyle(document *d, int row) {
     return d->lineStyles;
 }
 
+// Draw the row's part of a column selection, with the columns clamped to the
+// row as an edit would see them, and a caret if the block is a column of them.
+static void addBlockFlags(document *d, int row, int n, chars *styles) {
+    int left, right;
+    if (! columnsBlock(d->bk, d->content, row, &left, &right)) return;
+    if (right > n) right = n;
+    for (int c = left; c < right; c++) {
+        C(styles)[c] = addStyleFlag(C(styles)[c], SELECT);
+    }
+    if (left == right && left < n) {
+        C(styles)[left] = addStyleFlag(C(styles)[left], POINT);
+    }
+}
+
+// Only the cursors which touch the row are fetched, so the time taken depends
+// on the number of cursors on the row, not on the total number. The mark end of
+// a cursor is its caret. A column selection is drawn instead of the cursors.
 void addCursorFlags(document *d, int row, int n, chars *styles) {
-    applyCursors(getCursors(d->content), row, styles);
+    if (d->bk != NULL) { addBlockFlags(d, row, n, styles); return; }
+    int count, first = rowCursors(d->cs, row, &count);
+    if (count == 0) return;
+    int (*points)[4] = malloc(count * sizeof(int[4]));
+    getCursors(d->cs, first, count, points);
+    for (int i = 0; i < count; i++) {
+        int *p = points[i];
+        bool forward = p[0] < p[2] || (p[0] == p[2] && p[1] <= p[3]);
+        int *start = forward ? &p[0] : &p[2], *end = forward ? &p[2] : &p[0];
+        int from = (start[0] < row) ? 0 : start[1];
+        int to = (end[0] > row) ? n : end[1];
+        if (to > n) to = n;
+        for (int c = from; c < to; c++) {
+            C(styles)[c] = addStyleFlag(C(styles)[c], SELECT);
+        }
+        if (p[2] == row && p[3] < n) {
+            C(styles)[p[3]] = addStyleFlag(C(styles)[p[3]], POINT);
+        }
+    }
+    free(points);
 }
 
 static void cutLeft(document *d) {
     deleteAt(d->content);
-    d->changed = true;
+    edited(d);
 }
 
 static void cutRight(document *d) {
     deleteAt(d->content);
-    d->changed = true;
+    edited(d);
+}
+
+// Start a column selection at the current cursor's base, or extend it, to the
+// row and column given for the action, e.g. while dragging with a modifier.
+static void selectBlock(document *d) {
+    if (d->bk == NULL) {
+        int row = cursorBaseRow(d->cs), col = cursorBaseCol(d->cs);
+        d->bk = newBlock(row, col, d->row, d->col);
+    }
+    else markBlock(d->bk, d->row, d->col);
+}
+
+// Backspace in a column selection, cutting its columns or the character before
+// each caret.
+static void cutLeftBlock(document *d) {
+    cutBlock(d->bk, d->content);
+    edited(d);
+}
+
+// Type into every row of a column selection.
+static void insertBlock(document *d) {
+    typeBlock(d->bk, d->content, strlen(d->text), (char *) d->text);
+    edited(d);
 }
 
 // Delete any selection before inserting.
 static void doInsert(document *d) {
+    if (d->bk != NULL) { insertBlock(d); return; }
     cutLeft(d);
     insertAt(d->content, d->text);
-    d->changed = true;
+    edited(d);
 }
 
 static void doNewline(document *d) {
     insertAt(d->content, "\n");
-    d->changed = true;
+    edited(d);
 }
 
 static void doHelp(document *d) {
@@ -219,7 +502,7 @@ static void doHelp(document *d) {
 
 // Load the filename selected in a directory listing.
 static void doLoad(document *d) {
-    cursors *cs = getCursors(d->content);
+    cursors *cs = d->cs;
     ints *lines = getLines(d->content);
     int p = cursorAt(cs, 0);
     int r = findRow(lines, p);
@@ -244,6 +527,8 @@ void setRowColData(document *d, int row, int col) {
     int start = startLine(lines, row);
     int len = lengthLine(lines, row);
     if (col >= len) col = len - 1;
+    d->row = row;
+    d->col = col;
     d->pos = start + col;
 }
 
@@ -254,8 +539,10 @@ void setTextData(document *d, char const *t) {
 // Get the styles up to date up to the maximum cursor position before dispatch.
 // Return a flag to say whether the display should be redrawn.
 char const *actOnDocument(document *d, action a) {
-    cursors *cs = getCursors(d->content);
+    cursors *cs = d->cs;
     getStyle(d, maxRow(cs));
+    bool moving = a <= MarkEndLine || a == Point || a == Select;
+    if (moving || a == AddPoint) dropBlock(d);
     switch (a) {
         case MoveLeftChar: moveLeftChar(cs); break;
         case MoveRightChar: moveRightChar(cs); break;
@@ -273,7 +560,10 @@ char const *actOnDocument(document *d, action a) {
         case MarkDownLine: markDownLine(cs); break;
         case MarkStartLine: markStartLine(cs); break;
         case MarkEndLine: markEndLine(cs); break;
-        case CutLeftChar: pMarkLeftChar(cs); cutLeft(d); break;
+        case CutLeftChar:
+            if (d->bk != NULL) cutLeftBlock(d);
+            else { pMarkLeftChar(cs); cutLeft(d); }
+            break;
         case CutRightChar: pMarkRightChar(cs); cutRight(d); break;
         case CutLeftWord: markLeftWord(cs); cutLeft(d); break;
         case CutRightWord: markRightWord(cs); cutRight(d); break;
@@ -286,6 +576,7 @@ char const *actOnDocument(document *d, action a) {
         case Help: doHelp(d); break;
         case Point: point(cs, d->pos); break;
         case Select: doSelect(cs, d->pos); break;
+        case SelectBlock: selectBlock(d); break;
         case AddPoint: addPoint(cs, d->pos); break;
         case Copy: gatherText(d->content, d->line); break;
         case Cut: gatherText(d->content, d->line); cutLeft(d); break;
@@ -293,10 +584,11 @@ char const *actOnDocument(document *d, action a) {
         case Save: save(d); break;
         case Defocus: save(d); break;
         case Open: doOpen(d); break;
-        case Quit: save(d); break;
+        case Quit: save(d); finishSave(d); break;
+        case Blink: checkSave(d); flushJournal(d->jn); break;
         default: break;
     }
-    mergeCursors(getCursors(d->content));
+    mergeCursors(d->cs);
     return C(d->line);
 }
 
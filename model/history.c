@@ -1,63 +1,505 @@
 // History, undo, redo. Free and open source. See LICENSE.
-// TODO: Elide successive 1-char insertions.
+#define _POSIX_C_SOURCE 200809L
 #include "history.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
-// A history structure consists of a flexible array of bytes, with a current
-// position in the history during undo/redo sequences.
-struct history { int current, length, max; char *bs; };
+// The history bytes are held in segments of a fixed size, so the history grows
+// without copying, and old segments can be moved out of the way. A segment is
+// plain, or packed (compressed in memory), or spilled to a temporary file at an
+// offset, in packed form. The packed size is n, which is SEGMENT if the bytes
+// didn't compress. The memory budget is the default for plain and packed
+// segments together.
+enum { SEGMENT = 64 * 1024, BUDGET = 64 * 1024 * 1024 };
+enum { Plain, Packed, Spilled };
+struct segment { int state, n; long offset; char *data; };
+typedef struct segment segment;
+
+// A branch of the undo tree, other than the active one, forks from its parent
+// at a position, and its own length bytes after that are held as pieces of up
+// to SEGMENT bytes, each packed if that makes it smaller. The memory is that
+// of the pieces, and used is a clock value for when the branch was last
+// active. A pruned branch is no longer live. The default budget for branches
+// is BRANCHES.
+enum { BRANCHES = 16 * 1024 * 1024 };
+struct branch {
+    bool live;
+    int parent, fork, length, count, memory;
+    long long used;
+    segment *pieces;
+};
+typedef struct branch branch;
+
+// A source is a range of n immutable bytes, e.g. the original content of a
+// mapped file, which large deletions refer to instead of copying. The ranges
+// referred to are listed, as start and end offsets. When the source is
+// released, its data is set to NULL, and the ranges are merged into extents,
+// and the bytes of each extent are copied.
+struct source {
+    char const *data;
+    int n, count, max;
+    int (*ranges)[2];
+    char **copies;
+};
+typedef struct source source;
+
+// A history structure consists of segments of bytes, with a current position in
+// the history during undo/redo sequences. The bytes before the unchanged
+// position have not been altered since it was last reported, and the history
+// has not been cut back below the truncated position. The memory used by the
+// segments is kept within the budget, by packing and spilling the ones which
+// are furthest from the current position. A buffer is kept for copying out
+// bytes which straddle segments. The action index holds the end position of
+// each complete user action, in order. If the most recent edit is a typed
+// character or backspace, group is the start of its string, which further ones
+// can join, or else it is -1. The grouping rules are whether to end a group at
+// a word boundary, and a time gap in milliseconds (or 0 for none), with the
+// time of the previous typed character or backspace. The cut log holds the
+// position of every cut, so that other objects can tell whether what they know
+// about the bytes is still valid, however long ago they last looked. The
+// branches of the undo tree are numbered, and the history bytes are the edits
+// of the active one, with the rest held separately, within their budget.
+struct history {
+    int current, length, unchanged, truncated, group;
+    bool words;
+    int gap;
+    long long last;
+    int count, max;
+    segment *segs;
+    int budget, memory;
+    FILE *file;
+    long fileEnd;
+    char *copy;
+    int copyMax;
+    int actions, maxActions;
+    int *ends;
+    int cuts, maxCuts;
+    int *cutLog;
+    int branches, maxBranches, active, branchMemory, branchBudget;
+    long long clock;
+    branch *tree;
+    int sources, maxSources;
+    source *store;
+};
 
 history *newHistory() {
     history *h = malloc(sizeof(history));
-    *h = (history) { .current=0, .length=0, .max=1000, .bs=malloc(1000) };
+    *h = (history) {
+        .current=0, .length=0, .unchanged=0, .truncated=0, .group=-1,
+        .words=true, .gap=0, .last=0,
+        .count=0, .max=100, .segs=malloc(100 * sizeof(segment)),
+        .budget=BUDGET, .memory=0, .file=NULL, .fileEnd=0,
+        .copy=malloc(1000), .copyMax=1000,
+        .actions=0, .maxActions=100, .ends=malloc(100 * sizeof(int)),
+        .cuts=0, .maxCuts=10, .cutLog=malloc(10 * sizeof(int)),
+        .branches=1, .maxBranches=10, .active=0, .branchMemory=0,
+        .branchBudget=BRANCHES, .clock=0, .tree=malloc(10 * sizeof(branch)),
+        .sources=0, .maxSources=4, .store=malloc(4 * sizeof(source))
+    };
+    h->tree[0] = (branch) { .live=true, .parent=-1 };
     return h;
 }
 
+// Release the segments beyond the first n bytes.
+static void release(history *h, int n) {
+    int k = n / SEGMENT + (n % SEGMENT == 0 ? 0 : 1);
+    while (h->count > k) {
+        segment *s = &h->segs[--h->count];
+        if (s->state == Plain) h->memory -= SEGMENT;
+        else if (s->state == Packed) h->memory -= s->n;
+        free(s->data);
+    }
+    h->fileEnd = 0;
+    for (int i = 0; i < h->count; i++) {
+        segment *s = &h->segs[i];
+        if (s->state != Spilled || s->offset + s->n <= h->fileEnd) continue;
+        h->fileEnd = s->offset + s->n;
+    }
+}
+
+// Free the pieces of a branch, and make it empty.
+static void empty(history *h, branch *b) {
+    for (int i = 0; i < b->count; i++) free(b->pieces[i].data);
+    free(b->pieces);
+    h->branchMemory -= b->memory;
+    b->pieces = NULL;
+    b->length = b->count = b->memory = 0;
+}
+
+// Discard all the branches, leaving the active one as branch 0.
+static void uproot(history *h) {
+    for (int i = 0; i < h->branches; i++) empty(h, &h->tree[i]);
+    h->branches = 1;
+    h->active = 0;
+    h->tree[0] = (branch) { .live=true, .parent=-1 };
+}
+
 void freeHistory(history *h) {
-    free(h->bs);
+    uproot(h);
+    free(h->tree);
+    release(h, 0);
+    if (h->file != NULL) fclose(h->file);
+    free(h->segs);
+    free(h->copy);
+    free(h->ends);
+    free(h->cutLog);
+    for (int i = 0; i < h->sources; i++) {
+        source *s = &h->store[i];
+        if (s->data == NULL) for (int j = 0; j < s->count; j++) {
+            free(s->copies[j]);
+        }
+        free(s->copies);
+        free(s->ranges);
+    }
+    free(h->store);
     free(h);
 }
 
-// Resize the byte array to fit n more bytes.
-static void resize(history *h, int n) {
-    while (h->length + n > h->max) h->max = h->max * 3 / 2;
-    h->bs = realloc(h->bs, h->max);
+// Add a cut to the log.
+static void logCut(history *h, int at) {
+    if (h->cuts >= h->maxCuts) {
+        h->maxCuts = h->maxCuts * 3 / 2;
+        h->cutLog = realloc(h->cutLog, h->maxCuts * sizeof(int));
+    }
+    h->cutLog[h->cuts++] = at;
+}
+
+void clearHistory(history *h) {
+    h->current = h->length = h->unchanged = h->truncated = 0;
+    h->group = -1;
+    h->actions = 0;
+    release(h, 0);
+    logCut(h, 0);
+    uproot(h);
+}
+
+void groupHistory(history *h, bool words, int gap) {
+    h->words = words;
+    h->gap = gap;
+}
+
+void breakHistory(history *h) {
+    h->group = -1;
+}
+
+void budgetBranches(history *h, int budget) {
+    h->branchBudget = budget;
+}
+
+void budgetHistory(history *h, int budget) {
+    h->budget = budget;
+}
+
+int memoryHistory(history *h) {
+    return h->memory;
+}
+
+int sizeHistory(history *h) { return h->length; }
+int currentHistory(history *h) { return h->current; }
+
+int unchangedHistory(history *h) {
+    int n = h->unchanged;
+    h->unchanged = h->length;
+    return n;
+}
+
+int truncatedHistory(history *h) {
+    int n = h->truncated;
+    h->truncated = h->length;
+    return n;
+}
+
+// Note that the bytes from a given position onwards have been changed.
+static inline void changed(history *h, int at) {
+    if (at < h->unchanged) h->unchanged = at;
+}
+
+// Find the number of bytes needed to store a length.
+static int sizeLength(int n) {
+    int k = 1;
+    while (n >= 128) { n = n >> 7; k++; }
+    return k;
+}
+
+// Write a length into k bytes, seven bits per byte, least significant first,
+// with the top bit set in all but the last byte, or in reverse order, so that
+// it can be read from either end of a string.
+static void putLength(char *bs, int k, int n, bool reverse) {
+    for (int i = 0; i < k; i++) {
+        char b = (n & 0x7F) | (i < k - 1 ? 0x80 : 0);
+        bs[reverse ? k - 1 - i : i] = b;
+        n = n >> 7;
+    }
+}
+
+// Read a length forwards from a buffer, advancing *pi past it.
+static int takeLength(char const *bs, int *pi) {
+    int n = 0, shift = 0;
+    unsigned char b;
+    do {
+        b = bs[(*pi)++];
+        n = n | (b & 0x7F) << shift;
+        shift = shift + 7;
+    } while ((b & 0x80) != 0);
+    return n;
+}
+
+// Add n literal bytes to packed output at position m, with their count first.
+static int literals(char *out, int m, int n, char const *in) {
+    int k = sizeLength(n);
+    putLength(&out[m], k, n, false);
+    memcpy(&out[m + k], in, n);
+    return m + k + n;
+}
+
+// Pack n bytes into out, which needs room for n + 16 bytes, LZ77-style, and
+// return the packed size. The output is a sequence of steps, each of which is a
+// count of literal bytes then the bytes, then, unless the input has ended, a
+// match length less four, and the match's distance back as two bytes. Matches
+// are found with a hash table of recent positions of four-byte sequences.
+static int compress(int n, char const *in, char *out) {
+    enum { BITS = 12 };
+    int table[1 << BITS];
+    for (int i = 0; i < (1 << BITS); i++) table[i] = -1;
+    int m = 0, start = 0, i = 0;
+    while (i + 4 <= n) {
+        unsigned int x;
+        memcpy(&x, &in[i], 4);
+        int hash = (x * 2654435761u) >> (32 - BITS);
+        int j = table[hash];
+        table[hash] = i;
+        if (j < 0 || i - j > 0xFFFF || memcmp(&in[i], &in[j], 4) != 0) {
+            i++;
+            continue;
+        }
+        int length = 4;
+        while (i + length < n && in[j + length] == in[i + length]) length++;
+        m = literals(out, m, i - start, &in[start]);
+        int k = sizeLength(length - 4);
+        putLength(&out[m], k, length - 4, false);
+        m = m + k;
+        out[m++] = (i - j) & 0xFF;
+        out[m++] = (i - j) >> 8;
+        i = start = i + length;
+    }
+    return literals(out, m, n - start, &in[start]);
+}
+
+// Unpack m bytes into out.
+static void expand(int m, char const *in, char *out) {
+    int i = 0, o = 0;
+    while (i < m) {
+        int n = takeLength(in, &i);
+        memcpy(&out[o], &in[i], n);
+        i += n;
+        o += n;
+        if (i >= m) break;
+        int length = takeLength(in, &i) + 4;
+        int distance = (unsigned char) in[i] | (unsigned char) in[i + 1] << 8;
+        i += 2;
+        for (int j = 0; j < length; j++, o++) out[o] = out[o - distance];
+    }
+}
+
+// Pack segment k in memory.
+static void pack(history *h, int k) {
+    segment *s = &h->segs[k];
+    char *out = malloc(SEGMENT + 16);
+    int n = compress(SEGMENT, s->data, out);
+    if (n >= SEGMENT) { free(out); n = SEGMENT; }
+    else {
+        free(s->data);
+        s->data = realloc(out, n);
+    }
+    s->state = Packed;
+    s->n = n;
+    h->memory -= SEGMENT - n;
+}
+
+// Spill packed segment k to the temporary file, creating it if necessary.
+// Return false if that isn't possible.
+static bool spill(history *h, int k) {
+    segment *s = &h->segs[k];
+    if (h->file == NULL) h->file = tmpfile();
+    if (h->file == NULL) return false;
+    bool ok = fseek(h->file, h->fileEnd, SEEK_SET) == 0;
+    ok = ok && fwrite(s->data, 1, s->n, h->file) == s->n;
+    if (! ok) return false;
+    free(s->data);
+    s->data = NULL;
+    s->state = Spilled;
+    s->offset = h->fileEnd;
+    h->fileEnd += s->n;
+    h->memory -= s->n;
+    return true;
+}
+
+// Keep the memory within budget by packing the plain segment which is furthest
+// from the current position or, if there are none, spilling the packed segment
+// which is furthest away. Leave alone segment keep, the segments on either side
+// of the current position, and the last segment, where bytes are added.
+static void fit(history *h, int keep) {
+    int c = h->current / SEGMENT;
+    while (h->memory > h->budget) {
+        int best = -1, bestState = Spilled, far = -1;
+        for (int k = 0; k < h->count - 1; k++) {
+            int state = h->segs[k].state, d = k < c ? c - k : k - c;
+            if (k == keep || d <= 1 || state == Spilled) continue;
+            if (state > bestState || (state == bestState && d <= far)) continue;
+            best = k;
+            bestState = state;
+            far = d;
+        }
+        if (best < 0) return;
+        if (bestState == Plain) pack(h, best);
+        else if (! spill(h, best)) return;
+    }
+}
+
+// Make segment k plain, reading it back from the file and unpacking it if
+// necessary, and return its bytes.
+static char *plain(history *h, int k) {
+    segment *s = &h->segs[k];
+    if (s->state == Plain) return s->data;
+    if (s->state == Spilled) {
+        s->data = malloc(s->n);
+        bool ok = fseek(h->file, s->offset, SEEK_SET) == 0;
+        ok = ok && fread(s->data, 1, s->n, h->file) == s->n;
+        if (! ok) {
+            fprintf(stderr, "Error: can't read history back from file\n");
+            exit(1);
+        }
+        s->state = Packed;
+        h->memory += s->n;
+    }
+    if (s->n < SEGMENT) {
+        char *out = malloc(SEGMENT);
+        expand(s->n, s->data, out);
+        free(s->data);
+        s->data = out;
+        h->memory += SEGMENT - s->n;
+    }
+    s->state = Plain;
+    s->n = SEGMENT;
+    fit(h, k);
+    return s->data;
+}
+
+// Find the byte at position i, to read or write it.
+static inline char *byte(history *h, int i) {
+    segment *s = &h->segs[i / SEGMENT];
+    char *data = (s->state == Plain) ? s->data : plain(h, i / SEGMENT);
+    return &data[i % SEGMENT];
+}
+
+// Add segments, if necessary, so that there is room for n bytes.
+static void reserve(history *h, int n) {
+    while ((long long) h->count * SEGMENT < n) {
+        if (h->count >= h->max) {
+            h->max = h->max * 3 / 2;
+            h->segs = realloc(h->segs, h->max * sizeof(segment));
+        }
+        h->segs[h->count++] = (segment) {
+            .state=Plain, .n=SEGMENT, .offset=0, .data=malloc(SEGMENT)
+        };
+        h->memory += SEGMENT;
+        fit(h, h->count - 1);
+    }
+}
+
+void readHistory(history *h, int at, int n, char *out) {
+    while (n > 0) {
+        int k = SEGMENT - at % SEGMENT;
+        if (k > n) k = n;
+        memcpy(out, byte(h, at), k);
+        out += k;
+        at += k;
+        n -= k;
+    }
+}
+
+// Find n contiguous bytes at a given position, copying them out into a buffer
+// if they straddle segments.
+static char const *bytesAt(history *h, int at, int n) {
+    if (n == 0 || at / SEGMENT == (at + n - 1) / SEGMENT) return byte(h, at);
+    if (n > h->copyMax) {
+        h->copyMax = n;
+        h->copy = realloc(h->copy, n);
+    }
+    readHistory(h, at, n, h->copy);
+    return h->copy;
+}
+
+char const *bytesHistory(history *h) {
+    return bytesAt(h, 0, h->length);
+}
+
+// Overwrite bytes at a given position, which must already have room.
+static void writeBytes(history *h, int at, int n, char const *s) {
+    while (n > 0) {
+        int k = SEGMENT - at % SEGMENT;
+        if (k > n) k = n;
+        memcpy(byte(h, at), s, k);
+        s += k;
+        at += k;
+        n -= k;
+    }
 }
 
 // Add a byte to the history.
 static inline void save(history *h, char b) {
-    if (h->length + 1 > h->max) resize(h, 1);
-    h->bs[h->length++] = b;
+    reserve(h, h->length + 1);
+    *byte(h, h->length++) = b;
     h->current = h->length;
 }
 
 // Add n bytes to the history.
 static inline void saveString(history *h, int n, char const *s) {
-    if (h->length + n > h->max) resize(h, n);
-    memcpy(&h->bs[h->length], s, n);
+    reserve(h, h->length + n);
+    writeBytes(h, h->length, n, s);
     h->length += n;
     h->current = h->length;
 }
 
-// Check whether a byte is illegal, within valid UTF-8 text (ignoring 0x00, 0xC0
-// and 0xC1).
-static inline bool illegal(unsigned char b) {
-    return b >= 0xF5;
+// Record the end of an action at a given position, in the action index.
+static void addAction(history *h, int at) {
+    if (h->actions >= h->maxActions) {
+        h->maxActions = h->maxActions * 3 / 2;
+        h->ends = realloc(h->ends, h->maxActions * sizeof(int));
+    }
+    h->ends[h->actions++] = at;
+}
+
+// Remove the actions which end beyond the current length from the index.
+static void cutActions(history *h) {
+    while (h->actions > 0 && h->ends[h->actions - 1] > h->length) {
+        h->actions--;
+    }
 }
 
-// An insert or delete is stored as "..." OP and other operations as N OP.
+// An insert or delete is stored as L "..." L OP and other operations as N OP.
 // Putting the OP after the argument makes adding the 'end' flag easier. An
 // opcode is made negative and shifted left one bit to make room for the 'end'
 // flag. All opcode bytes have the top bit set to distinguish them from
-// numerical arguments, and the Move/Insert/Delete opcode bytes are illegal in
-// UTF-8 text so they can be used as terminators at either end of strings.
+// numerical arguments. The length L of a string is stored at both ends, so that
+// the string can be skipped in either direction without scanning it.
 static inline void saveOp(history *h, unsigned op) {
     save(h, (0xFF - op) << 1);
 }
 
+// Extract the opcode from a byte.
+static int getOp(unsigned char b) {
+    return 0xFF - ((b >> 1) | 0x80);
+}
+
+// Extract the 'end' flag from a byte.
+static bool getEnd(unsigned char b) {
+    return (b & 1) != 0;
+}
+
 // Add a signed integer argument to the history, packed in bytes with the top
 // bit zero. The opcodes on either side delimit it. If there are no argument
 // bytes, the argument is zero or not needed. (Avoid relying on arithmetic right
@@ -71,34 +513,461 @@ static void saveInt(history *h, int n) {
     save(h, n & 0x7F);
 }
 
+// Find the number of children of a branch.
+static int children(history *h, int b) {
+    int n = 0;
+    for (int i = 0; i < h->branches; i++) {
+        if (h->tree[i].live && h->tree[i].parent == b) n++;
+    }
+    return n;
+}
+
+// Prune least recently used branches, which have no children, until the
+// branches are within budget.
+static void prune(history *h) {
+    while (h->branchMemory > h->branchBudget) {
+        int best = -1;
+        for (int i = 0; i < h->branches; i++) {
+            branch *b = &h->tree[i];
+            if (! b->live || i == h->active || children(h, i) > 0) continue;
+            if (best < 0 || b->used < h->tree[best].used) best = i;
+        }
+        if (best < 0) return;
+        empty(h, &h->tree[best]);
+        h->tree[best].live = false;
+        h->tree[best].parent = -1;
+    }
+}
+
+// Pack the history bytes from a given position onwards into a branch.
+static void store(history *h, branch *b, int from) {
+    int n = h->length - from;
+    b->length = n;
+    b->count = (n + SEGMENT - 1) / SEGMENT;
+    b->pieces = malloc((b->count + 1) * sizeof(segment));
+    char *in = malloc(SEGMENT), *out = malloc(SEGMENT + 16);
+    for (int i = 0; i < b->count; i++) {
+        int k = (i < b->count - 1) ? SEGMENT : n - i * SEGMENT;
+        readHistory(h, from + i * SEGMENT, k, in);
+        int m = compress(k, in, out);
+        segment *s = &b->pieces[i];
+        if (m < k) *s = (segment) { .state=Packed, .n=m, .data=malloc(m) };
+        else *s = (segment) { .state=Plain, .n=k, .data=malloc(k) };
+        memcpy(s->data, s->state == Packed ? out : in, s->n);
+        b->memory += s->n;
+    }
+    h->branchMemory += b->memory;
+    free(in);
+    free(out);
+}
+
+// Unpack the bytes of a branch onto the end of the history, and empty it.
+static void unstore(history *h, branch *b) {
+    char *out = malloc(SEGMENT);
+    for (int i = 0; i < b->count; i++) {
+        int k = (i < b->count - 1) ? SEGMENT : b->length - i * SEGMENT;
+        segment *s = &b->pieces[i];
+        if (s->state == Packed) expand(s->n, s->data, out);
+        else memcpy(out, s->data, k);
+        saveString(h, k, out);
+    }
+    free(out);
+    empty(h, b);
+}
+
+// Keep the history bytes from the current position onwards as a new child of
+// the active branch. Any children of the active branch which fork later are
+// moved to the new branch.
+static void keep(history *h) {
+    if (h->branches >= h->maxBranches) {
+        h->maxBranches = h->maxBranches * 3 / 2;
+        h->tree = realloc(h->tree, h->maxBranches * sizeof(branch));
+    }
+    int k = h->branches++;
+    branch *b = &h->tree[k];
+    *b = (branch) {
+        .live=true, .parent=h->active, .fork=h->current, .used=h->clock++
+    };
+    for (int i = 0; i < k; i++) {
+        branch *c = &h->tree[i];
+        if (! c->live || c->parent != h->active) continue;
+        if (c->fork > h->current) c->parent = k;
+    }
+    store(h, b, h->current);
+    prune(h);
+}
+
+// End any group of typed characters. If this is after an undo/redo sequence,
+// keep the undone edits as a branch, then cut the history back to the current
+// position, releasing any segments which are no longer needed.
+static void cutBack(history *h) {
+    h->group = -1;
+    if (h->length <= h->current) return;
+    keep(h);
+    h->length = h->current;
+    if (h->length < h->truncated) h->truncated = h->length;
+    cutActions(h);
+    release(h, h->length);
+    logCut(h, h->length);
+}
+
 // Save an opcode and integer argument (in reverse order). If this is after an
 // undo/redo sequence, truncate the history first.
 static void saveOpN(history *h, int op, int by) {
-    if (h->length > h->current) h->length = h->current;
+    cutBack(h);
+    changed(h, h->length);
     saveInt(h,by);
     saveOp(h,op);
     h->current = h->length;
 }
 
-// Save an opcode and a string (in reverse order). Must come after a Move,
-// so is not immediately after an undo/redo sequence.
-static void saveOpS(history *h, int op, int n, char const *s) {
-    saveString(h,n,s);
-    saveOp(h,op);
+// Add a vector of signed integers to the history, packed in bytes with the top
+// bit zero. Each integer is folded to make it unsigned, with the sign as the
+// bottom bit, and is stored six bits per byte, least significant first, with
+// bit 6 set in all but its last byte.
+static void saveVector(history *h, int n, int const v[n]) {
+    for (int i = 0; i < n; i++) {
+        unsigned int u = v[i] >= 0 ? 2u * v[i] : 2u * -(v[i] + 1) + 1;
+        while (u >= 64) {
+            save(h, 0x40 | (u & 0x3F));
+            u = u >> 6;
+        }
+        save(h, u);
+    }
+}
+
+// Save an opcode and vector argument (in reverse order), like saveOpN.
+static void saveOpV(history *h, int op, int n, int const v[n]) {
+    cutBack(h);
+    changed(h, h->length);
+    saveVector(h, n, v);
+    saveOp(h, op);
     h->current = h->length;
 }
 
+// Read a string length forwards from a position.
+static int getLength(history *h, int at) {
+    int n = 0, shift = 0;
+    unsigned char b;
+    do {
+        b = *byte(h, at++);
+        n = n | (b & 0x7F) << shift;
+        shift = shift + 7;
+    } while ((b & 0x80) != 0);
+    return n;
+}
+
+// Read a reversed string length backwards from just before a position.
+static int getLengthBack(history *h, int end) {
+    int n = 0, shift = 0;
+    unsigned char b;
+    do {
+        b = *byte(h, --end);
+        n = n | (b & 0x7F) << shift;
+        shift = shift + 7;
+    } while ((b & 0x80) != 0);
+    return n;
+}
+
+// Save an opcode and a framed string (in reverse order). Must come after a
+// Move, so is not immediately after an undo/redo sequence.
+static void saveOpS(history *h, int op, int n, char const *s) {
+    int k = sizeLength(n);
+    char length[5];
+    putLength(length, k, n, false);
+    saveString(h, k, length);
+    saveString(h, n, s);
+    putLength(length, k, n, true);
+    saveString(h, k, length);
+    saveOp(h, op);
+}
+
+int sourceHistory(history *h, int n, char const *data) {
+    if (h->sources >= h->maxSources) {
+        h->maxSources = h->maxSources * 3 / 2;
+        h->store = realloc(h->store, h->maxSources * sizeof(source));
+    }
+    h->store[h->sources] = (source) {
+        .data=data, .n=n, .count=0, .max=4,
+        .ranges=malloc(4 * sizeof(int[2])), .copies=NULL
+    };
+    return h->sources++;
+}
+
+// Note that a range of a source has been referred to.
+static void note(history *h, int id, int offset, int n) {
+    if (id >= h->sources || h->store[id].data == NULL) return;
+    source *s = &h->store[id];
+    if (s->count >= s->max) {
+        s->max = s->max * 3 / 2;
+        s->ranges = realloc(s->ranges, s->max * sizeof(int[2]));
+    }
+    s->ranges[s->count][0] = offset;
+    s->ranges[s->count][1] = offset + n;
+    s->count++;
+}
+
+// Compare ranges by their start offsets, for sorting.
+static int compareRanges(void const *a, void const *b) {
+    int x = ((int const *) a)[0], y = ((int const *) b)[0];
+    return (x > y) - (x < y);
+}
+
+void releaseSource(history *h, int id) {
+    source *s = &h->store[id];
+    if (s->data == NULL) return;
+    qsort(s->ranges, s->count, sizeof(int[2]), compareRanges);
+    int k = 0;
+    for (int i = 0; i < s->count; i++) {
+        if (k > 0 && s->ranges[i][0] <= s->ranges[k - 1][1]) {
+            int end = s->ranges[i][1];
+            if (end > s->ranges[k - 1][1]) s->ranges[k - 1][1] = end;
+        }
+        else {
+            s->ranges[k][0] = s->ranges[i][0];
+            s->ranges[k][1] = s->ranges[i][1];
+            k++;
+        }
+    }
+    s->count = k;
+    s->copies = malloc((k + 1) * sizeof(char *));
+    for (int i = 0; i < k; i++) {
+        int start = s->ranges[i][0], n = s->ranges[i][1] - start;
+        s->copies[i] = malloc(n);
+        memcpy(s->copies[i], &s->data[start], n);
+    }
+    s->data = NULL;
+}
+
+int sourcesHistory(history *h) { return h->sources; }
+
+int extentsSource(history *h, int id) {
+    source *s = &h->store[id];
+    return (s->data != NULL) ? -1 : s->count;
+}
+
+char const *extentSource(history *h, int id, int i, int *offset, int *n) {
+    source *s = &h->store[id];
+    *offset = s->ranges[i][0];
+    *n = s->ranges[i][1] - s->ranges[i][0];
+    return s->copies[i];
+}
+
+void restoreSource(history *h, int id) {
+    while (h->sources <= id) sourceHistory(h, 0, "");
+    source *s = &h->store[id];
+    if (s->data == NULL) for (int i = 0; i < s->count; i++) {
+        free(s->copies[i]);
+    }
+    free(s->copies);
+    s->data = NULL;
+    s->count = 0;
+    s->copies = malloc(s->max * sizeof(char *));
+}
+
+void addExtent(history *h, int id, int offset, int n, char const *bytes) {
+    source *s = &h->store[id];
+    if (s->count >= s->max) {
+        s->max = s->max * 3 / 2;
+        s->ranges = realloc(s->ranges, s->max * sizeof(int[2]));
+        s->copies = realloc(s->copies, s->max * sizeof(char *));
+    }
+    s->ranges[s->count][0] = offset;
+    s->ranges[s->count][1] = offset + n;
+    s->copies[s->count] = malloc(n);
+    memcpy(s->copies[s->count], bytes, n);
+    s->count++;
+}
+
+// Find the bytes of a range of a source, from its data or, once it has been
+// released, from the extent which covers the range.
+static char const *resolve(history *h, int id, int offset) {
+    if (id >= h->sources) {
+        fprintf(stderr, "Error: history refers to an unknown source\n");
+        exit(1);
+    }
+    source *s = &h->store[id];
+    if (s->data != NULL) return &s->data[offset];
+    int lo = 0, hi = s->count;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (s->ranges[mid][0] <= offset) lo = mid;
+        else hi = mid;
+    }
+    return &s->copies[lo][offset - s->ranges[lo][0]];
+}
+
+// Save an opcode with a string argument held in a source, framed as 0 K R K 0,
+// where R is the source id, offset and length, stored as lengths in K bytes. A
+// real string is never empty, so it can't be mistaken for a reference.
+static void saveOpR(history *h, int op, int id, int offset, int n) {
+    char r[15], length[5];
+    int k = 0, args[3] = { id, offset, n };
+    for (int i = 0; i < 3; i++) {
+        int size = sizeLength(args[i]);
+        putLength(&r[k], size, args[i], false);
+        k = k + size;
+    }
+    int size = sizeLength(k);
+    save(h, 0);
+    putLength(length, size, k, false);
+    saveString(h, size, length);
+    saveString(h, k, r);
+    putLength(length, size, k, true);
+    saveString(h, size, length);
+    save(h, 0);
+    saveOp(h, op);
+    note(h, id, offset, n);
+}
+
+// If the framed string at a given position is a reference, decode it.
+static bool reference(history *h, int at, int *id, int *offset, int *n) {
+    if (*byte(h, at) != 0) return false;
+    int k = getLength(h, at + 1), i = 0;
+    char r[15];
+    readHistory(h, at + 1 + sizeLength(k), k, r);
+    *id = takeLength(r, &i);
+    *offset = takeLength(r, &i);
+    *n = takeLength(r, &i);
+    return true;
+}
+
+// Find the position just after the framed string at a given position.
+static int afterString(history *h, int at) {
+    int n = getLength(h, at);
+    if (n > 0) return at + 2 * sizeLength(n) + n;
+    int k = getLength(h, at + 1);
+    return at + 2 + 2 * sizeLength(k) + k;
+}
+
+// Find the position of the framed string which ends at a given position.
+static int beforeString(history *h, int end) {
+    int n = getLengthBack(h, end);
+    if (n > 0) return end - 2 * sizeLength(n) - n;
+    int k = getLengthBack(h, end - 1);
+    return end - 2 - 2 * sizeLength(k) - k;
+}
+
+// Get the bytes of the framed string at a given position, and its length.
+static char const *stringAt(history *h, int at, int *n) {
+    int id, offset;
+    if (reference(h, at, &id, &offset, n)) return resolve(h, id, offset);
+    *n = getLength(h, at);
+    return bytesAt(h, at + sizeLength(*n), *n);
+}
+
+// Find the time in milliseconds, from an arbitrary starting point.
+static long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Check whether a string is a single UTF-8 character.
+static bool single(int n, char const *s) {
+    if (n < 1 || n > 4 || (s[0] & 0xC0) == 0x80) return false;
+    for (int i = 1; i < n; i++) if ((s[i] & 0xC0) != 0x80) return false;
+    return true;
+}
+
+// Check whether there is a word boundary between two adjacent bytes, i.e. a
+// space or newline followed by anything else.
+static bool boundary(char before, char after) {
+    bool white = before == ' ' || before == '\n';
+    return white && after != ' ' && after != '\n';
+}
+
+// A group of backspaces ends when its string reaches this many bytes, since
+// each one shifts the string along to add a byte at the front.
+enum { GROUP = 1024 };
+
+// Check whether a typed character or backspace, with no change of position
+// since the previous one, can join the group of previous ones. The joined
+// string would cross a word boundary where the old and new bytes meet.
+static bool joins(history *h, int op, int p, int n, char const *s) {
+    long long time = (h->gap > 0) ? now() : 0, previous = h->last;
+    h->last = time;
+    if (p != 0 || h->group < 0 || h->current < h->length) return false;
+    if (! single(n, s) || getOp(*byte(h, h->length - 1)) != op) return false;
+    if (h->gap > 0 && time - previous > h->gap) return false;
+    int old = getLength(h, h->group), k = sizeLength(old);
+    if (op == Delete && old >= GROUP) return false;
+    if (! h->words) return true;
+    char first = *byte(h, h->group + k);
+    char last = *byte(h, h->group + k + old - 1);
+    if (op == Insert) return ! boundary(last, s[0]);
+    return ! boundary(s[n - 1], first);
+}
+
+// Add a typed character to the string of the group, after the existing bytes,
+// or before them for a backspace, since it comes earlier in the text. Rewrite
+// the lengths, and remove the end flag from the opcode, so the group becomes
+// part of the current action. A typed character usually overwrites the final
+// length and opcode in place, and the string is only moved if it has to shift,
+// for a backspace or when its length needs another byte.
+static void regroup(history *h, int n, char const *s, bool before) {
+    int g = h->group, old = getLength(h, g), k = sizeLength(old);
+    int length = old + n, k2 = sizeLength(length);
+    int total = g + 2 * k2 + length + 1;
+    char op = *byte(h, h->length - 1);
+    if (getEnd(op) && h->actions > 0) {
+        if (h->ends[h->actions - 1] == h->length) h->actions--;
+    }
+    changed(h, g);
+    reserve(h, total);
+    char bs[5];
+    if (before || k2 != k) {
+        char *string = malloc(length);
+        readHistory(h, g + k, old, &string[before ? n : 0]);
+        memcpy(&string[before ? 0 : old], s, n);
+        writeBytes(h, g + k2, length, string);
+        free(string);
+    }
+    else writeBytes(h, g + k + old, n, s);
+    putLength(bs, k2, length, false);
+    writeBytes(h, g, k2, bs);
+    putLength(bs, k2, length, true);
+    writeBytes(h, g + k2 + length, k2, bs);
+    *byte(h, total - 1) = op & ~1;
+    h->length = h->current = total;
+}
+
 void saveMove(history *h, int n) { saveOpN(h, Move, n); }
 void saveInsert(history *h, int p, int n, char const *s) {
+    if (joins(h, Insert, p, n, s)) { regroup(h, n, s, false); return; }
     saveMove(h, p);
+    int start = h->length;
     saveOpS(h, Insert, n, s);
+    if (single(n, s)) h->group = start;
 }
 void saveDelete(history *h, int p, int n, char const *s) {
+    if (joins(h, Delete, p, n, s)) { regroup(h, n, s, true); return; }
     saveMove(h, p);
+    int start = h->length;
     saveOpS(h, Delete, n, s);
+    if (single(n, s)) h->group = start;
+}
+void saveDeleteSource(history *h, int p, int id, int offset, int n) {
+    saveMove(h, p);
+    saveOpR(h, Delete, id, offset, n);
 }
 void saveAddCursor(history *h, int n) { saveOpN(h, AddCursor, n); }
 void saveCutCursor(history *h, int n) { saveOpN(h, CutCursor, n); }
+void saveAddCursors(history *h, int n, int const v[n]) {
+    saveOpV(h, AddCursors, n, v);
+}
+void saveCutCursors(history *h, int n, int const v[n]) {
+    saveOpV(h, CutCursors, n, v);
+}
+void saveMergeCursors(history *h, int n, int const v[n]) {
+    saveOpV(h, MergeCursors, n, v);
+}
+void saveShiftCursors(history *h, int n, int const v[n]) {
+    saveOpV(h, ShiftCursors, n, v);
+}
+void saveMoveCursors(history *h, int n, int const v[n]) {
+    saveOpV(h, MoveCursors, n, v);
+}
 void saveSetCursor(history *h, int n) { saveOpN(h, SetCursor, n); }
 void saveCursorRow(history *h, int n) { saveOpN(h, CursorRow, n); }
 void saveCursorCol(history *h, int n) { saveOpN(h, CursorCol, n); }
@@ -106,33 +975,28 @@ void saveBaseRow(history *h, int n) { saveOpN(h, BaseRow, n); }
 void saveBaseCol(history *h, int n) { saveOpN(h, BaseCol, n); }
 void saveMarkRow(history *h, int n) { saveOpN(h, MarkRow, n); }
 void saveMarkCol(history *h, int n) { saveOpN(h, MarkCol, n); }
-void saveEnd(history *h) { if (h->length > 0) h->bs[h->length-1] |= 1; }
-
-// Extract the opcode from a byte.
-static int getOp(unsigned char b) {
-    return 0xFF - ((b >> 1) | 0x80);
-}
-
-// Extract the 'end' flag from a byte.
-static bool getEnd(unsigned char b) {
-    return (b & 1) != 0;
+void saveEnd(history *h) {
+    if (h->length == 0 || getEnd(*byte(h, h->length-1))) return;
+    *byte(h, h->length-1) |= 1;
+    changed(h, h->length-1);
+    addAction(h, h->length);
 }
 
 // Unpack an int from a range of bytes with the top bit unset. Avoid left shift
 // of negative numbers.
 static int unpack(history *h, int start, int end) {
     if (start == end) return 0;
-    char ch = h->bs[start];
+    char ch = *byte(h, start);
     bool neg = (ch & 0x40) != 0;
     unsigned int n = neg ? -1 : 0;
-    for (int i = start; i < end; i++) n = (n << 7) | h->bs[i];
+    for (int i = start; i < end; i++) n = (n << 7) | *byte(h, i);
     return n;
 }
 
 // Pop an op and 'end' flag backward off the history.
 static void undoOpEnd(history *h, edit *e) {
     if (h->current == 0) { e->op = End; return; };
-    unsigned char b = h->bs[--h->current];
+    unsigned char b = *byte(h, --h->current);
     e->op = getOp(b);
     e->end = getEnd(b);
 }
@@ -140,18 +1004,24 @@ static void undoOpEnd(history *h, edit *e) {
 // Pop an integer backward off the history.
 static void undoInt(history *h, edit *e) {
     int end = h->current, start;
-    for (start = end; start > 0 && (h->bs[start-1] & 0x80) == 0; start--) {}
+    for (start = end; start > 0 && (*byte(h, start-1) & 0x80) == 0; start--) {}
     h->current = start;
     e->n = unpack(h, start, end);
 }
 
-// Pop a string backward off the history.
+// Pop a packed vector backward off the history, as a string of bytes.
+static void undoVector(history *h, edit *e) {
+    int end = h->current, start;
+    for (start = end; start > 0 && (*byte(h, start-1) & 0x80) == 0; start--) {}
+    h->current = start;
+    e->n = end - start;
+    e->s = bytesAt(h, start, e->n);
+}
+
+// Pop a framed string backward off the history, skipping it in one step.
 static void undoString(history *h, edit *e) {
-    int i;
-    for (i = h->current; i > 0 && ! illegal(h->bs[i-1]); i--) { }
-    e->n = h->current - i;
-    h->current = i;
-    e->s = &h->bs[h->current];
+    h->current = beforeString(h, h->current);
+    e->s = stringAt(h, h->current, &e->n);
 }
 
 // Invert an edit.
@@ -161,83 +1031,236 @@ static void invert(edit *e) {
         case Delete: e->op = Insert; break;
         case AddCursor: e->op = CutCursor; break;
         case CutCursor: e->op = AddCursor; break;
+        case AddCursors: e->op = CutCursors; break;
+        case CutCursors: e->op = AddCursors; break;
+        case MergeCursors: e->op = SplitCursors; break;
+        case SplitCursors: e->op = MergeCursors; break;
+        case ShiftCursors: e->op = UnshiftCursors; break;
+        case UnshiftCursors: e->op = ShiftCursors; break;
+        case MoveCursors: e->op = UnmoveCursors; break;
+        case UnmoveCursors: e->op = MoveCursors; break;
         default: e->n = - e->n; break;
     }
 }
 
 edit undo(history *h) {
     edit e = { .end=false, .op=0, .n=0, .s=NULL };
+    h->group = -1;
     undoOpEnd(h, &e);
     if (e.op == Insert || e.op == Delete) undoString(h, &e);
+    else if (vectorOp(e.op)) undoVector(h, &e);
     else undoInt(h, &e);
     invert(&e);
     return e;
 }
 
-// ----------------------------------------------------------------------------
-/*
-// Get the most recent op.
-static int endOp(history *h) {
-    if (h->current == 0) return End;
-    return getOp(h->bs[h->current-1]);
+// Check whether the most recent op before the current position is a Move, in
+// which case the next op is an Insert or Delete with a string argument.
+static bool afterMove(history *h) {
+    if (h->current == 0) return false;
+    return getOp(*byte(h, h->current-1)) == Move;
 }
 
-// Read an opcode forward off the history (for redo).
-static int readOp(history *h) {
-    if (h->current == h->length) return End;
-    return getOp(h->bs[h->current++]);
+// Read an integer forward off the history or, if the opcode which follows is
+// one with a vector argument, a packed vector as a string of bytes.
+static void redoArgument(history *h, edit *e) {
+    int start = h->current, end = start;
+    while (end < h->length && (*byte(h, end) & 0x80) == 0) end++;
+    h->current = end;
+    int op = (end < h->length) ? getOp(*byte(h, end)) : End;
+    if (vectorOp(op)) {
+        e->n = end - start;
+        e->s = bytesAt(h, start, e->n);
+    }
+    else e->n = unpack(h, start, end);
 }
 
-// Read an integer forward off the history (for redo).
-static int readInt(history *h) {
-    int start = h->current, end;
-    for (end = start; end < h->length && (h->bs[end] & 0x80) == 0; end++) {}
-    h->current = end;
-    return unpack(h, start, end);
+// Read a framed string forward off the history, skipping it in one step.
+static void redoString(history *h, edit *e) {
+    e->s = stringAt(h, h->current, &e->n);
+    h->current = afterString(h, h->current);
 }
 
-// Read a string from the history, returning the number of bytes in *pn.
-static char const *readString(history *h, int *pn) {
-    int i;
-    for (i = h->current; i < h->length && h->bs[i] < firstIllegal; i++) { }
-    *pn = i - h->current;
-    int old = h->current;
-    h->current = i;
-    return &h->bs[old];
+// Read an op and 'end' flag forward off the history.
+static void redoOpEnd(history *h, edit *e) {
+    unsigned char b = *byte(h, h->current++);
+    e->op = getOp(b);
+    e->end = getEnd(b);
 }
 
-// Read an edit forwards from the history, for redo.
-static edit readEdit(history *h) {
+edit redo(history *h) {
     edit e = { .end=false, .op=End, .n=0, .s=NULL };
+    h->group = -1;
     if (h->current >= h->length) return e;
-    if (endOp(h) == Move) {
-        e.s = readString(h, &e.n);
-        e.op = readOp(h);
-    }
-    else {
-        e.n = readInt(h);
-        e.op = readOp(h);
-    }
-    char ch = h->bs[h->current++];
-    e.end = ch & 1;
-    e.op = ch >> 1;
+    if (afterMove(h)) redoString(h, &e);
+    else redoArgument(h, &e);
+    redoOpEnd(h, &e);
     return e;
 }
 
-edit undo(history *h) {
-    edit e = { .op = End };
-    if (h->current == 0) return e;
-    e = popEdit(h);
-    invert(&e);
+// Read from a given position, without disturbing the current position or any
+// group of typed characters.
+edit redoAt(history *h, int *at) {
+    int current = h->current, group = h->group;
+    h->current = *at;
+    edit e = redo(h);
+    *at = h->current;
+    h->current = current;
+    h->group = group;
     return e;
 }
 
-edit redo(history *h) {
-    edit e = { .op = End };
-    if (h->current == h->length) return e;
-    return readEdit(h);
+edit undoAt(history *h, int *at) {
+    int current = h->current, group = h->group;
+    h->current = *at;
+    edit e = undo(h);
+    *at = h->current;
+    h->current = current;
+    h->group = group;
+    return e;
+}
+
+// Rebuild the action index from a given position, by skipping forward through
+// the records, without decoding them, except to note references to sources.
+static void indexActions(history *h, int from) {
+    while (h->actions > 0 && h->ends[h->actions - 1] > from) h->actions--;
+    bool string = from > 0 && getOp(*byte(h, from - 1)) == Move;
+    for (int at = from; at < h->length; ) {
+        int id, offset, n;
+        if (string && reference(h, at, &id, &offset, &n)) {
+            note(h, id, offset, n);
+        }
+        if (string) at = afterString(h, at);
+        else while ((*byte(h, at) & 0x80) == 0) at++;
+        unsigned char b = *byte(h, at++);
+        string = getOp(b) == Move;
+        if (getEnd(b)) addAction(h, at);
+    }
+}
+
+void loadHistory(history *h, int n, char const *bs, int current) {
+    release(h, 0);
+    h->length = 0;
+    saveString(h, n, bs);
+    h->current = current;
+    h->unchanged = 0;
+    h->truncated = n;
+    h->group = -1;
+    h->actions = 0;
+    indexActions(h, 0);
+    logCut(h, 0);
+    uproot(h);
+}
+
+int cutsHistory(history *h) { return h->cuts; }
+int cutHistory(history *h, int i) { return h->cutLog[i]; }
+
+int countActions(history *h) { return h->actions; }
+
+// Do a binary search for the number of action ends at or before the current
+// position.
+int currentAction(history *h) {
+    int lo = 0, hi = h->actions;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (h->ends[mid] <= h->current) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int startAction(history *h, int i) {
+    if (i <= 0) return 0;
+    if (i > h->actions) i = h->actions;
+    return h->ends[i - 1];
+}
+
+int countBranches(history *h) { return h->branches; }
+int activeBranch(history *h) { return h->active; }
+
+int parentBranch(history *h, int b) {
+    return h->tree[b].live ? h->tree[b].parent : -1;
+}
+
+int memoryBranch(history *h, int b) {
+    return h->tree[b].memory;
+}
+
+// Go up from the branch to the child of the active branch on its path.
+int forkBranch(history *h, int b) {
+    if (! h->tree[b].live) return -1;
+    if (b == h->active) return h->length;
+    while (h->tree[b].parent != h->active) b = h->tree[b].parent;
+    return h->tree[b].fork;
+}
+
+// Make branch x, a child of the active branch, active. The bytes after its fork
+// are packed into the previously active branch, which becomes a child of x, and
+// x's own bytes are unpacked in their place. Children of the previously active
+// branch which fork no later than x move across to x. The current position,
+// which is no later than the fork, is unchanged.
+static void swap(history *h, int x) {
+    int a = h->active, fork = h->tree[x].fork, current = h->current;
+    branch *old = &h->tree[a];
+    store(h, old, fork);
+    old->parent = x;
+    old->fork = fork;
+    old->used = h->clock++;
+    for (int i = 0; i < h->branches; i++) {
+        branch *c = &h->tree[i];
+        if (i == x || ! c->live || c->parent != a) continue;
+        if (c->fork <= fork) c->parent = x;
+    }
+    h->length = fork;
+    if (h->length < h->truncated) h->truncated = h->length;
+    changed(h, fork);
+    release(h, fork);
+    logCut(h, fork);
+    unstore(h, &h->tree[x]);
+    h->tree[x].parent = -1;
+    h->tree[x].used = h->clock++;
+    h->active = x;
+    h->current = current;
+    indexActions(h, fork);
+}
+
+// Switch one level at a time, starting with the child of the active branch
+// which is on the path to b.
+bool switchBranch(history *h, int b) {
+    int fork = forkBranch(h, b);
+    if (fork < 0 || h->current > fork) return false;
+    h->group = -1;
+    while (h->active != b) {
+        int c = b;
+        while (h->tree[c].parent != h->active) c = h->tree[c].parent;
+        swap(h, c);
+    }
+    prune(h);
+    return true;
+}
+
+bool vectorOp(int op) {
+    return op == AddCursors || op == CutCursors || op == MergeCursors ||
+        op == SplitCursors || op == ShiftCursors || op == UnshiftCursors ||
+        op == MoveCursors || op == UnmoveCursors;
+}
+
+int unpackVector(edit e, int v[]) {
+    int count = 0;
+    unsigned int u = 0;
+    int shift = 0;
+    for (int i = 0; i < e.n; i++) {
+        unsigned char b = e.s[i];
+        u = u | (unsigned int) (b & 0x3F) << shift;
+        shift = shift + 6;
+        if ((b & 0x40) != 0) continue;
+        v[count++] = (u & 1) == 0 ? (int) (u >> 1) : - (int) (u >> 1) - 1;
+        u = 0;
+        shift = 0;
+    }
+    return count;
 }
-*/
+
 #ifdef historyTest
 // ----------------------------------------------------------------------------
 
@@ -306,12 +1329,490 @@ static void testUndo(history *h) {
     assert(checkUndo(h, CursorRow, 100, NULL));
 }
 
+// Check that a sequence of edits can be undone and redone, and that changes to
+// existing bytes are reported.
+static void testRedo(history *h) {
+    clearHistory(h);
+    saveInsert(h, 5, 3, "abc");
+    saveBaseCol(h, -2);
+    saveDelete(h, 0, 2, "\xCE\xB1");
+    saveEnd(h);
+    assert(unchangedHistory(h) == 0);
+    int n = sizeHistory(h);
+    assert(unchangedHistory(h) == n);
+    edit e = undo(h);
+    assert(e.op == Insert && e.n == 2 && e.end);
+    e = undo(h);
+    assert(e.op == Move && e.n == 0);
+    e = undo(h);
+    assert(e.op == BaseCol && e.n == 2);
+    e = redo(h);
+    assert(e.op == BaseCol && e.n == -2);
+    e = redo(h);
+    assert(e.op == Move && e.n == 0);
+    e = redo(h);
+    assert(e.op == Delete && e.n == 2 && e.end);
+    assert(strncmp(e.s, "\xCE\xB1", 2) == 0);
+    e = redo(h);
+    assert(e.op == End);
+    while (currentHistory(h) > 0) undo(h);
+    e = redo(h);
+    assert(e.op == Move && e.n == 5);
+    e = redo(h);
+    assert(e.op == Insert && e.n == 3 && strncmp(e.s, "abc", 3) == 0);
+    truncatedHistory(h);
+    int cut = currentHistory(h);
+    saveMarkRow(h, 1);
+    assert(unchangedHistory(h) == currentHistory(h) - 2);
+    assert(truncatedHistory(h) == cut);
+    assert(truncatedHistory(h) == sizeHistory(h));
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), 0);
+    e = redo(copy);
+    assert(e.op == Move && e.n == 5);
+    freeHistory(copy);
+}
+
+// Check that vectors are packed compactly, and can be undone and redone.
+static void testVector(history *h) {
+    clearHistory(h);
+    int v[] = {
+        0, 1, -1, 31, -32, 32, 1000, -100000, 2147483647, -2147483647-1
+    };
+    saveSetCursor(h, 3);
+    saveAddCursors(h, 10, v);
+    saveEnd(h);
+    assert(sizeHistory(h) == 2 + 1 + 1 + 1 + 1 + 1 + 2 + 2 + 3 + 6 + 6 + 1);
+    int w[20];
+    edit e = undo(h);
+    assert(e.op == CutCursors && e.end && unpackVector(e, w) == 10);
+    for (int i = 0; i < 10; i++) assert(w[i] == v[i]);
+    e = undo(h);
+    assert(e.op == SetCursor && e.n == -3);
+    e = redo(h);
+    assert(e.op == SetCursor && e.n == 3);
+    e = redo(h);
+    assert(e.op == AddCursors && unpackVector(e, w) == 10);
+    for (int i = 0; i < 10; i++) assert(w[i] == v[i]);
+    saveCutCursors(h, 0, v);
+    e = undo(h);
+    assert(e.op == AddCursors && e.n == 0 && unpackVector(e, w) == 0);
+    e = redo(h);
+    assert(e.op == CutCursors && e.n == 0);
+    saveMergeCursors(h, 3, v);
+    e = undo(h);
+    assert(e.op == SplitCursors && unpackVector(e, w) == 3 && w[2] == -1);
+    int shift[] = { -2, 10000, 0, 1 };
+    int size = currentHistory(h);
+    saveShiftCursors(h, 4, shift);
+    saveEnd(h);
+    assert(sizeHistory(h) == size + 1 + 3 + 1 + 1 + 1);
+    e = undo(h);
+    assert(e.op == UnshiftCursors && e.end && unpackVector(e, w) == 4);
+    assert(w[0] == -2 && w[1] == 10000 && w[3] == 1);
+    e = redo(h);
+    assert(e.op == ShiftCursors && e.end);
+    saveMoveCursors(h, 5, v);
+    e = undo(h);
+    assert(e.op == UnmoveCursors && unpackVector(e, w) == 5 && w[3] == 31);
+    e = redo(h);
+    assert(e.op == MoveCursors && unpackVector(e, w) == 5 && w[4] == -32);
+}
+
+// Type or backspace one character at a time, ending an action after each.
+static void type(history *h, int op, int p, char const *s) {
+    int n = strlen(s);
+    if (op == Insert) saveInsert(h, p, n, s);
+    else saveDelete(h, p, n, s);
+    saveEnd(h);
+}
+
+// Check that typed characters and backspaces are grouped, at about a byte per
+// character, with groups ending at word boundaries or after a time gap.
+static void testGroup(history *h) {
+    clearHistory(h);
+    type(h, Insert, 5, "a");
+    type(h, Insert, 0, "\xCE\xB1");
+    type(h, Insert, 0, " ");
+    type(h, Insert, 0, "c");
+    type(h, Insert, 0, "d");
+    assert(sizeHistory(h) == (2 + 1 + 4 + 1 + 1) + (1 + 1 + 2 + 1 + 1));
+    edit e = undo(h);
+    assert(e.op == Delete && e.end && e.n == 2 && strncmp(e.s, "cd", 2) == 0);
+    e = undo(h);
+    assert(e.op == Move && e.n == 0 && ! e.end);
+    e = undo(h);
+    assert(e.op == Delete && e.end && e.n == 4);
+    assert(strncmp(e.s, "a\xCE\xB1 ", 4) == 0);
+    e = undo(h);
+    assert(e.op == Move && e.n == -5);
+    redo(h);
+    e = redo(h);
+    assert(e.op == Insert && e.end && e.n == 4);
+    redo(h);
+    redo(h);
+    type(h, Insert, 0, "e");
+    assert(sizeHistory(h) == 15 + 5);
+    int size = sizeHistory(h);
+    type(h, Delete, 0, "e");
+    type(h, Delete, 0, "d");
+    type(h, Delete, 0, " ");
+    type(h, Delete, 0, "x");
+    assert(sizeHistory(h) == size + 2 * (1 + 1 + 2 + 1 + 1));
+    e = undo(h);
+    assert(e.op == Insert && e.n == 2 && strncmp(e.s, "x ", 2) == 0);
+    undo(h);
+    e = undo(h);
+    assert(e.op == Insert && e.n == 2 && strncmp(e.s, "de", 2) == 0);
+    clearHistory(h);
+    groupHistory(h, false, 10);
+    type(h, Insert, 0, "a");
+    type(h, Insert, 0, " ");
+    type(h, Insert, 0, "b");
+    assert(sizeHistory(h) == 1 + 1 + 3 + 1 + 1);
+    struct timespec pause = { .tv_sec=0, .tv_nsec=50000000 };
+    nanosleep(&pause, NULL);
+    type(h, Insert, 0, "c");
+    assert(sizeHistory(h) == 7 + 5);
+    groupHistory(h, true, 0);
+}
+
+// Check that a long run of typing forms one group, across the sizes at which
+// its length needs more bytes, without each character rewriting the group,
+// and that a long run of backspaces is split into groups of limited size.
+static void testLong(history *h) {
+    clearHistory(h);
+    groupHistory(h, false, 0);
+    int n = 200000;
+    char *s = malloc(n);
+    for (int i = 0; i < n; i++) s[i] = 'a' + i % 26;
+    char c[2] = "";
+    for (int i = 0; i < n; i++) {
+        c[0] = s[i];
+        type(h, Insert, i == 0 ? 5 : 0, c);
+    }
+    assert(countActions(h) == 1);
+    edit e = undo(h);
+    assert(e.op == Delete && e.n == n && memcmp(e.s, s, n) == 0);
+    clearHistory(h);
+    for (int i = n - 1; i >= 0; i--) {
+        c[0] = s[i];
+        type(h, Delete, 0, c);
+    }
+    assert(countActions(h) == (n + GROUP - 1) / GROUP);
+    e = undo(h);
+    assert(e.op == Insert && e.n == n % GROUP);
+    assert(memcmp(e.s, s, n % GROUP) == 0);
+    free(s);
+    groupHistory(h, true, 0);
+}
+
+// Check that long strings are framed by their lengths, so that they are skipped
+// in one step, and that the action index is kept up to date.
+static void testFrame(history *h) {
+    clearHistory(h);
+    int n = 1000000;
+    char *s = malloc(n);
+    memset(s, 'x', n);
+    saveInsert(h, 0, n, s);
+    saveEnd(h);
+    assert(sizeHistory(h) == 1 + 3 + n + 3 + 1);
+    saveDelete(h, 0, 200, s);
+    saveBaseCol(h, 7);
+    saveEnd(h);
+    saveInsert(h, 3, 1, "a");
+    saveEnd(h);
+    saveInsert(h, 0, 1, "b");
+    saveEnd(h);
+    assert(countActions(h) == 3 && currentAction(h) == 3);
+    int third = startAction(h, 2);
+    assert(startAction(h, 0) == 0 && startAction(h, 1) == 1 + 3 + n + 3 + 1);
+    edit e = undo(h);
+    assert(e.op == Delete && e.n == 2 && strncmp(e.s, "ab", 2) == 0);
+    undo(h);
+    assert(currentHistory(h) == third && currentAction(h) == 2);
+    undo(h);
+    e = undo(h);
+    assert(e.op == Insert && e.n == 200);
+    undo(h);
+    e = undo(h);
+    assert(e.op == Delete && e.n == n && e.s[0] == 'x' && e.s[n - 1] == 'x');
+    undo(h);
+    assert(currentHistory(h) == 0 && currentAction(h) == 0);
+    e = redo(h);
+    e = redo(h);
+    assert(e.op == Insert && e.n == n && e.end && currentAction(h) == 1);
+    history *copy = newHistory();
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), currentHistory(h));
+    assert(countActions(copy) == 3 && currentAction(copy) == 1);
+    assert(startAction(copy, 2) == third);
+    freeHistory(copy);
+    saveMarkRow(h, 1);
+    saveEnd(h);
+    assert(countActions(h) == 2 && currentAction(h) == 2);
+    free(s);
+}
+
+// Check reading the history from a given position without moving the current
+// position, and that cuts are logged, but not for edits after a redo sequence.
+static void testAt(history *h) {
+    clearHistory(h);
+    int cuts = cutsHistory(h);
+    assert(cutHistory(h, cuts - 1) == 0);
+    saveInsert(h, 0, 3, "abc");
+    saveEnd(h);
+    int second = sizeHistory(h);
+    saveDelete(h, 3, 1, "c");
+    saveEnd(h);
+    int at = 0;
+    edit e = redoAt(h, &at);
+    assert(e.op == Move && e.n == 0);
+    e = redoAt(h, &at);
+    assert(e.op == Insert && e.n == 3 && e.end && at == second);
+    assert(currentHistory(h) == sizeHistory(h));
+    e = undoAt(h, &at);
+    assert(e.op == Delete && e.n == 3 && strncmp(e.s, "abc", 3) == 0);
+    while (currentHistory(h) > second) undo(h);
+    while (currentHistory(h) < sizeHistory(h)) redo(h);
+    saveMarkRow(h, 1);
+    assert(cutsHistory(h) == cuts);
+    undo(h);
+    saveMarkRow(h, 2);
+    assert(cutsHistory(h) == cuts + 1);
+    assert(cutHistory(h, cuts) == sizeHistory(h) - 2);
+}
+
+// Collect the inserted strings on the active branch.
+static void path(history *h, char *out) {
+    int n = 0;
+    for (int at = 0; at < sizeHistory(h); ) {
+        edit e = redoAt(h, &at);
+        if (e.op != Insert) continue;
+        memcpy(&out[n], e.s, e.n);
+        n += e.n;
+    }
+    out[n] = '\0';
+}
+
+// Save an action which inserts a string.
+static void act(history *h, char *s) {
+    saveInsert(h, 0, strlen(s), s);
+    saveEnd(h);
+}
+
+// Check that undone edits are kept as branches, that switching needs undo steps
+// only back to the common ancestor, and that branches are pruned to budget.
+static void testTree() {
+    history *h = newHistory();
+    char out[100];
+    act(h, "aa");
+    int afterA = sizeHistory(h);
+    act(h, "bb");
+    undo(h);
+    undo(h);
+    act(h, "cc");
+    assert(countBranches(h) == 2 && activeBranch(h) == 0);
+    assert(parentBranch(h, 1) == 0 && forkBranch(h, 1) == afterA);
+    assert(memoryBranch(h, 1) > 0);
+    assert(! switchBranch(h, 1));
+    undo(h);
+    undo(h);
+    assert(switchBranch(h, 1));
+    assert(activeBranch(h) == 1 && parentBranch(h, 0) == 1);
+    assert(currentHistory(h) == afterA && countActions(h) == 2);
+    path(h, out);
+    assert(strcmp(out, "aabb") == 0);
+    while (currentHistory(h) > 0) undo(h);
+    act(h, "dd");
+    assert(countBranches(h) == 3 && parentBranch(h, 2) == 1);
+    assert(parentBranch(h, 0) == 2 && forkBranch(h, 0) == 0);
+    undo(h);
+    undo(h);
+    assert(switchBranch(h, 0));
+    assert(activeBranch(h) == 0 && currentHistory(h) == 0);
+    path(h, out);
+    assert(strcmp(out, "aacc") == 0);
+    while (currentHistory(h) < sizeHistory(h)) redo(h);
+    assert(currentAction(h) == 2);
+    budgetBranches(h, 0);
+    undo(h);
+    undo(h);
+    act(h, "ee");
+    assert(countBranches(h) == 4);
+    assert(forkBranch(h, 3) == -1 && parentBranch(h, 3) == -1);
+    assert(forkBranch(h, 1) == -1 && forkBranch(h, 2) == -1);
+    path(h, out);
+    assert(strcmp(out, "aaee") == 0);
+    budgetBranches(h, 1 << 24);
+    int n = 300000;
+    char *big = malloc(n + 1);
+    for (int i = 0; i < n; i++) big[i] = 'a' + i % 10;
+    big[n] = '\0';
+    act(h, big);
+    undo(h);
+    undo(h);
+    act(h, "ff");
+    int b = countBranches(h) - 1;
+    assert(memoryBranch(h, b) < n / 10);
+    undo(h);
+    undo(h);
+    assert(switchBranch(h, b));
+    while (currentHistory(h) < sizeHistory(h)) redo(h);
+    edit e = undo(h);
+    assert(e.op == Delete && e.n == n && memcmp(e.s, big, n) == 0);
+    free(big);
+    freeHistory(h);
+}
+
+// Check that deletions held by reference are read back from their source, and
+// from copies of just the ranges referred to, once it has been released, and
+// that a reloaded history can use a source registered again, or rebuilt from
+// the copies.
+static void testSource() {
+    history *h = newHistory();
+    char data[] = "0123456789abcdefghij";
+    int id = sourceHistory(h, 20, data);
+    saveInsert(h, 0, 2, "xy");
+    saveEnd(h);
+    saveDeleteSource(h, 5, id, 3, 5);
+    saveEnd(h);
+    saveDeleteSource(h, 0, id, 12, 4);
+    saveEnd(h);
+    history *copy = newHistory();
+    assert(sourceHistory(copy, 20, data) == id);
+    loadHistory(copy, sizeHistory(h), bytesHistory(h), sizeHistory(h));
+    assert(countActions(copy) == 3);
+    edit e = undo(h);
+    assert(e.op == Insert && e.n == 4 && strncmp(e.s, "cdef", 4) == 0);
+    releaseSource(h, id);
+    releaseSource(copy, id);
+    memset(data, 'x', 20);
+    e = redo(h);
+    assert(e.op == Delete && e.n == 4 && strncmp(e.s, "cdef", 4) == 0);
+    undo(h);
+    undo(h);
+    e = undo(h);
+    assert(e.op == Insert && e.n == 5 && strncmp(e.s, "34567", 5) == 0);
+    e = undo(h);
+    assert(e.op == Move && e.n == -5);
+    e = undo(copy);
+    assert(e.op == Insert && e.n == 4 && strncmp(e.s, "cdef", 4) == 0);
+    history *other = newHistory();
+    char blank[] = "....................";
+    sourceHistory(other, 20, blank);
+    assert(sourcesHistory(h) == 1 && extentsSource(h, id) == 2);
+    assert(extentsSource(other, id) == -1);
+    restoreSource(other, id);
+    for (int i = 0; i < extentsSource(h, id); i++) {
+        int offset, n;
+        char const *bytes = extentSource(h, id, i, &offset, &n);
+        addExtent(other, id, offset, n, bytes);
+    }
+    loadHistory(other, sizeHistory(h), bytesHistory(h), sizeHistory(h));
+    e = undo(other);
+    assert(e.op == Insert && e.n == 4 && strncmp(e.s, "cdef", 4) == 0);
+    undo(other);
+    e = undo(other);
+    assert(e.op == Insert && e.n == 5 && strncmp(e.s, "34567", 5) == 0);
+    freeHistory(other);
+    freeHistory(copy);
+    freeHistory(h);
+}
+
+// Check that segments are packed and unpacked exactly, for repetitive text,
+// runs of one byte, and random bytes which don't compress.
+static void testPack() {
+    char *in = malloc(SEGMENT), *out = malloc(SEGMENT + 16);
+    char *back = malloc(SEGMENT);
+    unsigned int seed = 1;
+    for (int kind = 0; kind < 3; kind++) {
+        for (int i = 0; i < SEGMENT; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (kind == 0) in[i] = "the cat sat on the mat\n"[i % 23];
+            else if (kind == 1) in[i] = (i < SEGMENT / 2) ? 'x' : 'y';
+            else in[i] = seed >> 16;
+        }
+        int n = compress(SEGMENT, in, out);
+        assert(kind == 2 || n < SEGMENT / 10);
+        assert(n <= SEGMENT + 16);
+        expand(n, out, back);
+        assert(memcmp(in, back, SEGMENT) == 0);
+    }
+    free(in);
+    free(out);
+    free(back);
+}
+
+// Fill a string with n pseudo-random letters, about half of which repeat, for
+// the i'th insertion.
+static void fill(int i, int n, char *s) {
+    unsigned int seed = i;
+    for (int j = 0; j < n; j++) {
+        seed = seed * 1103515245 + 12345;
+        if (j % 100 < 50) s[j] = 'a' + (seed >> 16) % 26;
+        else s[j] = "abcdefghij"[j % 10];
+    }
+}
+
+// Check that a history over budget packs and spills old segments, and that
+// undo and redo bring them back transparently.
+static void testBudget() {
+    history *h = newHistory(), *big = newHistory();
+    budgetHistory(h, 4 * SEGMENT);
+    int n = 10000, count = 300;
+    char *s = malloc(n);
+    for (int i = 0; i < count; i++) {
+        fill(i, n, s);
+        saveInsert(h, i, n, s);
+        saveInsert(big, i, n, s);
+        saveEnd(h);
+        saveEnd(big);
+        assert(memoryHistory(h) <= 4 * SEGMENT);
+    }
+    assert(memoryHistory(big) > 40 * SEGMENT);
+    assert(h->file != NULL && h->fileEnd > 0);
+    for (int i = count - 1; i >= 0; i--) {
+        edit e = undo(h);
+        fill(i, n, s);
+        assert(e.op == Delete && e.n == n && memcmp(e.s, s, n) == 0);
+        e = undo(h);
+        assert(e.op == Move && e.n == -i);
+        assert(memoryHistory(h) <= 4 * SEGMENT);
+    }
+    for (int i = 0; i < count / 2; i++) {
+        redo(h);
+        edit e = redo(h);
+        fill(i, n, s);
+        assert(e.op == Insert && e.n == n && memcmp(e.s, s, n) == 0);
+    }
+    saveMarkRow(h, 1);
+    assert(sizeHistory(h) < sizeHistory(big) / 2);
+    int size = sizeHistory(h) - 1;
+    char *bs = malloc(size);
+    readHistory(h, 0, size, bs);
+    assert(memcmp(bs, bytesHistory(big), size) == 0);
+    free(bs);
+    free(s);
+    freeHistory(h);
+    freeHistory(big);
+}
+
 int main() {
     setbuf(stdout, NULL);
     testOps();
     history *h = newHistory();
     testInts(h);
     testUndo(h);
+    testRedo(h);
+    testVector(h);
+    testGroup(h);
+    testLong(h);
+    testFrame(h);
+    testAt(h);
+    testTree();
+    testSource();
+    testPack();
+    testBudget();
     freeHistory(h);
     printf("History module OK\n");
     return 0;
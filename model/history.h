@@ -8,9 +8,103 @@
 struct history;
 typedef struct history history;
 
+// Create or free a history object.
+history *newHistory();
+void freeHistory(history *h);
+
 // Remove all the entries.
 void clearHistory(history *h);
 
+// Access the history as raw bytes, e.g. for journalling. The size is the
+// number of bytes, and the current position is at most the size, being less
+// after undo steps. The bytes are held in segments, so bytesHistory copies them
+// all into one buffer, valid until the next change, which is for testing or
+// small histories, whereas readHistory copies n bytes from a given position.
+int sizeHistory(history *h);
+int currentHistory(history *h);
+char const *bytesHistory(history *h);
+void readHistory(history *h, int at, int n, char *out);
+
+// Set a budget for the memory used to hold the history bytes, or find the
+// memory currently used. When the history grows beyond the budget, old parts
+// far from the current position are compressed and, beyond that, moved out to
+// a temporary file. They are brought back automatically when undo or redo
+// reaches them. The default is 64MB.
+void budgetHistory(history *h, int budget);
+int memoryHistory(history *h);
+
+// Return the number of bytes at the start of the history which have not changed
+// since the previous call. Bytes are normally only added, but they can be
+// altered or truncated, e.g. by a new edit after undo steps.
+int unchangedHistory(history *h);
+
+// Return the lowest size to which the history has been cut back since the
+// previous call, e.g. by a new edit after undo steps, or the current size if
+// it hasn't been.
+int truncatedHistory(history *h);
+
+// Find the number of cuts made to the history since it was created, or the
+// position of the i'th cut, i.e. the size it was cut back to, which is 0 when
+// it is cleared or loaded. Unlike truncatedHistory, this doesn't depend on when
+// the previous call was made, so any number of objects can use it, e.g. to
+// discard information about the bytes beyond the cut.
+int cutsHistory(history *h);
+int cutHistory(history *h, int i);
+
+// Replace the history by n raw bytes, previously obtained from bytesHistory,
+// with the given current position.
+void loadHistory(history *h, int n, char const *bs, int current);
+
+// Set the rules for grouping typed characters. A single character inserted with
+// no change of position since the previous one, in the same group, joins it as
+// a single Insert, and similarly for backspaces, so that a word of typing takes
+// about a byte per character, and is undone in one step. A group is ended by
+// any other edit, or an undo or redo. If words is true, a group also ends at a
+// word boundary, i.e. before a character which follows a space or newline. If
+// gap is not zero, a group also ends after a pause of more than that many
+// milliseconds. The defaults are words and no time gap.
+void groupHistory(history *h, bool words, int gap);
+
+// End any group of typed characters, so that the edits recorded so far can't
+// change, e.g. when a checkpoint of the text is taken.
+void breakHistory(history *h);
+
+// Find the number of user actions in the history, i.e. whose ends have been
+// recorded, or the number of them before the current position.
+int countActions(history *h);
+int currentAction(history *h);
+
+// Find the position in the history bytes where the i'th action starts, for i
+// from 0 to countActions, e.g. to jump back or forward several actions at once,
+// without decoding the edits in between.
+int startAction(history *h, int i);
+
+// The undo tree. A new edit after undo steps doesn't discard the undone edits,
+// but keeps them as a branch. Branches are numbered from 0, and the history
+// bytes are the edits of the active branch, which undo and redo move through.
+// Any other branch shares its parent's edits up to the point where it forks,
+// followed by its own, which are packed. When the branches outgrow a memory
+// budget, the least recently used ones with no branches of their own are
+// pruned. The default budget is 16MB.
+int countBranches(history *h);
+int activeBranch(history *h);
+void budgetBranches(history *h, int budget);
+
+// Find the parent of a branch, or -1 for the active branch or one which has
+// been pruned, or the memory its own edits use.
+int parentBranch(history *h, int b);
+int memoryBranch(history *h, int b);
+
+// Find the position in the history bytes where the path to branch b leaves the
+// active branch, i.e. their common ancestor, or -1 if b has been pruned. Undo
+// steps back to that point are needed before switching to b, and no others.
+int forkBranch(history *h, int b);
+
+// Make b the active branch, so that redo follows its edits, provided that the
+// current position is no later than forkBranch, or else return false. The
+// previously active branch is kept, under the same number.
+bool switchBranch(history *h, int b);
+
 // Save a change of insert/delete position, relative to the previous one,
 // then an insertion of a string s of length n.
 void saveInsert(history *h, int p, int n, char const *s);
@@ -19,6 +113,35 @@ void saveInsert(history *h, int p, int n, char const *s);
 // then a deletion of a string s of length n before that position.
 void saveDelete(history *h, int p, int n, char const *s);
 
+// Register n bytes of immutable data as a source which large deletions can
+// refer to, instead of copying the deleted bytes, and return its id, e.g. for
+// the original content of a mapped file. The data must remain valid until the
+// source is released, when the history copies just the ranges referred to. Ids
+// are assigned in order from 0, so a history reloaded from saved bytes can use
+// its references if the same sources are registered again first.
+int sourceHistory(history *h, int n, char const *data);
+void releaseSource(history *h, int id);
+
+// Describe the sources, so that a copy of the history can resolve its
+// references without them, e.g. after a crash when a source's file has since
+// been replaced by a save. For a source which hasn't been released,
+// extentsSource returns -1, otherwise the number of extents copied from it,
+// each of which extentSource gives as an offset, a length and the bytes.
+int sourcesHistory(history *h);
+int extentsSource(history *h, int id);
+char const *extentSource(history *h, int id, int i, int *offset, int *n);
+
+// Rebuild a released source from its extents, registering blank sources up to
+// the given id first if necessary. Any data or extents it had are discarded.
+// Then add the extents, in order, copying their bytes.
+void restoreSource(history *h, int id);
+void addExtent(history *h, int id, int offset, int n, char const *bytes);
+
+// Save a change of position, as for saveDelete, then a deletion of n bytes
+// before that position, which are at the given offset in a source. The edit
+// retrieved by undo or redo holds the bytes, as for saveDelete.
+void saveDeleteSource(history *h, int p, int id, int offset, int n);
+
 // Save an addition of a new cursor at the given relative index, at the same
 // point as the current cursor (or previous cursor, if new index is #cursors).
 void saveAddCursor(history *h, int n);
@@ -28,6 +151,28 @@ void saveAddCursor(history *h, int n);
 // next (or previous) cursor.
 void saveCutCursor(history *h, int n);
 
+// Save an addition of new cursors after the current one, described by a vector
+// of n integers, which is packed compactly, at a few bits per small integer.
+void saveAddCursors(history *h, int n, int const v[n]);
+
+// Save a deletion of the cursors after the current one which are described by
+// a vector of n integers, so that they can be restored by undo.
+void saveCutCursors(history *h, int n, int const v[n]);
+
+// Save a merge of groups of overlapping cursors, with each group described in a
+// vector of n integers, so that undo can split them again.
+void saveMergeCursors(history *h, int n, int const v[n]);
+
+// Save a shift of a range of cursors by the same delta, described by a vector
+// of four integers: the index of the first, relative to the current cursor, the
+// number of cursors, and the change of row and column of both of their ends.
+void saveShiftCursors(history *h, int n, int const v[n]);
+
+// Save individual movements of a range of cursors, described by a vector of n
+// integers: the index of the first, relative to the current cursor, then the
+// change of base row and column and mark row and column of each cursor.
+void saveMoveCursors(history *h, int n, int const v[n]);
+
 // Save a relative change of current cursor index.
 void saveSetCursor(history *h, int n);
 
@@ -66,15 +211,33 @@ typedef struct edit edit;
 // which precedes the Insert or Delete itself.
 enum op {
     Move, Insert, Delete, AddCursor, CutCursor, SetCursor, CursorRow, CursorCol,
-    BaseRow, BaseCol, MarkRow, MarkCol, End
+    BaseRow, BaseCol, MarkRow, MarkCol, AddCursors, CutCursors, MergeCursors,
+    SplitCursors, ShiftCursors, UnshiftCursors, MoveCursors, UnmoveCursors, End
 };
 
 // Get the most recent edit, inverted ready to execute. This should be repeated
 // until the 'last' flag is set. If the opcode is End, there are no edits to
 // undo. (Insert and Delete are inverses, AddCursor and CutCursor are inverses,
-// and the rest are self-inverses by negation.)
+// AddCursors and CutCursors are inverses, MergeCursors and SplitCursors are
+// inverses, ShiftCursors and MoveCursors are inverted by UnshiftCursors and
+// UnmoveCursors, which subtract the deltas instead of adding them, and the rest
+// are self-inverses by negation.) For those eight, s holds the n bytes of a
+// packed vector.
 edit undo(history *h);
 
 // Get the most recent undone action, ready for re-execution. This should be
 // repeated until the last flag is set.
 edit redo(history *h);
+
+// Get the edit at or before a given position, as with redo or undo, without
+// changing the current position, and move *at past it, e.g. to replay the
+// history on a separate copy of the text.
+edit redoAt(history *h, int *at);
+edit undoAt(history *h, int *at);
+
+// Check whether an opcode has a packed vector as its argument.
+bool vectorOp(int op);
+
+// Unpack the vector from an edit into v, which needs room for e.n integers, and
+// return the number of integers.
+int unpackVector(edit e, int v[]);
@@ -0,0 +1,672 @@
+// Crash recovery journal. Free and open source. See LICENSE.
+#define _POSIX_C_SOURCE 200809L
+#include "journal.h"
+#include "text.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#define fdatasync _commit
+#endif
+
+// The journal file starts with a header which identifies the saved file it
+// applies to, by size and modification time, and gives the baseline, i.e. the
+// position in the history corresponding to the saved file, the text position
+// and current cursor index, and the number of cursors, whose points follow the
+// header. Then come the history's sources, which its references to deleted
+// bytes need, each as a count of extents followed by the extents, or as -1 if
+// the source is still live, in which case it is the saved file, registered
+// again when the file is loaded. Each record after that holds the history bytes
+// from a given start offset up to the end of the history, as it was when the
+// record was written, the current position, and a checksum so that a record
+// torn by a crash can be ignored.
+struct header {
+    char magic[8];
+    int64_t size, time;
+    int32_t base, pos, current, n, sources;
+};
+typedef struct header header;
+struct record { int32_t start, n, current; uint32_t check; };
+typedef struct record record;
+
+static char const MAGIC[8] = "Snipe\3J\n";
+
+// A journal has an open file descriptor, and the paths of the journal and the
+// saved file. The bytes of the history from origin to written are in the
+// journal, as is the current position. A journal is broken, and written to no
+// further until the next reset, if the history is cut back below the base,
+// because the saved state can no longer be reached from the history. The
+// background syncer thread waits for a sync to be pending, or for the journal
+// to be stopped.
+struct journal {
+    int fd;
+    char *path, *file;
+    history *h;
+    int base, origin, written, current;
+    bool broken;
+    pthread_t syncer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool pending, stopping;
+};
+
+// Make the journal path for a file, by putting . in front of the file name and
+// .journal after it.
+static char *journalPath(char const *file) {
+    int n = strlen(file);
+    char *path = malloc(n + 10);
+    char const *slash = strrchr(file, '/');
+    int d = (slash == NULL) ? 0 : slash - file + 1;
+    memcpy(path, file, d);
+    path[d] = '.';
+    strcpy(&path[d + 1], &file[d]);
+    strcat(path, ".journal");
+    return path;
+}
+
+// Make a header for a saved file, returning false if it doesn't exist.
+static bool makeHeader(char const *file, baseline *b, header *hd) {
+    struct stat info;
+    if (stat(file, &info) != 0) return false;
+    memset(hd, 0, sizeof(header));
+    memcpy(hd->magic, MAGIC, 8);
+    hd->size = info.st_size;
+    hd->time = info.st_mtime;
+    if (b == NULL) return true;
+    hd->base = b->base;
+    hd->pos = b->pos;
+    hd->current = b->current;
+    hd->n = b->n;
+    return true;
+}
+
+// Find the number of bytes needed to write out the sources of a history.
+static int sizeSources(history *h) {
+    int size = 0;
+    for (int id = 0; id < sourcesHistory(h); id++) {
+        size += sizeof(int32_t);
+        for (int i = 0; i < extentsSource(h, id); i++) {
+            int offset, n;
+            extentSource(h, id, i, &offset, &n);
+            size += sizeof(int32_t[2]) + n;
+        }
+    }
+    return size;
+}
+
+// Write out the sources of a history, returning the position after them.
+static char *writeSources(history *h, char *out) {
+    for (int id = 0; id < sourcesHistory(h); id++) {
+        int32_t count = extentsSource(h, id);
+        memcpy(out, &count, sizeof(int32_t));
+        out += sizeof(int32_t);
+        for (int i = 0; i < count; i++) {
+            int offset, n;
+            char const *bytes = extentSource(h, id, i, &offset, &n);
+            int32_t range[2] = { offset, n };
+            memcpy(out, range, sizeof(int32_t[2]));
+            memcpy(out + sizeof(int32_t[2]), bytes, n);
+            out += sizeof(int32_t[2]) + n;
+        }
+    }
+    return out;
+}
+
+// Check whether a header from a journal identifies the same saved file.
+static bool sameFile(header *hd, header *saved) {
+    if (memcmp(hd->magic, saved->magic, 8) != 0) return false;
+    return hd->size == saved->size && hd->time == saved->time;
+}
+
+// Compute an FNV-1a checksum of a record's fields and bytes.
+static uint32_t checksum(record *r, char const *bs) {
+    uint32_t x = 2166136261u;
+    int32_t fields[3] = { r->start, r->n, r->current };
+    unsigned char const *p = (unsigned char const *) fields;
+    for (int i = 0; i < sizeof(fields); i++) x = (x ^ p[i]) * 16777619u;
+    p = (unsigned char const *) bs;
+    for (int i = 0; i < r->n; i++) x = (x ^ p[i]) * 16777619u;
+    return x;
+}
+
+// Write out all of a buffer, allowing for partial writes.
+static bool writeAll(int fd, int n, char const *data) {
+    while (n > 0) {
+        ssize_t done = write(fd, data, n);
+        if (done < 0) return false;
+        data += done;
+        n -= done;
+    }
+    return true;
+}
+
+// Sync the journal in the background whenever asked, so that a batch of
+// records is committed to disk together, without holding up the editor.
+static void *syncJournal(void *arg) {
+    journal *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (true) {
+        while (! j->pending && ! j->stopping) {
+            pthread_cond_wait(&j->wake, &j->lock);
+        }
+        if (! j->pending) break;
+        j->pending = false;
+        pthread_mutex_unlock(&j->lock);
+        fdatasync(j->fd);
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// Ask the syncer thread to sync the journal.
+static void requestSync(journal *j) {
+    pthread_mutex_lock(&j->lock);
+    j->pending = true;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Empty the journal file and write a new header, followed by the cursors and
+// the sources.
+static bool restart(journal *j, baseline *b) {
+    header hd;
+    if (! makeHeader(j->file, b, &hd)) return false;
+    if (ftruncate(j->fd, 0) != 0) return false;
+    hd.sources = sourcesHistory(j->h);
+    int size = b->n * sizeof(int32_t[4]);
+    int n = sizeof(header) + size + sizeSources(j->h);
+    char *buffer = malloc(n);
+    memcpy(buffer, &hd, sizeof(header));
+    int32_t *points = (int32_t *) &buffer[sizeof(header)];
+    for (int i = 0; i < 4 * b->n; i++) points[i] = b->points[i / 4][i % 4];
+    writeSources(j->h, &buffer[sizeof(header) + size]);
+    bool ok = writeAll(j->fd, n, buffer);
+    free(buffer);
+    if (! ok) return false;
+    j->base = j->origin = j->written = b->base;
+    j->current = -1;
+    j->broken = false;
+    truncatedHistory(j->h);
+    requestSync(j);
+    return true;
+}
+
+journal *newJournal(char const *file, history *h, baseline *b) {
+    journal *j = malloc(sizeof(journal));
+    *j = (journal) {
+        .fd = -1, .file = malloc(strlen(file) + 1), .path = journalPath(file),
+        .h = h, .pending = false, .stopping = false
+    };
+    strcpy(j->file, file);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    bool ok = j->fd >= 0;
+    if (ok) {
+        pthread_mutex_init(&j->lock, NULL);
+        pthread_cond_init(&j->wake, NULL);
+        ok = pthread_create(&j->syncer, NULL, syncJournal, j) == 0;
+        if (! ok) {
+            pthread_mutex_destroy(&j->lock);
+            pthread_cond_destroy(&j->wake);
+        }
+    }
+    if (ok && restart(j, b)) return j;
+    if (ok) freeJournal(j, false);
+    else {
+        if (j->fd >= 0) { close(j->fd); remove(j->path); }
+        free(j->file);
+        free(j->path);
+        free(j);
+    }
+    return NULL;
+}
+
+void freeJournal(journal *j, bool keep) {
+    if (j == NULL) return;
+    if (keep) flushJournal(j);
+    pthread_mutex_lock(&j->lock);
+    j->stopping = true;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->syncer, NULL);
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->wake);
+    close(j->fd);
+    if (! keep || j->broken) remove(j->path);
+    free(j->file);
+    free(j->path);
+    free(j);
+}
+
+// Once broken, the journal is emptied, so that it is ignored after a crash.
+static void breakJournal(journal *j) {
+    j->broken = true;
+    if (ftruncate(j->fd, 0) == 0) requestSync(j);
+}
+
+// The record starts at the lowest point which has changed, or lower if undo
+// steps have gone back below the bytes already in the journal, so that the
+// journal always holds what is needed to reach the current position.
+void flushJournal(journal *j) {
+    if (j == NULL || j->broken) return;
+    history *h = j->h;
+    int cut = truncatedHistory(h), low = unchangedHistory(h);
+    if (cut < j->base) { breakJournal(j); return; }
+    int size = sizeHistory(h), current = currentHistory(h);
+    if (low > j->written) low = j->written;
+    if (current < j->origin && current < low) low = current;
+    if (low == size && current == j->current) return;
+    record r = { .start = low, .n = size - low, .current = current };
+    char *buffer = malloc(sizeof(record) + r.n);
+    char *bs = &buffer[sizeof(record)];
+    readHistory(h, low, r.n, bs);
+    r.check = checksum(&r, bs);
+    memcpy(buffer, &r, sizeof(record));
+    bool ok = writeAll(j->fd, sizeof(record) + r.n, buffer);
+    free(buffer);
+    if (! ok) { breakJournal(j); return; }
+    if (low < j->origin) j->origin = low;
+    j->written = size;
+    j->current = current;
+    requestSync(j);
+}
+
+void resetJournal(journal *j, baseline *b) {
+    if (j == NULL) return;
+    if (! restart(j, b)) breakJournal(j);
+}
+
+// Read a whole journal file, returning NULL if there isn't one.
+static char *readJournal(char const *path, int *pn) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(header)) {
+        close(fd);
+        return NULL;
+    }
+    int n = info.st_size;
+    char *data = malloc(n);
+    int k = 0;
+    while (k < n) {
+        ssize_t done = read(fd, &data[k], n - k);
+        if (done <= 0) break;
+        k += done;
+    }
+    close(fd);
+    *pn = k;
+    return data;
+}
+
+// Read the cursors following a journal's header, returning the offset after
+// them, or -1 if they don't fit the header.
+static int readPoints(header *hd, int n, char const *data, baseline *b) {
+    int at = sizeof(header);
+    if (hd->n < 1 || hd->n > (n - at) / sizeof(int32_t[4])) return -1;
+    if (hd->current < 0 || hd->current >= hd->n || hd->pos < 0) return -1;
+    int size = hd->n * sizeof(int32_t[4]);
+    int32_t *points = malloc(size);
+    memcpy(points, &data[at], size);
+    b->points = malloc(size);
+    for (int i = 0; i < 4 * hd->n; i++) b->points[i / 4][i % 4] = points[i];
+    free(points);
+    b->pos = hd->pos;
+    b->current = hd->current;
+    b->n = hd->n;
+    return at + size;
+}
+
+// Check the sources following the cursors, returning the offset after them, or
+// -1 if they don't fit, or a live source isn't registered with the history.
+static int readSources(header *hd, int n, char const *data, int at,
+    history *h) {
+    if (hd->sources < 0) return -1;
+    for (int id = 0; id < hd->sources; id++) {
+        int32_t count, range[2];
+        if (at + sizeof(int32_t) > n) return -1;
+        memcpy(&count, &data[at], sizeof(int32_t));
+        at += sizeof(int32_t);
+        bool live = id < sourcesHistory(h) && extentsSource(h, id) < 0;
+        if (count < 0 && (count < -1 || ! live)) return -1;
+        for (int i = 0, end = 0; i < count; i++) {
+            if (at + sizeof(int32_t[2]) > n) return -1;
+            memcpy(range, &data[at], sizeof(int32_t[2]));
+            at += sizeof(int32_t[2]);
+            if (range[0] < end || range[1] <= 0) return -1;
+            if (range[1] > n - at) return -1;
+            end = range[0] + range[1];
+            at += range[1];
+        }
+    }
+    return at;
+}
+
+// Rebuild the released sources of a history from checked data.
+static void restoreSources(header *hd, char const *data, int at, history *h) {
+    for (int id = 0; id < hd->sources; id++) {
+        int32_t count, range[2];
+        memcpy(&count, &data[at], sizeof(int32_t));
+        at += sizeof(int32_t);
+        if (count >= 0) restoreSource(h, id);
+        for (int i = 0; i < count; i++) {
+            memcpy(range, &data[at], sizeof(int32_t[2]));
+            at += sizeof(int32_t[2]);
+            addExtent(h, id, range[0], range[1], &data[at]);
+            at += range[1];
+        }
+    }
+}
+
+// Apply the records in order, each replacing the bytes from its start onwards,
+// and stop at the first torn or inconsistent record.
+bool recoverJournal(char const *file, history *h, baseline *b, int *ptarget) {
+    char *path = journalPath(file);
+    int n;
+    char *data = readJournal(path, &n);
+    free(path);
+    if (data == NULL) return false;
+    header hd, saved;
+    memcpy(&hd, data, sizeof(header));
+    bool ok = makeHeader(file, NULL, &saved) && sameFile(&hd, &saved);
+    int points = ok ? readPoints(&hd, n, data, b) : -1;
+    int start = (points >= 0) ? readSources(&hd, n, data, points, h) : -1;
+    ok = start >= 0;
+    char *bs = malloc(1);
+    int origin = -1, length = 0, current = 0;
+    for (int at = start; ok && at + sizeof(record) <= n; ) {
+        record r;
+        memcpy(&r, &data[at], sizeof(record));
+        at += sizeof(record);
+        if (r.n < 0 || r.n > n - at) break;
+        char const *rbs = &data[at];
+        if (r.check != checksum(&r, rbs)) break;
+        if (origin < 0 || r.start < origin) origin = r.start;
+        else if (r.start > origin + length) break;
+        length = r.start - origin;
+        bs = realloc(bs, length + r.n + 1);
+        memcpy(&bs[length], rbs, r.n);
+        length += r.n;
+        current = r.current;
+        at += r.n;
+    }
+    ok = ok && origin >= 0 && origin <= hd.base && hd.base <= origin + length;
+    ok = ok && current >= origin && current <= origin + length;
+    if (ok) {
+        restoreSources(&hd, data, points, h);
+        loadHistory(h, length, bs, hd.base - origin);
+        b->base = hd.base - origin;
+        *ptarget = current - origin;
+    }
+    else if (points >= 0) free(b->points);
+    free(bs);
+    free(data);
+    return ok;
+}
+
+#ifdef journalTest
+
+// Write a small file.
+static void writeSmall(char const *path, char const *s) {
+    FILE *f = fopen(path, "wb");
+    fputs(s, f);
+    fclose(f);
+}
+
+// Check that a recovered history matches the original.
+static bool same(history *h, history *h2, int target) {
+    int n = sizeHistory(h);
+    if (sizeHistory(h2) != n || target != currentHistory(h)) return false;
+    return memcmp(bytesHistory(h), bytesHistory(h2), n) == 0;
+}
+
+// Make a baseline for a history with no text, at its current position.
+static baseline plain(history *h) {
+    static int origin[1][4] = { { 0, 0, 0, 0 } };
+    return (baseline) {
+        .base=currentHistory(h), .pos=0, .current=0, .n=1, .points=origin
+    };
+}
+
+// Check that a history is recovered, and discard the baseline.
+static bool recovered(char const *file, history *h2, int *ptarget) {
+    baseline b;
+    if (! recoverJournal(file, h2, &b, ptarget)) return false;
+    free(b.points);
+    return true;
+}
+
+// Check journalling of edits, recovery, and resetting after a save.
+static void testJournal() {
+    char *file = "journalTest.txt";
+    writeSmall(file, "abc\n");
+    history *h = newHistory(), *h2 = newHistory();
+    baseline b = plain(h);
+    journal *j = newJournal(file, h, &b);
+    assert(j != NULL);
+    int target;
+    assert(! recovered(file, h2, &target));
+    saveInsert(h, 3, 2, "xy");
+    saveEnd(h);
+    flushJournal(j);
+    saveDelete(h, 0, 1, "x");
+    saveEnd(h);
+    flushJournal(j);
+    assert(recovered(file, h2, &target));
+    assert(same(h, h2, target) && currentHistory(h2) == 0);
+    undo(h);
+    undo(h);
+    flushJournal(j);
+    assert(recovered(file, h2, &target));
+    assert(same(h, h2, target));
+    saveBaseCol(h, 4);
+    flushJournal(j);
+    assert(recovered(file, h2, &target));
+    assert(same(h, h2, target));
+    b = plain(h);
+    resetJournal(j, &b);
+    assert(! recovered(file, h2, &target));
+    undo(h);
+    undo(h);
+    saveMarkRow(h, 1);
+    flushJournal(j);
+    assert(! recovered(file, h2, &target));
+    freeJournal(j, true);
+    assert(! recovered(file, h2, &target));
+    freeHistory(h);
+    freeHistory(h2);
+    remove(file);
+}
+
+// Check that a journal is ignored if the file has changed, and that a torn
+// final record is ignored.
+static void testTorn() {
+    char *file = "journalTest.txt";
+    writeSmall(file, "abc\n");
+    history *h = newHistory(), *h2 = newHistory();
+    baseline b = plain(h);
+    journal *j = newJournal(file, h, &b);
+    saveInsert(h, 3, 2, "xy");
+    flushJournal(j);
+    int n = currentHistory(h);
+    saveInsert(h, 0, 3, "pqr");
+    flushJournal(j);
+    freeJournal(j, true);
+    char *path = journalPath(file);
+    struct stat info;
+    stat(path, &info);
+    truncate(path, info.st_size - 1);
+    int target;
+    assert(recovered(file, h2, &target));
+    assert(target == n && sizeHistory(h2) == n);
+    writeSmall(file, "abcd\n");
+    assert(! recovered(file, h2, &target));
+    remove(path);
+    free(path);
+    freeHistory(h);
+    freeHistory(h2);
+    remove(file);
+}
+
+// Make a baseline for a text as it is now.
+static baseline current(text *t, cursors *cs, history *h) {
+    baseline b = {
+        .base=currentHistory(h), .pos=positionText(t),
+        .current=currentCursor(cs), .n=nCursors(cs)
+    };
+    b.points = malloc(b.n * sizeof(int[4]));
+    getCursors(cs, 0, b.n, b.points);
+    return b;
+}
+
+// Check that the text and cursors, not just the history, are recovered when the
+// journal has been reset after a mid-session save, i.e. the edits are replayed
+// at the right positions on top of the newly saved file.
+static void testReplay(char const *s, int at, int at2) {
+    char *file = "journalTest.txt";
+    writeSmall(file, s);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines(), *ls2 = newLines();
+    text *t = newText(ls, cs, h);
+    char buffer[100];
+    strcpy(buffer, s);
+    assert(loadText(t, strlen(buffer), buffer));
+    baseline b = current(t, cs, h);
+    journal *j = newJournal(file, h, &b);
+    free(b.points);
+    insertText(t, at, 1, "X");
+    moveCursor(cs, 0, 2);
+    saveEnd(h);
+    saveText(t, buffer)[lengthText(t)] = '\0';
+    writeSmall(file, buffer);
+    b = current(t, cs, h);
+    resetJournal(j, &b);
+    free(b.points);
+    insertText(t, at2, 1, "Y");
+    addCursor(cs, 1, 3);
+    saveEnd(h);
+    flushJournal(j);
+    history *h2 = newHistory();
+    cursors *cs2 = newCursors(h2);
+    text *t2 = newText(ls2, cs2, h2);
+    assert(loadText(t2, strlen(buffer), buffer));
+    int target;
+    assert(recoverJournal(file, h2, &b, &target));
+    assert(editText(t2, (edit) { .op=Move, .n=b.pos }));
+    restoreCursors(cs2, b.n, b.points, b.current);
+    free(b.points);
+    while (currentHistory(h2) < target) assert(editText(t2, redo(h2)));
+    char out[100];
+    saveText(t, buffer)[lengthText(t)] = '\0';
+    saveText(t2, out)[lengthText(t2)] = '\0';
+    assert(strcmp(buffer, out) == 0);
+    assert(positionText(t2) == positionText(t));
+    int n = nCursors(cs), points[n][4], points2[n][4];
+    assert(nCursors(cs2) == n && currentCursor(cs2) == currentCursor(cs));
+    getCursors(cs, 0, n, points);
+    getCursors(cs2, 0, n, points2);
+    assert(memcmp(points, points2, sizeof(points)) == 0);
+    freeJournal(j, false);
+    freeText(t);
+    freeText(t2);
+    freeLines(ls);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(h2);
+    remove(file);
+}
+
+// Check that a large deletion from a mapped file, recorded by reference, is
+// recovered correctly after a save has replaced the file, when undoing past it
+// needs the bytes of the file as it was.
+static void testMapped() {
+    char *file = "journalTest.txt";
+    int n = 20000;
+    char *data = malloc(n + 1), *buffer = malloc(n + 1), *out = malloc(n + 1);
+    for (int i = 0; i < n; i++) data[i] = (i % 50 == 49) ? '\n' : 'a' + i % 26;
+    data[n] = '\0';
+    writeSmall(file, data);
+    history *h = newHistory(), *h2 = newHistory();
+    cursors *cs = newCursors(h), *cs2 = newCursors(h2);
+    lines *ls = newLines(), *ls2 = newLines();
+    text *t = newText(ls, cs, h), *t2 = newText(ls2, cs2, h2);
+    assert(mapText(t, n, data));
+    baseline b = current(t, cs, h);
+    journal *j = newJournal(file, h, &b);
+    free(b.points);
+    deleteText(t, 1000, 11000);
+    saveEnd(h);
+    assert(sizeHistory(h) < 100);
+    detachText(t);
+    saveText(t, buffer)[lengthText(t)] = '\0';
+    writeSmall(file, buffer);
+    b = current(t, cs, h);
+    resetJournal(j, &b);
+    free(b.points);
+    assert(editText(t, undo(h)));
+    flushJournal(j);
+    assert(mapText(t2, strlen(buffer), buffer));
+    int target;
+    assert(recoverJournal(file, h2, &b, &target));
+    assert(editText(t2, (edit) { .op=Move, .n=b.pos }));
+    restoreCursors(cs2, b.n, b.points, b.current);
+    free(b.points);
+    while (currentHistory(h2) > target) assert(editText(t2, undo(h2)));
+    saveText(t2, out)[lengthText(t2)] = '\0';
+    assert(strcmp(data, out) == 0);
+    freeJournal(j, false);
+    freeText(t);
+    freeText(t2);
+    freeLines(ls);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeCursors(cs2);
+    freeHistory(h);
+    freeHistory(h2);
+    free(data);
+    free(buffer);
+    free(out);
+    remove(file);
+}
+
+// Check that edits which don't fit a text are rejected rather than applied, as
+// when a journal is replayed onto the wrong file.
+static void testBounds() {
+    history *h = newHistory();
+    lines *ls = newLines();
+    text *t = newText(ls, NULL, h);
+    char buffer[] = "abc\n";
+    assert(loadText(t, 4, buffer));
+    assert(! editText(t, (edit) { .op=Move, .n=5 }));
+    assert(! editText(t, (edit) { .op=Delete, .n=1, .s="a" }));
+    assert(editText(t, (edit) { .op=Move, .n=4 }));
+    assert(! editText(t, (edit) { .op=Delete, .n=5, .s="abc\nx" }));
+    assert(lengthText(t) == 4 && positionText(t) == 4);
+    freeText(t);
+    freeLines(ls);
+    freeHistory(h);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testJournal();
+    testTorn();
+    testReplay("abcdef\nghij\n", 5, 9);
+    testReplay("abcdef\nghij\n", 5, 0);
+    testReplay("abcdef\nghij\n", 0, 12);
+    testMapped();
+    testBounds();
+    printf("Journal module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// Crash recovery journal. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A journal protects a document's unsaved changes against a crash. It is a
+// file alongside the document's file, to which newly added history bytes are
+// appended in batches, typically on each timer tick, so the cost per keystroke
+// is almost nothing. The data is synced to disk by a background thread, so
+// that a batch of edits is committed together without blocking editing. After
+// a crash, the saved file plus the journal give back the exact text, cursors
+// and history. After a successful save, the journal is reset.
+struct journal;
+typedef struct journal journal;
+typedef struct history history;
+
+// The state of a document at the base of a journal, i.e. when its file was
+// saved, needed to replay the edits since. It holds the position in the history
+// corresponding to the saved file, and the position in the text which the
+// history's relative moves start from there. It also holds n cursors, each as
+// base row and column then mark row and column, and the current cursor index.
+struct baseline { int base, pos, current, n; int (*points)[4]; };
+typedef struct baseline baseline;
+
+// Start a journal for the file at the given path, with the baseline describing
+// the file as saved. Any old journal is overwritten. On failure, NULL is
+// returned, and the document is simply not protected.
+journal *newJournal(char const *path, history *h, baseline *b);
+
+// Stop journalling. If keep is true, e.g. because there are unsaved changes
+// which failed to save, the journal file is kept for recovery, otherwise it
+// is removed.
+void freeJournal(journal *j, bool keep);
+
+// Append any new or changed history bytes to the journal, and ask for them to
+// be synced to disk.
+void flushJournal(journal *j);
+
+// After the file has been saved successfully, reset the journal, given the
+// baseline describing the saved file.
+void resetJournal(journal *j, baseline *b);
+
+// Check for a journal left behind by a crash, for the file at the given path.
+// If there is one, and it matches the file as saved, fill the history from it
+// and return true. A source which the history refers to is rebuilt from the
+// journal, unless it is the saved file, which must already be registered with
+// the history if the file is mapped. The history is left positioned at the
+// saved state, the baseline is filled in, with an allocated array of points
+// which the caller frees, and the position to which the edits should be redone
+// (or undone) is put in *ptarget. The baseline can be passed to newJournal,
+// since the file on disk is still the one it describes until the next save.
+bool recoverJournal(char const *path, history *h, baseline *b, int *ptarget);
@@ -6,105 +6,353 @@
 #include <string.h>
 #include <assert.h>
 
-// Store an array holding the position in the text just after each newline. The
-// array is organised as a gap buffer from 0 to end, with the gap between lo and
-// hi. The total number of bytes in the text is tracked in max, and entries
-// after the gap are stored relative to max. This allows the lines to be tracked
-// incrementally, using only the insertions and deletions.
+// Store the length of each line, including its newline, in a B-tree, so that
+// finding a line by row or by position, and editing at any point, take
+// logarithmic time. All the leaves are at the same depth. A leaf node holds up
+// to MAX line lengths, and an internal node holds up to MAX children. Each node
+// records the total number of rows and bytes in its subtree. The total number
+// of bytes in the text is tracked in max, and any bytes beyond the last newline
+// are not in any line. This allows the lines to be tracked incrementally, using
+// only the insertions and deletions.
+enum { MAX = 64, FILL = MAX * 3 / 4 };
+
+typedef struct node node;
+typedef union entry { int length; node *child; } entry;
+struct node { bool leaf; int n, rows, bytes; entry e[MAX]; };
+
 struct lines {
-    int *a;
-    int lo, hi, end, max;
+    node *root;
+    int max;
 };
 
+static node *newNode(bool leaf) {
+    node *x = malloc(sizeof(node));
+    x->leaf = leaf;
+    x->n = x->rows = x->bytes = 0;
+    return x;
+}
+
+static void freeNode(node *x) {
+    if (! x->leaf) for (int i = 0; i < x->n; i++) freeNode(x->e[i].child);
+    free(x);
+}
+
 lines *newLines() {
     lines *ls = malloc(sizeof(lines));
-    int *a = malloc(6 * sizeof(int));
-    *ls = (lines) { .lo=0, .hi=6, .end=6, .max=0, .a=a };
+    *ls = (lines) { .root=newNode(true), .max=0 };
     return ls;
 }
 
 void freeLines(lines *ls) {
-    free(ls->a);
+    freeNode(ls->root);
     free(ls);
 }
 
-// Move the gap to the given text position.
-static void moveGap(lines *ls, int at) {
-    while (ls->lo > 0 && ls->a[ls->lo - 1] > at) {
-        ls->lo--;
-        ls->hi--;
-        ls->a[ls->hi] = ls->max - ls->a[ls->lo];
+// Recalculate the totals for a node from its entries.
+static void sum(node *x) {
+    x->rows = x->bytes = 0;
+    for (int i = 0; i < x->n; i++) {
+        if (x->leaf) {
+            x->rows++;
+            x->bytes += x->e[i].length;
+        }
+        else {
+            x->rows += x->e[i].child->rows;
+            x->bytes += x->e[i].child->bytes;
+        }
+    }
+}
+
+// Insert k entries into node x at index i. If x overflows, share the entries
+// evenly between x and as many new nodes as necessary, to the right of x.
+// Return the number of new nodes, with an allocated array of them in *pmore.
+static int put(node *x, int i, int k, entry es[k], node ***pmore) {
+    int total = x->n + k;
+    if (total <= MAX) {
+        memmove(&x->e[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+        memcpy(&x->e[i], es, k * sizeof(entry));
+        x->n = total;
+        sum(x);
+        return 0;
+    }
+    entry *all = malloc(total * sizeof(entry));
+    memcpy(all, x->e, i * sizeof(entry));
+    memcpy(&all[i], es, k * sizeof(entry));
+    memcpy(&all[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+    int m = (total + FILL - 1) / FILL;
+    node **more = malloc((m - 1) * sizeof(node *));
+    int done = 0;
+    for (int j = 0; j < m; j++) {
+        node *y = (j == 0) ? x : newNode(x->leaf);
+        int size = total / m + (j < total % m ? 1 : 0);
+        memcpy(y->e, &all[done], size * sizeof(entry));
+        y->n = size;
+        sum(y);
+        done += size;
+        if (j > 0) more[j - 1] = y;
+    }
+    free(all);
+    *pmore = more;
+    return m - 1;
+}
+
+// Insert k line lengths at a given row in the subtree x. An insertion at a
+// boundary between children goes at the end of the left child. Return the
+// number of new nodes created to the right of x, as with put. The entries for
+// new nodes are allocated, since a bulk load can create millions of them.
+static int insertRows(node *x, int row, int k, entry es[k], node ***pmore) {
+    if (x->leaf) return put(x, row, k, es, pmore);
+    int i = 0;
+    while (i < x->n - 1 && row > x->e[i].child->rows) {
+        row -= x->e[i].child->rows;
+        i++;
+    }
+    node **more;
+    int m = insertRows(x->e[i].child, row, k, es, &more);
+    if (m == 0) { sum(x); return 0; }
+    entry *cs = malloc(m * sizeof(entry));
+    for (int j = 0; j < m; j++) cs[j].child = more[j];
+    free(more);
+    m = put(x, i + 1, m, cs, pmore);
+    free(cs);
+    return m;
+}
+
+// Insert k line lengths at a given row, growing the tree upwards if necessary.
+static void insertAll(lines *ls, int row, int k, entry es[k]) {
+    node **more;
+    int m = insertRows(ls->root, row, k, es, &more);
+    while (m > 0) {
+        node *root = newNode(false);
+        entry *cs = malloc((m + 1) * sizeof(entry));
+        cs[0].child = ls->root;
+        for (int j = 0; j < m; j++) cs[j + 1].child = more[j];
+        free(more);
+        ls->root = root;
+        m = put(root, 0, m + 1, cs, &more);
+        free(cs);
+    }
+}
+
+// Merge child i+1 into child i of x.
+static void merge(node *x, int i) {
+    node *a = x->e[i].child, *b = x->e[i + 1].child;
+    memcpy(&a->e[a->n], b->e, b->n * sizeof(entry));
+    a->n += b->n;
+    sum(a);
+    free(b);
+    memmove(&x->e[i + 1], &x->e[i + 2], (x->n - i - 2) * sizeof(entry));
+    x->n--;
+}
+
+// Delete the rows from r1 up to (not including) r2 in the subtree x. Children
+// which are covered entirely are freed without being visited, so the time
+// taken is proportional to the number of rows deleted plus the height of the
+// tree. Neighbouring children which have become small are merged.
+static void deleteRows(node *x, int r1, int r2) {
+    if (x->leaf) {
+        memmove(&x->e[r1], &x->e[r2], (x->n - r2) * sizeof(entry));
+        x->n -= r2 - r1;
+        sum(x);
+        return;
+    }
+    int j = 0, start = 0;
+    for (int i = 0; i < x->n; i++) {
+        node *c = x->e[i].child;
+        int rows = c->rows;
+        int lo = (r1 > start ? r1 : start) - start;
+        int hi = (r2 < start + rows ? r2 : start + rows) - start;
+        start += rows;
+        if (lo <= 0 && hi >= rows) { freeNode(c); continue; }
+        if (lo < hi) deleteRows(c, lo, hi);
+        x->e[j++].child = c;
+    }
+    x->n = j;
+    for (int i = 0; i < x->n - 1; ) {
+        node *a = x->e[i].child, *b = x->e[i + 1].child;
+        bool small = a->n < MAX / 4 || b->n < MAX / 4;
+        if (small && a->n + b->n <= MAX) merge(x, i);
+        else i++;
+    }
+    sum(x);
+}
+
+// Delete the rows from r1 up to r2, shrinking the tree if necessary.
+static void deleteAll(lines *ls, int r1, int r2) {
+    if (r1 >= r2) return;
+    deleteRows(ls->root, r1, r2);
+    while (! ls->root->leaf && ls->root->n <= 1) {
+        node *root = ls->root;
+        if (root->n == 0) ls->root = newNode(true);
+        else ls->root = root->e[0].child;
+        free(root);
+    }
+}
+
+void clearLines(lines *ls) {
+    freeNode(ls->root);
+    ls->root = newNode(true);
+    ls->max = 0;
+}
+
+void appendLines(lines *ls, int n, int const lengths[n]) {
+    if (n <= 0) return;
+    entry *es = malloc(n * sizeof(entry));
+    for (int i = 0; i < n; i++) {
+        es[i].length = lengths[i];
+        ls->max += lengths[i];
+    }
+    insertAll(ls, countLines(ls), n, es);
+    free(es);
+}
+
+// Find the number of bytes before a given row, where 0 <= row <= #rows.
+static int before(lines *ls, int row) {
+    node *x = ls->root;
+    int bytes = 0;
+    while (! x->leaf) {
+        int i = 0;
+        while (i < x->n - 1 && row >= x->e[i].child->rows) {
+            row -= x->e[i].child->rows;
+            bytes += x->e[i].child->bytes;
+            i++;
+        }
+        x = x->e[i].child;
     }
-    while (ls->hi < ls->end && ls->max - ls->a[ls->hi] <= at) {
-        ls->a[ls->lo] = ls->max - ls->a[ls->hi];
-        ls->hi++;
-        ls->lo++;
+    for (int i = 0; i < row && i < x->n; i++) bytes += x->e[i].length;
+    return bytes;
+}
+
+// Find the entry holding the length of a given row, where 0 <= row < #rows,
+// adding a change of length to it, and to the totals on the path to it.
+static int *change(lines *ls, int row, int by) {
+    node *x = ls->root;
+    while (! x->leaf) {
+        x->bytes += by;
+        int i = 0;
+        while (i < x->n - 1 && row >= x->e[i].child->rows) {
+            row -= x->e[i].child->rows;
+            i++;
+        }
+        x = x->e[i].child;
     }
+    x->bytes += by;
+    x->e[row].length += by;
+    return &x->e[row].length;
 }
 
-static void resize(lines *ls) {
-    int size = ls->end;
-    size = size * 3 / 2;
-    ls->a = realloc(ls->a, size * sizeof(int));
-    int hilen = ls->end - ls->hi;
-    memmove(&ls->a[size - hilen], &ls->a[ls->hi], hilen * sizeof(int));
-    ls->hi = size - hilen;
-    ls->end = size;
+// Get the length of a row.
+static int get(lines *ls, int row) {
+    return *change(ls, row, 0);
 }
 
+// Set the length of a row.
+static void set(lines *ls, int row, int length) {
+    change(ls, row, length - get(ls, row));
+}
+
+int countLines(lines *ls) {
+    return ls->root->rows;
+}
+
+// Find the row containing a position (or the number of rows if it is after the
+// last newline) and the offset of the position within it.
+static int locate(lines *ls, int at, int *offset) {
+    node *x = ls->root;
+    int row = 0;
+    while (! x->leaf) {
+        int i = 0;
+        while (i < x->n && at >= x->e[i].child->bytes) {
+            at -= x->e[i].child->bytes;
+            row += x->e[i].child->rows;
+            i++;
+        }
+        if (i == x->n) { *offset = at; return row; }
+        x = x->e[i].child;
+    }
+    for (int i = 0; i < x->n && at >= x->e[i].length; i++) {
+        at -= x->e[i].length;
+        row++;
+    }
+    *offset = at;
+    return row;
+}
+
+// The inserted string, containing k newlines, splits the line it is inserted
+// into, or the bytes after the last newline, into k+1 pieces.
 void insertLines(lines *ls, int at, int n, char const s[n]) {
+    int offset;
+    int row = locate(ls, at, &offset);
+    int rows = countLines(ls);
+    int length = (row < rows) ? get(ls, row) : ls->max - ls->root->bytes;
     ls->max = ls->max + n;
-    moveGap(ls, at);
+    int k = 0;
+    for (int i = 0; i < n; i++) if (s[i] == '\n') k++;
+    if (k == 0) {
+        if (row < rows) change(ls, row, n);
+        return;
+    }
+    entry *es = malloc((k + 1) * sizeof(entry));
+    int j = 0, prev = -1;
     for (int i = 0; i < n; i++) if (s[i] == '\n') {
-        if (ls->lo >= ls->hi) resize(ls);
-        ls->a[ls->lo++] = at + i + 1;
+        es[j++].length = (prev < 0) ? offset + i + 1 : i - prev;
+        prev = i;
+    }
+    es[k].length = (length - offset) + (n - prev - 1);
+    if (row < rows) {
+        set(ls, row, es[0].length);
+        insertAll(ls, row + 1, k, &es[1]);
     }
+    else insertAll(ls, row, k, es);
+    free(es);
 }
 
+// The deleted bytes run from a position in one line to a position in another,
+// and the two partial lines are joined.
 void deleteLines(lines *ls, int at, int n, char const s[n]) {
+    int offset1, offset2;
+    int row1 = locate(ls, at - n, &offset1);
+    int row2 = locate(ls, at, &offset2);
+    int rows = countLines(ls);
     ls->max = ls->max - n;
-    moveGap(ls, at);
-    while (ls->lo > 0 && ls->a[ls->lo - 1] > at - n) {
-        ls->lo--;
+    if (row1 == row2) {
+        if (row1 < rows) change(ls, row1, -n);
+        return;
     }
-}
-
-int countLines(lines *ls) {
-    return ls->end - (ls->hi - ls->lo);
+    if (row2 < rows) {
+        int length = get(ls, row2);
+        deleteAll(ls, row1, row2);
+        set(ls, row1, offset1 + length - offset2);
+    }
+    else deleteAll(ls, row1, rows);
 }
 
 int startLine(lines *ls, int row) {
     int n = countLines(ls);
     if (n == 0) return 0;
     if (row < 0) row = 0; else if (row >= n) row = n - 1;
-    if (row == 0) return 0;
-    else if (row <= ls->lo) return ls->a[row - 1];
-    else return ls->max - ls->a[row + (ls->hi - ls->lo) - 1];
+    return before(ls, row);
 }
 
 int endLine(lines *ls, int row) {
     int n = countLines(ls);
     if (n == 0) return 0;
     if (row < 0) row = 0; else if (row >= n) row = n - 1;
-    if (row < ls->lo) return ls->a[row];
-    else return ls->max - ls->a[row + (ls->hi - ls->lo)];
+    return before(ls, row + 1);
 }
 
 int lengthLine(lines *ls, int row) {
-    return endLine(ls, row) - startLine(ls, row);
+    int n = countLines(ls);
+    if (n == 0) return 0;
+    if (row < 0) row = 0; else if (row >= n) row = n - 1;
+    return get(ls, row);
 }
 
-// Find the row number for a position by binary search.
+// Find the row number for a position by searching down the tree.
 int findRow(lines *ls, int at) {
     if (at < 0) at = 0; else if (at > ls->max) at = ls->max;
-    int start = 0, end = countLines(ls);
-    while (end > start) {
-        int mid = start + (end - start) / 2;
-        int s = endLine(ls, mid);
-        if (at < s) end = mid;
-        else start = mid + 1;
-    }
-    return start;
+    int offset;
+    return locate(ls, at, &offset);
 }
 
 #ifdef linesTest
@@ -163,8 +411,77 @@ static void testDelete(lines *ls) {
     check(ls, 0, NULL);
 }
 
+// Check the lines structure against a plain text.
+static bool checkText(lines *ls, int n, char *t) {
+    int row = 0;
+    for (int i = 0; i < n; i++) {
+        if (findRow(ls, i) != row) return false;
+        if (t[i] != '\n') continue;
+        if (endLine(ls, row) != i + 1) return false;
+        row++;
+    }
+    return countLines(ls) == row;
+}
+
+// Test random insertions and deletions on a text big enough to make a tree of
+// several levels, including ones which delete whole subtrees.
+static void testRandom() {
+    int max = 200000;
+    char *t = malloc(max);
+    int n = 0;
+    lines *ls = newLines();
+    for (int i = 0; i < 30000; i++) { t[n++] = 'a' + i % 7; t[n++] = '\n'; }
+    insertLines(ls, 0, n, t);
+    assert(checkText(ls, n, t));
+    srand(42);
+    char s[1000];
+    for (int k = 0; k < 400; k++) {
+        int at = rand() % (n + 1);
+        if (rand() % 2 == 0 && n < max - 1000) {
+            int len = rand() % 1000;
+            for (int i = 0; i < len; i++) s[i] = (rand() % 3 == 0) ? '\n' : 'x';
+            memmove(&t[at + len], &t[at], n - at);
+            memcpy(&t[at], s, len);
+            n += len;
+            insertLines(ls, at, len, s);
+        }
+        else {
+            int to = at + rand() % (k % 50 == 0 ? 50000 : 100);
+            if (to > n) to = n;
+            deleteLines(ls, to, to - at, &t[at]);
+            memmove(&t[at], &t[to], n - to);
+            n -= to - at;
+        }
+        if (k % 20 == 0) assert(checkText(ls, n, t));
+    }
+    assert(checkText(ls, n, t));
+    deleteLines(ls, n, n, t);
+    assert(countLines(ls) == 0);
+    freeLines(ls);
+    free(t);
+}
+
+// Test bulk loading, in batches.
+static void testAppend() {
+    lines *ls = newLines();
+    insertLines(ls, 0, 3, "ab\n");
+    clearLines(ls);
+    assert(countLines(ls) == 0);
+    int lengths[1000];
+    for (int i = 0; i < 1000; i++) lengths[i] = 1 + i % 10;
+    for (int i = 0; i < 100; i++) appendLines(ls, 1000, lengths);
+    assert(countLines(ls) == 100000);
+    assert(startLine(ls, 1000) == 5500 && endLine(ls, 1000) == 5501);
+    assert(findRow(ls, 5500 * 100 - 1) == 99999);
+    insertLines(ls, 5500 * 100, 2, "x\n");
+    assert(countLines(ls) == 100001);
+    freeLines(ls);
+}
+
 int main() {
     setbuf(stdout, NULL);
+    testRandom();
+    testAppend();
     lines *ls = newLines();
     testInsert(ls);
     testFind(ls);
@@ -10,6 +10,13 @@ typedef struct lines lines;
 lines *newLines();
 void freeLines(lines *ls);
 
+// Remove all the lines, when the text is about to be replaced.
+void clearLines(lines *ls);
+
+// Add n complete lines to the end of the text, e.g. while loading a file, given
+// their lengths including the newlines. The text must end with a newline.
+void appendLines(lines *ls, int n, int const lengths[n]);
+
 // The number of lines in the text, equal to the number of newlines.
 int countLines(lines *ls);
 
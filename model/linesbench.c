@@ -0,0 +1,48 @@
+// Benchmark for the lines module. Free and open source. See LICENSE.
+
+// Time the lines module on a big text, with edits which alternate between the
+// start and end of the text, and random lookups. Link with lines.c or with the
+// gap array version gaplines.c to compare them (make linesbench).
+#include "lines.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum { ROWS = 10000000, EDITS = 500, LOOKUPS = 1000000 };
+
+// Report the time since a given start time.
+static void report(char *name, clock_t start) {
+    double t = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf("  %-10s %8.3fs\n", name, t);
+}
+
+int main(int n, char *args[n]) {
+    setbuf(stdout, NULL);
+    printf("%s\n", n > 1 ? args[1] : "lines");
+    lines *ls = newLines();
+    int size = 40 * ROWS;
+    char *text = malloc(size);
+    for (int i = 0; i < size; i++) text[i] = (i % 40 == 39) ? '\n' : 'x';
+    clock_t start = clock();
+    insertLines(ls, 0, size, text);
+    report("load", start);
+    start = clock();
+    for (int i = 0; i < EDITS; i++) {
+        int at = (i % 2 == 0) ? 5 : size - 5;
+        insertLines(ls, at, 4, "ab\nc");
+        deleteLines(ls, at + 4, 4, "ab\nc");
+    }
+    report("edits", start);
+    start = clock();
+    long total = 0;
+    for (int i = 0; i < LOOKUPS; i++) {
+        int row = rand() % ROWS;
+        total += startLine(ls, row) + endLine(ls, row);
+        total += findRow(ls, rand() % size);
+    }
+    report("lookups", start);
+    if (total == 0) printf("?\n");
+    free(text);
+    freeLines(ls);
+    return 0;
+}
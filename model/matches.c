@@ -0,0 +1,816 @@
+// Search results. Free and open source. See LICENSE.
+#define _POSIX_C_SOURCE 200809L
+#include "text.h"
+#include "search.h"
+#include "regex.h"
+#include "matches.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+
+// The most worker threads, and the default size of a chunk in bytes. The chunk
+// size, and the number of threads (zero for one per processor) are variable,
+// for testing.
+enum { WORKERS = 64, CHUNK = 4 * 1024 * 1024 };
+static int chunkSize = CHUNK;
+static int threads = 0;
+
+// A chunk is a range of positions where matches may start. When it is done,
+// its matches are ready to be merged.
+struct chunk { int start, end; bool done; int count, max; match *a; };
+typedef struct chunk chunk;
+
+// A worker has a thread, a view of the snapshot, and its own copy of any regex.
+struct worker {
+    matches *ms;
+    pthread_t thread;
+    bool started;
+    text *view;
+    regex *r;
+};
+typedef struct worker worker;
+
+// The index of matches is held in a flexible array, and refers to a text of
+// the given length. While searching, the snapshot is being read by the workers,
+// which claim the chunks in order, and resume is the position to continue
+// searching from after the last match merged. Only one worker merges at a
+// time. The lock protects everything which changes while searching, except the
+// cancellation flag. Edits made to the text during a search are noted as the
+// range changed since the snapshot, in current positions, with the length of
+// the text after the last of them. When the search is seen to have finished,
+// the workers and the snapshot are released, and the index is repaired.
+struct matches {
+    text *t;
+    finder *f;
+    regex *r;
+    void (*notify)(void);
+    snapshot *s;
+    int length;
+    int changeStart, changeEnd, changeLength;
+    chunk *chunks;
+    int chunkCount, next, merged, resume;
+    bool merging;
+    worker *workers;
+    int workerCount, live;
+    match *a;
+    int count, max;
+    atomic_bool cancelled;
+    pthread_mutex_t lock;
+};
+
+// Add a match to a flexible array.
+static void add(match **pa, int *pcount, int *pmax, match m) {
+    if (*pcount >= *pmax) {
+        *pmax = (*pmax < 16) ? 16 : *pmax * 3 / 2;
+        *pa = realloc(*pa, *pmax * sizeof(match));
+    }
+    (*pa)[(*pcount)++] = m;
+}
+
+// Get the byte at a position in a view, or -1 if out of range.
+static int byteAt(text *t, int at) {
+    if (at < 0 || at >= lengthText(t)) return -1;
+    return (unsigned char) spanText(t, at).s[0];
+}
+
+// Move forward from a position, if necessary, to the start of a code point.
+static int align(text *t, int at) {
+    while ((byteAt(t, at) & 0xC0) == 0x80) at++;
+    return at;
+}
+
+// Find the position to continue searching from after a match, which is one
+// code point further on if the match is empty.
+static int after(text *t, match m) {
+    if (m.length > 0) return m.start + m.length;
+    return align(t, m.start + 1);
+}
+
+// Find the next match in a text starting at or after from and before to.
+static match search(matches *ms, text *t, regex *r, int from, int to) {
+    match m = { .start=-1, .length=0 };
+    if (ms->f != NULL) {
+        m.start = findNext(ms->f, t, from, to);
+        m.length = lengthFinder(ms->f);
+    }
+    else m.start = nextMatch(r, t, from, to, &m.length);
+    return m;
+}
+
+// Find the matches which start in a chunk.
+static void scan(matches *ms, worker *w, chunk *c) {
+    for (int at = c->start; at < c->end && ! atomic_load(&ms->cancelled); ) {
+        match m = search(ms, w->view, w->r, at, c->end);
+        if (m.start < 0) break;
+        add(&c->a, &c->count, &c->max, m);
+        at = after(w->view, m);
+    }
+}
+
+// Make a chunk's matches follow on from those already merged, which end just
+// before position from. If any of the chunk's matches start before that, they
+// are dropped, and the search is repeated from there until it finds one of the
+// chunk's matches again, after which the rest of them are correct.
+static void resolve(matches *ms, worker *w, chunk *c, int from) {
+    int i = 0;
+    while (i < c->count && c->a[i].start < from) i++;
+    if (i == 0) return;
+    int count = 0, max = 0;
+    match *a = NULL;
+    for (int at = from; at < c->end && ! atomic_load(&ms->cancelled); ) {
+        match m = search(ms, w->view, w->r, at, c->end);
+        if (m.start < 0) break;
+        while (i < c->count && c->a[i].start < m.start) i++;
+        bool found = i < c->count && c->a[i].start == m.start;
+        if (found && c->a[i].length == m.length) {
+            for (; i < c->count; i++) add(&a, &count, &max, c->a[i]);
+            break;
+        }
+        add(&a, &count, &max, m);
+        at = after(w->view, m);
+    }
+    free(c->a);
+    c->a = a;
+    c->count = count;
+    c->max = max;
+}
+
+// Merge the matches of chunks which are done, in order, unless another worker
+// is already doing so, and notify the user of each batch.
+static void merge(matches *ms, worker *w) {
+    pthread_mutex_lock(&ms->lock);
+    if (ms->merging) {
+        pthread_mutex_unlock(&ms->lock);
+        return;
+    }
+    ms->merging = true;
+    while (ms->merged < ms->chunkCount && ms->chunks[ms->merged].done) {
+        if (atomic_load(&ms->cancelled)) break;
+        chunk *c = &ms->chunks[ms->merged];
+        pthread_mutex_unlock(&ms->lock);
+        resolve(ms, w, c, ms->resume);
+        int resume = ms->resume;
+        if (c->count > 0) resume = after(w->view, c->a[c->count - 1]);
+        pthread_mutex_lock(&ms->lock);
+        for (int i = 0; i < c->count; i++) {
+            add(&ms->a, &ms->count, &ms->max, c->a[i]);
+        }
+        free(c->a);
+        c->a = NULL;
+        ms->resume = resume;
+        ms->merged++;
+        if (c->count == 0 || ms->notify == NULL) continue;
+        pthread_mutex_unlock(&ms->lock);
+        ms->notify();
+        pthread_mutex_lock(&ms->lock);
+    }
+    ms->merging = false;
+    pthread_mutex_unlock(&ms->lock);
+}
+
+// Claim and scan chunks until there are none left or the search is cancelled.
+static void *work(void *arg) {
+    worker *w = arg;
+    matches *ms = w->ms;
+    while (! atomic_load(&ms->cancelled)) {
+        pthread_mutex_lock(&ms->lock);
+        int k = (ms->next < ms->chunkCount) ? ms->next++ : -1;
+        pthread_mutex_unlock(&ms->lock);
+        if (k < 0) break;
+        scan(ms, w, &ms->chunks[k]);
+        pthread_mutex_lock(&ms->lock);
+        ms->chunks[k].done = true;
+        pthread_mutex_unlock(&ms->lock);
+        merge(ms, w);
+    }
+    pthread_mutex_lock(&ms->lock);
+    bool last = --ms->live == 0;
+    pthread_mutex_unlock(&ms->lock);
+    if (last && ms->notify != NULL) ms->notify();
+    return NULL;
+}
+
+// Find the number of workers to use, one per processor.
+static int processors() {
+    int n = threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    if (n == 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1) n = 1;
+    if (n > WORKERS) n = WORKERS;
+    return n;
+}
+
+// Divide the text into chunks, starting each at a code point. The last chunk
+// includes the end of the text, where an empty match may be found.
+static void divide(matches *ms, text *t) {
+    int length = ms->length;
+    ms->chunkCount = length / chunkSize + 1;
+    ms->chunks = malloc(ms->chunkCount * sizeof(chunk));
+    for (int i = 0; i < ms->chunkCount; i++) {
+        int start = (i == 0) ? 0 : align(t, i * chunkSize);
+        ms->chunks[i] = (chunk) {
+            .start=start, .end=length + 1, .done=false, .count=0, .max=0,
+            .a=NULL
+        };
+        if (i > 0) ms->chunks[i - 1].end = start;
+    }
+}
+
+// Take a snapshot of the text and start the workers. If no threads can be
+// created, search synchronously.
+static void begin(matches *ms, text *t) {
+    ms->s = snapText(t);
+    ms->length = lengthText(t);
+    ms->next = ms->merged = ms->resume = 0;
+    ms->merging = false;
+    ms->count = 0;
+    ms->changeStart = ms->changeEnd = -1;
+    ms->changeLength = ms->length;
+    atomic_store(&ms->cancelled, false);
+    divide(ms, t);
+    int n = processors();
+    if (n > ms->chunkCount) n = ms->chunkCount;
+    ms->workerCount = n;
+    ms->live = n;
+    ms->workers = malloc(n * sizeof(worker));
+    for (int i = 0; i < n; i++) {
+        worker *w = &ms->workers[i];
+        *w = (worker) {
+            .ms=ms, .started=false, .view=viewSnapshot(ms->s),
+            .r=(ms->f == NULL) ? copyRegex(ms->r) : NULL
+        };
+    }
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        worker *w = &ms->workers[i];
+        w->started = pthread_create(&w->thread, NULL, work, w) == 0;
+        if (w->started) started++;
+    }
+    pthread_mutex_lock(&ms->lock);
+    ms->live -= n - started;
+    pthread_mutex_unlock(&ms->lock);
+    if (started == 0) {
+        ms->live = 1;
+        work(&ms->workers[0]);
+    }
+}
+
+// Wait for the workers to stop, and free them and the snapshot.
+static void release(matches *ms) {
+    for (int i = 0; i < ms->workerCount; i++) {
+        worker *w = &ms->workers[i];
+        if (w->started) pthread_join(w->thread, NULL);
+        freeText(w->view);
+        if (w->r != NULL) freeRegex(w->r);
+    }
+    for (int i = 0; i < ms->chunkCount; i++) free(ms->chunks[i].a);
+    free(ms->chunks);
+    free(ms->workers);
+    freeSnapshot(ms->s);
+    ms->s = NULL;
+}
+
+static void repair(matches *ms, text *t, int from, int to);
+
+// Check whether the search has finished, and if so release the workers and
+// repair the index for any edits made during it. Return false if a search is
+// still running, which it may be again after a repair.
+static bool settle(matches *ms) {
+    if (ms->s == NULL) return true;
+    pthread_mutex_lock(&ms->lock);
+    bool done = ms->live == 0;
+    pthread_mutex_unlock(&ms->lock);
+    if (! done) return false;
+    release(ms);
+    if (ms->changeStart >= 0) repair(ms, ms->t, ms->changeStart, ms->changeEnd);
+    return ms->s == NULL;
+}
+
+// While a search is running, widen the range changed since its snapshot to
+// cover a new change from position from to position to, in a text of the given
+// length, rather than restarting the search.
+static void note(matches *ms, int from, int to, int length) {
+    int delta = length - ms->changeLength, end = to - delta;
+    if (ms->changeStart >= 0) {
+        int a = ms->changeStart, b = ms->changeEnd;
+        a = (a < from) ? a : (a >= end) ? a + delta : from;
+        b = (b <= from) ? b : (b >= end) ? b + delta : to;
+        if (a < from) from = a;
+        if (b > to) to = b;
+    }
+    ms->changeStart = from;
+    ms->changeEnd = to;
+    ms->changeLength = length;
+}
+
+matches *startMatches(text *t, finder *f, regex *r, void (*notify)(void)) {
+    matches *ms = malloc(sizeof(matches));
+    *ms = (matches) {
+        .t=t, .f=f, .r=r, .notify=notify, .s=NULL, .a=NULL, .count=0, .max=0
+    };
+    atomic_init(&ms->cancelled, false);
+    pthread_mutex_init(&ms->lock, NULL);
+    begin(ms, t);
+    return ms;
+}
+
+void cancelMatches(matches *ms) {
+    atomic_store(&ms->cancelled, true);
+}
+
+void freeMatches(matches *ms) {
+    cancelMatches(ms);
+    if (ms->s != NULL) release(ms);
+    free(ms->a);
+    pthread_mutex_destroy(&ms->lock);
+    free(ms);
+}
+
+int countFound(matches *ms, bool *done) {
+    bool finished = settle(ms);
+    pthread_mutex_lock(&ms->lock);
+    int count = ms->count;
+    pthread_mutex_unlock(&ms->lock);
+    if (done != NULL) *done = finished;
+    return count;
+}
+
+void getMatches(matches *ms, int i, int n, match out[n]) {
+    pthread_mutex_lock(&ms->lock);
+    assert(i >= 0 && i + n <= ms->count);
+    if (n > 0) memcpy(out, &ms->a[i], n * sizeof(match));
+    pthread_mutex_unlock(&ms->lock);
+}
+
+// Do a binary search, with the lock held.
+static int first(matches *ms, int at) {
+    int lo = 0, hi = ms->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ms->a[mid].start < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int firstMatch(matches *ms, int at) {
+    pthread_mutex_lock(&ms->lock);
+    int i = first(ms, at);
+    pthread_mutex_unlock(&ms->lock);
+    return i;
+}
+
+void selectMatches(matches *ms, text *t) {
+    pthread_mutex_lock(&ms->lock);
+    int n = ms->count;
+    int (*ranges)[2] = malloc((n + 1) * sizeof(int[2]));
+    for (int i = 0; i < n; i++) {
+        ranges[i][0] = ms->a[i].start;
+        ranges[i][1] = ms->a[i].start + ms->a[i].length;
+    }
+    pthread_mutex_unlock(&ms->lock);
+    selectText(t, n, ranges);
+    free(ranges);
+}
+
+// Find the start of the line containing a position.
+static int lineStart(text *t, int at) {
+    while (at > 0) {
+        span sp = spanBefore(t, at);
+        for (int i = sp.n - 1; i >= 0; i--) {
+            if (sp.s[i] == '\n') return at - sp.n + i + 1;
+        }
+        at = at - sp.n;
+    }
+    return 0;
+}
+
+// Find the position before which matches can't have been affected by a change
+// at a given position. For a literal, the byte after a match matters, for
+// whole-word matching. For a regex, a match can't cross a line boundary unless
+// it can contain a newline.
+static int unaffected(matches *ms, text *t, int at) {
+    if (ms->f != NULL) return at - lengthFinder(ms->f);
+    if (! multilineRegex(ms->r)) return lineStart(t, at);
+    return 0;
+}
+
+// Find the end of a match in the index which straddles a position, i.e. starts
+// before it and ends after it, or return -1 if there is none. If there is
+// none, a search from the position finds the matches in the index after it.
+static int straddles(matches *ms, int at) {
+    int k = first(ms, at);
+    if (k == 0) return -1;
+    match m = ms->a[k - 1];
+    int end = m.start + (m.length > 0 ? m.length : 1);
+    return (end > at) ? end : -1;
+}
+
+// Keep the matches before the changed range, from position from to position
+// to, and search from the end of the last of them. Beyond the range, a match
+// only depends on the text from the byte before it onwards, which is
+// unchanged. So once the search reaches a point after the range which no old
+// match straddles, the rest of the index is correct, shifted by the change in
+// length, and the search stops. Until then, it only looks for matches which
+// start in the range or the straddling match, so sparse matches don't make it
+// run on to the end of the text. Then splice in the new matches. A regex which
+// can cross lines may have matches before the range which depend on it, so
+// the search is started again in the background instead.
+static void repair(matches *ms, text *t, int from, int to) {
+    if (ms->f == NULL && multilineRegex(ms->r)) { begin(ms, t); return; }
+    int length = lengthText(t), delta = length - ms->length;
+    int i = first(ms, unaffected(ms, t, from));
+    int j = ms->count, count = 0, max = 0;
+    match *a = NULL;
+    for (int at = (i > 0) ? after(t, ms->a[i - 1]) : 0; at <= length; ) {
+        int limit = to + 1;
+        if (at > to) {
+            int end = straddles(ms, at - delta);
+            if (end < 0) { j = first(ms, at - delta); break; }
+            limit = end + delta;
+        }
+        match m = search(ms, t, ms->r, at, limit);
+        if (m.start < 0) { at = align(t, limit); continue; }
+        add(&a, &count, &max, m);
+        at = after(t, m);
+    }
+    int rest = ms->count - j, total = i + count + rest;
+    if (total > ms->max) {
+        ms->max = total;
+        ms->a = realloc(ms->a, ms->max * sizeof(match));
+    }
+    memmove(&ms->a[i + count], &ms->a[j], rest * sizeof(match));
+    for (int k = i + count; k < total; k++) ms->a[k].start += delta;
+    if (count > 0) memcpy(&ms->a[i], a, count * sizeof(match));
+    ms->count = total;
+    ms->length = length;
+    free(a);
+}
+
+// Repair straight away if the search has finished, or else note the change.
+void repairMatches(matches *ms, text *t) {
+    int from = startChanged(t), to = endChanged(t);
+    if (from < 0) return;
+    if (settle(ms)) repair(ms, t, from, to);
+    else note(ms, from, to, lengthText(t));
+}
+
+bool refineMatches(matches *ms, text *t, finder *f) {
+    if (ms->f == NULL || ! extendsFinder(ms->f, f)) return false;
+    if (! settle(ms)) return false;
+    int n = 0, from = 0, length = lengthFinder(f);
+    for (int i = 0; i < ms->count; i++) {
+        int at = ms->a[i].start;
+        if (at < from || ! findAt(f, t, at)) continue;
+        ms->a[n++] = (match) { .start=at, .length=length };
+        from = at + length;
+    }
+    ms->count = n;
+    ms->f = f;
+    return true;
+}
+
+#ifdef matchesTest
+
+// The number of notifications received.
+static atomic_int notices;
+
+// The objects which go with the text being tested.
+static lines *ls;
+static cursors *cs;
+static history *h;
+
+// Make a text from the first n bytes of a string, with its own lines, cursors
+// and history.
+static text *makeText(int n, char *s) {
+    h = newHistory();
+    cs = newCursors(h);
+    ls = newLines();
+    text *t = newText(ls, cs, h);
+    loadText(t, n, s);
+    return t;
+}
+
+// Free a text made by makeText.
+static void dropText(text *t) {
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Count notifications.
+static void notice() {
+    atomic_fetch_add(&notices, 1);
+}
+
+// Wait for a search to finish.
+static void waitFor(matches *ms) {
+    bool done = false;
+    while (! done) {
+        countFound(ms, &done);
+        struct timespec pause = { .tv_sec=0, .tv_nsec=1000000 };
+        if (! done) nanosleep(&pause, NULL);
+    }
+}
+
+// Search sequentially for comparison, returning the number of matches.
+static int sequential(text *t, finder *f, regex *r, match *a) {
+    int count = 0, length = lengthText(t);
+    for (int at = 0; at <= length; ) {
+        match m;
+        if (f != NULL) {
+            m.start = findNext(f, t, at, length + 1);
+            m.length = lengthFinder(f);
+        }
+        else m.start = nextMatch(r, t, at, length + 1, &m.length);
+        if (m.start < 0) break;
+        a[count++] = m;
+        at = after(t, m);
+    }
+    return count;
+}
+
+// Check that a parallel search gives the same matches as a sequential one.
+static void check(text *t, finder *f, regex *r, int expected) {
+    int length = lengthText(t);
+    match *a = malloc((length + 1) * sizeof(match));
+    int count = sequential(t, f, r, a);
+    assert(count == expected);
+    atomic_store(&notices, 0);
+    matches *ms = startMatches(t, f, r, notice);
+    waitFor(ms);
+    assert(countFound(ms, NULL) == count);
+    assert(atomic_load(&notices) >= 1);
+    match *b = malloc((count + 1) * sizeof(match));
+    getMatches(ms, 0, count, b);
+    for (int i = 0; i < count; i++) {
+        assert(a[i].start == b[i].start && a[i].length == b[i].length);
+    }
+    free(b);
+    freeMatches(ms);
+    free(a);
+}
+
+// Make a text which has runs of the letter a, of varying lengths, which cross
+// chunk boundaries, and some two-byte characters which straddle them.
+static char *makeRuns(int n) {
+    char *s = malloc(n + 1);
+    srand(3);
+    for (int i = 0; i < n; ) {
+        int run = rand() % 300;
+        for (int j = 0; j < run && i < n; j++) s[i++] = 'a';
+        if (i < n) s[i++] = "b\n"[rand() % 2];
+        if (i + 1 < n && rand() % 2 == 0) {
+            s[i++] = '\xC3';
+            s[i++] = '\xA9';
+        }
+    }
+    s[n - 1] = '\n';
+    s[n] = '\0';
+    return s;
+}
+
+// Test searches which cross chunk boundaries, with overlapping matches which
+// need to be resolved when merging.
+static void testChunks() {
+    chunkSize = 1000;
+    threads = 4;
+    int n = 100000;
+    char *s = makeRuns(n);
+    text *t = makeText(n, s);
+    char x[] = "x";
+    insertText(t, n / 2, 1, x);
+    finder *f = newFinder(3, "aab", 0);
+    check(t, f, NULL, countMatches(f, t));
+    freeFinder(f);
+    char *patterns[] = { "a+b?", "(aa)+", "b|ab|c*", "\xC3\xA9*", "^a*$" };
+    int counts[5];
+    for (int i = 0; i < 5; i++) {
+        regex *r = newRegex(strlen(patterns[i]), patterns[i], NULL);
+        match *a = malloc((lengthText(t) + 1) * sizeof(match));
+        counts[i] = sequential(t, NULL, r, a);
+        free(a);
+        check(t, NULL, r, counts[i]);
+        freeRegex(r);
+    }
+    assert(counts[0] > 100 && counts[3] > 100);
+    dropText(t);
+    free(s);
+    chunkSize = CHUNK;
+    threads = 0;
+}
+
+// Test cancelling a search soon after it starts.
+static void testCancel() {
+    chunkSize = 100;
+    threads = 3;
+    int n = 200000;
+    char *s = makeRuns(n);
+    text *t = makeText(n, s);
+    regex *r = newRegex(2, "a+", NULL);
+    matches *ms = startMatches(t, NULL, r, NULL);
+    cancelMatches(ms);
+    waitFor(ms);
+    int count = countFound(ms, NULL);
+    match *a = malloc((count + 1) * sizeof(match));
+    getMatches(ms, 0, count, a);
+    for (int i = 1; i < count; i++) assert(a[i].start > a[i - 1].start);
+    free(a);
+    freeMatches(ms);
+    freeRegex(r);
+    dropText(t);
+    free(s);
+    chunkSize = CHUNK;
+    threads = 0;
+}
+
+// Check that the index holds the same matches as a sequential search.
+static void same(matches *ms, text *t, finder *f, regex *r) {
+    match *a = malloc((lengthText(t) + 1) * sizeof(match));
+    int count = sequential(t, f, r, a);
+    bool done;
+    assert(countFound(ms, &done) == count && done);
+    match *b = malloc((count + 1) * sizeof(match));
+    getMatches(ms, 0, count, b);
+    for (int i = 0; i < count; i++) {
+        assert(a[i].start == b[i].start && a[i].length == b[i].length);
+    }
+    free(b);
+    free(a);
+}
+
+// Make a random edit, inserting or deleting a few characters.
+static void change(text *t) {
+    int length = lengthText(t), at = rand() % (length + 1);
+    if (rand() % 2 == 0) {
+        char s[4];
+        int n = 1 + rand() % 4;
+        for (int i = 0; i < n; i++) s[i] = "ab \n"[rand() % 4];
+        insertText(t, at, n, s);
+    }
+    else {
+        int to = at + rand() % 6;
+        if (to > length) to = length;
+        deleteText(t, at, to);
+    }
+}
+
+// Test repairing the index after random edits, one or two at a time, for a
+// literal, a whole word, regexes which can and can't cross lines, and one with
+// empty matches. Start a search and edit the text before it finishes, too.
+static void testRepair() {
+    chunkSize = 500;
+    threads = 2;
+    int n = 5000;
+    char *s = malloc(n);
+    srand(5);
+    for (int i = 0; i < n; i++) s[i] = "aab \n"[rand() % 5];
+    text *t = makeText(n, s);
+    finder *fs[] = {
+        newFinder(2, "ab", 0), newFinder(2, "ab", WholeWord), NULL, NULL, NULL
+    };
+    char *patterns[] = { NULL, NULL, "^a+b", "b[ \n]+a", "b*" };
+    for (int p = 0; p < 5; p++) {
+        regex *r = NULL;
+        if (patterns[p] != NULL) {
+            r = newRegex(strlen(patterns[p]), patterns[p], NULL);
+        }
+        resetChanged(t);
+        matches *ms = startMatches(t, fs[p], r, NULL);
+        change(t);
+        repairMatches(ms, t);
+        resetChanged(t);
+        waitFor(ms);
+        same(ms, t, fs[p], r);
+        for (int i = 0; i < 200; i++) {
+            change(t);
+            if (i % 3 == 0) change(t);
+            repairMatches(ms, t);
+            resetChanged(t);
+            waitFor(ms);
+            same(ms, t, fs[p], r);
+        }
+        freeMatches(ms);
+        if (r != NULL) freeRegex(r);
+        if (fs[p] != NULL) freeFinder(fs[p]);
+    }
+    dropText(t);
+    free(s);
+    chunkSize = CHUNK;
+    threads = 0;
+}
+
+// Test editing a text while it is being searched, for a literal and a regex
+// with sparse matches, checking that the search isn't started again, and that
+// the index is repaired when it finishes.
+static void testDefer() {
+    chunkSize = 100;
+    threads = 1;
+    int n = 200000;
+    char *s = malloc(n);
+    srand(7);
+    for (int i = 0; i < n; i++) {
+        s[i] = (rand() % 1000 == 0) ? 'b' : "a \n"[i % 3];
+    }
+    text *t = makeText(n, s);
+    finder *f = newFinder(2, "ab", 0);
+    regex *r = newRegex(4, "a+ b", NULL);
+    for (int p = 0; p < 2; p++) {
+        finder *fp = (p == 0) ? f : NULL;
+        resetChanged(t);
+        matches *ms = startMatches(t, fp, r, NULL);
+        snapshot *before = ms->s;
+        for (int i = 0; i < 50; i++) {
+            change(t);
+            repairMatches(ms, t);
+            resetChanged(t);
+            assert(ms->s == before || ms->s == NULL);
+        }
+        waitFor(ms);
+        same(ms, t, fp, r);
+        for (int i = 0; i < 50; i++) {
+            change(t);
+            repairMatches(ms, t);
+            resetChanged(t);
+            same(ms, t, fp, r);
+        }
+        freeMatches(ms);
+    }
+    freeFinder(f);
+    freeRegex(r);
+    dropText(t);
+    free(s);
+    chunkSize = CHUNK;
+    threads = 0;
+}
+
+// Test refining a literal search as the pattern is typed.
+static void testRefine() {
+    chunkSize = 100;
+    threads = 2;
+    char s[] = "abcab abab abcd aaa aaaa abc";
+    int n = strlen(s);
+    text *t = makeText(n, s);
+    finder *f = newFinder(2, "ab", 0), *g = newFinder(3, "abc", 0);
+    matches *ms = startMatches(t, f, NULL, NULL);
+    waitFor(ms);
+    assert(countFound(ms, NULL) == 6);
+    assert(refineMatches(ms, t, g));
+    same(ms, t, g, NULL);
+    assert(countFound(ms, NULL) == 3);
+    freeMatches(ms);
+    finder *aa = newFinder(2, "aa", 0), *aaa = newFinder(3, "aaa", 0);
+    ms = startMatches(t, aa, NULL, NULL);
+    waitFor(ms);
+    assert(! refineMatches(ms, t, aaa));
+    same(ms, t, aa, NULL);
+    freeMatches(ms);
+    freeFinder(f);
+    freeFinder(g);
+    freeFinder(aa);
+    freeFinder(aaa);
+    dropText(t);
+    chunkSize = CHUNK;
+    threads = 0;
+}
+
+// Test selecting all the matches.
+static void testSelect() {
+    char s[] = "ab xab\nab\n\nxxab\n";
+    int n = strlen(s);
+    text *t = makeText(n, s);
+    finder *f = newFinder(2, "ab", 0);
+    matches *ms = startMatches(t, f, NULL, NULL);
+    waitFor(ms);
+    selectMatches(ms, t);
+    assert(nCursors(cs) == 4 && currentCursor(cs) == 0);
+    assert(cursorMarkRow(cs) == 0 && cursorMarkCol(cs) == 0);
+    assert(cursorBaseRow(cs) == 0 && cursorBaseCol(cs) == 2);
+    setCursor(cs, 3);
+    assert(cursorMarkRow(cs) == 3 && cursorMarkCol(cs) == 2);
+    assert(cursorBaseRow(cs) == 3 && cursorBaseCol(cs) == 4);
+    freeMatches(ms);
+    freeFinder(f);
+    dropText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testChunks();
+    testCancel();
+    testRepair();
+    testDefer();
+    testRefine();
+    testSelect();
+    printf("Matches module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,67 @@
+// Search results. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A matches object holds the matches of a search in a sorted index, which is
+// kept up to date as the text is edited, for search-as-you-type. The initial
+// search runs in the background on a snapshot of the text, which is divided
+// into chunks, scanned by a pool of worker threads, one per processor. A match
+// which starts in a chunk may extend beyond it, so no match is missed at chunk
+// boundaries. The results of chunks are merged in order, dropping matches which
+// overlap earlier ones, so matches become available from the start of the text
+// onwards, well before the search is finished. The search can be cancelled,
+// e.g. as soon as the user changes the query. After an edit, the index is
+// repaired by searching again only around the changed range. If the user
+// extends a literal pattern, the existing matches are filtered. All functions
+// are called on the editing thread.
+struct matches;
+typedef struct matches matches;
+typedef struct text text;
+typedef struct finder finder;
+typedef struct regex regex;
+
+// A match, as a position and a length in bytes.
+struct match { int start, length; };
+typedef struct match match;
+
+// Start searching the text for a literal pattern if f is not NULL, or else for
+// a regex, which is copied for each worker. The finder or regex must remain
+// valid until the matches object is freed, or the finder is replaced. If
+// notify is not NULL, it is called on a worker thread whenever more matches
+// become available, and when the search finishes, e.g. to post an event.
+matches *startMatches(text *t, finder *f, regex *r, void (*notify)(void));
+
+// Cancel the search, if it hasn't finished, without waiting for it to stop.
+void cancelMatches(matches *ms);
+
+// Cancel the search if necessary, wait for the workers to stop, and free the
+// matches object, but not the finder or regex.
+void freeMatches(matches *ms);
+
+// Find the number of matches available so far. If done is not NULL, set *done
+// to say whether the search has finished, or has stopped after being cancelled.
+int countFound(matches *ms, bool *done);
+
+// Copy n of the available matches, from index i onwards.
+void getMatches(matches *ms, int i, int n, match out[n]);
+
+// Find the index of the first available match starting at or after a given
+// position, e.g. to find the matches which are on screen.
+int firstMatch(matches *ms, int at);
+
+// Select all the matches found so far, replacing the cursors, e.g. for
+// select-all-occurrences. The index must be up to date with the text.
+void selectMatches(matches *ms, text *t);
+
+// Repair the index after one or more edits, using the range of text changed
+// since resetChanged was last called. Matches are found again from just before
+// the range to just after it, and the rest of the index is shifted. For a regex
+// which can cross lines, the search is started again in the background. If the
+// search hadn't finished, the change is noted and the index is repaired when
+// it does, so the text passed to startMatches must remain valid until then.
+void repairMatches(matches *ms, text *t);
+
+// Refine a finished literal search by filtering the existing matches for those
+// of a new finder, which the matches object uses from then on. Return false,
+// changing nothing, if that isn't possible, in which case a new search is
+// needed. See extendsFinder.
+bool refineMatches(matches *ms, text *t, finder *f);
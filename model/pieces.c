@@ -0,0 +1,672 @@
+// Piece table storage. Free and open source. See LICENSE.
+#include "pieces.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+// A piece is a range of bytes, either in the original or in the add buffer.
+struct piece { bool added; int start, length; };
+typedef struct piece piece;
+
+// The table of pieces is a B-tree, as for lines, so that finding the piece at a
+// position, and editing at any point, take logarithmic time however many pieces
+// cleaning the original or editing has produced. A leaf node holds up to MAX
+// pieces, and an internal node up to MAX children, and each node records the
+// number of pieces and bytes in its subtree. Nodes are shared between copies of
+// a table, with a count of references, and a shared node is copied before it
+// is changed, so a copy takes constant time and only the paths to later edits
+// are duplicated.
+enum { MAX = 64, FILL = MAX * 3 / 4 };
+
+typedef struct node node;
+typedef union entry { piece p; node *child; } entry;
+struct node { bool leaf; int n, count, bytes, refs; entry e[MAX]; };
+
+// The add buffer only ever grows, so that existing pieces remain valid. A
+// shared object is a view of another.
+struct pieces {
+    char const *original;
+    char *add;
+    int addLength, addMax;
+    node *root;
+    bool shared;
+};
+
+static node *newNode(bool leaf) {
+    node *x = malloc(sizeof(node));
+    x->leaf = leaf;
+    x->n = x->count = x->bytes = 0;
+    x->refs = 1;
+    return x;
+}
+
+// Drop a reference to a node, freeing it when there are none left.
+static void freeNode(node *x) {
+    if (--x->refs > 0) return;
+    if (! x->leaf) for (int i = 0; i < x->n; i++) freeNode(x->e[i].child);
+    free(x);
+}
+
+// Get a node which can be changed, copying it if it is shared.
+static node *own(node *x) {
+    if (x->refs == 1) return x;
+    node *y = malloc(sizeof(node));
+    *y = *x;
+    y->refs = 1;
+    if (! y->leaf) for (int i = 0; i < y->n; i++) y->e[i].child->refs++;
+    x->refs--;
+    return y;
+}
+
+// Recalculate the totals for a node from its entries.
+static void sum(node *x) {
+    x->count = x->bytes = 0;
+    for (int i = 0; i < x->n; i++) {
+        if (x->leaf) {
+            x->count++;
+            x->bytes += x->e[i].p.length;
+        }
+        else {
+            x->count += x->e[i].child->count;
+            x->bytes += x->e[i].child->bytes;
+        }
+    }
+}
+
+// Insert k entries into node x at index i. If x overflows, share the entries
+// evenly between x and as many new nodes as necessary, to the right of x.
+// Return the number of new nodes, with an allocated array of them in *pmore.
+static int put(node *x, int i, int k, entry es[k], node ***pmore) {
+    int total = x->n + k;
+    if (total <= MAX) {
+        memmove(&x->e[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+        memcpy(&x->e[i], es, k * sizeof(entry));
+        x->n = total;
+        sum(x);
+        return 0;
+    }
+    entry *all = malloc(total * sizeof(entry));
+    memcpy(all, x->e, i * sizeof(entry));
+    memcpy(&all[i], es, k * sizeof(entry));
+    memcpy(&all[i + k], &x->e[i], (x->n - i) * sizeof(entry));
+    int m = (total + FILL - 1) / FILL;
+    node **more = malloc((m - 1) * sizeof(node *));
+    int done = 0;
+    for (int j = 0; j < m; j++) {
+        node *y = (j == 0) ? x : newNode(x->leaf);
+        int size = total / m + (j < total % m ? 1 : 0);
+        memcpy(y->e, &all[done], size * sizeof(entry));
+        y->n = size;
+        sum(y);
+        done += size;
+        if (j > 0) more[j - 1] = y;
+    }
+    free(all);
+    *pmore = more;
+    return m - 1;
+}
+
+// Insert k pieces at index i in the subtree x, which can be changed. An
+// insertion at a boundary between children goes at the end of the left child.
+// Return the number of new nodes created to the right of x, as with put.
+static int insertAt(node *x, int i, int k, entry es[k], node ***pmore) {
+    if (x->leaf) return put(x, i, k, es, pmore);
+    int c = 0;
+    while (c < x->n - 1 && i > x->e[c].child->count) {
+        i -= x->e[c].child->count;
+        c++;
+    }
+    node *child = x->e[c].child = own(x->e[c].child);
+    node **more;
+    int m = insertAt(child, i, k, es, &more);
+    if (m == 0) { sum(x); return 0; }
+    entry *cs = malloc(m * sizeof(entry));
+    for (int j = 0; j < m; j++) cs[j].child = more[j];
+    free(more);
+    m = put(x, c + 1, m, cs, pmore);
+    free(cs);
+    return m;
+}
+
+// Insert k pieces at index i, growing the tree upwards if necessary.
+static void insertAll(pieces *ps, int i, int k, entry es[k]) {
+    if (k <= 0) return;
+    ps->root = own(ps->root);
+    node **more;
+    int m = insertAt(ps->root, i, k, es, &more);
+    while (m > 0) {
+        node *root = newNode(false);
+        entry *cs = malloc((m + 1) * sizeof(entry));
+        cs[0].child = ps->root;
+        for (int j = 0; j < m; j++) cs[j + 1].child = more[j];
+        free(more);
+        ps->root = root;
+        m = put(root, 0, m + 1, cs, &more);
+        free(cs);
+    }
+}
+
+// Merge child i+1 into child i of x.
+static void merge(node *x, int i) {
+    node *a = x->e[i].child = own(x->e[i].child);
+    node *b = own(x->e[i + 1].child);
+    memcpy(&a->e[a->n], b->e, b->n * sizeof(entry));
+    a->n += b->n;
+    sum(a);
+    free(b);
+    memmove(&x->e[i + 1], &x->e[i + 2], (x->n - i - 2) * sizeof(entry));
+    x->n--;
+}
+
+// Delete the pieces from index i1 up to (not including) i2 in the subtree x,
+// which can be changed. Children which are covered entirely are dropped without
+// being visited. Neighbouring children which have become small are merged.
+static void deleteAt(node *x, int i1, int i2) {
+    if (x->leaf) {
+        memmove(&x->e[i1], &x->e[i2], (x->n - i2) * sizeof(entry));
+        x->n -= i2 - i1;
+        sum(x);
+        return;
+    }
+    int j = 0, start = 0;
+    for (int i = 0; i < x->n; i++) {
+        node *c = x->e[i].child;
+        int count = c->count;
+        int lo = (i1 > start ? i1 : start) - start;
+        int hi = (i2 < start + count ? i2 : start + count) - start;
+        start += count;
+        if (lo <= 0 && hi >= count) { freeNode(c); continue; }
+        if (lo < hi) {
+            c = own(c);
+            deleteAt(c, lo, hi);
+        }
+        x->e[j++].child = c;
+    }
+    x->n = j;
+    for (int i = 0; i < x->n - 1; ) {
+        node *a = x->e[i].child, *b = x->e[i + 1].child;
+        bool small = a->n < MAX / 4 || b->n < MAX / 4;
+        if (small && a->n + b->n <= MAX) merge(x, i);
+        else i++;
+    }
+    sum(x);
+}
+
+// Delete the pieces from index i1 up to i2, shrinking the tree if necessary.
+static void deleteAll(pieces *ps, int i1, int i2) {
+    if (i1 >= i2) return;
+    ps->root = own(ps->root);
+    deleteAt(ps->root, i1, i2);
+    while (! ps->root->leaf && ps->root->n <= 1) {
+        node *root = ps->root;
+        if (root->n == 0) ps->root = newNode(true);
+        else ps->root = root->e[0].child;
+        free(root);
+    }
+}
+
+// Find the piece containing a position, returning NULL at the end of the text,
+// and setting *pindex to its index and *poffset to the offset within it.
+static piece *locate(pieces *ps, int at, int *pindex, int *poffset) {
+    node *x = ps->root;
+    int index = 0;
+    while (! x->leaf) {
+        int i = 0;
+        while (i < x->n - 1 && at >= x->e[i].child->bytes) {
+            at -= x->e[i].child->bytes;
+            index += x->e[i].child->count;
+            i++;
+        }
+        x = x->e[i].child;
+    }
+    int i = 0;
+    while (i < x->n && at >= x->e[i].p.length) {
+        at -= x->e[i].p.length;
+        i++;
+    }
+    *pindex = index + i;
+    *poffset = at;
+    return (i < x->n) ? &x->e[i].p : NULL;
+}
+
+// Find the piece at index i, where 0 <= i < #pieces, copying any shared nodes
+// on the path to it, and change its length, and the totals, by a given amount.
+static piece *change(pieces *ps, int i, int by) {
+    node *x = ps->root = own(ps->root);
+    while (! x->leaf) {
+        x->bytes += by;
+        int c = 0;
+        while (c < x->n - 1 && i >= x->e[c].child->count) {
+            i -= x->e[c].child->count;
+            c++;
+        }
+        x = x->e[c].child = own(x->e[c].child);
+    }
+    x->bytes += by;
+    x->e[i].p.length += by;
+    return &x->e[i].p;
+}
+
+// Append n bytes to the add buffer, returning their offset.
+static int addBytes(pieces *ps, int n, char const *s) {
+    if (ps->addLength + n > ps->addMax) {
+        while (ps->addLength + n > ps->addMax) ps->addMax = ps->addMax * 3 / 2;
+        ps->add = realloc(ps->add, ps->addMax);
+    }
+    int start = ps->addLength;
+    memcpy(&ps->add[start], s, n);
+    ps->addLength += n;
+    return start;
+}
+
+// Get the address of the bytes of a piece.
+static inline char const *bytes(pieces *ps, piece *p) {
+    return p->added ? &ps->add[p->start] : &ps->original[p->start];
+}
+
+// A list of pieces built from the original content, before being put into the
+// tree in bulk.
+struct list { entry *es; int count, max, total; };
+typedef struct list list;
+
+// Add a range of bytes on the end of the list, extending the last piece if the
+// range follows on from it.
+static void append(list *l, bool added, int start, int length) {
+    if (length == 0) return;
+    l->total += length;
+    if (l->count > 0) {
+        piece *p = &l->es[l->count - 1].p;
+        if (p->added == added && p->start + p->length == start) {
+            p->length += length;
+            return;
+        }
+    }
+    if (l->count >= l->max) {
+        l->max = l->max * 3 / 2;
+        l->es = realloc(l->es, l->max * sizeof(entry));
+    }
+    l->es[l->count++].p = (piece) {
+        .added=added, .start=start, .length=length
+    };
+}
+
+// Find the k'th last byte of the list, with k = 1 for the last byte.
+static char endByte(pieces *ps, list *l, int k) {
+    for (int i = l->count - 1; i >= 0; i--) {
+        piece *p = &l->es[i].p;
+        if (k <= p->length) return bytes(ps, p)[p->length - k];
+        k = k - p->length;
+    }
+    return '\0';
+}
+
+// Remove one byte from the end of the list.
+static void shrink(list *l) {
+    piece *p = &l->es[l->count - 1].p;
+    p->length--;
+    if (p->length == 0) l->count--;
+    l->total--;
+}
+
+// Remove trailing spaces from the end of the list.
+static void trim(pieces *ps, list *l) {
+    while (l->total > 0 && endByte(ps, l, 1) == ' ') shrink(l);
+}
+
+// Describe the original content in pieces, cleaning it in the same way as
+// loading a file into a gap buffer, but without copying it. Runs of ordinary
+// bytes become single pieces, and tabs or a final newline are added to the add
+// buffer. Deal with trailing spaces at each newline.
+static void clean(pieces *ps, int n, char const *s) {
+    list l = { .es=malloc(16 * sizeof(entry)), .count=0, .max=16, .total=0 };
+    int run = 0;
+    for (int i = 0; i < n; i++) {
+        char ch = s[i];
+        if (ch > '\r' || ch < '\0') continue;
+        if (ch == '\n') {
+            append(&l, false, run, i - run);
+            trim(ps, &l);
+            run = i;
+            continue;
+        }
+        if (ch == '\t') {
+            append(&l, false, run, i - run);
+            append(&l, true, addBytes(ps, 1, " "), 1);
+            run = i + 1;
+        }
+        else if ('\0' <= ch && ch <= '\7') {
+            append(&l, false, run, i - run);
+            run = i + 1;
+        }
+        else if (ch == '\r') {
+            append(&l, false, run, i - run);
+            run = i + 1;
+        }
+    }
+    append(&l, false, run, n - run);
+    trim(ps, &l);
+    if (l.total > 0 && endByte(ps, &l, 1) != '\n') {
+        append(&l, true, addBytes(ps, 1, "\n"), 1);
+    }
+    while (l.total > 1 && endByte(ps, &l, 2) == '\n') shrink(&l);
+    insertAll(ps, 0, l.count, l.es);
+    free(l.es);
+}
+
+// Create an empty pieces object.
+static pieces *newEmpty(char const *original) {
+    pieces *ps = malloc(sizeof(pieces));
+    *ps = (pieces) {
+        .original=original, .add=malloc(1024), .addLength=0, .addMax=1024,
+        .root=newNode(true), .shared=false
+    };
+    return ps;
+}
+
+pieces *newPieces(int n, char const *original) {
+    pieces *ps = newEmpty(original);
+    clean(ps, n, original);
+    return ps;
+}
+
+pieces *wrapPieces(char const *original, int lo, int hi, int end) {
+    pieces *ps = newEmpty(original);
+    entry es[2];
+    int n = 0;
+    if (lo > 0) es[n++].p = (piece) { .added=false, .start=0, .length=lo };
+    if (hi < end) {
+        es[n++].p = (piece) { .added=false, .start=hi, .length=end - hi };
+    }
+    insertAll(ps, 0, n, es);
+    return ps;
+}
+
+pieces *copyPieces(pieces *ps) {
+    pieces *copy = malloc(sizeof(pieces));
+    *copy = *ps;
+    copy->shared = false;
+    copy->addMax = (ps->addLength > 0) ? ps->addLength : 1;
+    copy->add = malloc(copy->addMax);
+    memcpy(copy->add, ps->add, ps->addLength);
+    ps->root->refs++;
+    return copy;
+}
+
+pieces *sharePieces(pieces *ps) {
+    pieces *view = malloc(sizeof(pieces));
+    *view = *ps;
+    view->shared = true;
+    return view;
+}
+
+void freePieces(pieces *ps) {
+    if (ps->shared) { free(ps); return; }
+    free(ps->add);
+    freeNode(ps->root);
+    free(ps);
+}
+
+int lengthPieces(pieces *ps) {
+    return ps->root->bytes;
+}
+
+// Make sure there is a piece boundary at the given position, and return the
+// index of the piece starting there.
+static int split(pieces *ps, int at) {
+    int i, offset;
+    piece *p = locate(ps, at, &i, &offset);
+    if (offset == 0) return i;
+    piece rest = {
+        .added=p->added, .start=p->start + offset, .length=p->length - offset
+    };
+    change(ps, i, offset - p->length);
+    insertAll(ps, i + 1, 1, (entry[]) { { .p=rest } });
+    return i + 1;
+}
+
+// If the insertion follows directly on from the previous piece in both the text
+// and the add buffer, as when typing, extend that piece.
+void insertPieces(pieces *ps, int at, int n, char const s[n]) {
+    if (n <= 0) return;
+    int start = addBytes(ps, n, s);
+    int i = split(ps, at);
+    if (i > 0) {
+        int j, offset;
+        piece *p = locate(ps, at - 1, &j, &offset);
+        if (p->added && p->start + p->length == start) {
+            change(ps, i - 1, n);
+            return;
+        }
+    }
+    piece p = { .added=true, .start=start, .length=n };
+    insertAll(ps, i, 1, (entry[]) { { .p=p } });
+}
+
+void deletePieces(pieces *ps, int from, int to) {
+    if (to <= from) return;
+    int i = split(ps, from);
+    int j = split(ps, to);
+    deleteAll(ps, i, j);
+}
+
+char const *spanPieces(pieces *ps, int at, int n, int *plength) {
+    int i, offset;
+    piece *p = locate(ps, at, &i, &offset);
+    if (p == NULL || n <= 0) { *plength = 0; return ps->add; }
+    int length = p->length - offset;
+    *plength = (length < n) ? length : n;
+    return bytes(ps, p) + offset;
+}
+
+char const *backPieces(pieces *ps, int at, int n, int *plength) {
+    if (at <= 0 || n <= 0) { *plength = 0; return ps->add; }
+    int i, offset;
+    piece *p = locate(ps, at - 1, &i, &offset);
+    offset++;
+    *plength = (offset < n) ? offset : n;
+    return bytes(ps, p) + offset - *plength;
+}
+
+int originPieces(pieces *ps, int at, int n) {
+    int i, offset;
+    piece *p = locate(ps, at, &i, &offset);
+    if (p == NULL || n <= 0) return -1;
+    if (p->added || offset + n > p->length) return -1;
+    return p->start + offset;
+}
+
+void getPieces(pieces *ps, int at, int n, char *s) {
+    while (n > 0) {
+        int length;
+        char const *span = spanPieces(ps, at, n, &length);
+        if (length == 0) return;
+        memcpy(s, span, length);
+        s += length;
+        at += length;
+        n -= length;
+    }
+}
+
+#ifdef piecesTest
+
+// Check the text held in a pieces object.
+static bool check(pieces *ps, char *s) {
+    int n = strlen(s);
+    if (lengthPieces(ps) != n) return false;
+    char out[n + 1];
+    getPieces(ps, 0, n, out);
+    out[n] = '\0';
+    return strcmp(out, s) == 0;
+}
+
+// Test that the original content is cleaned without being copied.
+static void testClean() {
+    char *s = "ab\tc  \r\nd\7\n  \n\n\nef";
+    pieces *ps = newPieces(strlen(s), s);
+    assert(check(ps, "ab c\nd\n\n\n\nef\n"));
+    assert(ps->addLength == 2);
+    freePieces(ps);
+    s = "x\n\n\n";
+    ps = newPieces(strlen(s), s);
+    assert(check(ps, "x\n"));
+    assert(ps->root->count == 1 && ps->addLength == 0);
+    freePieces(ps);
+    ps = newPieces(0, "");
+    assert(check(ps, ""));
+    freePieces(ps);
+}
+
+// Test insertions and deletions, including consecutive typing.
+static void testEdits() {
+    char *s = "abc\ndef\n";
+    pieces *ps = newPieces(strlen(s), s);
+    insertPieces(ps, 2, 1, "x");
+    insertPieces(ps, 3, 1, "y");
+    assert(check(ps, "abxyc\ndef\n"));
+    assert(ps->root->count == 3);
+    deletePieces(ps, 1, 7);
+    assert(check(ps, "aef\n"));
+    insertPieces(ps, 0, 2, "zz");
+    assert(check(ps, "zzaef\n"));
+    int length;
+    char const *span = spanPieces(ps, 3, 10, &length);
+    assert(length == 3 && strncmp(span, "ef\n", 3) == 0);
+    span = spanPieces(ps, 0, 10, &length);
+    assert(length == 2 && strncmp(span, "zz", 2) == 0);
+    span = backPieces(ps, 5, 10, &length);
+    assert(length == 2 && strncmp(span, "ef", 2) == 0);
+    span = backPieces(ps, 2, 1, &length);
+    assert(length == 1 && span[0] == 'z');
+    assert(originPieces(ps, 3, 2) == 5 && originPieces(ps, 1, 2) == -1);
+    assert(originPieces(ps, 3, 4) == -1);
+    pieces *view = sharePieces(ps);
+    span = spanPieces(view, 3, 10, &length);
+    assert(length == 3 && strncmp(span, "ef\n", 3) == 0);
+    freePieces(view);
+    pieces *copy = copyPieces(ps);
+    deletePieces(ps, 0, 6);
+    assert(check(ps, ""));
+    assert(check(copy, "zzaef\n"));
+    freePieces(copy);
+    insertPieces(ps, 0, 4, "new\n");
+    assert(check(ps, "new\n"));
+    freePieces(ps);
+}
+
+// Compare random edits against a plain array.
+static void testRandom() {
+    char *s = "0123456789\n0123456789\n0123456789\n";
+    int n = strlen(s);
+    char plain[1000];
+    strcpy(plain, s);
+    pieces *ps = newPieces(n, s);
+    srand(42);
+    for (int k = 0; k < 500; k++) {
+        int at = rand() % (n + 1);
+        if (rand() % 2 == 0 && n < 900) {
+            char c[2] = { 'a' + k % 26, '\0' };
+            memmove(&plain[at + 1], &plain[at], n - at + 1);
+            plain[at] = c[0];
+            insertPieces(ps, at, 1, c);
+            n++;
+        }
+        else {
+            int to = at + rand() % 5;
+            if (to > n) to = n;
+            memmove(&plain[at], &plain[to], n - to + 1);
+            deletePieces(ps, at, to);
+            n -= to - at;
+        }
+        assert(check(ps, plain));
+    }
+    freePieces(ps);
+}
+
+// Test a text whose cleaning produces many pieces, one per CRLF line, so that
+// the tree has several levels, and compare edits on it and on copies of it
+// against plain arrays. The copies share nodes, which must not be changed.
+static void testMany() {
+    int lines = 5000, n = 0;
+    char *s = malloc(lines * 4 + 1);
+    for (int i = 0; i < lines; i++) {
+        s[n++] = 'a' + i % 26;
+        s[n++] = 'b';
+        s[n++] = '\r';
+        s[n++] = '\n';
+    }
+    s[n] = '\0';
+    pieces *ps = newPieces(n, s);
+    char *plain = malloc(4 * n), *old = malloc(4 * n);
+    int length = 0;
+    for (int i = 0; i < lines; i++) {
+        plain[length++] = 'a' + i % 26;
+        plain[length++] = 'b';
+        plain[length++] = '\n';
+    }
+    plain[length] = '\0';
+    assert(ps->root->count == lines + 1 && ! ps->root->leaf);
+    assert(check(ps, plain));
+    srand(7);
+    pieces *copy = NULL;
+    for (int k = 0; k < 2000; k++) {
+        if (k % 500 == 0) {
+            if (copy != NULL) {
+                assert(check(copy, old));
+                freePieces(copy);
+            }
+            copy = copyPieces(ps);
+            strcpy(old, plain);
+        }
+        int at = rand() % (length + 1);
+        if (rand() % 2 == 0) {
+            char c[2] = { 'A' + k % 26, '\0' };
+            memmove(&plain[at + 1], &plain[at], length - at + 1);
+            plain[at] = c[0];
+            insertPieces(ps, at, 1, c);
+            length++;
+        }
+        else {
+            int to = at + rand() % 2000;
+            if (to > length) to = length;
+            memmove(&plain[at], &plain[to], length - to + 1);
+            deletePieces(ps, at, to);
+            length -= to - at;
+        }
+        assert(check(ps, plain));
+    }
+    assert(check(copy, old));
+    freePieces(copy);
+    freePieces(ps);
+    free(plain);
+    free(old);
+    free(s);
+}
+
+// Test that a gap buffer can be described by pieces without being copied.
+static void testWrap() {
+    char data[] = "abc\n.....def\n";
+    pieces *ps = wrapPieces(data, 4, 9, 13);
+    assert(check(ps, "abc\ndef\n") && ps->addLength == 0);
+    insertPieces(ps, 4, 2, "xy");
+    assert(check(ps, "abc\nxydef\n"));
+    assert(strcmp(data, "abc\n.....def\n") == 0);
+    freePieces(ps);
+    ps = wrapPieces(data, 0, 13, 13);
+    assert(check(ps, "") && ps->root->count == 0);
+    freePieces(ps);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testClean();
+    testEdits();
+    testRandom();
+    testMany();
+    testWrap();
+    printf("Pieces module OK\n");
+    return 0;
+}
+
+#endif
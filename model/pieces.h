@@ -0,0 +1,67 @@
+// Piece table storage. Free and open source. See LICENSE.
+
+// A pieces object is an alternative to a gap buffer for storing the bytes of a
+// text, intended for very large files. The original content is held in a
+// read-only array, typically a memory-mapped file, which is never copied or
+// modified. Inserted bytes are appended to an add buffer, and the text is
+// described by a table of pieces, each of which refers to a range of bytes in
+// the original or the add buffer. Cleaning the original takes a piece for each
+// carriage return, tab, control byte or trimmed trailer, as well as edits, so
+// the table is a tree, in which finding a position or editing takes
+// logarithmic time in the number of pieces.
+struct pieces;
+typedef struct pieces pieces;
+
+// Create a pieces object from n bytes of original UTF-8 valid content, which
+// must stay valid until the object is freed. The content is cleaned as for a
+// newly loaded file, by describing it with pieces rather than by copying it, so
+// carriage returns, '\0' to '\7', and trailers are skipped, tabs become spaces,
+// and a final newline is added if necessary.
+pieces *newPieces(int n, char const *original);
+
+// Create a pieces object describing content which is already clean, held in a
+// buffer with a gap from lo to hi, e.g. a gap buffer handed over when the text
+// is snapshotted. The buffer is not copied, and must stay valid until the
+// object and any copies are freed.
+pieces *wrapPieces(char const *original, int lo, int hi, int end);
+
+// Make an independent copy of a pieces object, sharing the original content,
+// and the nodes of the table until one or the other is changed, but with its
+// own copy of the bytes in the add buffer, e.g. so that another thread can read
+// it while the original continues to be edited. Copying, editing and freeing
+// must all be done on one thread, since shared nodes are counted without locks.
+pieces *copyPieces(pieces *ps);
+
+// Make a read-only view of a pieces object, sharing its table and buffers but
+// with its own cache, so that several threads can read the same pieces at
+// once, provided that it isn't changed. Freeing a view frees only the view.
+pieces *sharePieces(pieces *ps);
+
+// Free a pieces object, but not the original content.
+void freePieces(pieces *ps);
+
+// Return the number of bytes in the text.
+int lengthPieces(pieces *ps);
+
+// Insert string s of length n at a given position.
+void insertPieces(pieces *ps, int at, int n, char const s[n]);
+
+// Delete the bytes between two positions, with from <= to.
+void deletePieces(pieces *ps, int from, int to);
+
+// Find up to n bytes of text at a given position without copying them. Return
+// a pointer to the bytes, and set *plength to the number which are contiguous.
+char const *spanPieces(pieces *ps, int at, int n, int *plength);
+
+// Find up to n bytes of text ending at a given position without copying them.
+// Return a pointer to the first of the bytes which are contiguous, and set
+// *plength to the number of them.
+char const *backPieces(pieces *ps, int at, int n, int *plength);
+
+// Check whether n bytes of text at a given position are a contiguous run of
+// the original content, and if so return their offset in it, or else -1, e.g.
+// so that a deletion can refer to the original instead of copying the bytes.
+int originPieces(pieces *ps, int at, int n);
+
+// Copy n bytes of text at a given position into s.
+void getPieces(pieces *ps, int at, int n, char *s);
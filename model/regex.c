@@ -0,0 +1,1096 @@
+// Regular expression search. Free and open source. See LICENSE.
+#include "text.h"
+#include "regex.h"
+#include "unicode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// A pattern is parsed into a tree of nodes, and the tree is compiled into two
+// programs, one for scanning forwards, and one for scanning backwards with
+// sequences reversed and the line anchors swapped. A forward scan finds where
+// the leftmost-longest match ends, and a backward scan from there finds where
+// it starts. Each program is run as a lazily built DFA. Code points are
+// divided into classes, where the code points in a class are not distinguished
+// by any part of the pattern, so each DFA state has one move per class.
+
+// The number of general categories, and the default cache budget in bytes.
+enum { CATEGORIES = Zs + 1, BUDGET = 1024 * 1024 };
+
+// A set of code points, given as ranges and a bit mask of general categories,
+// or the complement of such a set.
+struct set { bool negate; unsigned categories; int count, max; int *ranges; };
+typedef struct set set;
+
+// A node of the tree is the empty string, a code point from a set, the start or
+// end of a line, a concatenation or alternation, or a repetition. Children are
+// indexes into the array of nodes.
+enum {
+    Empty, Chars, LineStart, LineEnd, Concat, Alternate, Star, Plus, Optional
+};
+struct node { int kind, set, left, right; };
+typedef struct node node;
+
+// An instruction takes a code point in a set, jumps, splits into two threads,
+// checks for the start or end of a line, or reports a match.
+enum { Take, Jump, Split, AtStart, AtEnd, Matched };
+struct inst { int op, x, y; };
+typedef struct inst inst;
+
+// A DFA state is an ordered list of instructions, one per thread, divided into
+// groups by -1 markers, with threads which started earlier in earlier groups.
+// The state records whether the start of a line was allowed when it was made,
+// whether it is done (no more threads are started because a match has been
+// seen, or the scan is anchored), whether it is a match, or a match at the end
+// of a line, and whether it is dead.
+struct state {
+    int at, n;
+    unsigned hash;
+    bool bol, done, match, matchEol, dead;
+};
+typedef struct state state;
+
+// A DFA has a program, and a cache of states, with their lists in a pool and
+// their moves in a table indexed by state and class (-1 if not yet known), plus
+// a hash table of state indexes. The membership table of sets and classes is
+// shared with the regex. There are work arrays for making states, and
+// generation numbers to mark instructions already seen in a list.
+struct dfa {
+    inst *program;
+    int n, max, start;
+    int classes, newline, budget;
+    bool *member;
+    state *states;
+    int count, stateMax;
+    int *pool, used, poolMax;
+    int *moves;
+    int *table, size;
+    int *list, *cur, *extra, *stack, *seen, gen;
+};
+typedef struct dfa dfa;
+
+// A regex has its pattern, its sets and tree, and its classes of code points.
+// ASCII code points are classified by table. Others are classified by category,
+// within each interval between the bounds of the non-ASCII ranges in the sets.
+struct regex {
+    char *pattern;
+    int length;
+    set *sets;
+    int setCount, setMax;
+    node *nodes;
+    int nodeCount, nodeMax, root;
+    int classes, newline, ascii[128];
+    int boundCount, *bounds, *wide;
+    bool *member;
+    dfa forward, backward;
+};
+
+// ---------- Parsing ----------------------------------------------------------
+
+// The state of parsing a pattern, which has padding after it, and the first
+// error found.
+struct parser { regex *r; char const *s; int n, i; char const *error; };
+typedef struct parser parser;
+
+// Names of the categories, in the order of the category enumeration.
+static char const *names =
+    "CcCfCnCoCsLlLmLoLtLuMcMeMnNdNlNoPcPdPePfPiPoPsScSkSmSoZlZpZs";
+
+// Add a node to the tree, and return its index.
+static int addNode(regex *r, int kind, int set, int left, int right) {
+    if (r->nodeCount >= r->nodeMax) {
+        r->nodeMax = r->nodeMax * 3 / 2;
+        r->nodes = realloc(r->nodes, r->nodeMax * sizeof(node));
+    }
+    r->nodes[r->nodeCount] = (node) {
+        .kind=kind, .set=set, .left=left, .right=right
+    };
+    return r->nodeCount++;
+}
+
+// Add an empty set, and return its index.
+static int addSet(regex *r) {
+    if (r->setCount >= r->setMax) {
+        r->setMax = r->setMax * 3 / 2;
+        r->sets = realloc(r->sets, r->setMax * sizeof(set));
+    }
+    r->sets[r->setCount] = (set) {
+        .negate=false, .categories=0, .count=0, .max=4,
+        .ranges=malloc(4 * 2 * sizeof(int))
+    };
+    return r->setCount++;
+}
+
+// Add a range of code points to a set.
+static void addRange(set *s, int lo, int hi) {
+    if (s->count >= s->max) {
+        s->max = s->max * 3 / 2;
+        s->ranges = realloc(s->ranges, s->max * 2 * sizeof(int));
+    }
+    s->ranges[2 * s->count] = lo;
+    s->ranges[2 * s->count + 1] = hi;
+    s->count++;
+}
+
+// Check whether a code point with a given category is in a set.
+static bool inSet(set *s, int code, int category) {
+    bool in = ((s->categories >> category) & 1) != 0;
+    for (int i = 0; i < s->count && ! in; i++) {
+        in = s->ranges[2 * i] <= code && code <= s->ranges[2 * i + 1];
+    }
+    return in != s->negate;
+}
+
+// Read a literal code point from the pattern.
+static int readCode(parser *p) {
+    codePoint cp = getCode(&p->s[p->i]);
+    p->i += cp.length;
+    if (p->i > p->n) p->i = p->n;
+    return cp.code;
+}
+
+// Check whether a character after a backslash stands for a class.
+static bool classEscape(char ch) {
+    return ch != '\0' && strchr("dDwWsSpP", ch) != NULL;
+}
+
+// Read the code point given by an escape which isn't a class, after the
+// backslash.
+static int escapedCode(parser *p) {
+    char ch = p->s[p->i];
+    if (ch == 'n') { p->i++; return '\n'; }
+    if (ch == 't') { p->i++; return '\t'; }
+    if (ch == 'r') { p->i++; return '\r'; }
+    return readCode(p);
+}
+
+// Parse a category name such as L or Lu after \p or \P, with braces needed for
+// a two letter name, and return a mask of the categories it covers.
+static unsigned parseCategory(parser *p) {
+    bool brace = p->s[p->i] == '{';
+    if (brace) p->i++;
+    char name[3] = "";
+    int length = 0;
+    while (p->i < p->n && length < (brace ? 2 : 1)) {
+        char ch = p->s[p->i];
+        if (! (('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z'))) break;
+        name[length++] = ch;
+        p->i++;
+    }
+    if (brace && p->s[p->i] == '}') p->i++;
+    else if (brace) length = 0;
+    unsigned mask = 0;
+    for (int c = 0; c < CATEGORIES && length > 0; c++) {
+        if (names[2 * c] != name[0]) continue;
+        if (length == 1 || names[2 * c + 1] == name[1]) mask |= 1u << c;
+    }
+    if (mask == 0) p->error = "unknown category";
+    return mask;
+}
+
+// Add the code points of a class escape such as \d or \p{Lu}, after the
+// backslash, to a set. Return false if the class is negated, e.g. \D.
+static bool addClass(parser *p, set *s) {
+    char ch = p->s[p->i++];
+    switch (ch | 0x20) {
+    case 'd':
+        s->categories |= 1u << Nd;
+        break;
+    case 'w':
+        s->categories |= (1u << Ll) | (1u << Lm) | (1u << Lo) | (1u << Lt) |
+            (1u << Lu) | (1u << Mc) | (1u << Me) | (1u << Mn) | (1u << Nd) |
+            (1u << Nl) | (1u << No) | (1u << Pc);
+        break;
+    case 's':
+        s->categories |= (1u << Zs) | (1u << Zl) | (1u << Zp);
+        addRange(s, '\t', '\r');
+        break;
+    case 'p':
+        s->categories |= parseCategory(p);
+        break;
+    }
+    return 'a' <= ch && ch <= 'z';
+}
+
+// Read a code point in a bracketed set, possibly escaped.
+static int setCode(parser *p) {
+    if (p->s[p->i] != '\\') return readCode(p);
+    p->i++;
+    if (p->i < p->n) return escapedCode(p);
+    p->error = "trailing backslash";
+    return 0;
+}
+
+// Parse a bracketed set such as [^a-z\d], after the opening bracket. A closing
+// bracket straight after the opening one is literal.
+static int parseSet(parser *p) {
+    int k = addSet(p->r);
+    set *s = &p->r->sets[k];
+    if (p->i < p->n && p->s[p->i] == '^') {
+        s->negate = true;
+        p->i++;
+    }
+    for (bool first = true; p->i < p->n; first = false) {
+        char ch = p->s[p->i];
+        if (ch == ']' && ! first) break;
+        if (ch == '\\' && classEscape(p->s[p->i + 1])) {
+            p->i++;
+            if (! addClass(p, s)) p->error = "negated class inside brackets";
+            continue;
+        }
+        int lo = setCode(p), hi = lo;
+        if (p->i + 1 < p->n && p->s[p->i] == '-' && p->s[p->i + 1] != ']') {
+            p->i++;
+            hi = setCode(p);
+        }
+        if (hi < lo) p->error = "bad range";
+        addRange(s, lo, hi);
+    }
+    if (p->i < p->n) p->i++;
+    else p->error = "missing ]";
+    return addNode(p->r, Chars, k, -1, -1);
+}
+
+static int parseAlternation(parser *p);
+
+// Parse a literal, escape, set, anchor, or bracketed subexpression.
+static int parseAtom(parser *p) {
+    regex *r = p->r;
+    char ch = p->s[p->i];
+    if (ch == '(') {
+        p->i++;
+        if (p->s[p->i] == '?' && p->s[p->i + 1] == ':') p->i += 2;
+        int x = parseAlternation(p);
+        if (p->i < p->n && p->s[p->i] == ')') p->i++;
+        else p->error = "missing )";
+        return x;
+    }
+    if (ch == '[') {
+        p->i++;
+        return parseSet(p);
+    }
+    if (ch == '^' || ch == '$') {
+        p->i++;
+        return addNode(r, ch == '^' ? LineStart : LineEnd, -1, -1, -1);
+    }
+    if (ch == '*' || ch == '+' || ch == '?') {
+        p->i++;
+        p->error = "nothing to repeat";
+        return addNode(r, Empty, -1, -1, -1);
+    }
+    int k = addSet(r);
+    set *s = &r->sets[k];
+    if (ch == '.') {
+        p->i++;
+        s->negate = true;
+        addRange(s, '\n', '\n');
+    }
+    else if (ch == '\\') {
+        p->i++;
+        if (p->i >= p->n) p->error = "trailing backslash";
+        else if (classEscape(p->s[p->i])) s->negate = ! addClass(p, s);
+        else {
+            int code = escapedCode(p);
+            addRange(s, code, code);
+        }
+    }
+    else {
+        int code = readCode(p);
+        addRange(s, code, code);
+    }
+    return addNode(r, Chars, k, -1, -1);
+}
+
+// Parse an atom followed by any number of repetition operators.
+static int parseRepeat(parser *p) {
+    int x = parseAtom(p);
+    while (p->i < p->n) {
+        char ch = p->s[p->i];
+        int kind = ch == '*' ? Star : ch == '+' ? Plus :
+            ch == '?' ? Optional : -1;
+        if (kind < 0) break;
+        p->i++;
+        x = addNode(p->r, kind, -1, x, -1);
+    }
+    return x;
+}
+
+// Parse a sequence of repeated atoms, up to | or ) or the end.
+static int parseSequence(parser *p) {
+    int x = addNode(p->r, Empty, -1, -1, -1);
+    while (p->i < p->n && p->s[p->i] != '|' && p->s[p->i] != ')') {
+        int y = parseRepeat(p);
+        x = addNode(p->r, Concat, -1, x, y);
+    }
+    return x;
+}
+
+// Parse sequences separated by |.
+static int parseAlternation(parser *p) {
+    int x = parseSequence(p);
+    while (p->i < p->n && p->s[p->i] == '|') {
+        p->i++;
+        int y = parseSequence(p);
+        x = addNode(p->r, Alternate, -1, x, y);
+    }
+    return x;
+}
+
+// ---------- Classes ----------------------------------------------------------
+
+// Compare integers, for sorting.
+static int compare(void const *a, void const *b) {
+    int x = *(int const *) a, y = *(int const *) b;
+    return (x > y) - (x < y);
+}
+
+// Find or add the class with a given signature, which has one byte for each
+// set, saying whether the code points of the class are in it, and a final byte
+// for the newline, which is kept in a class of its own because of the anchors.
+static int findClass(regex *r, char *sigs, char *sig) {
+    int n = r->setCount + 1;
+    for (int k = 0; k < r->classes; k++) {
+        if (memcmp(&sigs[k * n], sig, n) == 0) return k;
+    }
+    memcpy(&sigs[r->classes * n], sig, n);
+    return r->classes++;
+}
+
+// Make the signature of a code point, or of a representative of an interval.
+static void sign(regex *r, char *sig, int code, int category) {
+    for (int i = 0; i < r->setCount; i++) {
+        sig[i] = inSet(&r->sets[i], code, category);
+    }
+    sig[r->setCount] = code == '\n';
+}
+
+// Divide code points into classes, and make the membership table.
+static void classify(regex *r) {
+    int n = r->setCount + 1, total = 0;
+    for (int i = 0; i < r->setCount; i++) total += r->sets[i].count;
+    r->bounds = malloc((2 * total + 1) * sizeof(int));
+    r->boundCount = 0;
+    for (int i = 0; i < r->setCount; i++) {
+        set *s = &r->sets[i];
+        for (int j = 0; j < 2 * s->count; j++) {
+            int b = s->ranges[j] + (j % 2);
+            if (b <= 128 || b >= 0x110000) continue;
+            r->bounds[r->boundCount++] = b;
+        }
+    }
+    qsort(r->bounds, r->boundCount, sizeof(int), compare);
+    int count = 0;
+    for (int i = 0; i < r->boundCount; i++) {
+        if (count == 0 || r->bounds[count - 1] != r->bounds[i]) {
+            r->bounds[count++] = r->bounds[i];
+        }
+    }
+    r->boundCount = count;
+    int intervals = count + 1;
+    int max = 128 + intervals * CATEGORIES;
+    char *sigs = malloc(max * n), sig[n];
+    r->classes = 0;
+    for (int code = 0; code < 128; code++) {
+        sign(r, sig, code, ucategory(code));
+        r->ascii[code] = findClass(r, sigs, sig);
+    }
+    r->newline = r->ascii['\n'];
+    r->wide = malloc(intervals * CATEGORIES * sizeof(int));
+    for (int i = 0; i < intervals; i++) {
+        int code = (i == 0) ? 128 : r->bounds[i - 1];
+        for (int c = 0; c < CATEGORIES; c++) {
+            sign(r, sig, code, c);
+            r->wide[i * CATEGORIES + c] = findClass(r, sigs, sig);
+        }
+    }
+    r->member = malloc(r->setCount * r->classes * sizeof(bool));
+    for (int i = 0; i < r->setCount; i++) {
+        for (int k = 0; k < r->classes; k++) {
+            r->member[i * r->classes + k] = sigs[k * n + i];
+        }
+    }
+    free(sigs);
+}
+
+// Find the class of a non-ASCII code point.
+static inline int wideClass(regex *r, int code) {
+    int lo = 0, hi = r->boundCount;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->bounds[mid] <= code) lo = mid + 1;
+        else hi = mid;
+    }
+    return r->wide[lo * CATEGORIES + ucategory(code)];
+}
+
+// ---------- DFA --------------------------------------------------------------
+
+// Add an instruction to a program, and return its index.
+static int emit(dfa *d, int op, int x, int y) {
+    if (d->n >= d->max) {
+        d->max = d->max * 3 / 2;
+        d->program = realloc(d->program, d->max * sizeof(inst));
+    }
+    d->program[d->n] = (inst) { .op=op, .x=x, .y=y };
+    return d->n++;
+}
+
+// Compile a node into a program, reversed if the program is for scanning
+// backwards.
+static void compile(regex *r, dfa *d, int i, bool reverse) {
+    node nd = r->nodes[i];
+    int split, jump, top;
+    switch (nd.kind) {
+    case Empty: break;
+    case Chars: emit(d, Take, nd.set, 0); break;
+    case LineStart: emit(d, reverse ? AtEnd : AtStart, 0, 0); break;
+    case LineEnd: emit(d, reverse ? AtStart : AtEnd, 0, 0); break;
+    case Concat:
+        compile(r, d, reverse ? nd.right : nd.left, reverse);
+        compile(r, d, reverse ? nd.left : nd.right, reverse);
+        break;
+    case Alternate:
+        split = emit(d, Split, d->n + 1, 0);
+        compile(r, d, nd.left, reverse);
+        jump = emit(d, Jump, 0, 0);
+        d->program[split].y = d->n;
+        compile(r, d, nd.right, reverse);
+        d->program[jump].x = d->n;
+        break;
+    case Star:
+        split = emit(d, Split, d->n + 1, 0);
+        compile(r, d, nd.left, reverse);
+        emit(d, Jump, split, 0);
+        d->program[split].y = d->n;
+        break;
+    case Plus:
+        top = d->n;
+        compile(r, d, nd.left, reverse);
+        emit(d, Split, top, d->n + 1);
+        break;
+    case Optional:
+        split = emit(d, Split, d->n + 1, 0);
+        compile(r, d, nd.left, reverse);
+        d->program[split].y = d->n;
+        break;
+    }
+}
+
+// Empty the hash table.
+static void clearTable(dfa *d) {
+    for (int i = 0; i < d->size; i++) d->table[i] = -1;
+}
+
+// Set up a DFA with a program compiled from the tree, and an empty cache.
+static void newDFA(regex *r, dfa *d, bool reverse) {
+    *d = (dfa) {
+        .program=malloc(16 * sizeof(inst)), .n=0, .max=16, .start=0,
+        .classes=r->classes, .newline=r->newline, .budget=BUDGET,
+        .member=r->member, .states=malloc(16 * sizeof(state)), .count=0,
+        .stateMax=16, .pool=malloc(256 * sizeof(int)), .used=0, .poolMax=256,
+        .table=malloc(64 * sizeof(int)), .size=64, .gen=0
+    };
+    compile(r, d, r->root, reverse);
+    emit(d, Matched, 0, 0);
+    d->moves = malloc(d->stateMax * d->classes * sizeof(int));
+    int n = 2 * d->n + 2;
+    d->list = malloc(n * sizeof(int));
+    d->cur = malloc(n * sizeof(int));
+    d->extra = malloc(n * sizeof(int));
+    d->stack = malloc(n * sizeof(int));
+    d->seen = calloc(d->n, sizeof(int));
+    clearTable(d);
+}
+
+// Free the contents of a DFA.
+static void freeDFA(dfa *d) {
+    free(d->program);
+    free(d->states);
+    free(d->pool);
+    free(d->moves);
+    free(d->table);
+    free(d->list);
+    free(d->cur);
+    free(d->extra);
+    free(d->stack);
+    free(d->seen);
+}
+
+// Add the closure of an instruction to a list, i.e. the instructions reachable
+// by following jumps, splits, and anchors which hold. A failed end-of-line
+// check is kept in the list, so it can be followed later if a newline is
+// found. Instructions already seen in the current generation are skipped,
+// because a thread which started earlier takes precedence.
+static void closure(dfa *d, int *list, int *n, int pc, bool bol, bool eol) {
+    int top = 0;
+    d->stack[top++] = pc;
+    while (top > 0) {
+        pc = d->stack[--top];
+        if (d->seen[pc] == d->gen) continue;
+        d->seen[pc] = d->gen;
+        inst *in = &d->program[pc];
+        switch (in->op) {
+        case Jump: d->stack[top++] = in->x; break;
+        case Split:
+            d->stack[top++] = in->y;
+            d->stack[top++] = in->x;
+            break;
+        case AtStart: if (bol) d->stack[top++] = pc + 1; break;
+        case AtEnd:
+            if (eol) d->stack[top++] = pc + 1;
+            else list[(*n)++] = pc;
+            break;
+        default: list[(*n)++] = pc; break;
+        }
+    }
+}
+
+// Follow the end-of-line checks in a list, giving a new list in d->cur, when
+// the next code point is a newline or the end of the text.
+static int expand(dfa *d, int n, int *list, bool bol) {
+    int m = 0;
+    d->gen++;
+    for (int i = 0; i < n; i++) {
+        if (list[i] < 0) d->cur[m++] = -1;
+        else closure(d, d->cur, &m, list[i], bol, true);
+    }
+    return m;
+}
+
+// Check whether a list contains a match.
+static bool found(dfa *d, int n, int *list) {
+    for (int i = 0; i < n; i++) {
+        if (list[i] >= 0 && d->program[list[i]].op == Matched) return true;
+    }
+    return false;
+}
+
+// Estimate the memory used by the cache of states.
+static long cost(dfa *d) {
+    long perState = sizeof(state) + d->classes * sizeof(int);
+    return d->used * (long) sizeof(int) + d->count * perState;
+}
+
+// Empty the cache of states.
+static void flush(dfa *d) {
+    d->count = 0;
+    d->used = 0;
+    clearTable(d);
+}
+
+// Double the size of the hash table.
+static void rehash(dfa *d) {
+    d->size = d->size * 2;
+    d->table = realloc(d->table, d->size * sizeof(int));
+    clearTable(d);
+    for (int k = 0; k < d->count; k++) {
+        int i = d->states[k].hash & (d->size - 1);
+        while (d->table[i] >= 0) i = (i + 1) & (d->size - 1);
+        d->table[i] = k;
+    }
+}
+
+// Find or add the state with a given list and flags, and return its index.
+static int intern(dfa *d, int n, int *list, bool bol, bool done) {
+    unsigned hash = 2166136261u ^ (bol ? 1 : 0) ^ (done ? 2 : 0);
+    for (int i = 0; i < n; i++) hash = (hash ^ list[i]) * 16777619u;
+    int mask = d->size - 1, i = hash & mask;
+    for (; d->table[i] >= 0; i = (i + 1) & mask) {
+        state *s = &d->states[d->table[i]];
+        if (s->hash != hash || s->n != n || s->bol != bol) continue;
+        if (s->done != done) continue;
+        if (memcmp(&d->pool[s->at], list, n * sizeof(int)) == 0) {
+            return d->table[i];
+        }
+    }
+    if (d->count >= d->stateMax) {
+        d->stateMax = d->stateMax * 3 / 2;
+        d->states = realloc(d->states, d->stateMax * sizeof(state));
+        d->moves = realloc(d->moves, d->stateMax * d->classes * sizeof(int));
+    }
+    if (d->used + n > d->poolMax) {
+        while (d->used + n > d->poolMax) d->poolMax = d->poolMax * 3 / 2;
+        d->pool = realloc(d->pool, d->poolMax * sizeof(int));
+    }
+    memcpy(&d->pool[d->used], list, n * sizeof(int));
+    bool match = found(d, n, list);
+    bool matchEol = match || found(d, expand(d, n, list, bol), d->cur);
+    int k = d->count++;
+    d->states[k] = (state) {
+        .at=d->used, .n=n, .hash=hash, .bol=bol, .done=done, .match=match,
+        .matchEol=matchEol, .dead=(n == 0 && done)
+    };
+    d->used += n;
+    for (int c = 0; c < d->classes; c++) d->moves[k * d->classes + c] = -1;
+    d->table[i] = k;
+    if (d->count * 2 > d->size) rehash(d);
+    return k;
+}
+
+// Make sure there is room in the cache for a new state, flushing it if it is
+// over budget, and return the new index of a given state which is kept.
+static int room(dfa *d, int s) {
+    if (cost(d) <= d->budget) return s;
+    state st = d->states[s];
+    memcpy(d->extra, &d->pool[st.at], st.n * sizeof(int));
+    flush(d);
+    return intern(d, st.n, d->extra, st.bol, st.done);
+}
+
+// Remove the markers of empty groups from a list, and return its new length.
+static int tidy(int n, int *list) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (list[i] < 0 && (m == 0 || list[m - 1] < 0)) continue;
+        list[m++] = list[i];
+    }
+    if (m > 0 && list[m - 1] < 0) m--;
+    return m;
+}
+
+// Make the state which follows a given state on a code point of class k, and
+// record the move. If there is a match before the code point, the groups of
+// threads which started later are dropped and no more threads are started, so
+// that only the leftmost match survives and is extended to its longest.
+static int step(dfa *d, int s, int k) {
+    s = room(d, s);
+    state st = d->states[s];
+    bool newline = (k == d->newline), done = st.done;
+    int *cur = &d->pool[st.at], n = st.n;
+    if (newline) {
+        n = expand(d, n, cur, st.bol);
+        cur = d->cur;
+    }
+    for (int i = 0; i < n; i++) {
+        if (cur[i] < 0 || d->program[cur[i]].op != Matched) continue;
+        done = true;
+        while (i < n && cur[i] >= 0) i++;
+        n = i;
+    }
+    int m = 0;
+    d->gen++;
+    for (int i = 0; i < n; i++) {
+        int pc = cur[i];
+        if (pc < 0) d->list[m++] = -1;
+        else if (d->program[pc].op != Take) continue;
+        else if (d->member[d->program[pc].x * d->classes + k]) {
+            closure(d, d->list, &m, pc + 1, newline, false);
+        }
+    }
+    if (! done) {
+        d->list[m++] = -1;
+        closure(d, d->list, &m, d->start, newline, false);
+    }
+    m = tidy(m, d->list);
+    int next = intern(d, m, d->list, newline, done);
+    d->moves[s * d->classes + k] = next;
+    return next;
+}
+
+// Find the state to start a scan with.
+static int begin(dfa *d, bool bol, bool anchored) {
+    if (cost(d) > d->budget) flush(d);
+    int n = 0;
+    d->gen++;
+    closure(d, d->list, &n, d->start, bol, false);
+    return intern(d, n, d->list, bol, anchored);
+}
+
+// ---------- Scanning ---------------------------------------------------------
+
+// Get the byte at a position, or -1 if out of range.
+static int byteAt(text *t, int at) {
+    if (at < 0 || at >= lengthText(t)) return -1;
+    span spans[2];
+    readText(t, at, 1, spans);
+    return (unsigned char) spans[0].s[0];
+}
+
+// Find the length of a UTF-8 sequence from its first byte.
+static inline int leadLength(unsigned char b) {
+    return b < 0xC0 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4;
+}
+
+// Decode the code point at the start of n bytes. An invalid or incomplete
+// sequence is treated as a single byte with code UBAD.
+static inline codePoint decode(char const *s, int n) {
+    codePoint bad = { .code=UBAD, .length=1 };
+    int expect = leadLength(s[0]);
+    if (expect > n) return bad;
+    codePoint cp = getCode(s);
+    if (cp.length != expect) return bad;
+    if (cp.code != UBAD) return cp;
+    if (expect != 3 || memcmp(s, "\xEF\xBF\xBD", 3) != 0) return bad;
+    return cp;
+}
+
+// Decode the code point ending at position i of the bytes s[0..i), or return
+// a length of 0 if its start may be before s.
+static inline codePoint decodeBack(char const *s, int i) {
+    int j = i - 1;
+    while (j > 0 && j > i - 4 && (s[j] & 0xC0) == 0x80) j--;
+    if ((s[j] & 0xC0) == 0x80 && j == 0 && i < 4) {
+        return (codePoint) { .code=UBAD, .length=0 };
+    }
+    codePoint cp = decode(&s[j], i - j);
+    if (j + cp.length != i) cp = (codePoint) { .code=UBAD, .length=1 };
+    return cp;
+}
+
+// Copy up to four bytes of text between two positions into a buffer.
+static int copyBytes(text *t, int from, int to, char s[4]) {
+    if (to - from > 4) to = from + 4;
+    span spans[2];
+    readText(t, from, to - from, spans);
+    memcpy(s, spans[0].s, spans[0].n);
+    memcpy(&s[spans[0].n], spans[1].s, spans[1].n);
+    return to - from;
+}
+
+// Find the state with the same threads as a given state, but which starts no
+// more threads.
+static int finish(dfa *d, int s) {
+    s = room(d, s);
+    state st = d->states[s];
+    memcpy(d->extra, &d->pool[st.at], st.n * sizeof(int));
+    return intern(d, st.n, d->extra, st.bol, true);
+}
+
+// Run the forward DFA from a position up to a limit, and return the position
+// of the end of the last match, or -1. Matches may start anywhere before stop,
+// unless the scan is anchored. Stop early if the state becomes dead. A code
+// point which straddles the end of a span is copied and decoded.
+static int scanForward(regex *r, text *t, int at, int stop, int limit,
+    bool anchored) {
+    dfa *d = &r->forward;
+    int s = begin(d, at == 0 || byteAt(t, at - 1) == '\n', anchored);
+    int last = -1;
+    while (at < limit) {
+        span sp = spanText(t, at);
+        if (sp.n > limit - at) sp.n = limit - at;
+        int i = 0;
+        while (i < sp.n) {
+            unsigned char b = sp.s[i];
+            int k, length = 1;
+            if (b < 0x80) k = r->ascii[b];
+            else {
+                codePoint cp;
+                if (leadLength(b) <= sp.n - i) cp = decode(&sp.s[i], sp.n - i);
+                else {
+                    char bytes[4];
+                    cp = decode(bytes, copyBytes(t, at + i, limit, bytes));
+                }
+                k = wideClass(r, cp.code);
+                length = cp.length;
+            }
+            if (at + i + length >= stop && ! d->states[s].done) {
+                s = finish(d, s);
+            }
+            state *st = &d->states[s];
+            if (st->match || (st->matchEol && k == d->newline)) last = at + i;
+            int next = d->moves[s * d->classes + k];
+            s = (next >= 0) ? next : step(d, s, k);
+            if (d->states[s].dead) return last;
+            i += length;
+        }
+        at += i;
+    }
+    state *st = &d->states[s];
+    bool eol = at >= lengthText(t) || byteAt(t, at) == '\n';
+    if (st->match || (st->matchEol && eol)) last = at;
+    return last;
+}
+
+// Run the backward DFA from a position down to a limit, and return the
+// position of the start of the last match, or -1.
+static int scanBackward(regex *r, text *t, int at, int limit, bool anchored) {
+    dfa *d = &r->backward;
+    int s = begin(d, at >= lengthText(t) || byteAt(t, at) == '\n', anchored);
+    int last = -1;
+    while (at > limit) {
+        span sp = spanBefore(t, at);
+        if (sp.n > at - limit) {
+            sp.s = sp.s + sp.n - (at - limit);
+            sp.n = at - limit;
+        }
+        int i = sp.n;
+        while (i > 0) {
+            unsigned char b = sp.s[i - 1];
+            int k, length = 1;
+            if (b < 0x80) k = r->ascii[b];
+            else {
+                codePoint cp = decodeBack(sp.s, i);
+                if (cp.length == 0) {
+                    char bytes[4];
+                    int p = at - sp.n + i;
+                    int from = (p - 4 < limit) ? limit : p - 4;
+                    cp = decodeBack(bytes, copyBytes(t, from, p, bytes));
+                }
+                k = wideClass(r, cp.code);
+                length = cp.length;
+            }
+            state *st = &d->states[s];
+            if (st->match || (st->matchEol && k == d->newline)) {
+                last = at - sp.n + i;
+            }
+            int next = d->moves[s * d->classes + k];
+            s = (next >= 0) ? next : step(d, s, k);
+            if (d->states[s].dead) return last;
+            i -= length;
+        }
+        at = at - sp.n + i;
+    }
+    state *st = &d->states[s];
+    bool bol = at == 0 || byteAt(t, at - 1) == '\n';
+    if (st->match || (st->matchEol && bol)) last = at;
+    return last;
+}
+
+regex *newRegex(int n, char const *pattern, char const **error) {
+    regex *r = malloc(sizeof(regex));
+    *r = (regex) {
+        .sets=malloc(8 * sizeof(set)), .setCount=0, .setMax=8,
+        .nodes=malloc(16 * sizeof(node)), .nodeCount=0, .nodeMax=16
+    };
+    char *s = malloc(n + 4);
+    memcpy(s, pattern, n);
+    memset(&s[n], 0, 4);
+    r->pattern = s;
+    r->length = n;
+    parser p = { .r=r, .s=s, .n=n, .i=0, .error=NULL };
+    r->root = parseAlternation(&p);
+    if (p.error == NULL && p.i < n) p.error = "unmatched )";
+    if (p.error != NULL) {
+        if (error != NULL) *error = p.error;
+        freeRegex(r);
+        return NULL;
+    }
+    classify(r);
+    newDFA(r, &r->forward, false);
+    newDFA(r, &r->backward, true);
+    return r;
+}
+
+bool multilineRegex(regex *r) {
+    for (int i = 0; i < r->setCount; i++) {
+        if (r->member[i * r->classes + r->newline]) return true;
+    }
+    return false;
+}
+
+regex *copyRegex(regex *r) {
+    return newRegex(r->length, r->pattern, NULL);
+}
+
+void freeRegex(regex *r) {
+    free(r->pattern);
+    for (int i = 0; i < r->setCount; i++) free(r->sets[i].ranges);
+    free(r->sets);
+    free(r->nodes);
+    free(r->bounds);
+    free(r->wide);
+    free(r->member);
+    freeDFA(&r->forward);
+    freeDFA(&r->backward);
+    free(r);
+}
+
+int nextMatch(regex *r, text *t, int from, int to, int *length) {
+    if (from >= to) return -1;
+    int end = scanForward(r, t, from, to, lengthText(t), false);
+    if (end < 0) return -1;
+    int start = scanBackward(r, t, end, from, true);
+    *length = end - start;
+    return start;
+}
+
+int previousMatch(regex *r, text *t, int before, int *length) {
+    int start = scanBackward(r, t, before, 0, false);
+    if (start < 0) return -1;
+    int end = scanForward(r, t, start, start, lengthText(t), true);
+    *length = end - start;
+    return start;
+}
+
+#ifdef regexTest
+
+// The objects which go with the text being tested.
+static lines *ls;
+static cursors *cs;
+static history *h;
+
+// Make a text from a string, either as a gap buffer or as a piece table, with
+// the gap or a piece boundary at a given position.
+static text *makeText(char *s, bool mapped, int gap) {
+    h = newHistory();
+    cs = newCursors(h);
+    ls = newLines();
+    text *t = newText(ls, cs, h);
+    int n = strlen(s);
+    if (mapped) mapText(t, n, s);
+    else {
+        char *copy = malloc(n + 1);
+        strcpy(copy, s);
+        loadText(t, n, copy);
+        free(copy);
+    }
+    char x[] = "x";
+    insertText(t, gap, 1, x);
+    deleteText(t, gap, gap + 1);
+    return t;
+}
+
+// Free a text made by makeText.
+static void dropText(text *t) {
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check the next match in a text, with the gap at every position, as a gap
+// buffer and a piece table, and with the cache flushed at every step.
+static void check(char *p, char *s, int from, int start, int length) {
+    int n = strlen(s);
+    for (int gap = 0; gap <= n; gap++) {
+        for (int i = 0; i < 3; i++) {
+            text *t = makeText(s, i == 1, gap);
+            regex *r = newRegex(strlen(p), p, NULL);
+            if (i == 2) r->forward.budget = r->backward.budget = 0;
+            int len = -1, at = nextMatch(r, t, from, lengthText(t), &len);
+            assert(at == start);
+            if (at >= 0) assert(len == length);
+            freeRegex(r);
+            dropText(t);
+        }
+    }
+}
+
+// Check the previous match in a text.
+static void checkBack(char *p, char *s, int before, int start, int length) {
+    text *t = makeText(s, false, strlen(s) / 2);
+    regex *r = newRegex(strlen(p), p, NULL);
+    int len = -1, at = previousMatch(r, t, before, &len);
+    assert(at == start);
+    if (at >= 0) assert(len == length);
+    freeRegex(r);
+    dropText(t);
+}
+
+// Test basic matching, with leftmost-longest semantics.
+static void testMatch() {
+    check("b+", "abbbc\n", 0, 1, 3);
+    check("ab|bcde", "abcde\n", 0, 0, 2);
+    check("bcde|ab", "abcde\n", 0, 0, 2);
+    check("a|ab|abc", "xabcd\n", 0, 1, 3);
+    check("a*", "bbb\n", 0, 0, 0);
+    check("x*y", "aaxxy\n", 0, 2, 3);
+    check("x*y", "aaxxy\n", 3, 3, 2);
+    check("(ab)+c?", "abababc\n", 1, 2, 5);
+    check("(?:a|b)*c", "abxbac\n", 0, 3, 3);
+    check("[a-c]+", "xyzcabz\n", 0, 3, 3);
+    check("[^a-z\\n]+", "ab12cd\n", 0, 2, 2);
+    check("a.c", "ab\nc abc\n", 0, 5, 3);
+    check("zz", "abc\n", 0, -1, 0);
+    check("\\(a\\)", "(a)\n", 0, 0, 3);
+}
+
+// Test limiting where matches start.
+static void testLimit() {
+    text *t = makeText("abbbc a\n", false, 3);
+    char *p = "b+|a";
+    regex *r = newRegex(strlen(p), p, NULL);
+    int length;
+    assert(nextMatch(r, t, 1, 1, &length) == -1);
+    assert(nextMatch(r, t, 1, 2, &length) == 1 && length == 3);
+    assert(nextMatch(r, t, 4, 6, &length) == -1);
+    assert(nextMatch(r, t, 4, 7, &length) == 6 && length == 1);
+    assert(! multilineRegex(r));
+    regex *copy = copyRegex(r);
+    assert(nextMatch(copy, t, 0, 8, &length) == 0 && length == 1);
+    freeRegex(copy);
+    freeRegex(r);
+    dropText(t);
+}
+
+// Test the line anchors.
+static void testAnchors() {
+    check("^b", "ab\nbc\n", 0, 3, 1);
+    check("c$", "abc\ncd\n", 0, 2, 1);
+    check("^$", "ab\n\ncd\n", 0, 3, 0);
+    check("^a", "aa\n", 1, -1, 0);
+    check("b$|x", "ab\nb\n", 2, 3, 1);
+    check("a\\n^b", "a\nb\n", 0, 0, 3);
+    regex *r = newRegex(5, "[^a]+", NULL);
+    assert(multilineRegex(r));
+    freeRegex(r);
+}
+
+// Test Unicode classes and categories, with code points straddling the gap.
+static void testUnicode() {
+    check("\\p{Lu}\\w*", "h\xC3\xA9llo \xC3\x89t\xC3\xA9\n", 0, 7, 5);
+    check("h.llo", "h\xC3\xA9llo\n", 0, 0, 6);
+    check("\\d+", "ab \xD9\xA3\xD9\xA4 12\n", 0, 3, 4);
+    check("[^a-z ]+", "abc \xC3\x80\xC3\x89 def\n", 0, 4, 4);
+    check("[\xC3\x80-\xC3\x89]", "ab\xC3\x8A\xC3\x84\n", 0, 4, 2);
+    check("\\PL+", "ab\xE2\x82\xAC!c\n", 0, 2, 4);
+    check("\\s\\S", "a\xE2\x80\x83z\n", 0, 1, 4);
+}
+
+// Test scanning backwards.
+static void testPrevious() {
+    checkBack("ab", "ab ab ab\n", 8, 6, 2);
+    checkBack("ab", "ab ab ab\n", 6, 3, 2);
+    checkBack("ab", "ab ab ab\n", 1, -1, 0);
+    checkBack("a+", "xaaay\n", 3, 1, 3);
+    checkBack("^a", "aa\nab\n", 6, 3, 1);
+    checkBack("\\w+", "h\xC3\xA9llo \xC3\x89t\xC3\xA9\n", 6, 0, 6);
+}
+
+// Test that invalid patterns are rejected.
+static void testErrors() {
+    char *bad[] = {
+        "(ab", "a)", "*a", "[ab", "\\p{Xy}", "[\\D]", "a\\", "[z-a]"
+    };
+    for (int i = 0; i < 8; i++) {
+        char const *error = NULL;
+        assert(newRegex(strlen(bad[i]), bad[i], &error) == NULL);
+        assert(error != NULL);
+    }
+}
+
+// Test that a pattern which makes backtracking engines take exponential time
+// is handled in linear time, even with a tiny cache.
+static void testLinear() {
+    int n = 100000;
+    char *s = malloc(n + 2);
+    memset(s, 'a', n);
+    strcpy(&s[n], "\n");
+    text *t = makeText(s, false, n / 2);
+    char *p = "(a*)*(a|aa)*b";
+    regex *r = newRegex(strlen(p), p, NULL);
+    int length;
+    assert(nextMatch(r, t, 0, n + 1, &length) == -1);
+    r->forward.budget = r->backward.budget = 100;
+    assert(nextMatch(r, t, 0, n + 1, &length) == -1);
+    assert(previousMatch(r, t, n, &length) == -1);
+    freeRegex(r);
+    dropText(t);
+    free(s);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testMatch();
+    testLimit();
+    testAnchors();
+    testUnicode();
+    testPrevious();
+    testErrors();
+    testLinear();
+    printf("Regex module OK\n");
+    return 0;
+}
+
+#endif
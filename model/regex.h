@@ -0,0 +1,56 @@
+// Regular expression search. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A regex searches a text for matches of a regular expression, in time linear
+// in the length of the text scanned, however the pattern is written. The
+// pattern is compiled into an automaton which is run as a DFA, with its states
+// built only when first needed, and kept in a cache which is flushed if it
+// grows beyond a fixed budget. The text is scanned in place, a span at a time,
+// on either side of the gap or in separate pieces, without moving the gap.
+// Matches are leftmost-longest, as in POSIX. The syntax is:
+//
+//     x         a literal code point, or \x if x is one of \.[]()|*+?^$
+//     .         any code point except newline
+//     [a-z]     a code point in a set of ranges, escapes and classes
+//     [^a-z]    a code point not in a set
+//     \d \w \s  a Unicode digit (Nd), word character (L, M, N or Pc), or space
+//     \D \W \S  a code point not in one of those classes
+//     \pL \p{Lu} a code point in a Unicode general category, or a group of them
+//     \PL \P{Lu} a code point not in a category
+//     \n \t \r  a newline, tab, or carriage return
+//     ^ $       the start or end of a line
+//     xy x|y    concatenation, alternation
+//     x* x+ x?  repetition
+//     (x) (?:x) grouping
+//
+// The classes \d \w \s and categories can be used inside brackets, but not
+// their negations.
+struct regex;
+typedef struct regex regex;
+typedef struct text text;
+
+// Compile a pattern of n bytes. If it is not valid, return NULL and, if error
+// is not NULL, set *error to a message describing the problem.
+regex *newRegex(int n, char const *pattern, char const **error);
+
+// Make a copy of a regex, with its own cache of states, e.g. for use on another
+// thread, since a regex can only be used by one thread at a time.
+regex *copyRegex(regex *r);
+
+// Check whether a match can include a newline. If not, edits to a line can't
+// affect matches in other lines.
+bool multilineRegex(regex *r);
+
+// Free a regex, including its cache of states.
+void freeRegex(regex *r);
+
+// Find the leftmost-longest match starting at or after from and before to, and
+// return its start and set *length, or return -1 if there is none. The match
+// may extend beyond to.
+int nextMatch(regex *r, text *t, int from, int to, int *length);
+
+// Find the last match ending at or before a given position, by scanning
+// backwards, and return its start and set *length, or return -1. The match is
+// the longest one ending at that point, and its length is then extended, if
+// possible, to the longest match from its start.
+int previousMatch(regex *r, text *t, int before, int *length);
@@ -0,0 +1,459 @@
+// Literal search. Free and open source. See LICENSE.
+#include "text.h"
+#include "search.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+// A finder holds the pattern of n bytes, with ASCII letters in lower case if
+// case is being ignored, and a fold mask for each byte which is 0x20 for a
+// letter being matched without case, or zero otherwise. The scanning functions
+// are chosen according to the processor and the options.
+struct finder {
+    int n;
+    bool fold, word;
+    char *pattern, *mask;
+    int (*forward)(finder *f, int n, char const *s);
+    int (*backward)(finder *f, int n, char const *s);
+};
+
+// Check whether a byte is a letter, digit, underscore or part of a non-ASCII
+// character.
+static inline bool wordByte(int b) {
+    if (b < 0) return false;
+    if (b >= 0x80 || b == '_') return true;
+    return ('a' <= b && b <= 'z') || ('A' <= b && b <= 'Z') ||
+        ('0' <= b && b <= '9');
+}
+
+// Check whether there is a match at s, which is known to have at least n bytes.
+static inline bool verify(finder *f, char const *s) {
+    if (! f->fold) return memcmp(s, f->pattern, f->n) == 0;
+    for (int i = 0; i < f->n; i++) {
+        if ((s[i] | f->mask[i]) != f->pattern[i]) return false;
+    }
+    return true;
+}
+
+// Find the first match wholly within n bytes, using memchr to skip to each
+// occurrence of the first byte of the pattern.
+static int forwardScalar(finder *f, int n, char const *s) {
+    int m = f->n;
+    char first = f->pattern[0];
+    for (int i = 0; i + m <= n; i++) {
+        if (f->fold) {
+            while (i + m <= n && (s[i] | f->mask[0]) != first) i++;
+        }
+        else {
+            char const *p = memchr(&s[i], first, n - m + 1 - i);
+            if (p == NULL) return -1;
+            i = p - s;
+        }
+        if (i + m > n) return -1;
+        if (verify(f, &s[i])) return i;
+    }
+    return -1;
+}
+
+// Find the last match wholly within n bytes.
+static int backwardScalar(finder *f, int n, char const *s) {
+    char first = f->pattern[0];
+    for (int i = n - f->n; i >= 0; i--) {
+        if ((s[i] | f->mask[0]) == first && verify(f, &s[i])) return i;
+    }
+    return -1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTORS
+#include <immintrin.h>
+
+// Find candidates in a block of 16 positions starting at s, where both the
+// first and last bytes of the pattern match, as a bit mask.
+__attribute__((target("sse2")))
+static inline int candidates16(finder *f, char const *s) {
+    int m = f->n;
+    __m128i first = _mm_set1_epi8(f->pattern[0]);
+    __m128i last = _mm_set1_epi8(f->pattern[m - 1]);
+    __m128i a = _mm_loadu_si128((__m128i const *) s);
+    __m128i b = _mm_loadu_si128((__m128i const *) &s[m - 1]);
+    a = _mm_or_si128(a, _mm_set1_epi8(f->mask[0]));
+    b = _mm_or_si128(b, _mm_set1_epi8(f->mask[m - 1]));
+    __m128i eq = _mm_cmpeq_epi8(a, first);
+    eq = _mm_and_si128(eq, _mm_cmpeq_epi8(b, last));
+    return _mm_movemask_epi8(eq);
+}
+
+// Scan forward 16 positions at a time, and finish off with the scalar version.
+__attribute__((target("sse2")))
+static int forwardSSE2(finder *f, int n, char const *s) {
+    int i = 0;
+    for (; i + f->n - 1 + 16 <= n; i += 16) {
+        int bits = candidates16(f, &s[i]);
+        while (bits != 0) {
+            int k = __builtin_ctz(bits);
+            if (verify(f, &s[i + k])) return i + k;
+            bits &= bits - 1;
+        }
+    }
+    int k = forwardScalar(f, n - i, &s[i]);
+    return (k < 0) ? -1 : i + k;
+}
+
+// Scan backward 16 positions at a time, after dealing with the scalar tail.
+__attribute__((target("sse2")))
+static int backwardSSE2(finder *f, int n, char const *s) {
+    int top = n - f->n + 1;
+    int i = top - 16;
+    if (i < 0) return backwardScalar(f, n, s);
+    int k = backwardScalar(f, n - (i + 16), &s[i + 16]);
+    if (k >= 0) return i + 16 + k;
+    for (; i >= 0; i -= 16) {
+        int bits = candidates16(f, &s[i]);
+        while (bits != 0) {
+            int k = 31 - __builtin_clz(bits);
+            if (verify(f, &s[i + k])) return i + k;
+            bits &= ~(1 << k);
+        }
+    }
+    return backwardScalar(f, i + 16 + f->n - 1, s);
+}
+
+// Find candidates in a block of 32 positions starting at s.
+__attribute__((target("avx2")))
+static inline uint32_t candidates32(finder *f, char const *s) {
+    int m = f->n;
+    __m256i first = _mm256_set1_epi8(f->pattern[0]);
+    __m256i last = _mm256_set1_epi8(f->pattern[m - 1]);
+    __m256i a = _mm256_loadu_si256((__m256i const *) s);
+    __m256i b = _mm256_loadu_si256((__m256i const *) &s[m - 1]);
+    a = _mm256_or_si256(a, _mm256_set1_epi8(f->mask[0]));
+    b = _mm256_or_si256(b, _mm256_set1_epi8(f->mask[m - 1]));
+    __m256i eq = _mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last));
+    return (uint32_t) _mm256_movemask_epi8(eq);
+}
+
+// Scan forward 32 positions at a time.
+__attribute__((target("avx2")))
+static int forwardAVX2(finder *f, int n, char const *s) {
+    int i = 0;
+    for (; i + f->n - 1 + 32 <= n; i += 32) {
+        uint32_t bits = candidates32(f, &s[i]);
+        while (bits != 0) {
+            int k = __builtin_ctz(bits);
+            if (verify(f, &s[i + k])) return i + k;
+            bits &= bits - 1;
+        }
+    }
+    int k = forwardScalar(f, n - i, &s[i]);
+    return (k < 0) ? -1 : i + k;
+}
+
+// Scan backward 32 positions at a time.
+__attribute__((target("avx2")))
+static int backwardAVX2(finder *f, int n, char const *s) {
+    int top = n - f->n + 1;
+    int i = top - 32;
+    if (i < 0) return backwardScalar(f, n, s);
+    int k = backwardScalar(f, n - (i + 32), &s[i + 32]);
+    if (k >= 0) return i + 32 + k;
+    for (; i >= 0; i -= 32) {
+        uint32_t bits = candidates32(f, &s[i]);
+        while (bits != 0) {
+            int k = 31 - __builtin_clz(bits);
+            if (verify(f, &s[i + k])) return i + k;
+            bits &= ~(1u << k);
+        }
+    }
+    return backwardScalar(f, i + 32 + f->n - 1, s);
+}
+
+#endif
+
+// Choose the scanning functions for the processor.
+static void chooseScanners(finder *f) {
+    f->forward = forwardScalar;
+    f->backward = backwardScalar;
+#ifdef VECTORS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        f->forward = forwardAVX2;
+        f->backward = backwardAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        f->forward = forwardSSE2;
+        f->backward = backwardSSE2;
+    }
+#endif
+}
+
+finder *newFinder(int n, char const *pattern, int options) {
+    finder *f = malloc(sizeof(finder));
+    f->n = n;
+    f->fold = (options & IgnoreCase) != 0;
+    f->word = (options & WholeWord) != 0;
+    f->pattern = malloc(n + 1);
+    f->mask = malloc(n + 1);
+    for (int i = 0; i < n; i++) {
+        char ch = pattern[i];
+        bool letter = ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z');
+        f->mask[i] = (f->fold && letter) ? 0x20 : 0;
+        f->pattern[i] = ch | f->mask[i];
+    }
+    chooseScanners(f);
+    return f;
+}
+
+void freeFinder(finder *f) {
+    free(f->pattern);
+    free(f->mask);
+    free(f);
+}
+
+int lengthFinder(finder *f) {
+    return f->n;
+}
+
+// Get the byte at a given position, or -1 if out of range.
+static int byteAt(text *t, int at) {
+    if (at < 0 || at >= lengthText(t)) return -1;
+    span spans[2];
+    readText(t, at, 1, spans);
+    return (unsigned char) spans[0].s[0];
+}
+
+// Check a match which has been found, for whole-word matching.
+static bool accept(finder *f, text *t, int at) {
+    if (! f->word) return true;
+    if (wordByte(byteAt(t, at - 1))) return false;
+    return ! wordByte(byteAt(t, at + f->n));
+}
+
+// Copy the bytes at the position, since they may straddle a boundary between
+// spans.
+bool findAt(finder *f, text *t, int at) {
+    if (at < 0 || at + f->n > lengthText(t)) return false;
+    span spans[2];
+    readText(t, at, f->n, spans);
+    char s[f->n];
+    memcpy(s, spans[0].s, spans[0].n);
+    memcpy(&s[spans[0].n], spans[1].s, spans[1].n);
+    return verify(f, s) && accept(f, t, at);
+}
+
+// Scan each span, and then check positions where the pattern straddles the end
+// of the span. Bytes beyond the last position a match could start at are not
+// looked at.
+int findNext(finder *f, text *t, int from, int to) {
+    int m = f->n, end = lengthText(t);
+    if (m == 0) return -1;
+    if (from < 0) from = 0;
+    if (to < end - m + 1) end = to + m - 1;
+    for (int at = from; at + m <= end; ) {
+        span sp = spanText(t, at);
+        if (sp.n > end - at) sp.n = end - at;
+        for (int i = 0; ; ) {
+            int k = f->forward(f, sp.n - i, &sp.s[i]);
+            if (k < 0) break;
+            if (accept(f, t, at + i + k)) return at + i + k;
+            i = i + k + 1;
+        }
+        int start = at + sp.n - m + 1;
+        if (start < at) start = at;
+        for (int p = start; p < at + sp.n && p + m <= end; p++) {
+            if (findAt(f, t, p)) return p;
+        }
+        at = at + sp.n;
+    }
+    return -1;
+}
+
+// Scan each span backwards, after checking positions where the pattern
+// straddles the end of the span, excluding those at or after the limit.
+int findPrevious(finder *f, text *t, int before) {
+    int m = f->n, length = lengthText(t);
+    if (m == 0) return -1;
+    if (before > length - m + 1) before = length - m + 1;
+    for (int at = before - 1 + m; at > 0 && before > 0; ) {
+        span sp = spanBefore(t, at);
+        int start = at - sp.n;
+        for (int p = at - 1; p > at - m && p >= start; p--) {
+            if (p < before && findAt(f, t, p)) return p;
+        }
+        int n = sp.n;
+        if (before - 1 + m - start < n) n = before - 1 + m - start;
+        while (n >= m) {
+            int k = f->backward(f, n, sp.s);
+            if (k < 0) break;
+            if (accept(f, t, start + k)) return start + k;
+            n = k + m - 1;
+        }
+        at = start;
+    }
+    return -1;
+}
+
+bool extendsFinder(finder *f, finder *g) {
+    if (f->fold != g->fold || f->word || g->word || g->n <= f->n) return false;
+    if (memcmp(f->pattern, g->pattern, f->n) != 0) return false;
+    for (int k = 1; k < f->n; k++) {
+        if (memcmp(f->pattern, &f->pattern[f->n - k], k) == 0) return false;
+    }
+    return true;
+}
+
+int countMatches(finder *f, text *t) {
+    int count = 0;
+    int length = lengthText(t);
+    for (int at = findNext(f, t, 0, length); at >= 0; ) {
+        count++;
+        at = findNext(f, t, at + f->n, length);
+    }
+    return count;
+}
+
+#ifdef searchTest
+
+// The objects which go with the text being tested.
+static lines *ls;
+static cursors *cs;
+static history *h;
+
+// Make a text from a string, either as a gap buffer with the gap at a given
+// position, or as a piece table with an insertion at that position.
+static text *makeText(char *s, bool mapped, int gap) {
+    h = newHistory();
+    cs = newCursors(h);
+    ls = newLines();
+    text *t = newText(ls, cs, h);
+    int n = strlen(s);
+    char *rest = malloc(n + 1);
+    if (mapped) mapText(t, n - 1, s);
+    else {
+        strcpy(rest, s);
+        loadText(t, n - 1, rest);
+    }
+    free(rest);
+    insertText(t, gap, 1, &s[n - 1]);
+    return t;
+}
+
+// Free a text made by makeText.
+static void dropText(text *t) {
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check searching in a text given as a string, whose last character is
+// inserted at a given position, to test matches straddling the gap or pieces.
+static void check(char *s, int gap, char *p, int options, int next, int prev) {
+    for (int i = 0; i < 2; i++) {
+        text *t = makeText(s, i == 1, gap);
+        finder *f = newFinder(strlen(p), p, options);
+        assert(findNext(f, t, 0, lengthText(t)) == next);
+        assert(findPrevious(f, t, lengthText(t)) == prev);
+        freeFinder(f);
+        dropText(t);
+    }
+}
+
+// Test simple cases, including matches straddling the gap.
+static void testFind() {
+    check("abc\nabc\nX", 0, "abc", 0, 1, 5);
+    check("abc\nxz\ny", 5, "xyz", 0, 4, 4);
+    check("abc\nxz\ny", 5, "xYz", 0, -1, -1);
+    check("abc\nxz\ny", 5, "XYZ", IgnoreCase, 4, 4);
+    check("ab cab\nz", 7, "ab", WholeWord, 0, 0);
+    check("ab cab ab\nz", 10, "ab", WholeWord, 0, 7);
+    check("Xab\n", 1, "ab", 0, 2, 2);
+}
+
+// Compare with a naive search on a long text, with random gap positions, for
+// each of the scanning functions.
+static void testRandom() {
+    int n = 3000;
+    char s[n + 2];
+    srand(7);
+    for (int i = 0; i < n; i++) s[i] = "abAB \n"[rand() % 6];
+    s[n - 2] = '\n';
+    s[n - 1] = 'a';
+    s[n] = '\0';
+    char *patterns[] = {
+        "a", "ab", "aBa", "abab", "ab ba", "aaaaaaaaaaaaaaaaaaaaa"
+    };
+    for (int k = 0; k < 60; k++) {
+        char *p = patterns[k % 6];
+        int m = strlen(p), options = k % 3 == 0 ? IgnoreCase : 0;
+        int gap = rand() % (n - 1);
+        for (int mapped = 0; mapped < 2; mapped++) {
+            text *t = makeText(s, mapped, gap);
+            int length = lengthText(t);
+            char plain[length + 1];
+            getText(t, 0, length, plain);
+            finder *f = newFinder(m, p, options);
+            int at = rand() % length, to = at + rand() % 100;
+            int next = -1, prev = -1, near = -1;
+            for (int i = 0; i + m <= length; i++) {
+                bool ok = (options & IgnoreCase) ?
+                    strncasecmp(&plain[i], p, m) == 0 :
+                    strncmp(&plain[i], p, m) == 0;
+                if (ok && i >= at && next < 0) next = i;
+                if (ok && i < at) prev = i;
+            }
+            if (next < to) near = next;
+            assert(findNext(f, t, at, length) == next);
+            assert(findNext(f, t, at, to) == near);
+            assert(findPrevious(f, t, at) == prev);
+            f->forward = forwardScalar;
+            f->backward = backwardScalar;
+            assert(findNext(f, t, at, length) == next);
+            assert(findPrevious(f, t, at) == prev);
+#ifdef VECTORS
+            f->forward = forwardSSE2;
+            f->backward = backwardSSE2;
+            assert(findNext(f, t, at, length) == next);
+            assert(findPrevious(f, t, at) == prev);
+#endif
+            freeFinder(f);
+            dropText(t);
+        }
+    }
+}
+
+// Test checking single positions, and extending patterns.
+static void testExtend() {
+    text *t = makeText("xab abc\nz", false, 8);
+    finder *f = newFinder(2, "ab", 0), *g = newFinder(3, "abc", 0);
+    assert(! findAt(f, t, 0) && findAt(f, t, 1) && findAt(f, t, 4));
+    assert(! findAt(g, t, 1) && findAt(g, t, 4) && ! findAt(g, t, 6));
+    assert(extendsFinder(f, g) && ! extendsFinder(g, f));
+    finder *a2 = newFinder(2, "aa", 0), *a3 = newFinder(3, "aaa", 0);
+    assert(! extendsFinder(a2, a3));
+    finder *w = newFinder(3, "abc", WholeWord);
+    finder *i = newFinder(3, "ABC", IgnoreCase);
+    assert(! extendsFinder(f, w) && ! extendsFinder(f, i));
+    freeFinder(f);
+    freeFinder(g);
+    freeFinder(a2);
+    freeFinder(a3);
+    freeFinder(w);
+    freeFinder(i);
+    dropText(t);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testFind();
+    testExtend();
+    testRandom();
+    printf("Search module OK\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+// Literal search. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A finder searches a text for a literal pattern. It scans the spans of the
+// text where they are, on either side of a gap or in separate pieces, without
+// copying the text or moving the gap, and finds matches which straddle spans.
+// Candidates are found a block at a time using vector instructions, if
+// available, by checking the first and last bytes of the pattern, and then
+// they are verified. Case-insensitive matching applies to ASCII letters only.
+// Whole-word matching treats ASCII letters, digits, underscores and all
+// non-ASCII characters as word characters.
+struct finder;
+typedef struct finder finder;
+typedef struct text text;
+
+// Options for searching.
+enum { IgnoreCase = 1, WholeWord = 2 };
+
+// Prepare to search for a pattern of n bytes, with a combination of options.
+finder *newFinder(int n, char const *pattern, int options);
+
+// Free a finder, but not the text it has been used on.
+void freeFinder(finder *f);
+
+// Find the length of the pattern, which is the length of every match.
+int lengthFinder(finder *f);
+
+// Find the first match starting at or after from and before to, or return -1.
+int findNext(finder *f, text *t, int from, int to);
+
+// Find the last match starting before a given position, or return -1.
+int findPrevious(finder *f, text *t, int before);
+
+// Check whether there is a match at a given position.
+bool findAt(finder *f, text *t, int at);
+
+// Check whether every match of g is at the position of a match of f, e.g. when
+// the user has typed another character of the pattern, so that the matches of
+// g can be found by checking those of f. That is so if the pattern of g
+// extends that of f, with the same options, and the matches of f can't
+// overlap, so that none of its occurrences are skipped.
+bool extendsFinder(finder *f, finder *g);
+
+// Count all the non-overlapping matches in the text.
+int countMatches(finder *f, text *t);
@@ -1,5 +1,6 @@
 // The Snipe editor is free and open source, see licence.txt.
 #include "text.h"
+#include "pieces.h"
 #include "unicode.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,34 +11,69 @@
 // TODO: text -> cursors -> lines -> history
 
 // A text object stores an array of bytes, as a gap buffer. The gap is between
-// offsets lo and hi in the data array. After each edit, startEdit and endEdit
-// cover the range of text which may have changed. For realloc info, see
+// offsets lo and hi in the data array. Alternatively, for a big file mapped
+// into memory, the bytes are stored in a piece table ps, and the gap buffer is
+// unused, and a copy buffer is used when reading across pieces. When a snapshot
+// of a gap buffer is taken, the buffer is handed over to a piece table, in a
+// store shared with the snapshot. A view of a snapshot shares its storage, and
+// has no lines, cursors or history. Each insertion or deletion
+// is recorded in the history relative to pos, the position just after the
+// previous one. After each edit, startEdit and endEdit cover the range of text
+// which may have changed. The original content of a mapped file is registered
+// with the history as a source, or else source is -1. For realloc info, see
 // http://blog.httrack.com/blog/2014/04/05/a-story-of-realloc-and-laziness/
 struct text {
     char *data;
     int lo, hi, end;
+    pieces *ps;
+    char *copy;
+    int copyMax;
+    struct store *store;
+    bool view;
+    int pos;
     cursors *cs;
     lines *ls;
     history *h;
+    int source;
     int startEdit, endEdit;
 };
 
-text *newText(cursors *cs, lines *ls, history *h) {
+text *newText(lines *ls, cursors *cs, history *h) {
     int n = 1024;
     text *t = malloc(sizeof(text));
     char *data = malloc(n);
-    *t = (text) { .lo=0, .hi=n, .end=n, .data=data, .cs=cs, .ls=ls, .h=h };
+    *t = (text) {
+        .lo=0, .hi=n, .end=n, .data=data, .ps=NULL, .copy=NULL, .copyMax=0,
+        .store=NULL, .view=false, .pos=0, .cs=cs, .ls=ls, .h=h, .source=-1
+    };
     t->startEdit = -1;
     t->endEdit = -1;
     return t;
 }
 
+// A store holds a buffer handed over from a gap buffer to a piece table, which
+// is shared by the text and its snapshots, and freed by the last of them.
+struct store { char *data; int refs; };
+typedef struct store store;
+
+// Release a store, if any, freeing it if it is no longer used.
+static void releaseStore(store *st) {
+    if (st == NULL || --st->refs > 0) return;
+    free(st->data);
+    free(st);
+}
+
 void freeText(text *t) {
-    free(t->data);
+    if (t->ps != NULL) freePieces(t->ps);
+    releaseStore(t->store);
+    if (t->source >= 0) releaseSource(t->h, t->source);
+    free(t->copy);
+    if (! t->view) free(t->data);
     free(t);
 }
 
 extern inline int lengthText(text *t) {
+    if (t->ps != NULL) return lengthPieces(t->ps);
     return t->lo + (t->end - t->hi);
 }
 
@@ -72,74 +108,661 @@ static void moveGap(text *t, int at) {
     }
 }
 
-// Clean up new UTF-8-valid text. Remove \0 to \7, carriage returns, tabs,
-// trailing spaces, trailing blank lines, and add a final newline.
-static int clean(int n, char *s) {
-    int j = 0;
+// A snapshot is a copy of a piece table, which shares the nodes of the table
+// until the text changes them, with the store it refers to, if any.
+struct snapshot {
+    pieces *ps;
+    store *store;
+};
+
+// A gap buffer is handed over to a piece table, which the text uses from then
+// on, so that the text and the snapshot share its bytes without either copying
+// them, even when the text is edited. The text gets a fresh, empty gap buffer
+// for when it is next loaded.
+snapshot *snapText(text *t) {
+    if (t->ps == NULL) {
+        t->store = malloc(sizeof(store));
+        *t->store = (store) { .data=t->data, .refs=1 };
+        t->ps = wrapPieces(t->data, t->lo, t->hi, t->end);
+        t->data = malloc(1024);
+        t->lo = 0;
+        t->hi = t->end = 1024;
+    }
+    snapshot *s = malloc(sizeof(snapshot));
+    *s = (snapshot) { .ps=copyPieces(t->ps), .store=t->store };
+    if (s->store != NULL) s->store->refs++;
+    return s;
+}
+
+int lengthSnapshot(snapshot *s) {
+    return lengthPieces(s->ps);
+}
+
+span spanSnapshot(snapshot *s, int at) {
+    span result;
+    int n = lengthPieces(s->ps) - at;
+    result.s = spanPieces(s->ps, at, n, &result.n);
+    return result;
+}
+
+text *viewSnapshot(snapshot *s) {
+    text *t = malloc(sizeof(text));
+    *t = (text) {
+        .data=NULL, .lo=0, .hi=0, .end=0, .ps=sharePieces(s->ps),
+        .copy=NULL, .copyMax=0, .store=NULL, .view=true, .pos=0, .cs=NULL,
+        .ls=NULL, .h=NULL, .source=-1, .startEdit=-1, .endEdit=-1
+    };
+    return t;
+}
+
+void freeSnapshot(snapshot *s) {
+    freePieces(s->ps);
+    releaseStore(s->store);
+    free(s);
+}
+
+void detachText(text *t) {
+    if (t->source >= 0) releaseSource(t->h, t->source);
+    t->source = -1;
+}
+
+// Discard any piece table from a previous mapped file or snapshot, and its
+// store, and release its source.
+static void discardPieces(text *t) {
+    if (t->ps == NULL) return;
+    freePieces(t->ps);
+    t->ps = NULL;
+    releaseStore(t->store);
+    t->store = NULL;
+    detachText(t);
+}
+
+// Files are loaded in blocks which fit comfortably in the cache.
+enum { BLOCK = 65536 };
+
+// Find the end of a block starting at a given position, at a code point
+// boundary, i.e. not at a UTF-8 continuation byte.
+static int endBlock(int n, char const *s, int start) {
+    int end = start + BLOCK;
+    if (end >= n) return n;
+    while (end > start && (s[end] & 0xC0) == 0x80) end--;
+    if (end == start) end = start + BLOCK;
+    return end;
+}
+
+// Clean up a block of new UTF-8-valid text, copying it into the gap buffer
+// after the first j bytes, removing carriage returns and trailing spaces and
+// converting tabs to spaces. Record the lengths of the lines completed in the
+// block, with *pline being the start of the current line. Return the new j.
+// Runs of bytes above '\r' are copied without further checks.
+static int cleanBlock(text *t, int j, int n, char const *s, int *pline,
+    int *lengths, int *pcount) {
+    char *out = t->data;
+    int line = *pline, count = 0;
     for (int i = 0; i < n; i++) {
+        int run = i;
+        while (i < n && (unsigned char) s[i] > '\r') i++;
+        memcpy(&out[j], &s[run], i - run);
+        j += i - run;
+        if (i == n) break;
         char ch = s[i];
-        if ('\0' <= ch && ch <= '\7') continue;
-        else if (ch == '\r') continue;
-        else if (ch == '\n') {
-            while (j > 0 && s[j-1] == ' ') j--;
+        if (ch == '\n') {
+            while (j > line && out[j-1] == ' ') j--;
+            out[j++] = '\n';
+            lengths[count++] = j - line;
+            line = j;
         }
-        else if (ch == '\t') ch = ' ';
-        s[j++] = ch;
+        else if (ch == '\r') continue;
+        else if (ch == '\t') out[j++] = ' ';
+        else out[j++] = ch;
     }
-    n = j;
-    while (n > 0 && s[n-1] == ' ') n--;
-    if (n > 0 && s[n-1] != '\n') s[n++] = '\n';
-    while (n > 1 && s[n-2] == '\n') n--;
-    s[n] = '\0';
-    return n;
+    *pline = line;
+    *pcount = count;
+    return j;
 }
 
+// Make one pass through the file, block by block. Each block is validated,
+// cleaned and copied into the gap buffer, and its newlines are found, while it
+// is in the cache, and the lines in it are added to the lines object in bulk.
+// Then remove trailing spaces, add a final newline if necessary, and remove
+// trailing blank lines.
 bool loadText(text *t, int n, char *buffer) {
-    bool ok = uvalid(n, buffer, true);
-    if (! ok) return false;
-    n = clean(n, buffer);
+    discardPieces(t);
+    clearLines(t->ls);
     t->lo = 0;
     t->hi = t->end;
-    resizeText(t, n);
-    t->hi = t->end - n;
-    memcpy(&t->data[t->hi], buffer, n);
+    t->pos = 0;
+    resizeText(t, n + 1);
+    int *lengths = malloc(BLOCK * sizeof(int));
+    int j = 0, line = 0, count;
+    for (int start = 0; start < n; ) {
+        int end = endBlock(n, buffer, start), size = end - start;
+        if (uvalid(size, &buffer[start]) >= 0) {
+            clearLines(t->ls);
+            free(lengths);
+            return false;
+        }
+        j = cleanBlock(t, j, size, &buffer[start], &line, lengths, &count);
+        appendLines(t->ls, count, lengths);
+        start = end;
+    }
+    free(lengths);
+    char *out = t->data;
+    while (j > line && out[j-1] == ' ') j--;
+    if (j > line) {
+        out[j++] = '\n';
+        appendLines(t->ls, 1, (int[]) { j - line });
+    }
+    int blank = j;
+    while (j > 1 && out[j-2] == '\n') j--;
+    if (j < blank) deleteLines(t->ls, blank, blank - j, &out[j]);
+    t->lo = j;
     return true;
 }
 
-/*
-// Expand the fix range to cover an insertion or deletion, plus one extra byte,
-// so covering any byte which might contain a newline with preceding spaces.
-static void addRange(text *t, int from, int to) {
-    if (t->startFix < 0) t->startFix = t->endFix = from;
-    if (from < t->startFix) t->startFix = from;
-    if (to >= t->endFix) {
-        if (to < lengthText(t)) t->endFix = to + 1;
-        else t->endFix = to;
+// Find the lines in a piece table, a block at a time.
+static void indexPieces(text *t) {
+    int n = lengthPieces(t->ps);
+    char *block = malloc(BLOCK);
+    int *lengths = malloc(BLOCK * sizeof(int));
+    int line = 0;
+    for (int start = 0; start < n; start += BLOCK) {
+        int len = (n - start < BLOCK) ? n - start : BLOCK;
+        getPieces(t->ps, start, len, block);
+        int count = 0;
+        char *p = block, *end = block + len;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            int at = start + (p - block);
+            lengths[count++] = at - line;
+            line = at;
+        }
+        appendLines(t->ls, count, lengths);
     }
+    free(block);
+    free(lengths);
 }
 
-void getText(text *t, position at, int n, char *s) {
-    if (at + n > lengthText(t)) return;
-    moveGap(t, at + n);
-    memcpy(s, &t->data[at], n);
-    s[n] = '\0';
+// The cleaning is done by the piece table, by skipping bytes, so that the
+// mapped data is never copied or written to.
+bool mapText(text *t, int n, char const *data) {
+    if (uvalid(n, data) >= 0) return false;
+    discardPieces(t);
+    clearLines(t->ls);
+    t->lo = 0;
+    t->hi = t->end;
+    t->pos = 0;
+    t->ps = newPieces(n, data);
+    if (t->h != NULL) t->source = sourceHistory(t->h, n, data);
+    indexPieces(t);
+    return true;
+}
+
+// Copy the text one span at a time, so that a piece table doesn't need a copy
+// buffer as big as the text.
+char *saveText(text *t, char *buffer) {
+    int n = lengthText(t);
+    for (int at = 0; at < n; ) {
+        span s = spanText(t, at);
+        memcpy(&buffer[at], s.s, s.n);
+        at += s.n;
+    }
+    return buffer;
+}
+
+// Expand the changed range to cover an insertion or deletion.
+static void addRange(text *t, int from, int to) {
+    if (t->startEdit < 0) t->startEdit = t->endEdit = from;
+    if (from < t->startEdit) t->startEdit = from;
+    if (to > t->endEdit) t->endEdit = to;
 }
 
-// Update the fix range after an insertion (n>0) or deletion (n<0). Cover the
-// case where the position was in the middle of the deleted text.
+// Update the changed range after an insertion or deletion of n bytes. Cover the
+// case where the range ends in the middle of the deleted text.
 static void update(text *t, int at, int n, bool insert) {
+    if (t->startEdit < 0) return;
     if (insert) {
-        if (t->startFix > at) t->startFix += n;
-        if (t->endFix >= at) t->endFix += n;
+        if (t->startEdit > at) t->startEdit += n;
+        if (t->endEdit >= at) t->endEdit += n;
+    }
+    else {
+        if (t->startEdit > at + n) t->startEdit -= n;
+        else if (t->startEdit >= at) t->startEdit = at;
+        if (t->endEdit > at + n) t->endEdit -= n;
+        else if (t->endEdit > at) t->endEdit = at;
+    }
+}
+
+// Find the row and column of a position, using the lines before any edit.
+static void rowCol(text *t, int at, int *row, int *col) {
+    int r = findRow(t->ls, at);
+    int start = (r < countLines(t->ls)) ? startLine(t->ls, r) :
+        (r == 0) ? 0 : endLine(t->ls, r - 1);
+    *row = r;
+    *col = at - start;
+}
+
+// Adjust the cursors for an insertion, finding where the inserted text ends
+// from its newlines.
+static void insertAdjust(text *t, int at, int n, char const *s) {
+    int row, col;
+    rowCol(t, at, &row, &col);
+    int endRow = row, endCol = col + n;
+    for (int i = 0; i < n; i++) if (s[i] == '\n') {
+        endRow++;
+        endCol = n - i - 1;
+    }
+    insertCursors(t->cs, row, col, endRow, endCol);
+}
+
+// Insert bytes, without recording the insertion in the history.
+static void insertBytes(text *t, int at, int n, char const *s) {
+    if (t->cs != NULL) insertAdjust(t, at, n, s);
+    if (t->ps != NULL) insertPieces(t->ps, at, n, s);
+    else {
+        moveGap(t, at);
+        resizeText(t, n);
+        memcpy(&t->data[at], s, n);
+        t->lo = t->lo + n;
+    }
+    insertLines(t->ls, at, n, s);
+    update(t, at, n, true);
+    addRange(t, at, at + n);
+    t->pos = at + n;
+}
+
+void insertText(text *t, int at, int n, char s[n]) {
+    if (at < 0 || at > lengthText(t) || n <= 0) return;
+    saveInsert(t->h, at - t->pos, n, s);
+    insertBytes(t, at, n, s);
+}
+
+// Deletions of at least this many bytes from the original content of a mapped
+// file are recorded in the history by reference, rather than copied, as long
+// as the history's source hasn't been released or rebuilt from copies.
+enum { REFER = 4096 };
+
+// Delete bytes, optionally recording the deletion in the history. The deleted
+// bytes are needed for the history and the lines object. With a piece table,
+// they are copied out first, unless they are a run of the original content
+// which the history can refer to.
+static void deleteBytes(text *t, int from, int to, bool record) {
+    int n = to - from;
+    int row, col, endRow, endCol;
+    if (t->cs != NULL) {
+        rowCol(t, from, &row, &col);
+        rowCol(t, to, &endRow, &endCol);
+    }
+    int offset = -1;
+    bool live = t->source >= 0 && extentsSource(t->h, t->source) < 0;
+    if (t->ps != NULL && record && live && n >= REFER) {
+        offset = originPieces(t->ps, from, n);
+    }
+    if (offset >= 0) {
+        int length;
+        char const *s = spanPieces(t->ps, from, n, &length);
+        saveDeleteSource(t->h, to - t->pos, t->source, offset, n);
+        deletePieces(t->ps, from, to);
+        deleteLines(t->ls, to, n, s);
+    }
+    else if (t->ps != NULL) {
+        char *s = malloc(n);
+        getPieces(t->ps, from, n, s);
+        if (record) saveDelete(t->h, to - t->pos, n, s);
+        deletePieces(t->ps, from, to);
+        deleteLines(t->ls, to, n, s);
+        free(s);
     }
     else {
-        if (t->startFix > at + n) t->startFix -= n;
-        else if (t->startFix >= at) t->startFix = at;
-        if (t->endFix > at + n) t->endFix -= n;
-        else if (t->endFix > at) t->endFix = at;
+        moveGap(t, to);
+        if (record) saveDelete(t->h, to - t->pos, n, &t->data[from]);
+        t->lo = from;
+        deleteLines(t->ls, to, n, &t->data[from]);
+    }
+    if (t->cs != NULL) deleteCursors(t->cs, row, col, endRow, endCol);
+    update(t, from, n, false);
+    addRange(t, from, from);
+    t->pos = from;
+}
+
+void deleteText(text *t, int from, int to) {
+    if (to < from) { int temp = from; from = to; to = temp; }
+    if (from < 0) from = 0;
+    if (to > lengthText(t)) to = lengthText(t);
+    if (to <= from) return;
+    deleteBytes(t, from, to, true);
+}
+
+// Move a position back to the start of the character containing it, but not
+// before the start of its line.
+static int boundary(text *t, int at, int start) {
+    char c[2];
+    while (at > start) {
+        getText(t, at, 1, c);
+        if ((c[0] & 0xC0) != 0x80) break;
+        at--;
+    }
+    return at;
+}
+
+int columnText(text *t, int row, int col) {
+    if (row < 0 || row >= countLines(t->ls)) return -1;
+    if (col < 0) col = 0;
+    int start = startLine(t->ls, row), length = lengthLine(t->ls, row) - 1;
+    if (col > length) col = length;
+    return boundary(t, start + col, start) - start;
+}
+
+// Each row's edit is near the previous one, so moving the gap is cheap.
+void replaceColumns(text *t, int row, int endRow, int col, int endCol,
+    int n, char s[n]) {
+    if (row < 0) row = 0;
+    if (endRow >= countLines(t->ls)) endRow = countLines(t->ls) - 1;
+    if (col < 0 || endCol < col) return;
+    for (int r = row; r <= endRow; r++) {
+        int start = startLine(t->ls, r), length = lengthLine(t->ls, r) - 1;
+        if (length < col) continue;
+        int end = endCol < length ? endCol : length;
+        int from = boundary(t, start + col, start);
+        int to = boundary(t, start + end, start);
+        if (to > from) deleteBytes(t, from, to, true);
+        if (n <= 0) continue;
+        saveInsert(t->h, from - t->pos, n, s);
+        insertBytes(t, from, n, s);
+    }
+}
+
+// Convert the ranges into rows and columns, as points for the cursors.
+void selectText(text *t, int n, int ranges[n][2]) {
+    if (n <= 0) return;
+    int (*points)[4] = malloc(n * sizeof(int[4]));
+    for (int i = 0; i < n; i++) {
+        rowCol(t, ranges[i][1], &points[i][0], &points[i][1]);
+        rowCol(t, ranges[i][0], &points[i][2], &points[i][3]);
+    }
+    setCursors(t->cs, n, points);
+    free(points);
+}
+
+// Insertions and deletions take place at pos, and any other edit is passed on
+// to the cursors.
+bool editText(text *t, edit e) {
+    int length = lengthText(t);
+    switch (e.op) {
+        case Move:
+            if (t->pos + e.n < 0 || t->pos + e.n > length) return false;
+            t->pos += e.n;
+            break;
+        case Insert:
+            if (e.n < 0) return false;
+            insertBytes(t, t->pos, e.n, e.s);
+            break;
+        case Delete:
+            if (e.n < 0 || t->pos - e.n < 0) return false;
+            deleteBytes(t, t->pos - e.n, t->pos, false);
+            break;
+        case End: break;
+        default: if (t->cs != NULL) editCursors(t->cs, e); break;
+    }
+    return true;
+}
+
+int positionText(text *t) { return t->pos; }
+
+// The edits of an action, gathered from the history for replay. Their strings
+// or vectors are copied into one buffer, at the given offsets, since the
+// history only keeps them until the next edit.
+struct batch { int n, max, size, room; edit *es; int *offsets; char *bytes; };
+typedef struct batch batch;
+
+// A text edit at a position in the text as left by the edits before it.
+struct change { bool insert; int at, n; char const *s; };
+typedef struct change change;
+
+// Add an edit to a batch.
+static void gather(batch *b, edit e) {
+    if (b->n >= b->max) {
+        b->max = b->max * 3 / 2;
+        b->es = realloc(b->es, b->max * sizeof(edit));
+        b->offsets = realloc(b->offsets, b->max * sizeof(int));
+    }
+    int k = (e.s == NULL) ? 0 : e.n;
+    if (b->size + k > b->room) {
+        while (b->size + k > b->room) b->room = b->room * 3 / 2;
+        b->bytes = realloc(b->bytes, b->room);
     }
+    if (k > 0) memcpy(&b->bytes[b->size], e.s, k);
+    b->offsets[b->n] = b->size;
+    b->es[b->n++] = e;
+    b->size += k;
 }
 
+// Check whether changes are in ascending order of position without
+// overlapping, returning 1, or in descending order, returning -1, or neither.
+static int direction(int n, change cs[n]) {
+    bool up = true, down = true;
+    for (int i = 1; i < n; i++) {
+        change *c = &cs[i - 1], *d = &cs[i];
+        if (d->at < c->at + (c->insert ? c->n : 0)) up = false;
+        if (d->at + (d->insert ? 0 : d->n) > c->at) down = false;
+    }
+    return up ? 1 : down ? -1 : 0;
+}
+
+// Put changes in descending order into ascending order. Changes which touch,
+// e.g. a deletion and an insertion at the same place, stay together in their
+// original order. Each group is shifted by the changes to its left, which
+// were originally applied after it.
+static void ascend(int n, change cs[n], change out[n]) {
+    int shift = 0, k = 0;
+    for (int end = n; end > 0; ) {
+        int start = end - 1;
+        while (start > 0) {
+            change *c = &cs[start - 1], *d = &cs[start];
+            if (d->at + (d->insert ? 0 : d->n) < c->at) break;
+            start--;
+        }
+        int delta = 0;
+        for (int i = start; i < end; i++) {
+            out[k] = cs[i];
+            out[k++].at += shift;
+            delta += cs[i].insert ? cs[i].n : - cs[i].n;
+        }
+        shift += delta;
+        end = start;
+    }
+}
+
+// Apply a run of insertions and deletions, relative to pos. If they are in
+// order of position, forwards or backwards, as with a multi-cursor edit or its
+// undo, they are applied in ascending order, in one pass which moves the gap
+// forwards from each to the next, after a single resize. Otherwise, or with a
+// piece table, they are applied one at a time.
+static void sweep(text *t, int n, edit const es[n]) {
+    change *cs = malloc((2 * n + 1) * sizeof(change)), *up = &cs[n];
+    int pos = t->pos, k = 0, grow = 0;
+    for (int i = 0; i < n; i++) {
+        edit e = es[i];
+        if (e.op == Move) { pos += e.n; continue; }
+        bool insert = e.op == Insert;
+        if (! insert) pos -= e.n;
+        cs[k++] = (change) { .insert=insert, .at=pos, .n=e.n, .s=e.s };
+        if (insert) { pos += e.n; grow += e.n; }
+    }
+    int order = direction(k, cs);
+    if (t->ps != NULL || order == 0 || k < 2) {
+        for (int i = 0; i < n; i++) editText(t, es[i]);
+        free(cs);
+        return;
+    }
+    if (order < 0) ascend(k, cs, up);
+    else up = cs;
+    resizeText(t, grow);
+    for (int i = 0; i < k; i++) {
+        change *c = &up[i];
+        if (c->insert) insertBytes(t, c->at, c->n, c->s);
+        else deleteBytes(t, c->at, c->at + c->n, false);
+    }
+    t->pos = pos;
+    free(cs);
+}
+
+// Replay a batch of edits, sweeping each run of text edits between any cursor
+// edits.
+static void replay(text *t, batch *b) {
+    for (int i = 0; i < b->n; i++) {
+        if (b->es[i].s != NULL) b->es[i].s = &b->bytes[b->offsets[i]];
+    }
+    int start = 0;
+    for (int i = 0; i <= b->n; i++) {
+        int op = (i < b->n) ? b->es[i].op : End;
+        if (op == Move || op == Insert || op == Delete) continue;
+        sweep(t, i - start, &b->es[start]);
+        if (i < b->n) editText(t, b->es[i]);
+        start = i + 1;
+    }
+}
+
+// Create an empty batch.
+static batch newBatch() {
+    return (batch) {
+        .n=0, .max=16, .size=0, .room=1024, .es=malloc(16 * sizeof(edit)),
+        .offsets=malloc(16 * sizeof(int)), .bytes=malloc(1024)
+    };
+}
+
+// Free the arrays of a batch.
+static void freeBatch(batch *b) {
+    free(b->es);
+    free(b->offsets);
+    free(b->bytes);
+}
+
+// Undo back to the start of the current action, or of the previous one if the
+// current position is already at a start.
+void undoText(text *t, bool small) {
+    history *h = t->h;
+    if (small) { editText(t, undo(h)); return; }
+    int a = currentAction(h), target = startAction(h, a);
+    if (target >= currentHistory(h)) target = startAction(h, a - 1);
+    batch b = newBatch();
+    while (currentHistory(h) > target) gather(&b, undo(h));
+    replay(t, &b);
+    freeBatch(&b);
+}
+
+// Redo forwards to the start of the next action, or the end of the history.
+void redoText(text *t, bool small) {
+    history *h = t->h;
+    if (small) { editText(t, redo(h)); return; }
+    int a = currentAction(h), n = countActions(h);
+    int target = (a < n) ? startAction(h, a + 1) : sizeHistory(h);
+    batch b = newBatch();
+    while (currentHistory(h) < target) gather(&b, redo(h));
+    replay(t, &b);
+    freeBatch(&b);
+}
+
+// The bytes are copied into the gap buffer, and their lines are added to the
+// end, one span at a time.
+void restoreText(text *t, int count, span spans[count], int pos) {
+    discardPieces(t);
+    clearLines(t->ls);
+    t->lo = 0;
+    t->hi = t->end;
+    int n = 0;
+    for (int i = 0; i < count; i++) n = n + spans[i].n;
+    resizeText(t, n);
+    for (int i = 0; i < count; i++) {
+        memcpy(&t->data[t->lo], spans[i].s, spans[i].n);
+        insertLines(t->ls, t->lo, spans[i].n, spans[i].s);
+        t->lo = t->lo + spans[i].n;
+    }
+    t->pos = pos;
+}
+
+int startChanged(text *t) { return t->startEdit; }
+int endChanged(text *t) { return t->endEdit; }
+void resetChanged(text *t) { t->startEdit = t->endEdit = -1; }
+
+void getText(text *t, int at, int n, char *s) {
+    if (at < 0 || at + n > lengthText(t)) return;
+    span spans[2];
+    readText(t, at, n, spans);
+    memcpy(s, spans[0].s, spans[0].n);
+    memcpy(&s[spans[0].n], spans[1].s, spans[1].n);
+    s[n] = '\0';
+}
+
+// For a piece table, copy all but the first span into the copy buffer. An
+// empty second span points at an empty string rather than a missing buffer.
+static void readPieces(text *t, int at, int n, span spans[2]) {
+    spans[0].s = spanPieces(t->ps, at, n, &spans[0].n);
+    spans[1].n = n - spans[0].n;
+    spans[1].s = "";
+    if (spans[1].n == 0) return;
+    if (spans[1].n > t->copyMax) {
+        t->copyMax = spans[1].n;
+        t->copy = realloc(t->copy, t->copyMax);
+    }
+    spans[1].s = t->copy;
+    getPieces(t->ps, at + spans[0].n, spans[1].n, t->copy);
+}
+
+void readText(text *t, int at, int n, span spans[2]) {
+    if (t->ps != NULL) { readPieces(t, at, n, spans); return; }
+    int end = at + n;
+    if (end <= t->lo) {
+        spans[0] = (span) { .n=n, .s=&t->data[at] };
+        spans[1] = (span) { .n=0, .s=&t->data[end] };
+    }
+    else if (at >= t->lo) {
+        int gap = t->hi - t->lo;
+        spans[0] = (span) { .n=n, .s=&t->data[at + gap] };
+        spans[1] = (span) { .n=0, .s=&t->data[end + gap] };
+    }
+    else {
+        spans[0] = (span) { .n=t->lo - at, .s=&t->data[at] };
+        spans[1] = (span) { .n=end - t->lo, .s=&t->data[t->hi] };
+    }
+}
+
+span spanText(text *t, int at) {
+    span result;
+    if (t->ps != NULL) {
+        int n = lengthPieces(t->ps) - at;
+        result.s = spanPieces(t->ps, at, n, &result.n);
+    }
+    else if (at < t->lo) result = (span) { .n=t->lo - at, .s=&t->data[at] };
+    else {
+        int gap = t->hi - t->lo;
+        result = (span) { .n=t->end - gap - at, .s=&t->data[at + gap] };
+    }
+    return result;
+}
+
+span spanBefore(text *t, int at) {
+    span result;
+    if (t->ps != NULL) result.s = backPieces(t->ps, at, at, &result.n);
+    else if (at <= t->lo) result = (span) { .n=at, .s=t->data };
+    else result = (span) { .n=at - t->lo, .s=&t->data[t->hi] };
+    return result;
+}
+
+lineReader readLines(text *t, int row) {
+    return (lineReader) { .t=t, .row=row, .at=startLine(t->ls, row) };
+}
+
+bool nextLine(lineReader *r, span spans[2]) {
+    if (r->row >= countLines(r->t->ls)) return false;
+    int end = endLine(r->t->ls, r->row);
+    readText(r->t, r->at, end - r->at, spans);
+    r->row++;
+    r->at = end;
+    return true;
+}
+
+/*
 // Carry out an insertion.
 static void insertText(text *t, edit *e) {
     int at = atEdit(e);
@@ -286,9 +909,389 @@ static bool testDelete(char *before, char *after) {
     return ok;
 }
 */
+// Check that a text has the given content.
+static bool same(text *t, char *s) {
+    char out[100];
+    int n = lengthText(t);
+    if (n != strlen(s)) return false;
+    saveText(t, out);
+    return strncmp(out, s, n) == 0;
+}
+
+// Check that a gap buffer and a piece table behave the same way.
+static void testMap() {
+    char *s = "abc\tdef  \r\nghi\n\n";
+    char buffer[100];
+    strcpy(buffer, s);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls1 = newLines(), *ls2 = newLines();
+    text *t1 = newText(ls1, cs, h), *t2 = newText(ls2, cs, h);
+    assert(loadText(t1, strlen(buffer), buffer));
+    assert(mapText(t2, strlen(s), s));
+    assert(same(t1, "abc def\nghi\n") && same(t2, "abc def\nghi\n"));
+    insertText(t1, 8, 4, "xyz\n");
+    insertText(t2, 8, 4, "xyz\n");
+    deleteText(t1, 2, 5);
+    deleteText(t2, 2, 5);
+    assert(same(t1, "abef\nxyz\nghi\n") && same(t2, "abef\nxyz\nghi\n"));
+    assert(countLines(ls1) == 3 && countLines(ls2) == 3);
+    assert(endLine(ls1, 1) == 9 && endLine(ls2, 1) == 9);
+    assert(t2->copy == NULL);
+    char out[10];
+    getText(t2, 5, 3, out);
+    assert(strcmp(out, "xyz") == 0);
+    freeText(t1);
+    freeText(t2);
+    freeLines(ls1);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check that a large deletion from a mapped file is recorded by reference, and
+// that the bytes can still be restored after the file has been released.
+static void testRefer() {
+    int n = 100000;
+    char *s = malloc(n), *saved = malloc(n);
+    for (int i = 0; i < n; i++) s[i] = (i % 10 == 9) ? '\n' : 'a' + i % 10;
+    memcpy(saved, s, n);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(mapText(t, n, s));
+    deleteText(t, 1000, 61000);
+    saveEnd(h);
+    assert(lengthText(t) == n - 60000 && countLines(ls) == n / 10 - 6000);
+    assert(sizeHistory(h) < 20);
+    deleteText(t, 0, 10);
+    saveEnd(h);
+    freeText(t);
+    memset(s, 'x', n);
+    free(s);
+    undo(h);
+    undo(h);
+    edit e = undo(h);
+    assert(e.op == Insert && e.n == 60000);
+    assert(memcmp(e.s, &saved[1000], 60000) == 0);
+    free(saved);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Test reading spans either side of the gap, without moving it, and reading
+// lines, from both a gap buffer and a piece table.
+static void testRead() {
+    char *s = "abc\ndef\nghi\n";
+    char buffer[100];
+    strcpy(buffer, s);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls1 = newLines(), *ls2 = newLines();
+    text *t1 = newText(ls1, cs, h), *t2 = newText(ls2, cs, h);
+    assert(loadText(t1, strlen(buffer), buffer));
+    assert(mapText(t2, strlen(s), s));
+    insertText(t1, 5, 1, "x");
+    insertText(t2, 5, 1, "x");
+    int lo = t1->lo;
+    span spans[2];
+    readText(t1, 2, 6, spans);
+    assert(t1->lo == lo);
+    assert(spans[0].n == 4 && strncmp(spans[0].s, "c\ndx", 4) == 0);
+    assert(spans[1].n == 2 && strncmp(spans[1].s, "ef", 2) == 0);
+    readText(t1, 7, 3, spans);
+    assert(spans[0].n == 3 && strncmp(spans[0].s, "f\ng", 3) == 0);
+    assert(spans[1].n == 0);
+    readText(t2, 2, 6, spans);
+    assert(spans[0].n == 3 && strncmp(spans[0].s, "c\nd", 3) == 0);
+    assert(spans[1].n == 3 && strncmp(spans[1].s, "xef", 3) == 0);
+    for (int i = 0; i < 2; i++) {
+        lineReader r = readLines(i == 0 ? t1 : t2, 1);
+        assert(nextLine(&r, spans));
+        assert(spans[0].n + spans[1].n == 5);
+        assert(nextLine(&r, spans));
+        assert(spans[0].n + spans[1].n == 4);
+        assert(strncmp(spans[0].s, "ghi\n", 4) == 0);
+        assert(! nextLine(&r, spans));
+    }
+    assert(t1->lo == lo);
+    span first = spanText(t1, 0), second = spanText(t1, first.n);
+    assert(first.n == lo && second.n == 13 - lo);
+    assert(spanText(t1, 13).n == 0);
+    first = spanText(t2, 0);
+    assert(first.n == 5 && spanText(t2, 13).n == 0);
+    span last = spanBefore(t1, 13);
+    assert(last.n == 13 - lo && last.s == second.s);
+    assert(spanBefore(t1, lo).n == lo && spanBefore(t1, 0).n == 0);
+    last = spanBefore(t2, 6);
+    assert(last.n == 1 && last.s[0] == 'x');
+    freeText(t1);
+    freeText(t2);
+    freeLines(ls1);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Read the whole of a snapshot into a buffer.
+static void readSnapshot(snapshot *s, char *out) {
+    int n = lengthSnapshot(s);
+    for (int at = 0; at < n; ) {
+        span sp = spanSnapshot(s, at);
+        memcpy(&out[at], sp.s, sp.n);
+        at += sp.n;
+    }
+    out[n] = '\0';
+}
+
+// Check that snapshots are unaffected by later edits, and that a gap buffer is
+// handed over to a piece table rather than copied, even when it is edited.
+static void testSnapshot() {
+    char *s = "abc\ndef\n";
+    char buffer[100], out[100];
+    strcpy(buffer, s);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls1 = newLines(), *ls2 = newLines();
+    text *t1 = newText(ls1, cs, h), *t2 = newText(ls2, cs, h);
+    assert(loadText(t1, strlen(buffer), buffer));
+    assert(mapText(t2, strlen(s), s));
+    for (int i = 0; i < 2; i++) {
+        text *t = (i == 0) ? t1 : t2;
+        insertText(t, 4, 2, "xy");
+        char *data = t->data;
+        snapshot *snap = snapText(t);
+        readSnapshot(snap, out);
+        assert(strcmp(out, "abc\nxydef\n") == 0);
+        if (i == 0) assert(snap->store->data == data && t->ps != NULL);
+        else assert(snap->store == NULL);
+        insertText(t, 0, 1, "z");
+        deleteText(t, 5, 8);
+        assert(same(t, "zabc\nef\n"));
+        readSnapshot(snap, out);
+        assert(strcmp(out, "abc\nxydef\n") == 0);
+        if (i == 0) assert(snap->store->data == data);
+        freeSnapshot(snap);
+        snap = snapText(t);
+        freeSnapshot(snap);
+        if (i == 0) assert(t->store->refs == 1);
+    }
+    snapshot *snap = snapText(t1);
+    assert(loadText(t1, strlen(buffer), buffer) && same(t1, "abc\ndef\n"));
+    readSnapshot(snap, out);
+    assert(strcmp(out, "zabc\nef\n") == 0);
+    freeSnapshot(snap);
+    freeText(t1);
+    freeText(t2);
+    freeLines(ls1);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Check that edits are recorded in the history, and that the history can be
+// undone, or replayed on a fresh copy of the original text.
+static void testHistory() {
+    char *s = "abc\ndef\n";
+    char buffer[100];
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls1 = newLines(), *ls2 = newLines();
+    text *t1 = newText(ls1, cs, h), *t2 = newText(ls2, cs, h);
+    strcpy(buffer, s);
+    assert(loadText(t1, strlen(buffer), buffer));
+    insertText(t1, 4, 2, "xy");
+    deleteText(t1, 1, 3);
+    insertText(t1, 6, 3, "\xCE\xB1\n");
+    saveEnd(h);
+    assert(same(t1, "a\nxyde\xCE\xB1\nf\n"));
+    strcpy(buffer, s);
+    assert(loadText(t2, strlen(buffer), buffer));
+    int n = currentHistory(h);
+    history *copy = newHistory();
+    loadHistory(copy, n, bytesHistory(h), 0);
+    while (currentHistory(copy) < n) editText(t2, redo(copy));
+    assert(same(t2, "a\nxyde\xCE\xB1\nf\n"));
+    assert(countLines(ls2) == 3);
+    while (currentHistory(copy) > 0) editText(t2, undo(copy));
+    assert(same(t2, s));
+    assert(countLines(ls2) == 2);
+    freeHistory(copy);
+    freeText(t1);
+    freeText(t2);
+    freeLines(ls1);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Test that the cursors move with insertions and deletions, including when
+// they are undone. A selection which collapses isn't restored.
+static void testCursors() {
+    char s[] = "abc\ndef\n";
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(loadText(t, strlen(s), s));
+    int ranges[3][2] = { { 1, 2 }, { 5, 6 }, { 8, 8 } };
+    selectText(t, 3, ranges);
+    int start = currentHistory(h);
+    insertText(t, 1, 3, "x\ny");
+    insertText(t, 4, 1, "z");
+    int points[3][4];
+    getCursors(cs, 0, 3, points);
+    assert(memcmp(points, (int[3][4]) {
+        { 1, 3, 1, 2 }, { 2, 2, 2, 1 }, { 3, 0, 3, 0 }
+    }, sizeof(points)) == 0);
+    deleteText(t, 2, 6);
+    getCursors(cs, 0, 3, points);
+    assert(memcmp(points, (int[3][4]) {
+        { 0, 2, 0, 2 }, { 1, 2, 1, 1 }, { 2, 0, 2, 0 }
+    }, sizeof(points)) == 0);
+    history *copy = newHistory();
+    int n = currentHistory(h);
+    loadHistory(copy, n, bytesHistory(h), n);
+    while (currentHistory(copy) > start) editText(t, undo(copy));
+    assert(same(t, "abc\ndef\n"));
+    getCursors(cs, 0, 3, points);
+    assert(memcmp(points, (int[3][4]) {
+        { 0, 2, 0, 2 }, { 1, 2, 1, 1 }, { 2, 0, 2, 0 }
+    }, sizeof(points)) == 0);
+    freeHistory(copy);
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+}
+
+// Test loading a file bigger than a block, with carriage returns, trailing
+// spaces and code points which straddle block boundaries.
+static void testLoad() {
+    char *line = "\xCE\xB1\xCE\xB2\tx  \r\n";
+    int n = strlen(line), count = 20000;
+    char *buffer = malloc(n * count + 10);
+    for (int i = 0; i < count; i++) memcpy(&buffer[i * n], line, n);
+    strcpy(&buffer[n * count], "end  \n\n\n");
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines();
+    text *t = newText(ls, cs, h);
+    assert(loadText(t, strlen(buffer), buffer));
+    assert(lengthText(t) == 7 * count + 4);
+    assert(countLines(ls) == count + 1);
+    assert(endLine(ls, count - 1) == 7 * count);
+    char out[10];
+    getText(t, 7 * 9999, 7, out);
+    assert(strcmp(out, "\xCE\xB1\xCE\xB2 x\n") == 0);
+    getText(t, 7 * count, 4, out);
+    assert(strcmp(out, "end\n") == 0);
+    buffer[n * 15000 + 1] = 'x';
+    assert(! loadText(t, strlen(buffer), buffer));
+    freeText(t);
+    freeLines(ls);
+    freeCursors(cs);
+    freeHistory(h);
+    free(buffer);
+}
+
 // Test all the ways in which trailing spaces, trailing blank lines or missing
 // final newlines can occur through an insertion or deletion.
+// Check that two texts have the same content, lines, position and cursors.
+static bool alike(text *t1, text *t2) {
+    int n = lengthText(t1), c = nCursors(t1->cs);
+    if (lengthText(t2) != n || nCursors(t2->cs) != c) return false;
+    if (countLines(t1->ls) != countLines(t2->ls)) return false;
+    if (positionText(t1) != positionText(t2)) return false;
+    char *s1 = malloc(n + 1), *s2 = malloc(n + 1);
+    getText(t1, 0, n, s1);
+    getText(t2, 0, n, s2);
+    bool ok = memcmp(s1, s2, n) == 0;
+    int (*p1)[4] = malloc((c + 1) * sizeof(int[4]));
+    int (*p2)[4] = malloc((c + 1) * sizeof(int[4]));
+    getCursors(t1->cs, 0, c, p1);
+    getCursors(t2->cs, 0, c, p2);
+    if (memcmp(p1, p2, c * sizeof(int[4])) != 0) ok = false;
+    free(s1);
+    free(s2);
+    free(p1);
+    free(p2);
+    return ok;
+}
+
+// Check that undoing and redoing whole actions has the same effect on the
+// text, its lines and its cursors as replaying the edits one at a time. The
+// actions are an edit at ten thousand cursors in ascending order, one in
+// descending order including newlines, and one in neither order.
+static void testReplay() {
+    int rows = 10000;
+    char *s = malloc(7 * rows + 1);
+    int (*ranges)[2] = malloc(rows * sizeof(int[2]));
+    history *h[2];
+    cursors *cs[2];
+    lines *ls[2];
+    text *t[2];
+    for (int k = 0; k < 2; k++) {
+        for (int r = 0; r < rows; r++) memcpy(&s[7 * r], "abcdef\n", 7);
+        h[k] = newHistory();
+        cs[k] = newCursors(h[k]);
+        ls[k] = newLines();
+        t[k] = newText(ls[k], cs[k], h[k]);
+        assert(loadText(t[k], 7 * rows, s));
+        for (int r = 0; r < rows; r++) ranges[r][0] = ranges[r][1] = 7 * r + 3;
+        selectText(t[k], rows, ranges);
+        saveEnd(h[k]);
+        replaceColumns(t[k], 0, rows - 1, 1, 3, 2, "XY");
+        saveEnd(h[k]);
+        for (int r = rows - 1; r >= 0; r -= 2) {
+            insertText(t[k], 7 * r + 1, 3, "pq\n");
+        }
+        saveEnd(h[k]);
+        insertText(t[k], 5, 2, "uv");
+        insertText(t[k], 1, 2, "st");
+        insertText(t[k], 20, 2, "wx");
+        saveEnd(h[k]);
+    }
+    assert(alike(t[0], t[1]));
+    int n = countActions(h[0]);
+    for (int i = 0; i < n; i++) {
+        int start = startAction(h[0], currentAction(h[0]) - 1);
+        while (currentHistory(h[0]) > start) editText(t[0], undo(h[0]));
+        undoText(t[1], false);
+        assert(currentHistory(h[1]) == start);
+        assert(alike(t[0], t[1]));
+    }
+    for (int i = 0; i < n; i++) {
+        int end = startAction(h[0], currentAction(h[0]) + 1);
+        while (currentHistory(h[0]) < end) editText(t[0], redo(h[0]));
+        redoText(t[1], false);
+        assert(currentHistory(h[1]) == end);
+        assert(alike(t[0], t[1]));
+    }
+    editText(t[0], undo(h[0]));
+    undoText(t[1], true);
+    assert(alike(t[0], t[1]));
+    for (int k = 0; k < 2; k++) {
+        freeText(t[k]);
+        freeLines(ls[k]);
+        freeCursors(cs[k]);
+        freeHistory(h[k]);
+    }
+    free(ranges);
+    free(s);
+}
+
 int main() {
+    testMap();
+    testRefer();
+    testRead();
+    testSnapshot();
+    testHistory();
+    testCursors();
+    testLoad();
+    testReplay();
     /*
     assert(testInsert("abc[def]ghi\n", "abcdefghi\n"));
     assert(testInsert("x  [\ny\n]z\n", "x\ny\nz\n")); // cursor holds trailers??
@@ -2,7 +2,6 @@
 #include <stdbool.h>
 #include "lines.h"
 #include "cursors.h"
-#include "history.h"
 
 // A text object holds the UTF-8 content of a file. For n bytes, there are n+1
 // positions in the text, running from 0 (at the start) to n (after the final
@@ -25,24 +24,74 @@ void freeText(text *t);
 // used for positions, and for positive or negative relative positions.
 int lengthText(text *t);
 
+// Files of at least this size are mapped into memory rather than read in, and
+// their text objects use a piece table rather than a gap buffer.
+enum { MAP_SIZE = 16 * 1024 * 1024 };
+
 // Fill a text object from a newly loaded file, discarding any previous content.
-// Return false if the buffer contains invalid UTF-8 sequences or nulls (because
-// it is probably binary and shouldn't be loaded).
+// Return false, leaving the text empty, if the buffer contains invalid UTF-8
+// sequences or nulls (because it is probably binary and shouldn't be loaded).
+// The lines object is filled in at the same time.
 bool loadText(text *t, int n, char *buffer);
 
+// Fill a text object from a read-only memory-mapped file, discarding any
+// previous content, as with loadText. The data is not copied, and must remain
+// valid until the text object is freed or reloaded.
+bool mapText(text *t, int n, char const *data);
+
+// Stop recording deletions from a mapped file by reference, and release the
+// file's source in the history, which copies the ranges already referred to,
+// e.g. before a save replaces the file, after which the references would no
+// longer match the file on disk.
+void detachText(text *t);
+
 // Copy the text out into a buffer, which must be big enough.
 char *saveText(text *t, char *buffer);
 
-// Insert s at a given position. Cursors are adjusted. Any cursor end at the
-// given position is moved to the end of the inserted text.
+// Insert s at a given position, recording it in the history. Cursors are
+// adjusted. Any cursor end at the given position is moved to the end of the
+// inserted text.
 void insertText(text *t, int at, int n, char s[n]);
 
-// Delete text in a range (with to<from allowed). Any cursor end within the
-// range, or at the left end, is moved to the right end before the deletion.
+// Delete text in a range (with to<from allowed), recording it in the history.
+// Any cursor end within the range, or at the left end, is moved to the right
+// end before the deletion.
 void deleteText(text *t, int from, int to);
 
-// Undo the most recent user action, taking normal or small steps. Small steps
-// correspond to 'tree-based undo', and also unpick combined typed characters.
+// Replace columns col to endCol (as byte offsets within lines) on each row from
+// row to endRow by s, e.g. to type into a column selection. The rows are edited
+// in one sweep from top to bottom, each recorded as a deletion and insertion.
+// Rows which end before col are left alone, and rows which end before endCol
+// have their text replaced up to the end. A column which falls inside a
+// multi-byte character is moved back to the start of the character, so that
+// no character is split. The string s must not contain a newline.
+void replaceColumns(text *t, int row, int endRow, int col, int endCol,
+    int n, char s[n]);
+
+// Find where a column falls on a row for replaceColumns, i.e. clamped to the
+// end of the row, before its newline, and moved back to the start of any
+// character it falls inside, e.g. to draw a column selection. Return -1 if
+// there is no such row.
+int columnText(text *t, int row, int col);
+
+// Select n ranges of text, e.g. all the matches of a search, replacing the
+// cursors. Each range is given as start and end positions, which become the
+// mark and base of a cursor. The ranges must be in order and not overlap. See
+// setCursors.
+void selectText(text *t, int n, int ranges[n][2]);
+
+// Carry out an edit retrieved from the history by undo or redo, without
+// recording it again. Cursor edits are passed on to the cursors, if any. Return
+// false, without changing anything, if a text edit doesn't fit the text, e.g.
+// from a journal which doesn't belong to it.
+bool editText(text *t, edit e);
+
+// Undo the most recent user action, taking normal or small steps. A normal step
+// gathers the whole action from the history and, if its insertions and
+// deletions are in order of position, as with an edit at many cursors, applies
+// them in one left to right pass over the text, so undoing an edit at ten
+// thousand cursors costs about one pass rather than one per cursor. Small steps
+// undo a single edit, e.g. to unpick combined typed characters.
 void undoText(text *t, bool small);
 
 // Redo the most recent undone user action, taking normal or small steps.
@@ -54,5 +103,76 @@ int startChanged(text *t);
 int endChanged(text *t);
 void resetChanged(text *t);
 
-// Make a copy in s of n characters of text at a given position.
+// Make a copy in s of n characters of text at a given position, followed by a
+// null terminator.
 void getText(text *t, int at, int n, char *s);
+
+// A span is a contiguous run of n bytes of text, valid until the next edit.
+struct span { int n; char const *s; };
+typedef struct span span;
+
+// Find n bytes of text at a given position without copying them or moving the
+// gap, as two spans, the second of which is empty unless the range straddles
+// the gap. For a piece table, if the range extends beyond the first piece, the
+// rest is copied into a buffer held by the text object to form the second span.
+void readText(text *t, int at, int n, span spans[2]);
+
+// Find the longest contiguous run of text starting at a given position, without
+// copying it, e.g. to write out the whole text one span at a time.
+span spanText(text *t, int at);
+
+// Find the longest contiguous run of text ending at a given position, without
+// copying it, e.g. to scan the text backwards one span at a time.
+span spanBefore(text *t, int at);
+
+// Find the position which the next edit recorded in the history is relative
+// to, i.e. the position just after the previous edit.
+int positionText(text *t);
+
+// Replace the content of a text object by a sequence of spans, without
+// recording anything in the history, e.g. to rebuild an earlier version of a
+// text, with the given position for the edits which follow it in the history.
+// The bytes must already be clean, as they would be after loadText. Any
+// cursors are not adjusted.
+void restoreText(text *t, int count, span spans[count], int pos);
+
+// A snapshot is an immutable view of the whole text, taken at a given moment,
+// which another thread can read, e.g. to save the text in the background, while
+// editing continues. The text as a whole is never copied. A gap buffer is
+// handed over to a piece table, which the text then uses for later edits. A
+// piece table is copied, sharing its nodes and content, with only the bytes
+// inserted since loading duplicated.
+struct snapshot;
+typedef struct snapshot snapshot;
+
+// Take a snapshot of the text.
+snapshot *snapText(text *t);
+
+// Find the number of bytes in a snapshot.
+int lengthSnapshot(snapshot *s);
+
+// Find the longest contiguous run of bytes at a given position in a snapshot.
+// This can be called from any thread.
+span spanSnapshot(snapshot *s, int at);
+
+// Make a read-only text object which views a snapshot, so that the usual
+// reading functions, and searches, can be used on it from another thread.
+// Several views of a snapshot can be read at once on different threads. A view
+// must not be edited, and must be freed with freeText before the snapshot.
+text *viewSnapshot(snapshot *s);
+
+// Free a snapshot, once any thread reading it has finished with it. This must
+// be called on the same thread as edits, before the text is freed.
+void freeSnapshot(snapshot *s);
+
+// A line reader iterates through the lines of the text from a given row, using
+// readText, so that reading lines doesn't copy them or move the gap.
+struct lineReader { text *t; int row, at; };
+typedef struct lineReader lineReader;
+
+// Start reading lines at a given row.
+lineReader readLines(text *t, int row);
+
+// Get the next line, including its newline, as two spans, returning false when
+// there are no more lines.
+bool nextLine(lineReader *r, span spans[2]);
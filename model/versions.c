@@ -0,0 +1,456 @@
+// Past versions. Free and open source. See LICENSE.
+#include "text.h"
+#include "versions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// The text is cut into chunks after a byte where a rolling hash of the bytes
+// before it has its top BITS bits zero, giving chunks of about 8K on average,
+// but no smaller than MIN or bigger than MAX bytes. The hash covers the last 32
+// bytes, so the cut points depend only on the content near them, and a change
+// to the text moves only the cut points around it. A checkpoint is due when
+// there is none within the spacing, which starts at INTERVAL actions or
+// INTERVAL KB of history, whichever is nearer.
+enum { BITS = 13, MIN = 2048, MAX = 32768, INTERVAL = 256 };
+enum { BUDGET = 64 * 1024 * 1024 };
+
+// A chunk is an immutable run of n bytes, shared by refs checkpoints.
+struct chunk { int refs, n; char data[]; };
+typedef struct chunk chunk;
+
+// A checkpoint is the content of the text after a given action, which ends at
+// position at in the history, as count chunks of the given total length, with
+// the text's edit position at that point.
+struct checkpoint { int action, at, pos, length, count; chunk **chunks; };
+typedef struct checkpoint checkpoint;
+
+// A versions object holds its checkpoints in order, and the number of cuts in
+// the history which have been dealt with. The spacing is a number of actions,
+// or of KB of history. The gear table holds a random number for each byte
+// value, for the rolling hash, and the buffer is for building a chunk.
+struct versions {
+    text *t;
+    history *h;
+    int count, max;
+    checkpoint *points;
+    int cuts, spacing, memory, budget;
+    unsigned int gear[256];
+    char *buffer;
+};
+
+versions *newVersions(text *t, history *h) {
+    versions *vs = malloc(sizeof(versions));
+    *vs = (versions) {
+        .t=t, .h=h, .count=0, .max=10, .points=malloc(10 * sizeof(checkpoint)),
+        .cuts=cutsHistory(h), .spacing=INTERVAL, .memory=0, .budget=BUDGET,
+        .buffer=malloc(MAX)
+    };
+    unsigned int x = 2463534242u;
+    for (int i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        vs->gear[i] = x;
+    }
+    checkVersions(vs);
+    return vs;
+}
+
+// Release a checkpoint's references to its chunks, freeing any which are no
+// longer used.
+static void drop(versions *vs, checkpoint *c) {
+    for (int i = 0; i < c->count; i++) {
+        chunk *k = c->chunks[i];
+        if (--k->refs > 0) continue;
+        vs->memory -= sizeof(chunk) + k->n;
+        free(k);
+    }
+    vs->memory -= c->count * sizeof(chunk *);
+    free(c->chunks);
+}
+
+void freeVersions(versions *vs) {
+    for (int i = 0; i < vs->count; i++) drop(vs, &vs->points[i]);
+    free(vs->points);
+    free(vs->buffer);
+    free(vs);
+}
+
+int countVersions(versions *vs) { return vs->count; }
+int memoryVersions(versions *vs) { return vs->memory; }
+
+void budgetVersions(versions *vs, int budget) {
+    vs->budget = budget;
+}
+
+// Drop the checkpoints beyond any new cuts in the history, and any which no
+// longer match the action index.
+static void prune(versions *vs) {
+    history *h = vs->h;
+    int low = INT_MAX;
+    for (; vs->cuts < cutsHistory(h); vs->cuts++) {
+        int at = cutHistory(h, vs->cuts);
+        if (at < low) low = at;
+    }
+    int j = 0;
+    for (int i = 0; i < vs->count; i++) {
+        checkpoint *c = &vs->points[i];
+        bool valid = c->at <= low && c->action <= countActions(h) &&
+            startAction(h, c->action) == c->at;
+        if (valid) vs->points[j++] = *c;
+        else drop(vs, c);
+    }
+    vs->count = j;
+}
+
+// Find the index of the first checkpoint at or after a history position.
+static int find(versions *vs, int at) {
+    int lo = 0, hi = vs->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (vs->points[mid].at < at) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Find the checkpoint nearest to a history position, from the two either side
+// of it, or return NULL if there are none.
+static checkpoint *nearest(versions *vs, int at) {
+    int i = find(vs, at);
+    if (vs->count == 0) return NULL;
+    if (i == vs->count) return &vs->points[i - 1];
+    if (i == 0) return &vs->points[0];
+    checkpoint *before = &vs->points[i - 1], *after = &vs->points[i];
+    return (at - before->at <= after->at - at) ? before : after;
+}
+
+// Check whether there is no checkpoint within the spacing of an action.
+static bool due(versions *vs, int action, int at) {
+    int i = find(vs, at);
+    for (int j = i - 1; j <= i; j++) {
+        if (j < 0 || j >= vs->count) continue;
+        checkpoint *c = &vs->points[j];
+        if (abs(c->action - action) >= vs->spacing) continue;
+        if (abs(c->at - at) >= vs->spacing * 1024) continue;
+        return false;
+    }
+    return true;
+}
+
+// Replay the history from a checkpoint to a given position, tracking only the
+// positions and lengths of the insertions and deletions, to find the number of
+// bytes at the start and end of the text which are unchanged.
+static void changes(versions *vs, checkpoint *c, int at, int *low, int *tail) {
+    int pos = c->pos, length = c->length;
+    *low = *tail = length;
+    for (int i = c->at; i != at; ) {
+        edit e = (i < at) ? redoAt(vs->h, &i) : undoAt(vs->h, &i);
+        if (e.op == Move) pos = pos + e.n;
+        else if (e.op == Insert) {
+            if (pos < *low) *low = pos;
+            pos = pos + e.n;
+            length = length + e.n;
+        }
+        else if (e.op == Delete) {
+            pos = pos - e.n;
+            length = length - e.n;
+            if (pos < *low) *low = pos;
+        }
+        else continue;
+        if (length - pos < *tail) *tail = length - pos;
+    }
+}
+
+// Add a chunk to a checkpoint which is being built, with room for max chunks.
+static void add(checkpoint *c, int *max, chunk *k) {
+    if (c->count >= *max) {
+        *max = *max * 3 / 2;
+        c->chunks = realloc(c->chunks, *max * sizeof(chunk *));
+    }
+    c->chunks[c->count++] = k;
+    k->refs++;
+}
+
+// Cut one chunk from the text at a given position, scanning it a span at a
+// time, add it to a checkpoint, and return the position after it.
+static int cut(versions *vs, checkpoint *c, int *max, int at) {
+    int n = 0;
+    unsigned int hash = 0;
+    bool found = false;
+    while (at < c->length && n < MAX && ! found) {
+        span s = spanText(vs->t, at);
+        int k = s.n, i;
+        if (k > c->length - at) k = c->length - at;
+        if (k > MAX - n) k = MAX - n;
+        for (i = 0; i < k && ! found; i++) {
+            hash = (hash << 1) + vs->gear[(unsigned char) s.s[i]];
+            found = n + i + 1 >= MIN && (hash >> (32 - BITS)) == 0;
+        }
+        memcpy(&vs->buffer[n], s.s, i);
+        n = n + i;
+        at = at + i;
+    }
+    chunk *k = malloc(sizeof(chunk) + n);
+    *k = (chunk) { .refs=0, .n=n };
+    memcpy(k->data, vs->buffer, n);
+    vs->memory += sizeof(chunk) + n;
+    add(c, max, k);
+    return at;
+}
+
+// Fill in the chunks of a new checkpoint. Those wholly before the changes since
+// the base checkpoint, if any, are shared. The text is cut into chunks from
+// there, until a cut point in the unchanged tail coincides with one in the
+// base, after which the cut points are bound to be the same, so the rest of
+// the base's chunks are shared.
+static void build(versions *vs, checkpoint *c, checkpoint *base) {
+    int max = 16, start = 0, i = 0, low = 0, tail = 0;
+    c->chunks = malloc(max * sizeof(chunk *));
+    if (base != NULL) {
+        changes(vs, base, c->at, &low, &tail);
+        while (i < base->count && start + base->chunks[i]->n <= low) {
+            start = start + base->chunks[i]->n;
+            add(c, &max, base->chunks[i++]);
+        }
+    }
+    int shift = (base == NULL) ? 0 : c->length - base->length, old = start;
+    for (int at = start; at < c->length; ) {
+        at = cut(vs, c, &max, at);
+        if (base == NULL || at < c->length - tail) continue;
+        while (i < base->count && old < at - shift) old += base->chunks[i++]->n;
+        if (old != at - shift) continue;
+        while (i < base->count) add(c, &max, base->chunks[i++]);
+        break;
+    }
+    c->chunks = realloc(c->chunks, (c->count + 1) * sizeof(chunk *));
+    vs->memory += c->count * sizeof(chunk *);
+}
+
+// Take a checkpoint of the text, which is after the given action, building it
+// from the nearest existing checkpoint.
+static void take(versions *vs, int action, int at) {
+    checkpoint c = {
+        .action=action, .at=at, .pos=positionText(vs->t),
+        .length=lengthText(vs->t), .count=0, .chunks=NULL
+    };
+    build(vs, &c, nearest(vs, at));
+    if (vs->count >= vs->max) {
+        vs->max = vs->max * 3 / 2;
+        vs->points = realloc(vs->points, vs->max * sizeof(checkpoint));
+    }
+    int i = find(vs, at);
+    int k = vs->count - i;
+    memmove(&vs->points[i + 1], &vs->points[i], k * sizeof(checkpoint));
+    vs->points[i] = c;
+    vs->count++;
+}
+
+// Drop every second checkpoint, keeping the first and last, and double the
+// spacing.
+static void thin(versions *vs) {
+    int j = 0;
+    for (int i = 0; i < vs->count; i++) {
+        if (i % 2 == 0 || i == vs->count - 1) vs->points[j++] = vs->points[i];
+        else drop(vs, &vs->points[i]);
+    }
+    vs->count = j;
+    vs->spacing = vs->spacing * 2;
+}
+
+void checkVersions(versions *vs) {
+    history *h = vs->h;
+    prune(vs);
+    int action = currentAction(h), at = currentHistory(h);
+    if (startAction(h, action) != at || ! due(vs, action, at)) return;
+    take(vs, action, at);
+    breakHistory(h);
+    while (vs->memory > vs->budget && vs->count > 2) thin(vs);
+}
+
+// Restore the nearest checkpoint into the text, and replay the history from
+// there to the start of the action, forwards or backwards.
+void loadVersion(versions *vs, int i, text *out) {
+    history *h = vs->h;
+    checkVersions(vs);
+    if (i < 0) i = 0;
+    if (i > countActions(h)) i = countActions(h);
+    int target = startAction(h, i);
+    checkpoint *c = nearest(vs, target);
+    assert(c != NULL);
+    span *spans = malloc((c->count + 1) * sizeof(span));
+    for (int j = 0; j < c->count; j++) {
+        spans[j] = (span) { .n=c->chunks[j]->n, .s=c->chunks[j]->data };
+    }
+    restoreText(out, c->count, spans, c->pos);
+    free(spans);
+    for (int at = c->at; at != target; ) {
+        edit e = (at < target) ? redoAt(h, &at) : undoAt(h, &at);
+        editText(out, e);
+    }
+}
+
+#ifdef versionsTest
+// ----------------------------------------------------------------------------
+
+// Check that a text object holds the given string.
+static bool same(text *t, char *s, int n) {
+    if (lengthText(t) != n) return false;
+    char *out = malloc(n + 1);
+    saveText(t, out);
+    bool ok = memcmp(out, s, n) == 0;
+    free(out);
+    return ok;
+}
+
+// Make a text of n bytes of numbered lines.
+static char *numbered(int n) {
+    char *s = malloc(n + 1);
+    for (int i = 0; i < n; i++) s[i] = (i % 16 == 15) ? '\n' : 'a' + i % 7;
+    for (int i = 0; i < n; i += 16) s[i] = '0' + (i / 16) % 10;
+    return s;
+}
+
+// Make a random edit in a window of the text, as one action: typing a few
+// characters, or backspacing, or inserting or deleting a longer string.
+static void change(text *t, history *h, int window) {
+    int n = lengthText(t), at = rand() % (n < window ? n : window);
+    int kind = rand() % 4;
+    if (kind == 0) {
+        int pos = positionText(t);
+        if (pos > n) pos = n;
+        for (int i = rand() % 4; i >= 0; i--) insertText(t, pos++, 1, "x");
+    }
+    else if (kind == 1 && positionText(t) > 0 && positionText(t) <= n) {
+        int pos = positionText(t);
+        deleteText(t, pos - 1, pos);
+    }
+    else if (kind == 2) insertText(t, at, 20, "inserted\nstring of 20");
+    else deleteText(t, at, at + 1 + rand() % 40);
+    saveEnd(h);
+}
+
+// Keep a copy of the text.
+static char *copy(text *t) {
+    char *s = malloc(lengthText(t) + 1);
+    saveText(t, s);
+    return s;
+}
+
+// Keep a copy of the text as the version after the current action, replacing
+// any previous copy, since typing may join the previous action.
+static void keep(text *t, history *h, char **copies, int *lengths) {
+    int i = currentAction(h);
+    free(copies[i]);
+    copies[i] = copy(t);
+    lengths[i] = lengthText(t);
+}
+
+// Check every version against the copies.
+static void check(versions *vs, history *h, text *out, char **copies,
+    int *lengths) {
+    for (int i = 0; i <= countActions(h); i++) {
+        loadVersion(vs, i, out);
+        assert(same(out, copies[i], lengths[i]));
+    }
+}
+
+// Make a thousand actions of random edits, and check that every version can be
+// rebuilt, before and after undoing some of them, and after a new edit cuts the
+// history. With a small budget, the checkpoints are thinned out.
+static void testVersions(int budget) {
+    int n = 10000, actions = 1000;
+    char *s = numbered(n);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines(), *ls2 = newLines();
+    text *t = newText(ls, cs, h), *out = newText(ls2, NULL, NULL);
+    assert(loadText(t, n, s));
+    versions *vs = newVersions(t, h);
+    budgetVersions(vs, budget);
+    char **copies = calloc(actions + 1, sizeof(char *));
+    int *lengths = malloc((actions + 1) * sizeof(int));
+    keep(t, h, copies, lengths);
+    srand(1);
+    while (countActions(h) < actions) {
+        change(t, h, n);
+        checkVersions(vs);
+        keep(t, h, copies, lengths);
+    }
+    assert(countVersions(vs) > 1);
+    check(vs, h, out, copies, lengths);
+    assert(memoryVersions(vs) <= budget || countVersions(vs) <= 2);
+    while (currentHistory(h) > startAction(h, 600)) editText(t, undo(h));
+    checkVersions(vs);
+    check(vs, h, out, copies, lengths);
+    insertText(t, 0, 3, "new");
+    saveEnd(h);
+    checkVersions(vs);
+    assert(countActions(h) == 601);
+    keep(t, h, copies, lengths);
+    check(vs, h, out, copies, lengths);
+    for (int i = 0; i <= actions; i++) free(copies[i]);
+    free(copies);
+    free(lengths);
+    freeVersions(vs);
+    freeText(t);
+    freeText(out);
+    freeLines(ls);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+    free(s);
+}
+
+// Check that checkpoints of a large text, with edits in one area, share most
+// of their chunks.
+static void testShare() {
+    int n = 4000000, actions = 2000;
+    char *s = numbered(n);
+    history *h = newHistory();
+    cursors *cs = newCursors(h);
+    lines *ls = newLines(), *ls2 = newLines();
+    text *t = newText(ls, cs, h), *out = newText(ls2, NULL, NULL);
+    assert(loadText(t, n, s));
+    versions *vs = newVersions(t, h);
+    char *middle = NULL;
+    int length = 0;
+    srand(2);
+    while (countActions(h) < actions) {
+        change(t, h, 10000);
+        checkVersions(vs);
+        if (currentAction(h) != 777) continue;
+        free(middle);
+        middle = copy(t);
+        length = lengthText(t);
+    }
+    assert(countVersions(vs) >= 8);
+    assert(memoryVersions(vs) < 2 * n);
+    loadVersion(vs, 0, out);
+    assert(same(out, s, n));
+    loadVersion(vs, 777, out);
+    assert(same(out, middle, length));
+    free(middle);
+    freeVersions(vs);
+    freeText(t);
+    freeText(out);
+    freeLines(ls);
+    freeLines(ls2);
+    freeCursors(cs);
+    freeHistory(h);
+    free(s);
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    testVersions(BUDGET);
+    testVersions(20000);
+    testShare();
+    printf("Versions module OK\n");
+    return 0;
+}
+
+#endif
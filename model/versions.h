@@ -0,0 +1,42 @@
+// Past versions. Free and open source. See LICENSE.
+#include <stdbool.h>
+
+// A versions object gives fast access to any past version of a text, i.e. its
+// content after any user action in the history, e.g. for a version scrubber,
+// or to compare the text with an earlier version of itself. It keeps
+// checkpoints of the text, every so many actions. A checkpoint holds the text
+// as a list of chunks, cut at points chosen by the content, so that a new
+// checkpoint shares all but the chunks around the changes since the nearest
+// existing one, and only the changed part of the text is scanned to make it.
+// A version is rebuilt by restoring the nearest checkpoint and replaying the
+// history from there, forwards or backwards, so the cost is bounded by the
+// spacing of the checkpoints, not by the length of the history. If the
+// checkpoints outgrow a memory budget, every second one is dropped, and the
+// spacing is doubled. Checkpoints beyond a cut in the history are dropped. If
+// the text is reloaded, the versions object should be replaced.
+struct versions;
+typedef struct versions versions;
+typedef struct text text;
+typedef struct history history;
+
+// Create a versions object for a text and its history, with a checkpoint of
+// the current content, or free it.
+versions *newVersions(text *t, history *h);
+void freeVersions(versions *vs);
+
+// Take a checkpoint of the text if one is due, e.g. after every user action,
+// once its end has been recorded in the history. This does nothing in the
+// middle of an action. Taking a checkpoint ends any group of typed characters.
+void checkVersions(versions *vs);
+
+// Fill a separate text object, which has its own lines object but no cursors
+// or history, with the content after the first i actions of the history, for
+// i from 0 to countActions. The history's current position isn't changed.
+void loadVersion(versions *vs, int i, text *out);
+
+// Find the number of checkpoints, or the memory they use.
+int countVersions(versions *vs);
+int memoryVersions(versions *vs);
+
+// Set a budget for the memory used by the checkpoints. The default is 64MB.
+void budgetVersions(versions *vs, int budget);
@@ -1,7 +1,12 @@
 // Unicode support. Free and open source, see licence.txt.
 #include "unicode.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 // The success and failure states of the UTF-8 byte state machine.
 enum { UTF8_ACCEPT = 0, UTF8_REJECT = 12 };
@@ -66,6 +71,249 @@ bool graphemeStart(char grapheme) {
     return (grapheme & B) != 0;
 }
 
+// ----------------------------------------------------------------------------
+// Validation of UTF-8 text, as a check that a file is not binary. The scalar
+// version checks one code point at a time, but skips ASCII text eight bytes at
+// a time. The SSE2 version skips ASCII text sixteen bytes at a time. The AVX2
+// version checks all text 32 bytes at a time, using the lookup table algorithm
+// of Keiser and Lemire, https://arxiv.org/abs/2010.03090. In each case, when an
+// error is found, the scalar version is used to find its exact position. The
+// version is chosen on the first call, according to the processor's features.
+
+// Check that a, b form a valid character code (8 to 11 bits)
+static inline bool check2(byte a, byte b) {
+    return ((0xC2 <= a && a <= 0xDF) && (0x80 <= b && b <= 0xBF));
+}
+
+// Check that a, b, c are valid (12..16 bits) excluding surrogates
+static inline bool check3(byte a, byte b, byte c) {
+    if (a == 0xE0) {
+        if ((0xA0 <= b && b <= 0xBF) && (0x80 <= c && c <= 0xBF)) return true;
+    }
+    else if ((0xE1 <= a && a <= 0xEC) || a == 0xEE || a == 0xEF) {
+        if ((0x80 <= b && b <= 0xBF) && (0x80 <= c && c <= 0xBF)) return true;
+    }
+    else if (a == 0xED) {
+        if ((0x80 <= b && b <= 0x9F) && (0x80 <= c && c <= 0xBF)) return true;
+    }
+    return false;
+}
+
+// Check that a, b, c, d are valid (17..21 bits up to 1114111)
+static inline bool check4(byte a, byte b, byte c, byte d) {
+    if (a == 0xF0) {
+        if ((0x90 <= b && b <= 0xBF) &&
+        (0x80 <= c && c <= 0xBF) &&
+        (0x80 <= d && d <= 0xBF)) return true;
+    }
+    else if (0xF1 <= a && a <= 0xF3) {
+        if ((0x80 <= b && b <= 0xBF) &&
+        (0x80 <= c && c <= 0xBF) &&
+        (0x80 <= d && d <= 0xBF)) return true;
+    }
+    else if (a == 0xF4) {
+        if ((0x80 <= b && b <= 0x8F) &&
+        (0x80 <= c && c <= 0xBF) &&
+        (0x80 <= d && d <= 0xBF)) return true;
+    }
+    return false;
+}
+
+// Find the length of the valid code point at position i, or 0 if it is invalid.
+static inline int codeLength(int n, byte const *s, int i) {
+    byte a = s[i];
+    if (a < 0x80) return a >= 0x08 ? 1 : 0;
+    if (i + 1 < n && check2(a, s[i+1])) return 2;
+    if (i + 2 < n && check3(a, s[i+1], s[i+2])) return 3;
+    if (i + 3 < n && check4(a, s[i+1], s[i+2], s[i+3])) return 4;
+    return 0;
+}
+
+// Check the text from position i, which must be at the start of a code point.
+// Eight ASCII bytes at a time are valid if none has the top bit set, and
+// subtracting 8 from each doesn't set a top bit.
+static int validFrom(int n, byte const *s, int i) {
+    const uint64_t highs = 0x8080808080808080, eights = 0x0808080808080808;
+    while (i < n) {
+        if (i + 8 <= n) {
+            uint64_t w;
+            memcpy(&w, &s[i], 8);
+            if (((w | (w - eights)) & highs) == 0) { i += 8; continue; }
+        }
+        int length = codeLength(n, s, i);
+        if (length == 0) return i;
+        i += length;
+    }
+    return -1;
+}
+
+static int validScalar(int n, byte const *s) {
+    return validFrom(n, s, 0);
+}
+
+// Find the start of the code point which may straddle position i, given that
+// the text before i has been checked, so that checking can restart from there.
+static int restart(byte const *s, int i) {
+    for (int j = i - 1; j >= 0 && j >= i - 3; j--) {
+        if (s[j] < 0x80) return j + 1;
+        if (s[j] >= 0xC0) return j;
+    }
+    return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTORS
+
+// Check whole blocks of 16 ASCII bytes, as signed bytes all greater than 7.
+// Deal with any block containing other bytes one code point at a time.
+__attribute__((target("sse2")))
+static int validSSE2(int n, byte const *s) {
+    __m128i sevens = _mm_set1_epi8(7);
+    int i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((__m128i const *) &s[i]);
+        int ok = _mm_movemask_epi8(_mm_cmpgt_epi8(v, sevens));
+        if (ok == 0xFFFF) { i += 16; continue; }
+        int end = i + 16;
+        while (i < end) {
+            int length = codeLength(n, s, i);
+            if (length == 0) return i;
+            i += length;
+        }
+    }
+    return validFrom(n, s, i);
+}
+
+// Bits representing errors for pairs of bytes, in the lookup tables. The top
+// bit is written as -128 so that table entries fit in (signed) chars.
+enum {
+    TooShort = 1<<0, TooLong = 1<<1, Overlong3 = 1<<2, TooLarge = 1<<3,
+    Surrogate = 1<<4, Overlong2 = 1<<5, TooLarge1000 = 1<<6, Overlong4 = 1<<6,
+    TwoConts = -128, Carry = TooShort | TooLong | TwoConts
+};
+
+// Look up the high nibble of each byte of v in a table of 16 bytes.
+__attribute__((target("avx2")))
+static inline __m256i lookupHigh(__m256i v, __m256i table) {
+    __m256i nibbles = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+        _mm256_set1_epi8(0x0F));
+    return _mm256_shuffle_epi8(table, nibbles);
+}
+
+// Find the bytes n positions before those in v, with p the previous block.
+#define PREV(v, p, n) _mm256_alignr_epi8(v, \
+    _mm256_permute2x128_si256(p, v, 0x21), 16 - n)
+
+// Find errors in the pairs of bytes ending at each byte of v, using the high
+// and low nibbles of the first byte and the high nibble of the second. Then
+// check that the continuation bytes expected from three or four byte code
+// points are there.
+__attribute__((target("avx2")))
+static inline __m256i errors(__m256i v, __m256i p) {
+    const __m256i high1 = _mm256_setr_epi8(
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        TwoConts, TwoConts, TwoConts, TwoConts, TooShort | Overlong2, TooShort,
+        TooShort | Overlong3 | Surrogate,
+        TooShort | TooLarge | TooLarge1000 | Overlong4,
+        TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+        TwoConts, TwoConts, TwoConts, TwoConts, TooShort | Overlong2, TooShort,
+        TooShort | Overlong3 | Surrogate,
+        TooShort | TooLarge | TooLarge1000 | Overlong4);
+    const __m256i low1 = _mm256_setr_epi8(
+        Carry | Overlong3 | Overlong2 | Overlong4, Carry | Overlong2, Carry,
+        Carry, Carry | TooLarge, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000 | Surrogate,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | Overlong3 | Overlong2 | Overlong4, Carry | Overlong2, Carry,
+        Carry, Carry | TooLarge, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000,
+        Carry | TooLarge | TooLarge1000 | Surrogate,
+        Carry | TooLarge | TooLarge1000, Carry | TooLarge | TooLarge1000);
+    const __m256i high2 = _mm256_setr_epi8(
+        TooShort, TooShort, TooShort, TooShort,
+        TooShort, TooShort, TooShort, TooShort,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooShort, TooShort, TooShort, TooShort,
+        TooShort, TooShort, TooShort, TooShort,
+        TooShort, TooShort, TooShort, TooShort,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+        TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+        TooShort, TooShort, TooShort, TooShort);
+    __m256i prev1 = PREV(v, p, 1);
+    __m256i lows = _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F));
+    __m256i e = _mm256_and_si256(
+        _mm256_and_si256(lookupHigh(prev1, high1),
+            _mm256_shuffle_epi8(low1, lows)),
+        lookupHigh(v, high2));
+    __m256i third = _mm256_subs_epu8(PREV(v, p, 2), _mm256_set1_epi8(0xE0-0x80));
+    __m256i fourth = _mm256_subs_epu8(PREV(v, p, 3), _mm256_set1_epi8(0xF0-0x80));
+    __m256i must = _mm256_and_si256(_mm256_or_si256(third, fourth),
+        _mm256_set1_epi8((char) 0x80));
+    return _mm256_xor_si256(must, e);
+}
+
+// Check 32 bytes at a time. Blocks of pure ASCII only need to be checked for
+// '\0' to '\7', and for an incomplete code point at the end of the previous
+// block. Other blocks are checked in full.
+__attribute__((target("avx2")))
+static int validAVX2(int n, byte const *s) {
+    const __m256i eights = _mm256_set1_epi8(8);
+    const __m256i limits = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char) (0xF0-1), (char) (0xE0-1), (char) (0xC0-1));
+    __m256i prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    int i = 0;
+    for ( ; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *) &s[i]);
+        __m256i bad = _mm256_subs_epu8(eights, v);
+        if (_mm256_movemask_epi8(v) == 0) {
+            bad = _mm256_or_si256(bad, incomplete);
+            incomplete = _mm256_setzero_si256();
+        }
+        else {
+            bad = _mm256_or_si256(bad, errors(v, prev));
+            incomplete = _mm256_subs_epu8(v, limits);
+        }
+        if (! _mm256_testz_si256(bad, bad)) break;
+        prev = v;
+    }
+    return validFrom(n, s, restart(s, i));
+}
+
+#endif
+
+// The validation function, chosen on the first call.
+static int (*validator)(int n, byte const *s) = NULL;
+
+// Choose the best validation function for the processor.
+static void chooseValidator() {
+    validator = validScalar;
+#ifdef VECTORS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) validator = validAVX2;
+    else if (__builtin_cpu_supports("sse2")) validator = validSSE2;
+#endif
+}
+
+int uvalid(int n, char const *s) {
+    if (validator == NULL) chooseValidator();
+    return validator(n, (byte const *) s);
+}
+
 #ifdef unicodeTest
 // ----------------------------------------------------------------------------
 
@@ -142,8 +390,82 @@ void breakTest(int const test[]) {
     }
 }
 
+void testCheck2() {
+    assert(check2(0xC2, 0x80));   // 8 bits
+    assert(check2(0xC2, 0xBF));
+    assert(check2(0xDF, 0x80));   // 11 bits
+    assert(check2(0xDF, 0xBF));
+    assert(! check2(0xC0, 0xBF)); // < 8 bits
+    assert(! check2(0xC1, 0xBF));
+    assert(! check2(0xC2, 0x7F)); // bad 2nd byte
+    assert(! check2(0xC2, 0xC0));
+    assert(! check2(0xE0, 0xBF)); // > 11 bits
+}
+
+void testCheck3() {
+    assert(check3(0xE0, 0xA0, 0x80));   // 12 bits
+    assert(check3(0xE0, 0xBF, 0xBF));
+    assert(check3(0xE8, 0x80, 0x80));   // 15 bits
+    assert(check3(0xEF, 0xBF, 0xBF));
+    assert(! check3(0xE0, 0x9F, 0xBF)); // < 12 bits
+    assert(! check3(0xED, 0xA0, 0x80)); // UTF-16 surrogates
+    assert(! check3(0xED, 0xBF, 0xBF)); // UTF-16 surrogates
+    assert(! check3(0xF0, 0x80, 0x80)); // > 15 bits
+}
+
+void testCheck4() {
+    assert(check4(0xF0, 0x90, 0x80, 0x80));   // 16 bits
+    assert(check4(0xF4, 0x8F, 0xBF, 0xBF));   // limit 1114111
+    assert(! check4(0xF0, 0x8F, 0xBF, 0xBF)); // < 16 bits
+    assert(! check4(0xF4, 0x90, 0x80, 0x80)); // > limit
+}
+
+// Check that all the available validators give the same answer, with the
+// test string embedded at a given offset in ASCII text.
+bool valid(char const *s, int offset, int expect) {
+    char t[200];
+    int n = strlen(s);
+    memset(t, 'x', 200);
+    memcpy(&t[offset], s, n);
+    int length = offset + n + (offset % 3) * 20;
+    if (expect >= 0) expect += offset;
+    byte const *b = (byte const *) t;
+    bool ok = validScalar(length, b) == expect;
+#ifdef VECTORS
+    if (__builtin_cpu_supports("sse2")) ok = ok && validSSE2(length, b) == expect;
+    if (__builtin_cpu_supports("avx2")) ok = ok && validAVX2(length, b) == expect;
+#endif
+    return ok && uvalid(length, t) == expect;
+}
+
+// Test validation with errors in every position relative to vector blocks.
+void validTest() {
+    for (int i = 0; i < 80; i++) {
+        assert(valid("abc\n", i, -1));
+        assert(valid("\xC2\x80\xE0\xA0\x80\xF4\x8F\xBF\xBF\x7F\x08", i, -1));
+        assert(valid("ab\7", i, 2));
+        assert(valid("\1", i, 0));
+        assert(valid("\xC2\x80\xC0\xBF", i, 2));         // overlong
+        assert(valid("\xC2\x7F", i, 0));                 // bad 2nd byte
+        assert(valid("\xE0\x9F\xBF", i, 0));             // overlong
+        assert(valid("\xED\xA0\x80", i, 0));             // UTF-16 surrogate
+        assert(valid("\xF0\x8F\xBF\xBF", i, 0));         // overlong
+        assert(valid("\xF4\x90\x80\x80", i, 0));         // > limit
+        assert(valid("\xF5\x80\x80\x80", i, 0));         // > limit
+        assert(valid("\xE2\x82\xAC\x80", i, 3));         // extra continuation
+        assert(valid("\xE2\x82", i, 0));                 // too short
+    }
+    assert(uvalid(3, "\xE2\x82\xAC") == -1);
+    assert(uvalid(2, "\xE2\x82") == 0);
+    assert(uvalid(3, "ab\0") == 2);
+}
+
 int main() {
     codeTest();
+    testCheck2();
+    testCheck3();
+    testCheck4();
+    validTest();
     categoryTest();
     graphemeTest();
     for (int i = 0; testTable[i][0] >= 0; i++) breakTest(testTable[i]);
@@ -33,6 +33,11 @@ codePoint nextCode(char grapheme, const char *s);
 // Check if the most recent code point is the start of a grapheme.
 bool graphemeStart(char grapheme);
 
+// Check that n bytes of text are valid UTF-8, and contain none of the control
+// characters '\0' to '\7', which indicate a binary file. Return the offset of
+// the first invalid byte, or -1 if the text is valid.
+int uvalid(int n, char const *s);
+
 // Grapheme break values. A classification of all code points for finding
 // boundaries between graphemes (extended grapheme clusters). These are for
 // internal use, but are provided here for unigen.c.